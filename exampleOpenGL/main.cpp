@@ -287,12 +287,32 @@ int main(int argc, const char * argv[]) {
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
 
-    unsigned char *image = stbi_load("res/tianjin_tower.jpg", &width, &height, &bpp, 4);
-    
-    GlCall(glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, image));
+    // decode straight into a pixel unpack buffer - saves stbi's malloc'd copy
+    if (!stbi_info("res/tianjin_tower.jpg", &width, &height, &bpp)) {
+        std::cout << "texture load failed: " << stbi_failure_reason() << std::endl;
+    } else {
+        GLuint pixelBuffer;
+        void *pixels;
+        size_t imageSize = (size_t) width * height * 4;
+        GlCall(glGenBuffers(1, &pixelBuffer));
+        GlCall(glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pixelBuffer));
+        GlCall(glBufferData(GL_PIXEL_UNPACK_BUFFER, imageSize, NULL, GL_STREAM_DRAW));
+        GlCall(pixels = glMapBuffer(GL_PIXEL_UNPACK_BUFFER, GL_WRITE_ONLY));
+        if (!pixels) {
+            std::cout << "couldn't map pixel buffer" << std::endl;
+        } else {
+            int loaded = stbi_load_into("res/tianjin_tower.jpg", &width, &height, &bpp, pixels, width * 4, imageSize, 4);
+            if (!loaded)
+                std::cout << "texture load failed: " << stbi_failure_reason() << std::endl;
+            GlCall(glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER));
+            if (loaded) {
+                GlCall(glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, 0));
+            }
+        }
+        GlCall(glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0));
+        GlCall(glDeleteBuffers(1, &pixelBuffer));
+    }
     glBindTexture(GL_TEXTURE_2D, 0);
-    
-    if (image) stbi_image_free(image);
   
     std::string vertexShader = getShader("res/vertex.shader");
     std::string fragmentShader = getShader("res/fragment.shader");
@@ -32,8 +32,8 @@
  PIC (Softimage PIC)
  PNM (PPM and PGM binary only)
  
- Animated GIF still needs a proper API, but here's one way to do it:
- http://gist.github.com/urraka/685d9a6340b26b830d49
+ Animated GIFs load all at once with stbi_load_gif_from_memory, or a frame
+ at a time with stbi_gif_begin (see "Animated GIF" below).
  
  - decode from memory or through FILE (define STBI_NO_STDIO to remove code)
  - decode from arbitrary I/O callbacks
@@ -211,12 +211,226 @@
 // (at least this is true for iOS and Android). Therefore, the NEON support is
 // toggled by a build flag: define STBI_NEON to get NEON loops.
 //
+// On top of SSE2, AVX2 versions of the IDCT (two blocks at a time), the
+// 2x2 upsampler and the color converter are compiled in and used when a
+// run-time CPUID check says the CPU and OS support AVX2. These don't need
+// -mavx2; define STBI_NO_AVX2 to leave them out.
+//
 // If for some reason you do not want to use any of SIMD code, or if
 // you have issues compiling it, you can disable it entirely by
 // defining STBI_NO_SIMD.
 //
 // ===========================================================================
 //
+// Multithreaded decoding
+//
+// stbi_load_mt and stbi_load_from_memory_mt take an extra thread count.
+// Baseline JPEGs with a restart interval (DRI marker) split the
+// entropy-coded data at the RSTn markers and Huffman decode, dequantize and
+// IDCT the segments on that many threads. PNGs inflate on one thread while
+// the others unfilter rows as they come out; interlaced PNGs also unfilter
+// and de-interlace their seven passes concurrently. Everything else decodes
+// exactly as with stbi_load.
+//
+// stbi_batch_load decodes a whole list of files instead, one file per
+// thread at a time. Each thread keeps its scratch memory from one image to
+// the next, and threads that run out of files take over half of another
+// thread's remaining ones. stbi_failure_reason is per thread where the
+// compiler supports thread-local storage, so decodes on different threads
+// don't overwrite each other's errors.
+//
+// Threads come from pthreads, or _beginthreadex on Windows. Define
+// STBI_NO_THREADS to leave them out, in which case the _mt functions
+// always decode on the calling thread. STBI_MAX_THREADS (default 64)
+// caps the number of workers per decode.
+//
+// ===========================================================================
+//
+// Streaming decode
+//
+// For images too big to hold decoded at once, stbi_stream_begin opens an
+// image and stbi_stream_read_rows hands out its rows top to bottom, as many
+// per call as you ask for:
+//
+//    stbi_stream *st = stbi_stream_begin(filename, &x, &y, &n, 4);
+//    while ((rows = stbi_stream_read_rows(st, band, x*4, 16)) > 0)
+//        ... use 'rows' rows of band ...
+//    stbi_stream_end(st);
+//
+// Baseline JPEGs (with all components in one scan) only keep a few MCU rows
+// of decoded data around, and non-interlaced PNGs only the compressed data,
+// the 32K inflate window and a band of rows. Progressive JPEGs, interlaced
+// PNGs and the other formats are decoded in full by stbi_stream_begin and
+// copied out from there. stbi_set_flip_vertically_on_load doesn't apply.
+//
+// ===========================================================================
+//
+// Animated GIF
+//
+// stbi_load_gif_from_memory decodes every frame of an animation into one
+// array. To play one back instead, stbi_gif_begin opens it and
+// stbi_gif_next_frame draws the frames one at a time onto a single RGBA
+// canvas:
+//
+//    stbi_gif *gif = stbi_gif_begin(filename, &x, &y);
+//    while (stbi_gif_next_frame(gif, &frame) > 0)
+//        ... redraw frame.w*frame.h pixels at frame.x,frame.y of frame.pixels ...
+//    stbi_gif_end(gif);
+//
+// The frames come out the same as from stbi_load_gif_from_memory. The
+// rectangle in frame.x/y/w/h covers everything that changed since the
+// previous frame (the whole canvas for the first one): the part the
+// previous frame's disposal restored, and the part this frame drew.
+// frame.dispose is this frame's own disposal method, which the next call
+// applies. Besides the canvas, only the last two frames are kept, for the
+// "restore to previous" disposal method, so memory doesn't grow with the
+// number of frames. stbi_set_flip_vertically_on_load doesn't apply.
+//
+// ===========================================================================
+//
+// Probing
+//
+// stbi_probe and stbi_probe_from_memory report an image's format,
+// dimensions, channels, bit depth, and for JPEGs and PNGs whether it's
+// progressive or interlaced and its restart interval, for indexing lots of
+// files quickly. Unlike stbi_info, which asks each format's decoder in turn,
+// they look at the magic bytes once and go straight to the one format's
+// header. JPEG and PNG headers are walked in place: JPEG segments are
+// skipped by their lengths without building the Huffman tables, so the
+// tables aren't checked the way stbi_info checks them. stbi_probe reads the
+// first 4K of the file, and only goes back for the rest (mapping it where it
+// can, like stbi_load_mapped) if the headers run on past that.
+//
+// ===========================================================================
+//
+// Uncompressed files
+//
+// Binary PGM and PPM files, and uncompressed grey TGAs, already hold their
+// pixels as rows of 8-bit channels; stbi_view_from_memory finds those rows
+// in the buffer and returns a pointer to them, copying nothing, and returns
+// NULL for any other file. Uncompressed BMPs and color TGAs are stored BGR,
+// so they're loaded as usual, but a row at a time straight from a memory or
+// mapped file, swapped to RGB on the way into the output (or into
+// stbi_load_into's buffer when no other conversion is needed), with
+// bottom-up files' rows written in reverse rather than flipped after.
+//
+// ===========================================================================
+//
+// PSD channels
+//
+// PSDs store the merged image one channel after another, each plane
+// optionally RLE compressed. From a memory or mapped file, the loader finds
+// where each of the first four channels starts and works a band of rows at
+// a time, expanding runs with memset and copying literals whole, then
+// interleaving the band into RGBA with SIMD, so the channels are never held
+// whole. From a stream they're read whole first. stbi_load_psd_planes and
+// stbi_load_psd_planes_from_memory (and their _16 variants) leave out the
+// interleaving: they return every channel, alpha and extra ones included,
+// as a plane of samples, without the white matte removal stbi_load does.
+//
+// ===========================================================================
+//
+// Profiling
+//
+// Compile with STBI_PROFILE defined (for the implementation and wherever the
+// declarations are used) to time the stages of each decode:
+//
+//    stbi_profile_reset();
+//    data = stbi_load(filename, &x, &y, &n, 0);
+//    stbi_profile_get(&prof);   // prof.seconds[STBI_stage_jpeg_idct] etc.
+//
+// Totals are kept per thread and add up until reset. Time a worker thread
+// spends on a multithreaded decode is added to the calling thread's totals
+// when it finishes, so stages that overlap (inflating and unfiltering a PNG
+// with stbi_load_mt, say) can add up to more than the wall-clock time.
+// Baseline JPEGs transform each block as soon as it's decoded, so their
+// IDCT time is part of the entropy decoding stage. Without STBI_PROFILE
+// none of this is compiled in.
+//
+// ===========================================================================
+//
+// Per-call options
+//
+// The stbi_set_* functions, stbi_convert_iphone_png_to_rgb and the
+// LDR/HDR gamma and scale functions change settings for every load in the
+// process. Each load copies them when it starts and only looks at its
+// copy, but a thread changing them while another starts a load still
+// races. The _opt loaders take all of those settings, plus the scale,
+// region, preview, thread count and allocator of the other variants, in
+// an stbi_options instead, and never read the globals:
+//
+//    stbi_options opt;
+//    stbi_options_init(&opt);       // defaults, not the current globals
+//    opt.flip_vertically = 1;
+//    opt.threads = 4;
+//    data = stbi_load_opt(filename, &x, &y, &n, 4, &opt);
+//    if (!data) ... opt.failure_reason ...
+//
+// Scale and preview only apply to JPEGs, as for stbi_load_scaled and
+// stbi_load_preview, and a region is in the coordinates of the scaled
+// image. Premultiply and sRGB to linear only apply to 8-bit loads.
+//
+// ===========================================================================
+//
+// Scaled JPEG decoding
+//
+// stbi_load_scaled and stbi_load_from_memory_scaled decode JPEGs straight
+// to 1/2, 1/4 or 1/8 of their size, for thumbnails and small mipmaps. Each
+// 8x8 block is inverse transformed to 4x4, 2x2 or a single pixel from its
+// low-frequency coefficients only, which is close to (though not exactly)
+// a box filter of the full decode. Chroma that's subsampled by no more than
+// the scale (e.g. 4:2:0 at 1/2 and below) is transformed at the output
+// resolution directly, so it skips upsampling too. The Huffman decoding
+// still has to go through every coefficient.
+//
+// ===========================================================================
+//
+// Region decoding
+//
+// stbi_load_region and stbi_load_from_memory_region return just a rectangle
+// of the image. For JPEGs, only the MCUs around the rectangle are kept: the
+// component planes are allocated for those, and the rest are Huffman decoded
+// but not transformed, upsampled or color converted. Each scan stops at the
+// rectangle's last MCU row, and with a restart interval (DRI marker),
+// restart segments that don't touch the rectangle are skipped over without
+// decoding. A progressive JPEG still keeps coefficients for the whole image,
+// since later scans refine them.
+//
+// ===========================================================================
+//
+// Progressive JPEG previews
+//
+// A progressive JPEG sends the DC coefficients of every block first, which
+// is enough for a 1/8 size image. stbi_load_preview and
+// stbi_load_from_memory_preview decode just that: they stop reading once
+// each component's first DC scan is in, and a file that's cut short after
+// its first scan still loads (the missing part comes out flat or garbled),
+// so a viewer can show something while the rest downloads and load the
+// whole image later. A baseline JPEG previews as stbi_load_scaled at 1/8,
+// which still reads the whole file; other formats load full size.
+//
+// The later refinement scans of a full progressive decode only touch the
+// coefficients they refine: each block keeps a 64-bit mask of which have
+// been coded, so the refinement decoder finds the next zero with a bit scan
+// instead of walking every coefficient, and takes the common +-1 codes with
+// their sign bit from a fast_ac-style table.
+//
+// ===========================================================================
+//
+// Load-time postprocessing
+//
+// What an 8-bit load does after decoding -- converting to desired_channels
+// where the decoder didn't, the flip from stbi_set_flip_vertically_on_load,
+// and optionally premultiplying color by alpha (stbi_set_premultiply_on_load)
+// and converting color from sRGB to linear (stbi_set_srgb_to_linear_on_load)
+// -- happens in one pass over the image, a row at a time, in place when the
+// pixels don't grow and straight into the buffer given to stbi_load_into.
+// sRGB to linear is done through a table, so it's 8 bits in and 8 out and
+// loses precision in the darks; premultiplying rounds c*a/255 exactly. Those
+// two don't apply to the float or 16-bit loaders.
+//
+// ===========================================================================
+//
 // HDR image support   (disable by defining STBI_NO_HDR)
 //
 // stb_image now supports loading HDR images in general, and currently
@@ -244,6 +458,14 @@
 //     stbi_ldr_to_hdr_scale(1.0f);
 //     stbi_ldr_to_hdr_gamma(2.2f);
 //
+// For textures, stbi_loadh returns the same values as half floats (IEEE
+// binary16, rounded to nearest even as glm::packHalf1x16 and F16C do), and
+// stbi_load_rgb9e5 as one GL_RGB9_E5 word per pixel (glm::packF3x9_E1x5's
+// layout), without a float image in between: HDR files are packed a row at
+// a time as they're decoded, which halves the peak memory. Like stbi_loadf,
+// they keep the 16 bits of 16-bit PNG and PSD files instead of going
+// through 8. Free the result with stbi_image_free.
+//
 // Finally, given a filename (or an open file or memory block--see header
 // file for details) containing image data, you can query for the "most
 // appropriate" interface to use (that is, whether the image is HDR or
@@ -301,8 +523,21 @@
 //   - If you use STBI_NO_PNG (or _ONLY_ without PNG), and you still
 //     want the zlib decoder to be available, #define STBI_SUPPORT_ZLIB
 //
+//   - If you don't want stb_image to create threads (or can't link
+//     against pthreads), #define STBI_NO_THREADS
+//
+//   - The failure reason and profiling totals are kept per thread where
+//     the compiler supports thread-local storage, even with
+//     STBI_NO_THREADS. If yours can't use it, #define STBI_NO_THREAD_LOCALS
+//     to make them plain globals
+//
+//   - stbi_load_mapped uses mmap() on unix-like systems and reads the
+//     file into memory elsewhere; #define STBI_NO_MMAP to always read
+//
 
 
+#include <stddef.h> // size_t
+
 #ifndef STBI_NO_STDIO
 #include <stdio.h>
 #endif // STBI_NO_STDIO
@@ -348,6 +583,34 @@ extern "C" {
         int      (*eof)   (void *user);                       // returns nonzero if we are at end of file/data
     } stbi_io_callbacks;
     
+    //
+    // optional allocator for the decoders' temporary buffers (JPEG component
+    // planes, PNG compressed and inflated data, ...), passed to the _ex
+    // functions. the returned image always comes from STBI_MALLOC, so it can
+    // still be freed with stbi_image_free.
+    //
+    
+    typedef struct
+    {
+        void *(*alloc_fn)  (void *user, size_t size);
+        void *(*realloc_fn)(void *user, void *p, size_t oldsize, size_t newsize); // NULL: alloc+copy+free
+        void  (*free_fn)   (void *user, void *p);
+        void *user;
+    } stbi_allocator;
+    
+    // a bump allocator over a caller-provided block of memory. frees are
+    // no-ops; call stbi_arena_reset between images to reuse the block.
+    // requests that don't fit fall back to STBI_MALLOC.
+    typedef struct
+    {
+        unsigned char *base;
+        size_t size, used, last;
+    } stbi_arena;
+    
+    STBIDEF void           stbi_arena_init     (stbi_arena *arena, void *memory, size_t size);
+    STBIDEF void           stbi_arena_reset    (stbi_arena *arena);
+    STBIDEF stbi_allocator stbi_arena_allocator(stbi_arena *arena);
+    
     ////////////////////////////////////
     //
     // 8-bits-per-channel interface
@@ -364,6 +627,147 @@ extern "C" {
     STBIDEF stbi_uc *stbi_load            (char const *filename, int *x, int *y, int *channels_in_file, int desired_channels);
     STBIDEF stbi_uc *stbi_load_from_file  (FILE *f, int *x, int *y, int *channels_in_file, int desired_channels);
     // for stbi_load_from_file, file pointer is left pointing immediately after image
+    STBIDEF stbi_uc *stbi_load_mapped     (char const *filename, int *x, int *y, int *channels_in_file, int desired_channels);
+    // for stbi_load_mapped, the file is memory-mapped and decoded in place (or
+    // read into memory in one go where mmap isn't available)
+#endif
+    
+    // same as above, but decoders that can split their work may use up to
+    // 'threads' threads; stbi_load_mt maps or reads the whole file first
+    STBIDEF stbi_uc *stbi_load_from_memory_mt(stbi_uc const *buffer, int len, int *x, int *y, int *channels_in_file, int desired_channels, int threads);
+#ifndef STBI_NO_STDIO
+    STBIDEF stbi_uc *stbi_load_mt         (char const *filename, int *x, int *y, int *channels_in_file, int desired_channels, int threads);
+    
+    // load a list of files at once on up to 'threads' threads; results[i]
+    // is filled in for filenames[i]. returns how many images loaded. free
+    // each result's data with stbi_image_free.
+    typedef struct
+    {
+        stbi_uc *data;              // NULL if the file failed to load
+        int x, y, channels_in_file;
+        const char *failure_reason; // stbi_failure_reason for this file, or NULL
+    } stbi_batch_result;
+    
+    STBIDEF int      stbi_batch_load       (char const * const *filenames, int count, stbi_batch_result *results, int desired_channels, int threads);
+#endif
+    
+    // decode at 1/scale_denom of the full size, for thumbnails; scale_denom
+    // is 1, 2, 4 or 8 and *x, *y get the reduced size, rounded up. only
+    // JPEGs can do this (see "Scaled JPEG decoding" above); other formats
+    // come back full size, so check *x and *y.
+    STBIDEF stbi_uc *stbi_load_from_memory_scaled(stbi_uc const *buffer, int len, int *x, int *y, int *channels_in_file, int desired_channels, int scale_denom);
+#ifndef STBI_NO_STDIO
+    STBIDEF stbi_uc *stbi_load_scaled            (char const *filename, int *x, int *y, int *channels_in_file, int desired_channels, int scale_denom);
+#endif
+    
+    // 1/8 size image from the first scans of a progressive JPEG, which may be
+    // a partial download (see "Progressive JPEG previews" above). other
+    // formats come back as from stbi_load_scaled with scale_denom 8.
+    STBIDEF stbi_uc *stbi_load_from_memory_preview(stbi_uc const *buffer, int len, int *x, int *y, int *channels_in_file, int desired_channels);
+#ifndef STBI_NO_STDIO
+    STBIDEF stbi_uc *stbi_load_preview            (char const *filename, int *x, int *y, int *channels_in_file, int desired_channels);
+#endif
+    
+    // decode only the region_w x region_h rectangle at (region_x, region_y),
+    // clipped to the image; *x and *y get the size of what's returned. JPEGs
+    // skip most of the work outside the region (see "Region decoding" above);
+    // other formats are decoded whole and cropped.
+    STBIDEF stbi_uc *stbi_load_from_memory_region(stbi_uc const *buffer, int len, int *x, int *y, int *channels_in_file, int desired_channels, int region_x, int region_y, int region_w, int region_h);
+#ifndef STBI_NO_STDIO
+    STBIDEF stbi_uc *stbi_load_region            (char const *filename, int *x, int *y, int *channels_in_file, int desired_channels, int region_x, int region_y, int region_w, int region_h);
+#endif
+    
+    // decode into caller memory instead of a new buffer: rows of *x pixels of
+    // desired_channels (1..4) bytes each are written dst_stride bytes apart,
+    // and the image must fit in dst_size bytes (size it with stbi_info).
+    // returns 1 on success, 0 on failure. JPEGs are converted straight into
+    // dst; other formats are decoded as usual and then copied in.
+    STBIDEF int      stbi_load_from_memory_into(stbi_uc const *buffer, int len, int *x, int *y, int *channels_in_file, void *dst, size_t dst_stride, size_t dst_size, int desired_channels);
+#ifndef STBI_NO_STDIO
+    STBIDEF int      stbi_load_into            (char const *filename, int *x, int *y, int *channels_in_file, void *dst, size_t dst_stride, size_t dst_size, int desired_channels);
+#endif
+    
+    // decode a band of rows at a time (see "Streaming decode" above). begin
+    // returns NULL on failure; read_rows writes up to max_rows rows of *x
+    // pixels, dst_stride bytes apart, and returns how many it wrote: 0 once
+    // the image is done, -1 on error.
+    typedef struct stbi_stream stbi_stream;
+    
+    STBIDEF stbi_stream *stbi_stream_begin_from_memory(stbi_uc const *buffer, int len, int *x, int *y, int *channels_in_file, int desired_channels);
+#ifndef STBI_NO_STDIO
+    STBIDEF stbi_stream *stbi_stream_begin            (char const *filename, int *x, int *y, int *channels_in_file, int desired_channels);
+#endif
+    STBIDEF int          stbi_stream_read_rows        (stbi_stream *stream, void *dst, size_t dst_stride, int max_rows);
+    STBIDEF void         stbi_stream_end              (stbi_stream *stream);
+    
+#ifndef STBI_NO_GIF
+    // play an animated GIF a frame at a time (see "Animated GIF" above). begin
+    // returns NULL on failure; next_frame returns 1 and fills in *frame, 0 once
+    // the frames run out, or -1 on error. frame->pixels is the *x by *y RGBA
+    // canvas, which the next call draws over.
+    typedef struct stbi_gif stbi_gif;
+    
+    typedef struct
+    {
+        stbi_uc const *pixels;
+        int x, y, w, h;      // the part of the canvas that changed since the previous frame
+        int delay;           // in milliseconds
+        int dispose;         // GIF disposal method, applied by the next call
+        int index;           // counts from 0
+    } stbi_gif_frame;
+    
+    STBIDEF stbi_gif *stbi_gif_begin_from_memory(stbi_uc const *buffer, int len, int *x, int *y);
+#ifndef STBI_NO_STDIO
+    STBIDEF stbi_gif *stbi_gif_begin            (char const *filename, int *x, int *y);
+#endif
+    STBIDEF int       stbi_gif_next_frame       (stbi_gif *gif, stbi_gif_frame *frame);
+    STBIDEF void      stbi_gif_end              (stbi_gif *gif);
+#endif
+    
+    // same as above, but temporary buffers come from 'alloc' (NULL means STBI_MALLOC)
+    STBIDEF stbi_uc *stbi_load_from_memory_ex   (stbi_uc const *buffer, int len, int *x, int *y, int *channels_in_file, int desired_channels, stbi_allocator const *alloc);
+    STBIDEF stbi_uc *stbi_load_from_callbacks_ex(stbi_io_callbacks const *clbk, void *user, int *x, int *y, int *channels_in_file, int desired_channels, stbi_allocator const *alloc);
+#ifndef STBI_NO_STDIO
+    STBIDEF stbi_uc *stbi_load_ex               (char const *filename, int *x, int *y, int *channels_in_file, int desired_channels, stbi_allocator const *alloc);
+#endif
+    
+    // everything a load can be asked to do, per call instead of through the
+    // global stbi_set_* functions, so loads on different threads with
+    // different settings don't touch any shared state (see "Per-call
+    // options" above). a NULL 'opt' means stbi_options_init's defaults.
+    typedef struct
+    {
+        int flip_vertically;         // as stbi_set_flip_vertically_on_load
+        int premultiply;             // as stbi_set_premultiply_on_load
+        int srgb_to_linear;          // as stbi_set_srgb_to_linear_on_load
+        int unpremultiply;           // as stbi_set_unpremultiply_on_load
+        int convert_iphone_png;      // as stbi_convert_iphone_png_to_rgb
+        float ldr_to_hdr_gamma, ldr_to_hdr_scale; // as stbi_ldr_to_hdr_gamma/_scale
+        float hdr_to_ldr_gamma, hdr_to_ldr_scale; // as stbi_hdr_to_ldr_gamma/_scale
+        int scale_denom;             // 1, 2, 4 or 8, as stbi_load_scaled
+        int region_x, region_y, region_w, region_h; // as stbi_load_region; region_w 0 for the whole image
+        int preview;                 // as stbi_load_preview
+        int threads;                 // as stbi_load_mt
+        stbi_allocator const *alloc; // as stbi_load_ex; NULL for STBI_MALLOC
+        const char *failure_reason;  // out: what stbi_failure_reason would say, or NULL on success
+    } stbi_options;
+    
+    STBIDEF void     stbi_options_init             (stbi_options *opt);
+    
+    STBIDEF stbi_uc *stbi_load_from_memory_opt     (stbi_uc const *buffer, int len, int *x, int *y, int *channels_in_file, int desired_channels, stbi_options *opt);
+    STBIDEF stbi_uc *stbi_load_from_callbacks_opt  (stbi_io_callbacks const *clbk, void *user, int *x, int *y, int *channels_in_file, int desired_channels, stbi_options *opt);
+    STBIDEF stbi_us *stbi_load_16_from_memory_opt  (stbi_uc const *buffer, int len, int *x, int *y, int *channels_in_file, int desired_channels, stbi_options *opt);
+    STBIDEF stbi_us *stbi_load_16_from_callbacks_opt(stbi_io_callbacks const *clbk, void *user, int *x, int *y, int *channels_in_file, int desired_channels, stbi_options *opt);
+#ifndef STBI_NO_LINEAR
+    STBIDEF float   *stbi_loadf_from_memory_opt    (stbi_uc const *buffer, int len, int *x, int *y, int *channels_in_file, int desired_channels, stbi_options *opt);
+    STBIDEF float   *stbi_loadf_from_callbacks_opt (stbi_io_callbacks const *clbk, void *user, int *x, int *y, int *channels_in_file, int desired_channels, stbi_options *opt);
+#endif
+#ifndef STBI_NO_STDIO
+    STBIDEF stbi_uc *stbi_load_opt                 (char const *filename, int *x, int *y, int *channels_in_file, int desired_channels, stbi_options *opt);
+    STBIDEF stbi_us *stbi_load_16_opt              (char const *filename, int *x, int *y, int *channels_in_file, int desired_channels, stbi_options *opt);
+#ifndef STBI_NO_LINEAR
+    STBIDEF float   *stbi_loadf_opt                (char const *filename, int *x, int *y, int *channels_in_file, int desired_channels, stbi_options *opt);
+#endif
 #endif
     
     ////////////////////////////////////
@@ -391,6 +795,21 @@ extern "C" {
     STBIDEF float *stbi_loadf            (char const *filename, int *x, int *y, int *channels_in_file, int desired_channels);
     STBIDEF float *stbi_loadf_from_file  (FILE *f, int *x, int *y, int *channels_in_file, int desired_channels);
 #endif
+    
+    // the same as half floats, for GL_HALF_FLOAT textures
+    STBIDEF stbi_us *stbi_loadh_from_memory   (stbi_uc const *buffer, int len, int *x, int *y, int *channels_in_file, int desired_channels);
+    STBIDEF stbi_us *stbi_loadh_from_callbacks(stbi_io_callbacks const *clbk, void *user, int *x, int *y, int *channels_in_file, int desired_channels);
+    
+    // or packed as GL_RGB9_E5 (GL_UNSIGNED_INT_5_9_9_9_REV), one word per pixel
+    STBIDEF unsigned int *stbi_load_rgb9e5_from_memory   (stbi_uc const *buffer, int len, int *x, int *y, int *channels_in_file);
+    STBIDEF unsigned int *stbi_load_rgb9e5_from_callbacks(stbi_io_callbacks const *clbk, void *user, int *x, int *y, int *channels_in_file);
+    
+#ifndef STBI_NO_STDIO
+    STBIDEF stbi_us *stbi_loadh          (char const *filename, int *x, int *y, int *channels_in_file, int desired_channels);
+    STBIDEF stbi_us *stbi_loadh_from_file(FILE *f, int *x, int *y, int *channels_in_file, int desired_channels);
+    STBIDEF unsigned int *stbi_load_rgb9e5          (char const *filename, int *x, int *y, int *channels_in_file);
+    STBIDEF unsigned int *stbi_load_rgb9e5_from_file(FILE *f, int *x, int *y, int *channels_in_file);
+#endif
 #endif
     
 #ifndef STBI_NO_HDR
@@ -412,8 +831,8 @@ extern "C" {
 #endif // STBI_NO_STDIO
     
     
-    // get a VERY brief reason for failure
-    // NOT THREADSAFE
+    // get a VERY brief reason for failure. it's per thread where the compiler
+    // supports thread-local storage
     STBIDEF const char *stbi_failure_reason  (void);
     
     // free the loaded image -- this is just free()
@@ -432,6 +851,77 @@ extern "C" {
     STBIDEF int      stbi_is_16_bit_from_file(FILE *f);
 #endif
     
+    // everything about an image that its headers tell, in one pass (see
+    // "Probing" above). returns 1 and fills in *result, or 0 on failure
+    enum
+    {
+        STBI_format_unknown = 0,
+        STBI_format_jpeg,
+        STBI_format_png,
+        STBI_format_bmp,
+        STBI_format_gif,
+        STBI_format_psd,
+        STBI_format_pic,
+        STBI_format_pnm,
+        STBI_format_hdr,
+        STBI_format_tga
+    };
+    
+    typedef struct
+    {
+        int format;              // STBI_format_*
+        int x, y;
+        int channels;            // channels_in_file, as stbi_info reports it
+        int bits_per_channel;    // 8, 16 (16-bit PNG and PSD) or 32 (HDR, as floats)
+        int progressive;         // progressive JPEG
+        int interlaced;          // Adam7 interlaced PNG
+        int restart_interval;    // JPEG restart interval in MCUs, 0 if there's none
+    } stbi_probe_result;
+    
+    STBIDEF int      stbi_probe_from_memory  (stbi_uc const *buffer, int len, stbi_probe_result *result);
+#ifndef STBI_NO_STDIO
+    STBIDEF int      stbi_probe              (char const *filename, stbi_probe_result *result);
+#endif
+    
+    // the pixels of a file stored just as stbi_load would return them (see
+    // "Uncompressed files" above), in place: the top row is at the returned
+    // pointer into buffer, and each row is *row_stride bytes from the one
+    // above, negative for files stored bottom-up. NULL if it needs decoding.
+    STBIDEF stbi_uc const *stbi_view_from_memory(stbi_uc const *buffer, int len, int *x, int *y, int *channels_in_file, ptrdiff_t *row_stride);
+    
+    // a PSD's channels as they're stored (see "PSD channels" above): one
+    // plane of x*y samples after another, *channels_in_file of them, in file
+    // order. flipped if set to flip on load, but otherwise as is
+    STBIDEF stbi_uc *stbi_load_psd_planes_from_memory   (stbi_uc const *buffer, int len, int *x, int *y, int *channels_in_file);
+    STBIDEF stbi_us *stbi_load_psd_planes_16_from_memory(stbi_uc const *buffer, int len, int *x, int *y, int *channels_in_file);
+#ifndef STBI_NO_STDIO
+    STBIDEF stbi_uc *stbi_load_psd_planes               (char const *filename, int *x, int *y, int *channels_in_file);
+    STBIDEF stbi_us *stbi_load_psd_planes_16            (char const *filename, int *x, int *y, int *channels_in_file);
+#endif
+    
+#ifdef STBI_PROFILE
+    // time spent in each decoding stage on this thread (see "Profiling" above)
+    enum
+    {
+        STBI_stage_jpeg_entropy,     // Huffman decoding; baseline JPEGs include dequantizing and the IDCT
+        STBI_stage_jpeg_idct,        // progressive JPEGs only
+        STBI_stage_jpeg_upsample,
+        STBI_stage_jpeg_color,       // YCbCr (or CMYK) to RGB
+        STBI_stage_png_inflate,
+        STBI_stage_png_unfilter,     // including bit depth expansion, de-interlacing, and tRNS and palettes when done per band
+        STBI_stage_convert,          // palette expansion, channel and bit depth conversion, flip, premultiply, sRGB
+        STBI_stage_count
+    };
+    
+    typedef struct
+    {
+        double seconds[STBI_stage_count];
+    } stbi_profile;
+    
+    STBIDEF void     stbi_profile_get        (stbi_profile *profile);
+    STBIDEF void     stbi_profile_reset      (void);
+#endif
+    
     
     
     // for image formats that explicitly notate that they have premultiplied alpha,
@@ -446,6 +936,12 @@ extern "C" {
     // flip the image vertically, so the first pixel in the output array is the bottom left
     STBIDEF void stbi_set_flip_vertically_on_load(int flag_true_if_should_flip);
     
+    // premultiply color by alpha in 8-bit loads that have an alpha channel
+    STBIDEF void stbi_set_premultiply_on_load(int flag_true_if_should_premultiply);
+    
+    // convert color (not alpha) from sRGB to linear in 8-bit loads
+    STBIDEF void stbi_set_srgb_to_linear_on_load(int flag_true_if_should_convert);
+    
     // ZLIB client - used by PNG, available for other purposes
     
     STBIDEF char *stbi_zlib_decode_malloc_guesssize(const char *buffer, int len, int initial_size, int *outlen);
@@ -513,13 +1009,22 @@ extern "C" {
 #include <limits.h>
 
 #if !defined(STBI_NO_LINEAR) || !defined(STBI_NO_HDR)
-#include <math.h>  // ldexp, pow
+#include <math.h>  // pow
+#include <float.h> // FLT_MAX
 #endif
 
 #ifndef STBI_NO_STDIO
 #include <stdio.h>
 #endif
 
+#if !defined(STBI_NO_STDIO) && !defined(STBI_NO_MMAP) && (defined(__unix__) || defined(__APPLE__))
+#define STBI__MMAP
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
 #ifndef STBI_ASSERT
 #include <assert.h>
 #define STBI_ASSERT(x) assert(x)
@@ -542,12 +1047,14 @@ typedef unsigned short stbi__uint16;
 typedef   signed short stbi__int16;
 typedef unsigned int   stbi__uint32;
 typedef   signed int   stbi__int32;
+typedef unsigned __int64 stbi__uint64;
 #else
 #include <stdint.h>
 typedef uint16_t stbi__uint16;
 typedef int16_t  stbi__int16;
 typedef uint32_t stbi__uint32;
 typedef int32_t  stbi__int32;
+typedef uint64_t stbi__uint64;
 #endif
 
 // should produce compiler error if size is wrong
@@ -559,16 +1066,6 @@ typedef unsigned char validate_uint32[sizeof(stbi__uint32)==4 ? 1 : -1];
 #define STBI_NOTUSED(v)  (void)sizeof(v)
 #endif
 
-#ifdef _MSC_VER
-#define STBI_HAS_LROTL
-#endif
-
-#ifdef STBI_HAS_LROTL
-#define stbi_lrot(x,y)  _lrotl(x,y)
-#else
-#define stbi_lrot(x,y)  (((x) << (y)) | ((x) >> (32 - (y))))
-#endif
-
 #if defined(STBI_MALLOC) && defined(STBI_FREE) && (defined(STBI_REALLOC) || defined(STBI_REALLOC_SIZED))
 // ok
 #elif !defined(STBI_MALLOC) && !defined(STBI_FREE) && !defined(STBI_REALLOC) && !defined(STBI_REALLOC_SIZED)
@@ -682,110 +1179,486 @@ static int stbi__sse2_available(void)
 #define STBI_SIMD_ALIGN(type, name) type name
 #endif
 
-///////////////////////////////////////////////
-//
-//  stbi__context struct and start_xxx functions
-
-// stbi__context structure is our basic context used by all images, so it
-// contains all the IO context, plus some basic image information
-typedef struct
-{
-    stbi__uint32 img_x, img_y;
-    int img_n, img_out_n;
-    
-    stbi_io_callbacks io;
-    void *io_user_data;
-    
-    int read_from_callbacks;
-    int buflen;
-    stbi_uc buffer_start[128];
-    
-    stbi_uc *img_buffer, *img_buffer_end;
-    stbi_uc *img_buffer_original, *img_buffer_original_end;
-} stbi__context;
-
+// AVX2 kernels are compiled alongside the SSE2 ones and picked at run-time,
+// so unlike SSE2 they don't need -mavx2. That takes per-function target
+// attributes on GCC/Clang, and VS2012 or later for the intrinsics on MSVC.
+#if defined(STBI_SSE2) && !defined(STBI_NO_AVX2)
+#if defined(_MSC_VER) && _MSC_VER >= 1700
+#define STBI_AVX2
+#define STBI__AVX2_TARGET
+#define STBI__F16C_TARGET
+#elif defined(__clang__) || (defined(__GNUC__) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9)))
+#define STBI_AVX2
+#define STBI__AVX2_TARGET __attribute__((target("avx2")))
+#define STBI__F16C_TARGET __attribute__((target("avx2,f16c")))
+#endif
+#endif
 
-static void stbi__refill_buffer(stbi__context *s);
+#ifdef STBI_AVX2
+#include <immintrin.h>
+#ifndef _MSC_VER
+#include <cpuid.h> // __get_cpuid
+#endif
 
-// initialize a memory-decode context
-static void stbi__start_mem(stbi__context *s, stbi_uc const *buffer, int len)
+static int stbi__avx2_available(void)
 {
-    s->io.read = NULL;
-    s->read_from_callbacks = 0;
-    s->img_buffer = s->img_buffer_original = (stbi_uc *) buffer;
-    s->img_buffer_end = s->img_buffer_original_end = (stbi_uc *) buffer+len;
+#ifdef _MSC_VER
+    int info[4];
+    __cpuid(info,0);
+    if (info[0] < 7) return 0;
+    __cpuid(info,1);
+    // the OS must save the ymm registers across context switches, too
+    if (((info[2] >> 27) & 1) == 0 || (_xgetbv(0) & 6) != 6) return 0;
+    __cpuidex(info,7,0);
+    return ((info[1] >> 5) & 1) != 0;
+#else
+    // also checks the OS has enabled ymm state
+    return __builtin_cpu_supports("avx2");
+#endif
 }
 
-// initialize a callback-based context
-static void stbi__start_callbacks(stbi__context *s, stbi_io_callbacks *c, void *user)
+#ifndef STBI_NO_LINEAR
+// the half-float conversions; every AVX2 cpu from Intel and AMD has them,
+// but an emulator or a VM can offer AVX2 alone
+static int stbi__f16c_available(void)
 {
-    s->io = *c;
-    s->io_user_data = user;
-    s->buflen = sizeof(s->buffer_start);
-    s->read_from_callbacks = 1;
-    s->img_buffer_original = s->buffer_start;
-    stbi__refill_buffer(s);
-    s->img_buffer_original_end = s->img_buffer_end;
+    unsigned int ecx;
+#ifdef _MSC_VER
+    int info[4];
+    __cpuid(info,1);
+    ecx = (unsigned int) info[2];
+#else
+    unsigned int eax, ebx, edx;
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) return 0;
+#endif
+    return stbi__avx2_available() && ((ecx >> 29) & 1) != 0;
 }
+#endif
+#endif
 
-#ifndef STBI_NO_STDIO
+///////////////////////////////////////////////
+//
+//  worker threads
+//
+// Just enough threading to fork a few workers over independent pieces of a
+// decode and join them again. Only Win32 and pthreads are supported; anything
+// else gets STBI_NO_THREADS and the _mt entry points decode serially.
 
-static int stbi__stdio_read(void *user, char *data, int size)
-{
-    return (int) fread(data,1,size,(FILE*) user);
-}
+#if !defined(STBI_NO_THREADS) && !defined(_WIN32) && !defined(__unix__) && !defined(__APPLE__)
+#define STBI_NO_THREADS
+#endif
 
-static void stbi__stdio_skip(void *user, int n)
-{
-    fseek((FILE*) user, n, SEEK_CUR);
-}
+// thread-local storage doesn't need the worker threads, so it's used with
+// STBI_NO_THREADS too; STBI_NO_THREAD_LOCALS turns it off
+#ifndef STBI_NO_THREAD_LOCALS
+#if defined(__cplusplus) && __cplusplus >= 201103L
+#define STBI__THREAD_LOCAL thread_local
+#elif defined(_MSC_VER)
+#define STBI__THREAD_LOCAL __declspec(thread)
+#elif defined(__GNUC__)
+#define STBI__THREAD_LOCAL __thread
+#elif defined(__STDC_VERSION__) && __STDC_VERSION__ >= 201112L && !defined(__STDC_NO_THREADS__)
+#define STBI__THREAD_LOCAL _Thread_local
+#endif
+#endif
+#ifndef STBI__THREAD_LOCAL
+#define STBI__THREAD_LOCAL
+#endif
 
-static int stbi__stdio_eof(void *user)
-{
-    return feof((FILE*) user);
-}
+// set by stbi__err. it's per thread where the compiler allows, so decodes on
+// different threads each see their own error; stbi__parallel_run hands
+// errors from its workers back to the calling thread.
+static STBI__THREAD_LOCAL const char *stbi__g_failure_reason;
 
-static stbi_io_callbacks stbi__stdio_callbacks =
-{
-    stbi__stdio_read,
-    stbi__stdio_skip,
-    stbi__stdio_eof,
-};
+#ifdef STBI_PROFILE
+#include <time.h>
 
-static void stbi__start_file(stbi__context *s, FILE *f)
+// per-thread stage totals, in nanoseconds
+static STBI__THREAD_LOCAL stbi__uint64 stbi__prof[STBI_stage_count];
+
+static stbi__uint64 stbi__ticks(void)
 {
-    stbi__start_callbacks(s, &stbi__stdio_callbacks, (void *) f);
+#if defined(CLOCK_MONOTONIC) && !defined(_WIN32)
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (stbi__uint64) t.tv_sec * 1000000000u + (stbi__uint64) t.tv_nsec;
+#elif defined(TIME_UTC)
+    struct timespec t;
+    timespec_get(&t, TIME_UTC);
+    return (stbi__uint64) t.tv_sec * 1000000000u + (stbi__uint64) t.tv_nsec;
+#else
+    // coarse, and counts cpu time rather than wall time
+    return (stbi__uint64) ((double) clock() * (1e9 / CLOCKS_PER_SEC));
+#endif
 }
 
-//static void stop_file(stbi__context *s) { }
-
-#endif // !STBI_NO_STDIO
+#define STBI__PROF_VAR(t)          stbi__uint64 t;
+#define STBI__PROF_START(t)        ((t) = stbi__ticks())
+#define STBI__PROF_END(stage, t)   (stbi__prof[stage] += stbi__ticks() - (t))
 
-static void stbi__rewind(stbi__context *s)
+STBIDEF void stbi_profile_get(stbi_profile *profile)
 {
-    // conceptually rewind SHOULD rewind to the beginning of the stream,
-    // but we just rewind to the beginning of the initial buffer, because
-    // we only use it after doing 'test', which only ever looks at at most 92 bytes
-    s->img_buffer = s->img_buffer_original;
-    s->img_buffer_end = s->img_buffer_original_end;
+    int i;
+    for (i=0; i < STBI_stage_count; ++i)
+        profile->seconds[i] = (double) stbi__prof[i] * 1e-9;
 }
 
-enum
+STBIDEF void stbi_profile_reset(void)
 {
-    STBI_ORDER_RGB,
-    STBI_ORDER_BGR
-};
+    memset(stbi__prof, 0, sizeof(stbi__prof));
+}
+#else
+#define STBI__PROF_VAR(t)
+#define STBI__PROF_START(t)        ((void) 0)
+#define STBI__PROF_END(stage, t)   ((void) 0)
+#endif
 
-typedef struct
-{
+#ifndef STBI_MAX_THREADS
+#define STBI_MAX_THREADS 64
+#endif
+
+#ifndef STBI_NO_THREADS
+#ifdef _WIN32
+#include <process.h> // _beginthreadex
+#ifdef __cplusplus
+#define STBI__THREAD_EXTERN extern "C"
+#else
+#define STBI__THREAD_EXTERN extern
+#endif
+// avoid pulling in all of windows.h for a few functions
+STBI__THREAD_EXTERN __declspec(dllimport) unsigned long __stdcall WaitForSingleObject(void *hHandle, unsigned long dwMilliseconds);
+STBI__THREAD_EXTERN __declspec(dllimport) int __stdcall CloseHandle(void *hObject);
+STBI__THREAD_EXTERN __declspec(dllimport) int __stdcall SwitchToThread(void);
+typedef void *stbi__thread;
+#define stbi__thread_yield() SwitchToThread()
+#else
+#include <pthread.h>
+#include <sched.h>
+typedef pthread_t stbi__thread;
+#define stbi__thread_yield() sched_yield()
+#endif
+
+// counters shared between workers: a store releases everything written
+// before it to whoever loads the new value
+#ifdef _MSC_VER
+#include <intrin.h> // _InterlockedExchange
+#endif
+
+#ifndef STBI_NO_PNG
+// the threaded PNG decoder's progress and failure flags
+#ifdef _MSC_VER
+static stbi__uint32 stbi__atomic_load(stbi__uint32 volatile *p)
+{
+    return (stbi__uint32) _InterlockedCompareExchange((long volatile *) p, 0, 0);
+}
+static void stbi__atomic_store(stbi__uint32 volatile *p, stbi__uint32 v)
+{
+    _InterlockedExchange((long volatile *) p, (long) v);
+}
+#else
+static stbi__uint32 stbi__atomic_load(stbi__uint32 volatile *p)
+{
+    return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+}
+static void stbi__atomic_store(stbi__uint32 volatile *p, stbi__uint32 v)
+{
+    __atomic_store_n(p, v, __ATOMIC_RELEASE);
+}
+#endif
+#endif // !STBI_NO_PNG
+
+#ifndef STBI_NO_STDIO
+// stbi_batch_load's work ranges
+#ifdef _MSC_VER
+static stbi__uint64 stbi__atomic_load64(stbi__uint64 volatile *p)
+{
+    return (stbi__uint64) _InterlockedCompareExchange64((__int64 volatile *) p, 0, 0);
+}
+static int stbi__atomic_cas64(stbi__uint64 volatile *p, stbi__uint64 expect, stbi__uint64 want)
+{
+    return (stbi__uint64) _InterlockedCompareExchange64((__int64 volatile *) p, (__int64) want, (__int64) expect) == expect;
+}
+#else
+static stbi__uint64 stbi__atomic_load64(stbi__uint64 volatile *p)
+{
+    return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+}
+static int stbi__atomic_cas64(stbi__uint64 volatile *p, stbi__uint64 expect, stbi__uint64 want)
+{
+    return __atomic_compare_exchange_n(p, &expect, want, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+}
+#endif
+#endif // !STBI_NO_STDIO
+
+typedef struct
+{
+    void (*func)(void *arg, int worker);
+    void *arg;
+    int worker;
+    const char *failure_reason; // the thread's stbi__g_failure_reason when it finished
+#ifdef STBI_PROFILE
+    stbi__uint64 prof[STBI_stage_count]; // and its stage totals
+#endif
+} stbi__thread_job;
+
+static void stbi__thread_job_done(stbi__thread_job *job)
+{
+    job->failure_reason = stbi__g_failure_reason;
+#ifdef STBI_PROFILE
+    memcpy(job->prof, stbi__prof, sizeof(stbi__prof));
+    memset(stbi__prof, 0, sizeof(stbi__prof));
+#endif
+}
+
+#ifdef _WIN32
+static unsigned __stdcall stbi__thread_main(void *p)
+{
+    stbi__thread_job *job = (stbi__thread_job *) p;
+    job->func(job->arg, job->worker);
+    stbi__thread_job_done(job);
+    return 0;
+}
+#else
+static void *stbi__thread_main(void *p)
+{
+    stbi__thread_job *job = (stbi__thread_job *) p;
+    job->func(job->arg, job->worker);
+    stbi__thread_job_done(job);
+    return NULL;
+}
+#endif
+
+// run func(arg,0..num_workers-1) concurrently and wait for all of them; worker
+// 0 runs on the calling thread, and any worker whose thread can't be created
+// is just run inline after it
+static void stbi__parallel_run(int num_workers, void (*func)(void *arg, int worker), void *arg)
+{
+    stbi__thread_job job[STBI_MAX_THREADS];
+    stbi__thread thread[STBI_MAX_THREADS];
+    int started[STBI_MAX_THREADS];
+    int k;
+    if (num_workers > STBI_MAX_THREADS) num_workers = STBI_MAX_THREADS;
+    for (k=1; k < num_workers; ++k) {
+        job[k].func = func;
+        job[k].arg = arg;
+        job[k].worker = k;
+        job[k].failure_reason = NULL;
+#ifdef _WIN32
+        thread[k] = (stbi__thread) _beginthreadex(NULL, 0, stbi__thread_main, &job[k], 0, NULL);
+        started[k] = thread[k] != NULL;
+#else
+        started[k] = pthread_create(&thread[k], NULL, stbi__thread_main, &job[k]) == 0;
+#endif
+    }
+    func(arg, 0);
+    for (k=1; k < num_workers; ++k) {
+        if (!started[k]) {
+            func(arg, k);
+            continue;
+        }
+#ifdef _WIN32
+        WaitForSingleObject(thread[k], 0xffffffff);
+        CloseHandle(thread[k]);
+#else
+        pthread_join(thread[k], NULL);
+#endif
+        if (job[k].failure_reason)
+            stbi__g_failure_reason = job[k].failure_reason;
+#ifdef STBI_PROFILE
+        {
+            int i;
+            for (i=0; i < STBI_stage_count; ++i)
+                stbi__prof[i] += job[k].prof[i];
+        }
+#endif
+    }
+}
+#endif // STBI_NO_THREADS
+
+// the global load settings. each load copies them into its context when it
+// starts, and the decoders only look at the copy, so stbi_options can
+// override them per call
+static int stbi__vertically_flip_on_load = 0;
+static int stbi__premultiply_on_load = 0;
+static int stbi__srgb_to_linear_on_load = 0;
+static int stbi__unpremultiply_on_load = 0;
+static int stbi__de_iphone_flag = 0;
+static float stbi__l2h_gamma=2.2f, stbi__l2h_scale=1.0f;
+static float stbi__h2l_gamma_i=1.0f/2.2f, stbi__h2l_scale_i=1.0f;
+
+STBIDEF void stbi_set_flip_vertically_on_load(int flag_true_if_should_flip)
+{
+    stbi__vertically_flip_on_load = flag_true_if_should_flip;
+}
+
+STBIDEF void stbi_set_premultiply_on_load(int flag_true_if_should_premultiply)
+{
+    stbi__premultiply_on_load = flag_true_if_should_premultiply;
+}
+
+STBIDEF void stbi_set_srgb_to_linear_on_load(int flag_true_if_should_convert)
+{
+    stbi__srgb_to_linear_on_load = flag_true_if_should_convert;
+}
+
+STBIDEF void stbi_set_unpremultiply_on_load(int flag_true_if_should_unpremultiply)
+{
+    stbi__unpremultiply_on_load = flag_true_if_should_unpremultiply;
+}
+
+STBIDEF void stbi_convert_iphone_png_to_rgb(int flag_true_if_should_convert)
+{
+    stbi__de_iphone_flag = flag_true_if_should_convert;
+}
+
+#ifndef STBI_NO_LINEAR
+STBIDEF void   stbi_ldr_to_hdr_gamma(float gamma) { stbi__l2h_gamma = gamma; }
+STBIDEF void   stbi_ldr_to_hdr_scale(float scale) { stbi__l2h_scale = scale; }
+#endif
+
+STBIDEF void   stbi_hdr_to_ldr_gamma(float gamma) { stbi__h2l_gamma_i = 1/gamma; }
+STBIDEF void   stbi_hdr_to_ldr_scale(float scale) { stbi__h2l_scale_i = 1/scale; }
+
+///////////////////////////////////////////////
+//
+//  stbi__context struct and start_xxx functions
+
+// stbi__context structure is our basic context used by all images, so it
+// contains all the IO context, plus some basic image information
+typedef struct
+{
+    stbi__uint32 img_x, img_y;
+    int img_n, img_out_n;
+    
+    stbi_io_callbacks io;
+    void *io_user_data;
+    
+    int read_from_callbacks;
+    int buflen;
+    stbi_uc buffer_start[128];
+    
+    stbi_uc *img_buffer, *img_buffer_end;
+    stbi_uc *img_buffer_original, *img_buffer_original_end;
+
+    int num_threads; // decoders that can split work may use up to this many
+    int scale_denom; // decoders that can decode smaller divide each side by this
+    int roi_x, roi_y, roi_w, roi_h; // region to return, or roi_w == 0 for all of it
+    int preview;     // decoders that load incrementally may stop early, and at a short file
+    int flip;        // stbi_set_flip_vertically_on_load
+    int premultiply, srgb_to_linear; // color work for the 8-bit postprocess pass
+    int unpremultiply, de_iphone;    // iPhone PNGs
+    float l2h_gamma, l2h_scale, h2l_gamma_i, h2l_scale_i; // LDR <-> HDR curves
+    stbi_allocator const *alloc; // for scratch buffers; NULL for STBI_MALLOC
+    
+    stbi_uc *into;               // caller's output buffer for stbi_load_into, or NULL
+    size_t into_stride, into_size;
+} stbi__context;
+
+
+static void stbi__refill_buffer(stbi__context *s);
+
+// the settings every load starts with
+static void stbi__start_settings(stbi__context *s)
+{
+    s->num_threads = 1;
+    s->scale_denom = 1;
+    s->roi_w = 0;
+    s->preview = 0;
+    s->flip = stbi__vertically_flip_on_load;
+    s->premultiply = stbi__premultiply_on_load;
+    s->srgb_to_linear = stbi__srgb_to_linear_on_load;
+    s->unpremultiply = stbi__unpremultiply_on_load;
+    s->de_iphone = stbi__de_iphone_flag;
+    s->l2h_gamma = stbi__l2h_gamma;
+    s->l2h_scale = stbi__l2h_scale;
+    s->h2l_gamma_i = stbi__h2l_gamma_i;
+    s->h2l_scale_i = stbi__h2l_scale_i;
+    s->alloc = NULL;
+    s->into = NULL;
+}
+
+// initialize a memory-decode context
+static void stbi__start_mem(stbi__context *s, stbi_uc const *buffer, int len)
+{
+    s->io.read = NULL;
+    s->read_from_callbacks = 0;
+    stbi__start_settings(s);
+    s->img_buffer = s->img_buffer_original = (stbi_uc *) buffer;
+    s->img_buffer_end = s->img_buffer_original_end = (stbi_uc *) buffer+len;
+}
+
+// initialize a callback-based context
+static void stbi__start_callbacks(stbi__context *s, stbi_io_callbacks *c, void *user)
+{
+    s->io = *c;
+    s->io_user_data = user;
+    s->buflen = sizeof(s->buffer_start);
+    s->read_from_callbacks = 1;
+    stbi__start_settings(s);
+    s->img_buffer_original = s->buffer_start;
+    stbi__refill_buffer(s);
+    s->img_buffer_original_end = s->img_buffer_end;
+}
+
+#ifndef STBI_NO_STDIO
+
+static int stbi__stdio_read(void *user, char *data, int size)
+{
+    return (int) fread(data,1,size,(FILE*) user);
+}
+
+static void stbi__stdio_skip(void *user, int n)
+{
+    fseek((FILE*) user, n, SEEK_CUR);
+}
+
+static int stbi__stdio_eof(void *user)
+{
+    return feof((FILE*) user);
+}
+
+static stbi_io_callbacks stbi__stdio_callbacks =
+{
+    stbi__stdio_read,
+    stbi__stdio_skip,
+    stbi__stdio_eof,
+};
+
+static void stbi__start_file(stbi__context *s, FILE *f)
+{
+    stbi__start_callbacks(s, &stbi__stdio_callbacks, (void *) f);
+}
+
+//static void stop_file(stbi__context *s) { }
+
+#endif // !STBI_NO_STDIO
+
+static void stbi__rewind(stbi__context *s)
+{
+    // conceptually rewind SHOULD rewind to the beginning of the stream,
+    // but we just rewind to the beginning of the initial buffer, because
+    // we only use it after doing 'test', which only ever looks at at most 92 bytes
+    s->img_buffer = s->img_buffer_original;
+    s->img_buffer_end = s->img_buffer_original_end;
+}
+
+enum
+{
+    STBI_ORDER_RGB,
+    STBI_ORDER_BGR
+};
+
+typedef struct
+{
     int bits_per_channel;
     int num_channels;
     int channel_order;
+    int cropped; // the decoder applied the context's roi itself
 } stbi__result_info;
 
 #ifndef STBI_NO_JPEG
 static int      stbi__jpeg_test(stbi__context *s);
-static void    *stbi__jpeg_load(stbi__context *s, int *x, int *y, int *comp, int req_comp, stbi__result_info *ri);
+static void    *stbi__jpeg_load(stbi__context *s, int *x, int *y, int *comp, int req_comp, stbi__result_info *ri, int bpc);
 static int      stbi__jpeg_info(stbi__context *s, int *x, int *y, int *comp);
 #endif
 
@@ -818,6 +1691,7 @@ static int      stbi__psd_is16(stbi__context *s);
 #ifndef STBI_NO_HDR
 static int      stbi__hdr_test(stbi__context *s);
 static float   *stbi__hdr_load(stbi__context *s, int *x, int *y, int *comp, int req_comp, stbi__result_info *ri);
+static void    *stbi__hdr_load_as(stbi__context *s, int *x, int *y, int *comp, int req_comp, int fmt);
 static int      stbi__hdr_info(stbi__context *s, int *x, int *y, int *comp);
 #endif
 
@@ -840,9 +1714,6 @@ static void    *stbi__pnm_load(stbi__context *s, int *x, int *y, int *comp, int
 static int      stbi__pnm_info(stbi__context *s, int *x, int *y, int *comp);
 #endif
 
-// this is not threadsafe
-static const char *stbi__g_failure_reason;
-
 STBIDEF const char *stbi_failure_reason(void)
 {
     return stbi__g_failure_reason;
@@ -926,7 +1797,7 @@ static void *stbi__malloc_mad3(int a, int b, int c, int add)
     return stbi__malloc(a*b*c + add);
 }
 
-#if !defined(STBI_NO_LINEAR) || !defined(STBI_NO_HDR)
+#ifndef STBI_NO_LINEAR
 static void *stbi__malloc_mad4(int a, int b, int c, int d, int add)
 {
     if (!stbi__mad4sizes_valid(a, b, c, d, add)) return NULL;
@@ -934,56 +1805,190 @@ static void *stbi__malloc_mad4(int a, int b, int c, int d, int add)
 }
 #endif
 
-// stbi__err - error
-// stbi__errpf - error returning pointer to float
-// stbi__errpuc - error returning pointer to unsigned char
-
-#ifdef STBI_NO_FAILURE_STRINGS
-#define stbi__err(x,y)  0
-#elif defined(STBI_FAILURE_USERMSG)
-#define stbi__err(x,y)  stbi__err(y)
-#else
-#define stbi__err(x,y)  stbi__err(x)
-#endif
+#if !defined(STBI_NO_JPEG) || !defined(STBI_NO_ZLIB) || !defined(STBI_NO_BMP) || !defined(STBI_NO_PSD)
+// scratch buffers that never escape a decoder go through the caller's
+// allocator if there is one
+static void *stbi__scratch_malloc(stbi_allocator const *al, size_t size)
+{
+    if (al) return al->alloc_fn(al->user, size);
+    return stbi__malloc(size);
+}
 
-#define stbi__errpf(x,y)   ((float *)(size_t) (stbi__err(x,y)?NULL:NULL))
-#define stbi__errpuc(x,y)  ((unsigned char *)(size_t) (stbi__err(x,y)?NULL:NULL))
+static void stbi__scratch_free(stbi_allocator const *al, void *p)
+{
+    if (al) {
+        if (p) al->free_fn(al->user, p);
+    } else
+        STBI_FREE(p);
+}
 
-STBIDEF void stbi_image_free(void *retval_from_stbi_load)
+#ifndef STBI_NO_ZLIB
+static void *stbi__scratch_realloc(stbi_allocator const *al, void *p, size_t oldsz, size_t newsz)
 {
-    STBI_FREE(retval_from_stbi_load);
+    void *q;
+    if (!al) {
+        STBI_NOTUSED(oldsz);
+        return STBI_REALLOC_SIZED(p, oldsz, newsz);
+    }
+    if (al->realloc_fn) return al->realloc_fn(al->user, p, oldsz, newsz);
+    q = al->alloc_fn(al->user, newsz);
+    if (q && p) {
+        memcpy(q, p, oldsz < newsz ? oldsz : newsz);
+        al->free_fn(al->user, p);
+    }
+    return q;
 }
+#endif
 
-#ifndef STBI_NO_LINEAR
-static float   *stbi__ldr_to_hdr(stbi_uc *data, int x, int y, int comp);
+#ifndef STBI_NO_JPEG
+static void *stbi__scratch_malloc_mad2(stbi_allocator const *al, int a, int b, int add)
+{
+    if (!stbi__mad2sizes_valid(a, b, add)) return NULL;
+    return stbi__scratch_malloc(al, a*b + add);
+}
 #endif
 
-#ifndef STBI_NO_HDR
-static stbi_uc *stbi__hdr_to_ldr(float   *data, int x, int y, int comp);
+#if !defined(STBI_NO_JPEG) || !defined(STBI_NO_PSD)
+static void *stbi__scratch_malloc_mad3(stbi_allocator const *al, int a, int b, int c, int add)
+{
+    if (!stbi__mad3sizes_valid(a, b, c, add)) return NULL;
+    return stbi__scratch_malloc(al, a*b*c + add);
+}
+#endif
 #endif
 
-static int stbi__vertically_flip_on_load = 0;
+#define STBI__ARENA_ALIGN 16 // enough for the SIMD kernels
 
-STBIDEF void stbi_set_flip_vertically_on_load(int flag_true_if_should_flip)
+static void *stbi__arena_alloc(void *user, size_t size)
 {
-    stbi__vertically_flip_on_load = flag_true_if_should_flip;
+    stbi_arena *a = (stbi_arena *) user;
+    size_t start = (a->used + STBI__ARENA_ALIGN-1) & ~(size_t) (STBI__ARENA_ALIGN-1);
+    if (start > a->size || size > a->size - start)
+        return stbi__malloc(size);
+    a->last = start;
+    a->used = start + size;
+    return a->base + start;
 }
 
-static void *stbi__load_main(stbi__context *s, int *x, int *y, int *comp, int req_comp, stbi__result_info *ri, int bpc)
+static int stbi__arena_owns(stbi_arena *a, void *p)
 {
-    memset(ri, 0, sizeof(*ri)); // make sure it's initialized if we add new fields
-    ri->bits_per_channel = 8; // default is 8 so most paths don't have to be changed
-    ri->channel_order = STBI_ORDER_RGB; // all current input & output are this, but this is here so we can add BGR order
-    ri->num_channels = 0;
-    
-#ifndef STBI_NO_JPEG
-    if (stbi__jpeg_test(s)) return stbi__jpeg_load(s,x,y,comp,req_comp, ri);
-#endif
-#ifndef STBI_NO_PNG
-    if (stbi__png_test(s))  return stbi__png_load(s,x,y,comp,req_comp, ri);
-#endif
-#ifndef STBI_NO_BMP
-    if (stbi__bmp_test(s))  return stbi__bmp_load(s,x,y,comp,req_comp, ri);
+    return (unsigned char *) p >= a->base && (unsigned char *) p < a->base + a->size;
+}
+
+static void stbi__arena_free(void *user, void *p)
+{
+    stbi_arena *a = (stbi_arena *) user;
+    if (!stbi__arena_owns(a, p))
+        STBI_FREE(p);
+}
+
+static void *stbi__arena_realloc(void *user, void *p, size_t oldsz, size_t newsz)
+{
+    stbi_arena *a = (stbi_arena *) user;
+    void *q;
+    if (p == NULL)
+        return stbi__arena_alloc(user, newsz);
+    if (!stbi__arena_owns(a, p)) {
+        STBI_NOTUSED(oldsz);
+        return STBI_REALLOC_SIZED(p, oldsz, newsz);
+    }
+    // the most recent allocation can grow in place, which is the common
+    // case for buffers that are appended to while being filled
+    if ((unsigned char *) p == a->base + a->last && newsz <= a->size - a->last) {
+        a->used = a->last + newsz;
+        return p;
+    }
+    q = stbi__arena_alloc(user, newsz);
+    if (q) memcpy(q, p, oldsz < newsz ? oldsz : newsz);
+    return q;
+}
+
+STBIDEF void stbi_arena_init(stbi_arena *arena, void *memory, size_t size)
+{
+    arena->base = (unsigned char *) memory;
+    arena->size = memory ? size : 0;
+    arena->used = arena->last = 0;
+}
+
+STBIDEF void stbi_arena_reset(stbi_arena *arena)
+{
+    arena->used = arena->last = 0;
+}
+
+STBIDEF stbi_allocator stbi_arena_allocator(stbi_arena *arena)
+{
+    stbi_allocator al;
+    al.alloc_fn = stbi__arena_alloc;
+    al.realloc_fn = stbi__arena_realloc;
+    al.free_fn = stbi__arena_free;
+    al.user = arena;
+    return al;
+}
+
+// stbi__err - error
+// stbi__errpf - error returning pointer to float
+// stbi__errpuc - error returning pointer to unsigned char
+
+#ifdef STBI_NO_FAILURE_STRINGS
+#define stbi__err(x,y)  0
+#elif defined(STBI_FAILURE_USERMSG)
+#define stbi__err(x,y)  stbi__err(y)
+#else
+#define stbi__err(x,y)  stbi__err(x)
+#endif
+
+#define stbi__errpf(x,y)   ((float *)(size_t) (stbi__err(x,y)?NULL:NULL))
+#define stbi__errpuc(x,y)  ((unsigned char *)(size_t) (stbi__err(x,y)?NULL:NULL))
+
+STBIDEF void stbi_image_free(void *retval_from_stbi_load)
+{
+    STBI_FREE(retval_from_stbi_load);
+}
+
+// output formats for the float loaders
+#define STBI__FMT_FLOAT    0
+#define STBI__FMT_HALF     1
+#define STBI__FMT_RGB9E5   2
+
+#ifndef STBI_NO_LINEAR
+static float   *stbi__ldr_to_hdr(stbi__context *s, stbi_uc *data, int x, int y, int comp);
+static float   *stbi__ldr16_to_hdr(stbi__context *s, stbi__uint16 *data, int x, int y, int comp);
+static int      stbi__pack_simd(int fmt);
+static void     stbi__pack_row(void *out, int row, int w, float const *src, int n, int fmt, int simd);
+static void    *stbi__load_gpu_main(stbi__context *s, int *x, int *y, int *comp, int req_comp, int fmt);
+#endif
+
+#ifndef STBI_NO_HDR
+static stbi_uc *stbi__hdr_to_ldr(stbi__context *s, float   *data, int x, int y, int comp);
+#endif
+
+// work for stbi__postprocess_pass beyond the channel conversion
+#define STBI__POST_FLIP         1
+#define STBI__POST_PREMULTIPLY  2
+#define STBI__POST_LINEAR       4
+
+static unsigned char *stbi__convert_format(unsigned char *data, int img_n, int req_comp, unsigned int x, unsigned int y);
+static stbi__uint16 *stbi__convert_format16(stbi__uint16 *data, int img_n, int req_comp, unsigned int x, unsigned int y);
+static stbi_uc *stbi__convert_16_to_8(stbi__uint16 *orig, int img_n, int out_n, int w, int h);
+static stbi__uint16 *stbi__convert_8_to_16(stbi_uc *orig, int img_n, int out_n, int w, int h);
+static void stbi__postprocess_pixels(stbi_uc *p, int n, int comp, int flags);
+static stbi_uc *stbi__postprocess_pass(stbi_uc *data, int img_n, int out_n, int w, int h, int flags, stbi_uc *dst, size_t dst_stride);
+
+static void *stbi__load_main(stbi__context *s, int *x, int *y, int *comp, int req_comp, stbi__result_info *ri, int bpc)
+{
+    memset(ri, 0, sizeof(*ri)); // make sure it's initialized if we add new fields
+    ri->bits_per_channel = 8; // default is 8 so most paths don't have to be changed
+    ri->channel_order = STBI_ORDER_RGB; // all current input & output are this, but this is here so we can add BGR order
+    ri->num_channels = 0;
+    
+#ifndef STBI_NO_JPEG
+    if (stbi__jpeg_test(s)) return stbi__jpeg_load(s,x,y,comp,req_comp, ri, bpc);
+#endif
+#ifndef STBI_NO_PNG
+    if (stbi__png_test(s))  return stbi__png_load(s,x,y,comp,req_comp, ri);
+#endif
+#ifndef STBI_NO_BMP
+    if (stbi__bmp_test(s))  return stbi__bmp_load(s,x,y,comp,req_comp, ri);
 #endif
 #ifndef STBI_NO_GIF
     if (stbi__gif_test(s))  return stbi__gif_load(s,x,y,comp,req_comp, ri);
@@ -1001,7 +2006,7 @@ static void *stbi__load_main(stbi__context *s, int *x, int *y, int *comp, int re
 #ifndef STBI_NO_HDR
     if (stbi__hdr_test(s)) {
         float *hdr = stbi__hdr_load(s, x,y,comp,req_comp, ri);
-        return stbi__hdr_to_ldr(hdr, *x, *y, req_comp ? req_comp : *comp);
+        return stbi__hdr_to_ldr(s, hdr, *x, *y, req_comp ? req_comp : *comp);
     }
 #endif
     
@@ -1014,38 +2019,6 @@ static void *stbi__load_main(stbi__context *s, int *x, int *y, int *comp, int re
     return stbi__errpuc("unknown image type", "Image not of any known type, or corrupt");
 }
 
-static stbi_uc *stbi__convert_16_to_8(stbi__uint16 *orig, int w, int h, int channels)
-{
-    int i;
-    int img_len = w * h * channels;
-    stbi_uc *reduced;
-    
-    reduced = (stbi_uc *) stbi__malloc(img_len);
-    if (reduced == NULL) return stbi__errpuc("outofmem", "Out of memory");
-    
-    for (i = 0; i < img_len; ++i)
-        reduced[i] = (stbi_uc)((orig[i] >> 8) & 0xFF); // top half of each byte is sufficient approx of 16->8 bit scaling
-    
-    STBI_FREE(orig);
-    return reduced;
-}
-
-static stbi__uint16 *stbi__convert_8_to_16(stbi_uc *orig, int w, int h, int channels)
-{
-    int i;
-    int img_len = w * h * channels;
-    stbi__uint16 *enlarged;
-    
-    enlarged = (stbi__uint16 *) stbi__malloc(img_len*2);
-    if (enlarged == NULL) return (stbi__uint16 *) stbi__errpuc("outofmem", "Out of memory");
-    
-    for (i = 0; i < img_len; ++i)
-        enlarged[i] = (stbi__uint16)((orig[i] << 8) + orig[i]); // replicate to high and low byte, maps 0->0, 255->0xffff
-    
-    STBI_FREE(orig);
-    return enlarged;
-}
-
 static void stbi__vertical_flip(void *image, int w, int h, int bytes_per_pixel)
 {
     int row;
@@ -1082,59 +2055,169 @@ static void stbi__vertical_flip_slices(void *image, int w, int h, int z, int byt
     }
 }
 
-static unsigned char *stbi__load_and_postprocess_8bit(stbi__context *s, int *x, int *y, int *comp, int req_comp)
+// clip the context's roi to a w x h image; returns 0 if nothing is left
+static int stbi__clip_roi(stbi__context *s, int w, int h, int *x0, int *y0, int *x1, int *y1)
 {
-    stbi__result_info ri;
-    void *result = stbi__load_main(s, x, y, comp, req_comp, &ri, 8);
+    *x0 = s->roi_x;
+    *y0 = s->roi_y;
+    *x1 = s->roi_w < w - s->roi_x ? s->roi_x + s->roi_w : w;
+    *y1 = s->roi_h < h - s->roi_y ? s->roi_y + s->roi_h : h;
+    return *x0 < *x1 && *y0 < *y1;
+}
+
+// crop a decoded image to the context's roi, in place
+static stbi_uc *stbi__crop(stbi__context *s, stbi_uc *image, int *w, int *h, int n)
+{
+    int x0,y0,x1,y1,j;
+    if (!stbi__clip_roi(s, *w, *h, &x0, &y0, &x1, &y1)) {
+        STBI_FREE(image);
+        return stbi__errpuc("bad region", "Region is outside the image");
+    }
+    for (j=y0; j < y1; ++j)
+        memmove(image + (size_t) (j-y0) * (x1-x0) * n, image + ((size_t) j * *w + x0) * n, (size_t) (x1-x0) * n);
+    *w = x1-x0;
+    *h = y1-y0;
+    return image;
+}
+
+// returns 1 if a w*h image of n-byte pixels fits the stbi_load_into buffer
+static int stbi__into_fits(stbi__context *s, int w, int h, int n)
+{
+    size_t row = (size_t) w * n;
+    if (s->into_stride < row) return 0;
+    return h == 0 || (s->into_size >= row && (size_t) (h-1) <= (s->into_size - row) / s->into_stride);
+}
+
+// the rest of an 8-bit load, once the decoder has returned 'result'
+static unsigned char *stbi__postprocess_8bit(stbi__context *s, void *result, stbi__result_info ri, int *x, int *y, int *comp, int req_comp)
+{
+    int n, out_n, flags = 0;
+    STBI__PROF_VAR(t)
     
     if (result == NULL)
         return NULL;
+    STBI__PROF_START(t);
+    
+    // decoders may leave converting to req_comp for the pass below
+    out_n = req_comp ? req_comp : *comp;
+    n = ri.num_channels ? ri.num_channels : out_n;
     
     if (ri.bits_per_channel != 8) {
         STBI_ASSERT(ri.bits_per_channel == 16);
-        result = stbi__convert_16_to_8((stbi__uint16 *) result, *x, *y, req_comp == 0 ? *comp : req_comp);
+        // reduce and convert channels in one go, rather than in two passes
+        result = stbi__convert_16_to_8((stbi__uint16 *) result, n, out_n, *x, *y);
         ri.bits_per_channel = 8;
+        n = out_n;
     }
     
-    // @TODO: move stbi__convert_format to here
+    if (result && s->roi_w && !ri.cropped) {
+        result = stbi__crop(s, (stbi_uc *) result, x, y, n);
+        if (result == NULL) return NULL;
+    }
     
-    if (stbi__vertically_flip_on_load) {
-        int channels = req_comp ? req_comp : *comp;
-        stbi__vertical_flip(result, *x, *y, channels * sizeof(stbi_uc));
+    if (s->premultiply)    flags |= STBI__POST_PREMULTIPLY;
+    if (s->srgb_to_linear) flags |= STBI__POST_LINEAR;
+    
+    if (result == s->into) {
+        // a decoder that wrote into s->into has already converted and flipped it
+        int j;
+        if (flags)
+            for (j=0; j < *y; ++j)
+                stbi__postprocess_pixels(s->into + j*s->into_stride, *x, out_n, flags);
+        STBI__PROF_END(STBI_stage_convert, t);
+        return s->into;
+    }
+    
+    if (s->flip) flags |= STBI__POST_FLIP;
+    
+    if (s->into) {
+        // finish straight into the caller's buffer
+        if (!stbi__into_fits(s, *x, *y, out_n)) {
+            STBI_FREE(result);
+            return stbi__errpuc("buffer too small", "Output buffer too small");
+        }
+        result = stbi__postprocess_pass((stbi_uc *) result, n, out_n, *x, *y, flags, s->into, s->into_stride);
+        STBI__PROF_END(STBI_stage_convert, t);
+        return (unsigned char *) result;
     }
     
+    if (flags || n != out_n)
+        result = stbi__postprocess_pass((stbi_uc *) result, n, out_n, *x, *y, flags, NULL, 0);
+    
+    STBI__PROF_END(STBI_stage_convert, t);
     return (unsigned char *) result;
 }
 
-static stbi__uint16 *stbi__load_and_postprocess_16bit(stbi__context *s, int *x, int *y, int *comp, int req_comp)
+static unsigned char *stbi__load_and_postprocess_8bit(stbi__context *s, int *x, int *y, int *comp, int req_comp)
 {
     stbi__result_info ri;
-    void *result = stbi__load_main(s, x, y, comp, req_comp, &ri, 16);
+    void *result = stbi__load_main(s, x, y, comp, req_comp, &ri, 8);
+    return stbi__postprocess_8bit(s, result, ri, x, y, comp, req_comp);
+}
+
+static int stbi__load_into(stbi__context *s, int *x, int *y, int *comp, void *dst, size_t dst_stride, size_t dst_size, int req_comp)
+{
+    int w, h;
+    if (req_comp < 1 || req_comp > 4) return stbi__err("bad req_comp", "Internal error");
+    s->into = (stbi_uc *) dst;
+    s->into_stride = dst_stride;
+    s->into_size = dst_size;
+    // decoders that can't write in place have the postprocess pass finish into dst
+    if (stbi__load_and_postprocess_8bit(s, &w, &h, comp, req_comp) == NULL) return 0;
+    if (x) *x = w;
+    if (y) *y = h;
+    return 1;
+}
+
+// the rest of a 16-bit load, once the decoder has returned 'result'
+static stbi__uint16 *stbi__postprocess_16bit(stbi__context *s, void *result, stbi__result_info ri, int *x, int *y, int *comp, int req_comp)
+{
+    int n, out_n;
+    STBI__PROF_VAR(t)
     
     if (result == NULL)
         return NULL;
+    STBI__PROF_START(t);
+    
+    // decoders may leave converting to req_comp for the sweep below
+    out_n = req_comp ? req_comp : *comp;
+    n = ri.num_channels ? ri.num_channels : out_n;
+    
+    if (s->roi_w && !ri.cropped) {
+        result = stbi__crop(s, (stbi_uc *) result, x, y, n * ri.bits_per_channel / 8);
+        if (result == NULL) return NULL;
+    }
     
     if (ri.bits_per_channel != 16) {
         STBI_ASSERT(ri.bits_per_channel == 8);
-        result = stbi__convert_8_to_16((stbi_uc *) result, *x, *y, req_comp == 0 ? *comp : req_comp);
+        // finish any conversion the decoder left while still 8-bit, to round the same way
+        result = stbi__convert_8_to_16((stbi_uc *) result, n, out_n, *x, *y);
         ri.bits_per_channel = 16;
+    } else if (n != out_n) {
+        result = stbi__convert_format16((stbi__uint16 *) result, n, out_n, *x, *y);
     }
+    if (result == NULL) return NULL;
     
-    // @TODO: move stbi__convert_format16 to here
     // @TODO: special case RGB-to-Y (and RGBA-to-YA) for 8-bit-to-16-bit case to keep more precision
     
-    if (stbi__vertically_flip_on_load) {
-        int channels = req_comp ? req_comp : *comp;
-        stbi__vertical_flip(result, *x, *y, channels * sizeof(stbi__uint16));
-    }
+    if (s->flip)
+        stbi__vertical_flip(result, *x, *y, out_n * sizeof(stbi__uint16));
     
+    STBI__PROF_END(STBI_stage_convert, t);
     return (stbi__uint16 *) result;
 }
 
+static stbi__uint16 *stbi__load_and_postprocess_16bit(stbi__context *s, int *x, int *y, int *comp, int req_comp)
+{
+    stbi__result_info ri;
+    void *result = stbi__load_main(s, x, y, comp, req_comp, &ri, 16);
+    return stbi__postprocess_16bit(s, result, ri, x, y, comp, req_comp);
+}
+
 #if !defined(STBI_NO_HDR) || !defined(STBI_NO_LINEAR)
-static void stbi__float_postprocess(float *result, int *x, int *y, int *comp, int req_comp)
+static void stbi__float_postprocess(stbi__context *s, float *result, int *x, int *y, int *comp, int req_comp)
 {
-    if (stbi__vertically_flip_on_load && result != NULL) {
+    if (s->flip && result != NULL) {
         int channels = req_comp ? req_comp : *comp;
         stbi__vertical_flip(result, *x, *y, channels * sizeof(float));
     }
@@ -1155,6 +2238,121 @@ static FILE *stbi__fopen(char const *filename, char const *mode)
     return f;
 }
 
+// a whole file in memory, either mapped or read into a malloc'd buffer
+typedef struct
+{
+    stbi_uc *data;
+    int len;
+    int mapped;
+} stbi__mapped_file;
+
+// the rest of 'f', after the 'head_len' bytes of it already read into
+// 'head', read until it ends into a buffer that doubles as it fills
+static int stbi__read_stream(stbi__mapped_file *m, FILE *f, stbi_uc const *head, int head_len)
+{
+    size_t size = (size_t) head_len, cap = 0, got;
+    stbi_uc *grown;
+    m->data = NULL;
+    m->mapped = 0;
+    for (;;) {
+        if (size >= cap) {
+            if (cap == INT_MAX) {
+                STBI_FREE(m->data);
+                return stbi__err("too large", "File too large");
+            }
+            got = cap ? (cap > INT_MAX / 2 ? INT_MAX : cap * 2) : 65536;
+            grown = (stbi_uc *) STBI_REALLOC_SIZED(m->data, cap, got);
+            if (!grown) {
+                STBI_FREE(m->data);
+                return stbi__err("outofmem", "Out of memory");
+            }
+            if (!m->data && head_len) memcpy(grown, head, (size_t) head_len);
+            m->data = grown;
+            cap = got;
+        }
+        got = fread(m->data + size, 1, cap - size, f);
+        size += got;
+        if (got == 0) break;
+    }
+    if (ferror(f)) {
+        STBI_FREE(m->data);
+        return stbi__err("can't fread", "Unable to read file");
+    }
+    if (size == 0) {
+        STBI_FREE(m->data);
+        return stbi__err("empty file", "Image file is empty");
+    }
+    m->len = (int) size;
+    return 1;
+}
+
+static int stbi__map_file(stbi__mapped_file *m, char const *filename)
+{
+    FILE *f = NULL;
+    long len;
+    int r;
+#ifdef STBI__MMAP
+    int fd = open(filename, O_RDONLY);
+    if (fd >= 0) {
+        struct stat st;
+        if (fstat(fd, &st) == 0 && st.st_size > 0 && st.st_size <= INT_MAX) {
+            void *p = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (p != MAP_FAILED) {
+                close(fd);
+                m->data = (stbi_uc *) p;
+                m->len = (int) st.st_size;
+                m->mapped = 1;
+                return 1;
+            }
+        }
+        // not mappable (a pipe, say, or no size to map); read it instead,
+        // through this descriptor, since opening a FIFO again would lose
+        // what its writer has already sent
+        f = fdopen(fd, "rb");
+        if (!f) close(fd);
+    }
+#endif
+    if (!f) f = stbi__fopen(filename, "rb");
+    if (!f) return stbi__err("can't fopen", "Unable to open file");
+    m->mapped = 0;
+    if (fseek(f, 0, SEEK_END) == 0 && (len = ftell(f)) > 0 && fseek(f, 0, SEEK_SET) == 0) {
+        if (len > INT_MAX) {
+            fclose(f);
+            return stbi__err("too large", "File too large");
+        }
+        m->data = (stbi_uc *) stbi__malloc((size_t) len);
+        if (!m->data) {
+            fclose(f);
+            return stbi__err("outofmem", "Out of memory");
+        }
+        if (fread(m->data, 1, (size_t) len, f) != (size_t) len) {
+            fclose(f);
+            STBI_FREE(m->data);
+            return stbi__err("can't fread", "Unable to read file");
+        }
+        fclose(f);
+        m->len = (int) len;
+        return 1;
+    }
+    
+    // no size to go by (a FIFO, /dev/stdin, a file that claims to be empty)
+    clearerr(f);
+    r = stbi__read_stream(m, f, NULL, 0);
+    fclose(f);
+    return r;
+}
+
+static void stbi__unmap_file(stbi__mapped_file *m)
+{
+#ifdef STBI__MMAP
+    if (m->mapped) {
+        munmap(m->data, (size_t) m->len);
+        return;
+    }
+#endif
+    STBI_FREE(m->data);
+}
+
 
 STBIDEF stbi_uc *stbi_load(char const *filename, int *x, int *y, int *comp, int req_comp)
 {
@@ -1166,6 +2364,41 @@ STBIDEF stbi_uc *stbi_load(char const *filename, int *x, int *y, int *comp, int
     return result;
 }
 
+STBIDEF int stbi_load_into(char const *filename, int *x, int *y, int *comp, void *dst, size_t dst_stride, size_t dst_size, int req_comp)
+{
+    FILE *f = stbi__fopen(filename, "rb");
+    stbi__context s;
+    int result;
+    if (!f) return stbi__err("can't fopen", "Unable to open file");
+    stbi__start_file(&s,f);
+    result = stbi__load_into(&s,x,y,comp,dst,dst_stride,dst_size,req_comp);
+    fclose(f);
+    return result;
+}
+
+STBIDEF stbi_uc *stbi_load_ex(char const *filename, int *x, int *y, int *comp, int req_comp, stbi_allocator const *alloc)
+{
+    FILE *f = stbi__fopen(filename, "rb");
+    stbi__context s;
+    unsigned char *result;
+    if (!f) return stbi__errpuc("can't fopen", "Unable to open file");
+    stbi__start_file(&s,f);
+    s.alloc = alloc;
+    result = stbi__load_and_postprocess_8bit(&s,x,y,comp,req_comp);
+    fclose(f);
+    return result;
+}
+
+STBIDEF stbi_uc *stbi_load_mapped(char const *filename, int *x, int *y, int *comp, int req_comp)
+{
+    stbi__mapped_file m;
+    stbi_uc *result;
+    if (!stbi__map_file(&m, filename)) return NULL;
+    result = stbi_load_from_memory(m.data, m.len, x, y, comp, req_comp);
+    stbi__unmap_file(&m);
+    return result;
+}
+
 STBIDEF stbi_uc *stbi_load_from_file(FILE *f, int *x, int *y, int *comp, int req_comp)
 {
     unsigned char *result;
@@ -1233,94 +2466,609 @@ STBIDEF stbi_uc *stbi_load_from_callbacks(stbi_io_callbacks const *clbk, void *u
     return stbi__load_and_postprocess_8bit(&s,x,y,comp,req_comp);
 }
 
-#ifndef STBI_NO_GIF
-STBIDEF stbi_uc *stbi_load_gif_from_memory(stbi_uc const *buffer, int len, int **delays, int *x, int *y, int *z, int *comp, int req_comp)
+STBIDEF int stbi_load_from_memory_into(stbi_uc const *buffer, int len, int *x, int *y, int *comp, void *dst, size_t dst_stride, size_t dst_size, int req_comp)
 {
-    unsigned char *result;
     stbi__context s;
     stbi__start_mem(&s,buffer,len);
-    
-    result = (unsigned char*) stbi__load_gif_main(&s, delays, x, y, z, comp, req_comp);
-    if (stbi__vertically_flip_on_load) {
-        stbi__vertical_flip_slices( result, *x, *y, *z, *comp );
-    }
-    
-    return result;
-}
-#endif
-
-#ifndef STBI_NO_LINEAR
-static float *stbi__loadf_main(stbi__context *s, int *x, int *y, int *comp, int req_comp)
-{
-    unsigned char *data;
-#ifndef STBI_NO_HDR
-    if (stbi__hdr_test(s)) {
-        stbi__result_info ri;
-        float *hdr_data = stbi__hdr_load(s,x,y,comp,req_comp, &ri);
-        if (hdr_data)
-            stbi__float_postprocess(hdr_data,x,y,comp,req_comp);
-        return hdr_data;
-    }
-#endif
-    data = stbi__load_and_postprocess_8bit(s, x, y, comp, req_comp);
-    if (data)
-        return stbi__ldr_to_hdr(data, *x, *y, req_comp ? req_comp : *comp);
-    return stbi__errpf("unknown image type", "Image not of any known type, or corrupt");
+    return stbi__load_into(&s,x,y,comp,dst,dst_stride,dst_size,req_comp);
 }
 
-STBIDEF float *stbi_loadf_from_memory(stbi_uc const *buffer, int len, int *x, int *y, int *comp, int req_comp)
+STBIDEF stbi_uc *stbi_load_from_memory_ex(stbi_uc const *buffer, int len, int *x, int *y, int *comp, int req_comp, stbi_allocator const *alloc)
 {
     stbi__context s;
     stbi__start_mem(&s,buffer,len);
-    return stbi__loadf_main(&s,x,y,comp,req_comp);
+    s.alloc = alloc;
+    return stbi__load_and_postprocess_8bit(&s,x,y,comp,req_comp);
 }
 
-STBIDEF float *stbi_loadf_from_callbacks(stbi_io_callbacks const *clbk, void *user, int *x, int *y, int *comp, int req_comp)
+STBIDEF stbi_uc *stbi_load_from_callbacks_ex(stbi_io_callbacks const *clbk, void *user, int *x, int *y, int *comp, int req_comp, stbi_allocator const *alloc)
 {
     stbi__context s;
     stbi__start_callbacks(&s, (stbi_io_callbacks *) clbk, user);
-    return stbi__loadf_main(&s,x,y,comp,req_comp);
+    s.alloc = alloc;
+    return stbi__load_and_postprocess_8bit(&s,x,y,comp,req_comp);
 }
 
-#ifndef STBI_NO_STDIO
-STBIDEF float *stbi_loadf(char const *filename, int *x, int *y, int *comp, int req_comp)
+STBIDEF stbi_uc *stbi_load_from_memory_mt(stbi_uc const *buffer, int len, int *x, int *y, int *comp, int req_comp, int threads)
 {
-    float *result;
-    FILE *f = stbi__fopen(filename, "rb");
-    if (!f) return stbi__errpf("can't fopen", "Unable to open file");
-    result = stbi_loadf_from_file(f,x,y,comp,req_comp);
-    fclose(f);
-    return result;
+    stbi__context s;
+    stbi__start_mem(&s,buffer,len);
+    s.num_threads = threads;
+    return stbi__load_and_postprocess_8bit(&s,x,y,comp,req_comp);
 }
 
-STBIDEF float *stbi_loadf_from_file(FILE *f, int *x, int *y, int *comp, int req_comp)
+STBIDEF stbi_uc *stbi_load_from_memory_scaled(stbi_uc const *buffer, int len, int *x, int *y, int *comp, int req_comp, int scale_denom)
 {
     stbi__context s;
-    stbi__start_file(&s,f);
-    return stbi__loadf_main(&s,x,y,comp,req_comp);
+    if (scale_denom != 1 && scale_denom != 2 && scale_denom != 4 && scale_denom != 8)
+        return stbi__errpuc("bad scale_denom", "Scale must be 1, 2, 4 or 8");
+    stbi__start_mem(&s,buffer,len);
+    s.scale_denom = scale_denom;
+    return stbi__load_and_postprocess_8bit(&s,x,y,comp,req_comp);
 }
-#endif // !STBI_NO_STDIO
 
-#endif // !STBI_NO_LINEAR
-
-// these is-hdr-or-not is defined independent of whether STBI_NO_LINEAR is
-// defined, for API simplicity; if STBI_NO_LINEAR is defined, it always
-// reports false!
-
-STBIDEF int stbi_is_hdr_from_memory(stbi_uc const *buffer, int len)
+STBIDEF stbi_uc *stbi_load_from_memory_preview(stbi_uc const *buffer, int len, int *x, int *y, int *comp, int req_comp)
 {
-#ifndef STBI_NO_HDR
     stbi__context s;
     stbi__start_mem(&s,buffer,len);
-    return stbi__hdr_test(&s);
-#else
-    STBI_NOTUSED(buffer);
-    STBI_NOTUSED(len);
-    return 0;
-#endif
+    s.scale_denom = 8;
+    s.preview = 1;
+    return stbi__load_and_postprocess_8bit(&s,x,y,comp,req_comp);
 }
 
-#ifndef STBI_NO_STDIO
+STBIDEF stbi_uc *stbi_load_from_memory_region(stbi_uc const *buffer, int len, int *x, int *y, int *comp, int req_comp, int region_x, int region_y, int region_w, int region_h)
+{
+    stbi__context s;
+    if (region_x < 0 || region_y < 0 || region_w <= 0 || region_h <= 0)
+        return stbi__errpuc("bad region", "Region is outside the image");
+    stbi__start_mem(&s,buffer,len);
+    s.roi_x = region_x;
+    s.roi_y = region_y;
+    s.roi_w = region_w;
+    s.roi_h = region_h;
+    return stbi__load_and_postprocess_8bit(&s,x,y,comp,req_comp);
+}
+
+#ifndef STBI_NO_STDIO
+STBIDEF stbi_uc *stbi_load_region(char const *filename, int *x, int *y, int *comp, int req_comp, int region_x, int region_y, int region_w, int region_h)
+{
+    FILE *f;
+    stbi__context s;
+    unsigned char *result;
+    if (region_x < 0 || region_y < 0 || region_w <= 0 || region_h <= 0)
+        return stbi__errpuc("bad region", "Region is outside the image");
+    f = stbi__fopen(filename, "rb");
+    if (!f) return stbi__errpuc("can't fopen", "Unable to open file");
+    stbi__start_file(&s,f);
+    s.roi_x = region_x;
+    s.roi_y = region_y;
+    s.roi_w = region_w;
+    s.roi_h = region_h;
+    result = stbi__load_and_postprocess_8bit(&s,x,y,comp,req_comp);
+    fclose(f);
+    return result;
+}
+
+STBIDEF stbi_uc *stbi_load_preview(char const *filename, int *x, int *y, int *comp, int req_comp)
+{
+    FILE *f = stbi__fopen(filename, "rb");
+    stbi__context s;
+    unsigned char *result;
+    if (!f) return stbi__errpuc("can't fopen", "Unable to open file");
+    stbi__start_file(&s,f);
+    s.scale_denom = 8;
+    s.preview = 1;
+    result = stbi__load_and_postprocess_8bit(&s,x,y,comp,req_comp);
+    fclose(f);
+    return result;
+}
+
+STBIDEF stbi_uc *stbi_load_scaled(char const *filename, int *x, int *y, int *comp, int req_comp, int scale_denom)
+{
+    FILE *f;
+    stbi__context s;
+    unsigned char *result;
+    if (scale_denom != 1 && scale_denom != 2 && scale_denom != 4 && scale_denom != 8)
+        return stbi__errpuc("bad scale_denom", "Scale must be 1, 2, 4 or 8");
+    f = stbi__fopen(filename, "rb");
+    if (!f) return stbi__errpuc("can't fopen", "Unable to open file");
+    stbi__start_file(&s,f);
+    s.scale_denom = scale_denom;
+    result = stbi__load_and_postprocess_8bit(&s,x,y,comp,req_comp);
+    fclose(f);
+    return result;
+}
+
+STBIDEF stbi_uc *stbi_load_mt(char const *filename, int *x, int *y, int *comp, int req_comp, int threads)
+{
+    stbi__mapped_file m;
+    stbi_uc *result;
+    if (!stbi__map_file(&m, filename)) return NULL;
+    result = stbi_load_from_memory_mt(m.data, m.len, x, y, comp, req_comp, threads);
+    stbi__unmap_file(&m);
+    return result;
+}
+
+// stbi_batch_load: each worker keeps an arena for the decoders' scratch
+// memory and regrows it after any image that didn't fit, so once a worker
+// has seen its biggest image the decoders stop going to malloc. workers
+// start with an even share of the files and, once theirs run out, steal
+// the back half of another worker's remaining files.
+typedef struct
+{
+    stbi_arena arena;
+    size_t spilled; // scratch bytes that didn't fit in the arena this image
+} stbi__batch_arena;
+
+static void *stbi__batch_alloc(void *user, size_t size)
+{
+    stbi__batch_arena *w = (stbi__batch_arena *) user;
+    void *p = stbi__arena_alloc(&w->arena, size);
+    if (!stbi__arena_owns(&w->arena, p)) w->spilled += size;
+    return p;
+}
+
+static void *stbi__batch_realloc(void *user, void *p, size_t oldsz, size_t newsz)
+{
+    stbi__batch_arena *w = (stbi__batch_arena *) user;
+    void *q = stbi__arena_realloc(&w->arena, p, oldsz, newsz);
+    if (!stbi__arena_owns(&w->arena, q)) w->spilled += newsz;
+    return q;
+}
+
+static void stbi__batch_free(void *user, void *p)
+{
+    stbi__arena_free(&((stbi__batch_arena *) user)->arena, p);
+}
+
+typedef struct
+{
+    char const * const *filenames;
+    stbi_batch_result *results;
+    int count, desired_channels, num_workers;
+#ifdef STBI_NO_THREADS
+    int next;
+#else
+    stbi__uint64 volatile range[STBI_MAX_THREADS]; // first file << 32 | end of a worker's files
+#endif
+    int loaded[STBI_MAX_THREADS];
+} stbi__batch;
+
+#ifndef STBI_NO_THREADS
+#define STBI__BATCH_RANGE(first, end) (((stbi__uint64) (first) << 32) | (stbi__uint32) (end))
+#endif
+
+// returns the next file for 'worker' to load, or -1 if there are none left
+static int stbi__batch_next(stbi__batch *b, int worker)
+{
+#ifdef STBI_NO_THREADS
+    STBI_NOTUSED(worker);
+    return b->next < b->count ? b->next++ : -1;
+#else
+    stbi__uint64 mine, r;
+    stbi__uint32 first, end, mid;
+    int k;
+    for (;;) {
+        mine = stbi__atomic_load64(&b->range[worker]);
+        first = (stbi__uint32) (mine >> 32);
+        end = (stbi__uint32) mine;
+        if (first >= end) break;
+        if (stbi__atomic_cas64(&b->range[worker], mine, STBI__BATCH_RANGE(first+1, end)))
+            return (int) first;
+    }
+    // ranges only ever shrink, apart from an empty one being refilled by
+    // its owner, so a range that compares equal hasn't changed
+    for (k=1; k < b->num_workers; ++k) {
+        int v = (worker + k) % b->num_workers;
+        for (;;) {
+            r = stbi__atomic_load64(&b->range[v]);
+            first = (stbi__uint32) (r >> 32);
+            end = (stbi__uint32) r;
+            if (first >= end) break;
+            mid = end - (end - first + 1) / 2;
+            if (stbi__atomic_cas64(&b->range[v], r, STBI__BATCH_RANGE(first, mid))) {
+                // nobody else touches an empty range, so this can't fail
+                stbi__atomic_cas64(&b->range[worker], mine, STBI__BATCH_RANGE(mid+1, end));
+                return (int) mid;
+            }
+        }
+    }
+    return -1;
+#endif
+}
+
+static void stbi__batch_worker(void *arg, int worker)
+{
+    stbi__batch *b = (stbi__batch *) arg;
+    stbi__batch_arena w;
+    stbi_allocator al;
+    stbi__mapped_file m;
+    int i;
+    stbi_arena_init(&w.arena, NULL, 0);
+    al.alloc_fn = stbi__batch_alloc;
+    al.realloc_fn = stbi__batch_realloc;
+    al.free_fn = stbi__batch_free;
+    al.user = &w;
+    b->loaded[worker] = 0;
+    while ((i = stbi__batch_next(b, worker)) >= 0) {
+        stbi_batch_result *r = &b->results[i];
+        r->data = NULL;
+        r->x = r->y = r->channels_in_file = 0;
+        if (stbi__map_file(&m, b->filenames[i])) {
+            stbi_arena_reset(&w.arena);
+            w.spilled = 0;
+            r->data = stbi_load_from_memory_ex(m.data, m.len, &r->x, &r->y, &r->channels_in_file, b->desired_channels, &al);
+            stbi__unmap_file(&m);
+            if (w.spilled) {
+                // round up to a megabyte so a run of slightly bigger images
+                // doesn't regrow it every time
+                size_t size = (w.arena.used + w.spilled + 0xfffff) & ~(size_t) 0xfffff;
+                STBI_FREE(w.arena.base);
+                stbi_arena_init(&w.arena, stbi__malloc(size), size);
+            }
+        }
+        r->failure_reason = r->data ? NULL : stbi__g_failure_reason;
+        if (r->data) ++b->loaded[worker];
+    }
+    STBI_FREE(w.arena.base);
+}
+
+STBIDEF int stbi_batch_load(char const * const *filenames, int count, stbi_batch_result *results, int desired_channels, int threads)
+{
+    stbi__batch b;
+    int k, loaded = 0;
+    if (count <= 0) return 0;
+    b.filenames = filenames;
+    b.results = results;
+    b.count = count;
+    b.desired_channels = desired_channels;
+    if (threads > count) threads = count;
+    if (threads > STBI_MAX_THREADS) threads = STBI_MAX_THREADS;
+    if (threads < 1) threads = 1;
+#ifdef STBI_NO_THREADS
+    threads = 1;
+    b.next = 0;
+#else
+    for (k=0; k < threads; ++k)
+        b.range[k] = STBI__BATCH_RANGE((stbi__uint64) count * k / threads, (stbi__uint64) count * (k+1) / threads);
+#endif
+    b.num_workers = threads;
+#ifdef STBI_NO_THREADS
+    stbi__batch_worker(&b, 0);
+#else
+    stbi__parallel_run(threads, stbi__batch_worker, &b);
+#endif
+    for (k=0; k < threads; ++k)
+        loaded += b.loaded[k];
+    return loaded;
+}
+#endif
+
+#ifndef STBI_NO_GIF
+STBIDEF stbi_uc *stbi_load_gif_from_memory(stbi_uc const *buffer, int len, int **delays, int *x, int *y, int *z, int *comp, int req_comp)
+{
+    unsigned char *result;
+    stbi__context s;
+    stbi__start_mem(&s,buffer,len);
+    
+    result = (unsigned char*) stbi__load_gif_main(&s, delays, x, y, z, comp, req_comp);
+    if (s.flip) {
+        stbi__vertical_flip_slices( result, *x, *y, *z, *comp );
+    }
+    
+    return result;
+}
+#endif
+
+#ifndef STBI_NO_LINEAR
+static float *stbi__loadf_main(stbi__context *s, int *x, int *y, int *comp, int req_comp)
+{
+    stbi__result_info ri;
+    void *data;
+#ifndef STBI_NO_HDR
+    if (stbi__hdr_test(s)) {
+        stbi__result_info ri;
+        float *hdr_data = stbi__hdr_load(s,x,y,comp,req_comp, &ri);
+        if (hdr_data && s->roi_w)
+            hdr_data = (float *) stbi__crop(s, (stbi_uc *) hdr_data, x, y, (req_comp ? req_comp : *comp) * (int) sizeof(float));
+        if (hdr_data)
+            stbi__float_postprocess(s,hdr_data,x,y,comp,req_comp);
+        return hdr_data;
+    }
+#endif
+    s->premultiply = s->srgb_to_linear = 0; // stbi__ldr_to_hdr has its own gamma
+    // 16-bit files keep their 16 bits, as in stbi_loadh and stbi_load_rgb9e5;
+    // a JPEG would only be widened
+#ifndef STBI_NO_JPEG
+    if (stbi__jpeg_test(s))
+        data = stbi__load_main(s, x, y, comp, req_comp, &ri, 8);
+    else
+#endif
+    data = stbi__load_main(s, x, y, comp, req_comp, &ri, 16);
+    if (data && ri.bits_per_channel == 16) {
+        data = stbi__postprocess_16bit(s, data, ri, x, y, comp, req_comp);
+        if (data)
+            return stbi__ldr16_to_hdr(s, (stbi__uint16 *) data, *x, *y, req_comp ? req_comp : *comp);
+        return NULL;
+    }
+    data = stbi__postprocess_8bit(s, data, ri, x, y, comp, req_comp);
+    if (data)
+        return stbi__ldr_to_hdr(s, (stbi_uc *) data, *x, *y, req_comp ? req_comp : *comp);
+    return stbi__errpf("unknown image type", "Image not of any known type, or corrupt");
+}
+
+STBIDEF float *stbi_loadf_from_memory(stbi_uc const *buffer, int len, int *x, int *y, int *comp, int req_comp)
+{
+    stbi__context s;
+    stbi__start_mem(&s,buffer,len);
+    return stbi__loadf_main(&s,x,y,comp,req_comp);
+}
+
+STBIDEF float *stbi_loadf_from_callbacks(stbi_io_callbacks const *clbk, void *user, int *x, int *y, int *comp, int req_comp)
+{
+    stbi__context s;
+    stbi__start_callbacks(&s, (stbi_io_callbacks *) clbk, user);
+    return stbi__loadf_main(&s,x,y,comp,req_comp);
+}
+
+#ifndef STBI_NO_STDIO
+STBIDEF float *stbi_loadf(char const *filename, int *x, int *y, int *comp, int req_comp)
+{
+    float *result;
+    FILE *f = stbi__fopen(filename, "rb");
+    if (!f) return stbi__errpf("can't fopen", "Unable to open file");
+    result = stbi_loadf_from_file(f,x,y,comp,req_comp);
+    fclose(f);
+    return result;
+}
+
+STBIDEF float *stbi_loadf_from_file(FILE *f, int *x, int *y, int *comp, int req_comp)
+{
+    stbi__context s;
+    stbi__start_file(&s,f);
+    return stbi__loadf_main(&s,x,y,comp,req_comp);
+}
+#endif // !STBI_NO_STDIO
+#endif // !STBI_NO_LINEAR
+
+STBIDEF void stbi_options_init(stbi_options *opt)
+{
+    memset(opt, 0, sizeof(*opt));
+    opt->ldr_to_hdr_gamma = 2.2f;
+    opt->ldr_to_hdr_scale = 1.0f;
+    opt->hdr_to_ldr_gamma = 2.2f;
+    opt->hdr_to_ldr_scale = 1.0f;
+    opt->scale_denom = 1;
+    opt->threads = 1;
+}
+
+// replace the context's copy of the global settings with 'opt'
+static int stbi__apply_options(stbi__context *s, stbi_options const *opt)
+{
+    if (opt->scale_denom != 1 && opt->scale_denom != 2 && opt->scale_denom != 4 && opt->scale_denom != 8)
+        return stbi__err("bad scale_denom", "Scale must be 1, 2, 4 or 8");
+    if (opt->region_w && (opt->region_x < 0 || opt->region_y < 0 || opt->region_w <= 0 || opt->region_h <= 0))
+        return stbi__err("bad region", "Region is outside the image");
+    s->flip = opt->flip_vertically;
+    s->premultiply = opt->premultiply;
+    s->srgb_to_linear = opt->srgb_to_linear;
+    s->unpremultiply = opt->unpremultiply;
+    s->de_iphone = opt->convert_iphone_png;
+    s->l2h_gamma = opt->ldr_to_hdr_gamma;
+    s->l2h_scale = opt->ldr_to_hdr_scale;
+    s->h2l_gamma_i = 1/opt->hdr_to_ldr_gamma;
+    s->h2l_scale_i = 1/opt->hdr_to_ldr_scale;
+    s->scale_denom = opt->preview ? 8 : opt->scale_denom;
+    s->preview = opt->preview != 0;
+    s->roi_x = opt->region_x;
+    s->roi_y = opt->region_y;
+    s->roi_w = opt->region_w;
+    s->roi_h = opt->region_h;
+    s->num_threads = opt->threads > 1 ? opt->threads : 1;
+    s->alloc = opt->alloc;
+    return 1;
+}
+
+// the _opt loaders; bpc picks the 8-bit, 16-bit or float path
+static void *stbi__load_opt(stbi__context *s, int *x, int *y, int *comp, int req_comp, stbi_options *opt, int bpc)
+{
+    stbi_options def;
+    void *result = NULL;
+    if (!opt) {
+        stbi_options_init(&def);
+        opt = &def;
+    }
+    if (stbi__apply_options(s, opt)) {
+        if (bpc == 8)
+            result = stbi__load_and_postprocess_8bit(s, x, y, comp, req_comp);
+        else if (bpc == 16)
+            result = stbi__load_and_postprocess_16bit(s, x, y, comp, req_comp);
+#ifndef STBI_NO_LINEAR
+        else
+            result = stbi__loadf_main(s, x, y, comp, req_comp);
+#endif
+    }
+    opt->failure_reason = result ? NULL : stbi__g_failure_reason;
+    return result;
+}
+
+STBIDEF stbi_uc *stbi_load_from_memory_opt(stbi_uc const *buffer, int len, int *x, int *y, int *comp, int req_comp, stbi_options *opt)
+{
+    stbi__context s;
+    stbi__start_mem(&s,buffer,len);
+    return (stbi_uc *) stbi__load_opt(&s,x,y,comp,req_comp,opt,8);
+}
+
+STBIDEF stbi_uc *stbi_load_from_callbacks_opt(stbi_io_callbacks const *clbk, void *user, int *x, int *y, int *comp, int req_comp, stbi_options *opt)
+{
+    stbi__context s;
+    stbi__start_callbacks(&s, (stbi_io_callbacks *) clbk, user);
+    return (stbi_uc *) stbi__load_opt(&s,x,y,comp,req_comp,opt,8);
+}
+
+STBIDEF stbi_us *stbi_load_16_from_memory_opt(stbi_uc const *buffer, int len, int *x, int *y, int *comp, int req_comp, stbi_options *opt)
+{
+    stbi__context s;
+    stbi__start_mem(&s,buffer,len);
+    return (stbi_us *) stbi__load_opt(&s,x,y,comp,req_comp,opt,16);
+}
+
+STBIDEF stbi_us *stbi_load_16_from_callbacks_opt(stbi_io_callbacks const *clbk, void *user, int *x, int *y, int *comp, int req_comp, stbi_options *opt)
+{
+    stbi__context s;
+    stbi__start_callbacks(&s, (stbi_io_callbacks *) clbk, user);
+    return (stbi_us *) stbi__load_opt(&s,x,y,comp,req_comp,opt,16);
+}
+
+#ifndef STBI_NO_LINEAR
+STBIDEF float *stbi_loadf_from_memory_opt(stbi_uc const *buffer, int len, int *x, int *y, int *comp, int req_comp, stbi_options *opt)
+{
+    stbi__context s;
+    stbi__start_mem(&s,buffer,len);
+    return (float *) stbi__load_opt(&s,x,y,comp,req_comp,opt,32);
+}
+
+STBIDEF float *stbi_loadf_from_callbacks_opt(stbi_io_callbacks const *clbk, void *user, int *x, int *y, int *comp, int req_comp, stbi_options *opt)
+{
+    stbi__context s;
+    stbi__start_callbacks(&s, (stbi_io_callbacks *) clbk, user);
+    return (float *) stbi__load_opt(&s,x,y,comp,req_comp,opt,32);
+}
+#endif
+
+#ifndef STBI_NO_STDIO
+static void *stbi__load_file_opt(char const *filename, int *x, int *y, int *comp, int req_comp, stbi_options *opt, int bpc)
+{
+    stbi__context s;
+    stbi__mapped_file m;
+    FILE *f = NULL;
+    void *result;
+    int ok;
+    if (opt && opt->threads > 1) {
+        // the multithreaded decoders want the whole file in memory, as for stbi_load_mt
+        ok = stbi__map_file(&m, filename);
+        if (ok) stbi__start_mem(&s, m.data, m.len);
+    } else {
+        f = stbi__fopen(filename, "rb");
+        ok = f ? 1 : stbi__err("can't fopen", "Unable to open file");
+        if (ok) stbi__start_file(&s, f);
+    }
+    if (!ok) {
+        if (opt) opt->failure_reason = stbi__g_failure_reason;
+        return NULL;
+    }
+    result = stbi__load_opt(&s,x,y,comp,req_comp,opt,bpc);
+    if (f)
+        fclose(f);
+    else
+        stbi__unmap_file(&m);
+    return result;
+}
+
+STBIDEF stbi_uc *stbi_load_opt(char const *filename, int *x, int *y, int *comp, int req_comp, stbi_options *opt)
+{
+    return (stbi_uc *) stbi__load_file_opt(filename,x,y,comp,req_comp,opt,8);
+}
+
+STBIDEF stbi_us *stbi_load_16_opt(char const *filename, int *x, int *y, int *comp, int req_comp, stbi_options *opt)
+{
+    return (stbi_us *) stbi__load_file_opt(filename,x,y,comp,req_comp,opt,16);
+}
+
+#ifndef STBI_NO_LINEAR
+STBIDEF float *stbi_loadf_opt(char const *filename, int *x, int *y, int *comp, int req_comp, stbi_options *opt)
+{
+    return (float *) stbi__load_file_opt(filename,x,y,comp,req_comp,opt,32);
+}
+#endif
+#endif // !STBI_NO_STDIO
+
+#ifndef STBI_NO_LINEAR
+
+STBIDEF stbi_us *stbi_loadh_from_memory(stbi_uc const *buffer, int len, int *x, int *y, int *comp, int req_comp)
+{
+    stbi__context s;
+    stbi__start_mem(&s,buffer,len);
+    return (stbi_us *) stbi__load_gpu_main(&s,x,y,comp,req_comp,STBI__FMT_HALF);
+}
+
+STBIDEF stbi_us *stbi_loadh_from_callbacks(stbi_io_callbacks const *clbk, void *user, int *x, int *y, int *comp, int req_comp)
+{
+    stbi__context s;
+    stbi__start_callbacks(&s, (stbi_io_callbacks *) clbk, user);
+    return (stbi_us *) stbi__load_gpu_main(&s,x,y,comp,req_comp,STBI__FMT_HALF);
+}
+
+STBIDEF unsigned int *stbi_load_rgb9e5_from_memory(stbi_uc const *buffer, int len, int *x, int *y, int *comp)
+{
+    stbi__context s;
+    stbi__start_mem(&s,buffer,len);
+    return (unsigned int *) stbi__load_gpu_main(&s,x,y,comp,3,STBI__FMT_RGB9E5);
+}
+
+STBIDEF unsigned int *stbi_load_rgb9e5_from_callbacks(stbi_io_callbacks const *clbk, void *user, int *x, int *y, int *comp)
+{
+    stbi__context s;
+    stbi__start_callbacks(&s, (stbi_io_callbacks *) clbk, user);
+    return (unsigned int *) stbi__load_gpu_main(&s,x,y,comp,3,STBI__FMT_RGB9E5);
+}
+
+#ifndef STBI_NO_STDIO
+STBIDEF stbi_us *stbi_loadh(char const *filename, int *x, int *y, int *comp, int req_comp)
+{
+    stbi_us *result;
+    FILE *f = stbi__fopen(filename, "rb");
+    if (!f) return (stbi_us *) stbi__errpuc("can't fopen", "Unable to open file");
+    result = stbi_loadh_from_file(f,x,y,comp,req_comp);
+    fclose(f);
+    return result;
+}
+
+STBIDEF stbi_us *stbi_loadh_from_file(FILE *f, int *x, int *y, int *comp, int req_comp)
+{
+    stbi__context s;
+    stbi__start_file(&s,f);
+    return (stbi_us *) stbi__load_gpu_main(&s,x,y,comp,req_comp,STBI__FMT_HALF);
+}
+
+STBIDEF unsigned int *stbi_load_rgb9e5(char const *filename, int *x, int *y, int *comp)
+{
+    unsigned int *result;
+    FILE *f = stbi__fopen(filename, "rb");
+    if (!f) return (unsigned int *) stbi__errpuc("can't fopen", "Unable to open file");
+    result = stbi_load_rgb9e5_from_file(f,x,y,comp);
+    fclose(f);
+    return result;
+}
+
+STBIDEF unsigned int *stbi_load_rgb9e5_from_file(FILE *f, int *x, int *y, int *comp)
+{
+    stbi__context s;
+    stbi__start_file(&s,f);
+    return (unsigned int *) stbi__load_gpu_main(&s,x,y,comp,3,STBI__FMT_RGB9E5);
+}
+#endif // !STBI_NO_STDIO
+
+#endif // !STBI_NO_LINEAR
+
+// these is-hdr-or-not is defined independent of whether STBI_NO_LINEAR is
+// defined, for API simplicity; if STBI_NO_LINEAR is defined, it always
+// reports false!
+
+STBIDEF int stbi_is_hdr_from_memory(stbi_uc const *buffer, int len)
+{
+#ifndef STBI_NO_HDR
+    stbi__context s;
+    stbi__start_mem(&s,buffer,len);
+    return stbi__hdr_test(&s);
+#else
+    STBI_NOTUSED(buffer);
+    STBI_NOTUSED(len);
+    return 0;
+#endif
+}
+
+#ifndef STBI_NO_STDIO
 STBIDEF int      stbi_is_hdr          (char const *filename)
 {
     FILE *f = stbi__fopen(filename, "rb");
@@ -1356,23 +3104,11 @@ STBIDEF int      stbi_is_hdr_from_callbacks(stbi_io_callbacks const *clbk, void
     stbi__start_callbacks(&s, (stbi_io_callbacks *) clbk, user);
     return stbi__hdr_test(&s);
 #else
-    STBI_NOTUSED(clbk);
-    STBI_NOTUSED(user);
-    return 0;
-#endif
-}
-
-#ifndef STBI_NO_LINEAR
-static float stbi__l2h_gamma=2.2f, stbi__l2h_scale=1.0f;
-
-STBIDEF void   stbi_ldr_to_hdr_gamma(float gamma) { stbi__l2h_gamma = gamma; }
-STBIDEF void   stbi_ldr_to_hdr_scale(float scale) { stbi__l2h_scale = scale; }
+    STBI_NOTUSED(clbk);
+    STBI_NOTUSED(user);
+    return 0;
 #endif
-
-static float stbi__h2l_gamma_i=1.0f/2.2f, stbi__h2l_scale_i=1.0f;
-
-STBIDEF void   stbi_hdr_to_ldr_gamma(float gamma) { stbi__h2l_gamma_i = 1/gamma; }
-STBIDEF void   stbi_hdr_to_ldr_scale(float scale) { stbi__h2l_scale_i = 1/scale; }
+}
 
 
 //////////////////////////////////////////////////////////////////////////////
@@ -1497,6 +3233,91 @@ static stbi__uint32 stbi__get32le(stbi__context *s)
 }
 #endif
 
+#if !defined(STBI_NO_BMP) || !defined(STBI_NO_TGA) || !defined(STBI_NO_PNM)
+// where the uncompressed formats write their rows: straight into
+// stbi_load_into's buffer when there's no channel conversion or cropping
+// left for the postprocess pass, in which case *flip says whether to write
+// them bottom-up, as the pass would have; else a new w*h*n buffer. *stride
+// is the distance between rows
+static stbi_uc *stbi__rows_alloc(stbi__context *s, int w, int h, int n, int req_comp, size_t *stride, int *flip)
+{
+    stbi_uc *out;
+    *stride = (size_t) w * n;
+    *flip = 0;
+    if (s->into && !s->roi_w && req_comp == n) {
+        if (!stbi__into_fits(s, w, h, n)) return stbi__errpuc("buffer too small", "Output buffer too small");
+        *stride = s->into_stride;
+        *flip = s->flip;
+        return s->into;
+    }
+    out = (stbi_uc *) stbi__malloc_mad3(n, w, h, 0);
+    if (!out) return stbi__errpuc("outofmem", "Out of memory");
+    return out;
+}
+#endif
+
+#if !defined(STBI_NO_BMP) || !defined(STBI_NO_TGA)
+// the next n bytes, where they already are if the context holds them (a
+// memory or mapped file) so the only copy is the one into the output, else
+// read into buf; NULL if the file is short
+static stbi_uc const *stbi__getn_inplace(stbi__context *s, stbi_uc *buf, int n)
+{
+    if (s->img_buffer_end - s->img_buffer >= n) {
+        stbi_uc const *p = s->img_buffer;
+        s->img_buffer += n;
+        return p;
+    }
+    return stbi__getn(s, buf, n) ? buf : NULL;
+}
+
+#ifdef STBI_AVX2
+// 5 pixels per 16 bytes; the 16th byte is stored back as it was, and
+// rewritten by the next 5 pixels' store, so this works in place too
+static STBI__AVX2_TARGET int stbi__swap_rb3_avx2(stbi_uc *dest, stbi_uc const *src, int count)
+{
+    int i = 0;
+    __m256i swap = _mm256_setr_epi8(2,1,0,5,4,3,8,7,6,11,10,9,14,13,12,15,
+                                    2,1,0,5,4,3,8,7,6,11,10,9,14,13,12,15);
+    for (; i+11 <= count; i += 10) {
+        __m256i v = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((__m128i const *) (src + i*3))),
+                                            _mm_loadu_si128((__m128i const *) (src + i*3 + 15)), 1);
+        v = _mm256_shuffle_epi8(v, swap);
+        _mm_storeu_si128((__m128i *) (dest + i*3),      _mm256_castsi256_si128(v));
+        _mm_storeu_si128((__m128i *) (dest + i*3 + 15), _mm256_extracti128_si256(v, 1));
+    }
+    return i;
+}
+#endif
+
+// count pixels of n (3 or 4) bytes from BGR(A) to RGB(A); dest may be src
+static void stbi__swap_rb(stbi_uc *dest, stbi_uc const *src, int count, int n)
+{
+    int i = 0;
+#ifdef STBI_AVX2
+    if (n == 3 && stbi__avx2_available())
+        i = stbi__swap_rb3_avx2(dest, src, count);
+#endif
+#ifdef STBI_SSE2
+    if (n == 4 && stbi__sse2_available()) {
+        __m128i ag = _mm_set1_epi32((int) 0xff00ff00), lo = _mm_set1_epi32(0xff);
+        for (; i+4 <= count; i += 4) {
+            __m128i v = _mm_loadu_si128((__m128i const *) (src + i*4));
+            __m128i r = _mm_and_si128(_mm_srli_epi32(v, 16), lo);
+            __m128i b = _mm_slli_epi32(_mm_and_si128(v, lo), 16);
+            _mm_storeu_si128((__m128i *) (dest + i*4), _mm_or_si128(_mm_and_si128(v, ag), _mm_or_si128(r, b)));
+        }
+    }
+#endif
+    for (; i < count; ++i) {
+        stbi_uc b = src[i*n];
+        dest[i*n  ] = src[i*n+2];
+        dest[i*n+1] = src[i*n+1];
+        dest[i*n+2] = b;
+        if (n == 4) dest[i*n+3] = src[i*n+3];
+    }
+}
+#endif
+
 #define STBI__BYTECAST(x)  ((stbi_uc) ((x) & 255))  // truncate int to byte without warnings
 
 
@@ -1516,9 +3337,41 @@ static stbi_uc stbi__compute_y(int r, int g, int b)
     return (stbi_uc) (((r*77) + (g*150) +  (29*b)) >> 8);
 }
 
+// convert one row of x pixels; dest may be src when req_comp <= img_n
+static void stbi__convert_row(unsigned char *dest, unsigned char const *src, int img_n, int req_comp, int x)
+{
+    int i;
+    
+    if (req_comp == img_n) {
+        if (dest != src) memcpy(dest, src, (size_t) x * img_n);
+        return;
+    }
+    
+#define STBI__COMBO(a,b)  ((a)*8+(b))
+#define STBI__CASE(a,b)   case STBI__COMBO(a,b): for(i=x-1; i >= 0; --i, src += a, dest += b)
+    // convert source image with img_n components to one with req_comp components;
+    // avoid switch per pixel, so use switch per scanline and massive macros
+    switch (STBI__COMBO(img_n, req_comp)) {
+            STBI__CASE(1,2) { dest[0]=src[0], dest[1]=255;                                     } break;
+            STBI__CASE(1,3) { dest[0]=dest[1]=dest[2]=src[0];                                  } break;
+            STBI__CASE(1,4) { dest[0]=dest[1]=dest[2]=src[0], dest[3]=255;                     } break;
+            STBI__CASE(2,1) { dest[0]=src[0];                                                  } break;
+            STBI__CASE(2,3) { dest[0]=dest[1]=dest[2]=src[0];                                  } break;
+            STBI__CASE(2,4) { dest[0]=dest[1]=dest[2]=src[0], dest[3]=src[1];                  } break;
+            STBI__CASE(3,4) { dest[0]=src[0],dest[1]=src[1],dest[2]=src[2],dest[3]=255;        } break;
+            STBI__CASE(3,1) { dest[0]=stbi__compute_y(src[0],src[1],src[2]);                   } break;
+            STBI__CASE(3,2) { dest[0]=stbi__compute_y(src[0],src[1],src[2]), dest[1] = 255;    } break;
+            STBI__CASE(4,1) { dest[0]=stbi__compute_y(src[0],src[1],src[2]);                   } break;
+            STBI__CASE(4,2) { dest[0]=stbi__compute_y(src[0],src[1],src[2]), dest[1] = src[3]; } break;
+            STBI__CASE(4,3) { dest[0]=src[0],dest[1]=src[1],dest[2]=src[2];                    } break;
+        default: STBI_ASSERT(0);
+    }
+#undef STBI__CASE
+}
+
 static unsigned char *stbi__convert_format(unsigned char *data, int img_n, int req_comp, unsigned int x, unsigned int y)
 {
-    int i,j;
+    int j;
     unsigned char *good;
     
     if (req_comp == img_n) return data;
@@ -1530,123 +3383,454 @@ static unsigned char *stbi__convert_format(unsigned char *data, int img_n, int r
         return stbi__errpuc("outofmem", "Out of memory");
     }
     
-    for (j=0; j < (int) y; ++j) {
-        unsigned char *src  = data + j * x * img_n   ;
-        unsigned char *dest = good + j * x * req_comp;
-        
-#define STBI__COMBO(a,b)  ((a)*8+(b))
-#define STBI__CASE(a,b)   case STBI__COMBO(a,b): for(i=x-1; i >= 0; --i, src += a, dest += b)
-        // convert source image with img_n components to one with req_comp components;
-        // avoid switch per pixel, so use switch per scanline and massive macros
-        switch (STBI__COMBO(img_n, req_comp)) {
-                STBI__CASE(1,2) { dest[0]=src[0], dest[1]=255;                                     } break;
-                STBI__CASE(1,3) { dest[0]=dest[1]=dest[2]=src[0];                                  } break;
-                STBI__CASE(1,4) { dest[0]=dest[1]=dest[2]=src[0], dest[3]=255;                     } break;
-                STBI__CASE(2,1) { dest[0]=src[0];                                                  } break;
-                STBI__CASE(2,3) { dest[0]=dest[1]=dest[2]=src[0];                                  } break;
-                STBI__CASE(2,4) { dest[0]=dest[1]=dest[2]=src[0], dest[3]=src[1];                  } break;
-                STBI__CASE(3,4) { dest[0]=src[0],dest[1]=src[1],dest[2]=src[2],dest[3]=255;        } break;
-                STBI__CASE(3,1) { dest[0]=stbi__compute_y(src[0],src[1],src[2]);                   } break;
-                STBI__CASE(3,2) { dest[0]=stbi__compute_y(src[0],src[1],src[2]), dest[1] = 255;    } break;
-                STBI__CASE(4,1) { dest[0]=stbi__compute_y(src[0],src[1],src[2]);                   } break;
-                STBI__CASE(4,2) { dest[0]=stbi__compute_y(src[0],src[1],src[2]), dest[1] = src[3]; } break;
-                STBI__CASE(4,3) { dest[0]=src[0],dest[1]=src[1],dest[2]=src[2];                    } break;
-            default: STBI_ASSERT(0);
-        }
-#undef STBI__CASE
-    }
+    for (j=0; j < (int) y; ++j)
+        stbi__convert_row(good + (size_t) j * x * req_comp, data + (size_t) j * x * img_n, img_n, req_comp, x);
     
     STBI_FREE(data);
     return good;
 }
 
+// sRGB to linear, rounded to 8 bits
+static stbi_uc const stbi__srgb_to_linear8[256] =
+{
+      0,  0,  0,  0,  0,  0,  0,  1,  1,  1,  1,  1,  1,  1,  1,  1,
+      1,  1,  2,  2,  2,  2,  2,  2,  2,  2,  3,  3,  3,  3,  3,  3,
+      4,  4,  4,  4,  4,  5,  5,  5,  5,  6,  6,  6,  6,  7,  7,  7,
+      8,  8,  8,  8,  9,  9,  9, 10, 10, 10, 11, 11, 12, 12, 12, 13,
+     13, 13, 14, 14, 15, 15, 16, 16, 17, 17, 17, 18, 18, 19, 19, 20,
+     20, 21, 22, 22, 23, 23, 24, 24, 25, 25, 26, 27, 27, 28, 29, 29,
+     30, 30, 31, 32, 32, 33, 34, 35, 35, 36, 37, 37, 38, 39, 40, 41,
+     41, 42, 43, 44, 45, 45, 46, 47, 48, 49, 50, 51, 51, 52, 53, 54,
+     55, 56, 57, 58, 59, 60, 61, 62, 63, 64, 65, 66, 67, 68, 69, 70,
+     71, 72, 73, 74, 76, 77, 78, 79, 80, 81, 82, 84, 85, 86, 87, 88,
+     90, 91, 92, 93, 95, 96, 97, 99,100,101,103,104,105,107,108,109,
+    111,112,114,115,116,118,119,121,122,124,125,127,128,130,131,133,
+    134,136,138,139,141,142,144,146,147,149,151,152,154,156,157,159,
+    161,163,164,166,168,170,171,173,175,177,179,181,183,184,186,188,
+    190,192,194,196,198,200,202,204,206,208,210,212,214,216,218,220,
+    222,224,226,229,231,233,235,237,239,242,244,246,248,250,253,255,
+};
+
+// the per-pixel half of the postprocess pass on n pixels of comp channels:
+// sRGB to linear on the color channels, then premultiply by alpha
+static void stbi__postprocess_pixels(stbi_uc *p, int n, int comp, int flags)
+{
+    int i=0, k;
+    
+    if (flags & STBI__POST_LINEAR) {
+        if (comp & 1) {
+            for (k=0; k < n*comp; ++k)
+                p[k] = stbi__srgb_to_linear8[p[k]];
+        } else {
+            for (i=0; i < n; ++i)
+                for (k=0; k < comp-1; ++k)
+                    p[i*comp+k] = stbi__srgb_to_linear8[p[i*comp+k]];
+        }
+    }
+    
+    if (!(flags & STBI__POST_PREMULTIPLY) || (comp & 1))
+        return;
+    
+    // c*a/255 rounded, exactly: t = c*a+128, (t + (t>>8)) >> 8
+    i = 0;
+#ifdef STBI_SSE2
+    if (comp == 4 && stbi__sse2_available()) {
+        __m128i zero  = _mm_setzero_si128();
+        __m128i bias  = _mm_set1_epi16(128);
+        __m128i alpha = _mm_set1_epi32(~0xffffff);
+        for (; i+4 <= n; i += 4) {
+            __m128i v  = _mm_loadu_si128((__m128i *) (p + i*4));
+            __m128i lo = _mm_unpacklo_epi8(v, zero);
+            __m128i hi = _mm_unpackhi_epi8(v, zero);
+            __m128i alo = _mm_shufflehi_epi16(_mm_shufflelo_epi16(lo, 0xff), 0xff);
+            __m128i ahi = _mm_shufflehi_epi16(_mm_shufflelo_epi16(hi, 0xff), 0xff);
+            lo = _mm_add_epi16(_mm_mullo_epi16(lo, alo), bias);
+            hi = _mm_add_epi16(_mm_mullo_epi16(hi, ahi), bias);
+            lo = _mm_srli_epi16(_mm_add_epi16(lo, _mm_srli_epi16(lo, 8)), 8);
+            hi = _mm_srli_epi16(_mm_add_epi16(hi, _mm_srli_epi16(hi, 8)), 8);
+            // keep the original alpha
+            v = _mm_or_si128(_mm_andnot_si128(alpha, _mm_packus_epi16(lo, hi)), _mm_and_si128(alpha, v));
+            _mm_storeu_si128((__m128i *) (p + i*4), v);
+        }
+    }
+#endif
+    for (; i < n; ++i) {
+        stbi_uc *q = p + i*comp;
+        int a = q[comp-1];
+        for (k=0; k < comp-1; ++k) {
+            int t = q[k]*a + 128;
+            q[k] = (stbi_uc) ((t + (t >> 8)) >> 8);
+        }
+    }
+}
+
+// the single pass over a decoded 8-bit image that does whatever the decoder
+// left: img_n to out_n channels, the vertical flip, sRGB to linear and
+// premultiplied alpha, each row finished while it's still in cache. writes
+// to dst at dst_stride if given, else in place if the pixels don't grow,
+// else to one new buffer; frees data unless that's what it returns
+static stbi_uc *stbi__postprocess_pass(stbi_uc *data, int img_n, int out_n, int w, int h, int flags, stbi_uc *dst, size_t dst_stride)
+{
+    size_t src_row = (size_t) w * img_n, out_row = (size_t) w * out_n;
+    int j, flip = flags & STBI__POST_FLIP;
+    
+    if (dst == NULL) {
+        dst_stride = out_row;
+        if (img_n == out_n || (img_n > out_n && !flip)) {
+            dst = data;
+        } else {
+            dst = (stbi_uc *) stbi__malloc_mad3(out_n, w, h, 0);
+            if (dst == NULL) {
+                STBI_FREE(data);
+                return stbi__errpuc("outofmem", "Out of memory");
+            }
+        }
+    }
+    
+    if (dst == data && flip) {
+        // same size in place, so swap row pairs a pixel-aligned chunk at a time
+        stbi_uc temp[2048];
+        size_t chunk = sizeof(temp) / out_n * out_n;
+        for (j=0; j < (h+1)>>1; ++j) {
+            stbi_uc *row0 = data + j*out_row;
+            stbi_uc *row1 = data + (h-1-j)*out_row;
+            size_t left = out_row;
+            while (left) {
+                size_t len = left < chunk ? left : chunk;
+                if (row0 != row1) {
+                    memcpy(temp, row0, len);
+                    memcpy(row0, row1, len);
+                    memcpy(row1, temp, len);
+                    stbi__postprocess_pixels(row1, (int) (len / out_n), out_n, flags);
+                }
+                stbi__postprocess_pixels(row0, (int) (len / out_n), out_n, flags);
+                row0 += len;
+                row1 += len;
+                left -= len;
+            }
+        }
+        return data;
+    }
+    
+    for (j=0; j < h; ++j) {
+        stbi_uc *out = dst + (size_t) (flip ? h-1-j : j) * dst_stride;
+        stbi__convert_row(out, data + j*src_row, img_n, out_n, w);
+        stbi__postprocess_pixels(out, w, out_n, flags);
+    }
+    if (dst != data) STBI_FREE(data);
+    return dst;
+}
+
 static stbi__uint16 stbi__compute_y_16(int r, int g, int b)
 {
     return (stbi__uint16) (((r*77) + (g*150) +  (29*b)) >> 8);
 }
 
+// convert one row of x 16-bit pixels; dest may be src when req_comp <= img_n
+static void stbi__convert_row16(stbi__uint16 *dest, stbi__uint16 const *src, int img_n, int req_comp, int x)
+{
+    int i;
+    
+    if (req_comp == img_n) {
+        if (dest != src) memcpy(dest, src, (size_t) x * img_n * 2);
+        return;
+    }
+    
+#define STBI__COMBO(a,b)  ((a)*8+(b))
+#define STBI__CASE(a,b)   case STBI__COMBO(a,b): for(i=x-1; i >= 0; --i, src += a, dest += b)
+    // convert source image with img_n components to one with req_comp components;
+    // avoid switch per pixel, so use switch per scanline and massive macros
+    switch (STBI__COMBO(img_n, req_comp)) {
+            STBI__CASE(1,2) { dest[0]=src[0], dest[1]=0xffff;                                     } break;
+            STBI__CASE(1,3) { dest[0]=dest[1]=dest[2]=src[0];                                     } break;
+            STBI__CASE(1,4) { dest[0]=dest[1]=dest[2]=src[0], dest[3]=0xffff;                     } break;
+            STBI__CASE(2,1) { dest[0]=src[0];                                                     } break;
+            STBI__CASE(2,3) { dest[0]=dest[1]=dest[2]=src[0];                                     } break;
+            STBI__CASE(2,4) { dest[0]=dest[1]=dest[2]=src[0], dest[3]=src[1];                     } break;
+            STBI__CASE(3,4) { dest[0]=src[0],dest[1]=src[1],dest[2]=src[2],dest[3]=0xffff;        } break;
+            STBI__CASE(3,1) { dest[0]=stbi__compute_y_16(src[0],src[1],src[2]);                   } break;
+            STBI__CASE(3,2) { dest[0]=stbi__compute_y_16(src[0],src[1],src[2]), dest[1] = 0xffff; } break;
+            STBI__CASE(4,1) { dest[0]=stbi__compute_y_16(src[0],src[1],src[2]);                   } break;
+            STBI__CASE(4,2) { dest[0]=stbi__compute_y_16(src[0],src[1],src[2]), dest[1] = src[3]; } break;
+            STBI__CASE(4,3) { dest[0]=src[0],dest[1]=src[1],dest[2]=src[2];                       } break;
+        default: STBI_ASSERT(0);
+    }
+#undef STBI__CASE
+}
+
 static stbi__uint16 *stbi__convert_format16(stbi__uint16 *data, int img_n, int req_comp, unsigned int x, unsigned int y)
 {
-    int i,j;
+    int j;
     stbi__uint16 *good;
     
     if (req_comp == img_n) return data;
     STBI_ASSERT(req_comp >= 1 && req_comp <= 4);
     
-    good = (stbi__uint16 *) stbi__malloc(req_comp * x * y * 2);
+    good = (stbi__uint16 *) stbi__malloc_mad3(req_comp * 2, x, y, 0);
     if (good == NULL) {
         STBI_FREE(data);
         return (stbi__uint16 *) stbi__errpuc("outofmem", "Out of memory");
     }
     
-    for (j=0; j < (int) y; ++j) {
-        stbi__uint16 *src  = data + j * x * img_n   ;
-        stbi__uint16 *dest = good + j * x * req_comp;
-        
-#define STBI__COMBO(a,b)  ((a)*8+(b))
-#define STBI__CASE(a,b)   case STBI__COMBO(a,b): for(i=x-1; i >= 0; --i, src += a, dest += b)
-        // convert source image with img_n components to one with req_comp components;
-        // avoid switch per pixel, so use switch per scanline and massive macros
-        switch (STBI__COMBO(img_n, req_comp)) {
-                STBI__CASE(1,2) { dest[0]=src[0], dest[1]=0xffff;                                     } break;
-                STBI__CASE(1,3) { dest[0]=dest[1]=dest[2]=src[0];                                     } break;
-                STBI__CASE(1,4) { dest[0]=dest[1]=dest[2]=src[0], dest[3]=0xffff;                     } break;
-                STBI__CASE(2,1) { dest[0]=src[0];                                                     } break;
-                STBI__CASE(2,3) { dest[0]=dest[1]=dest[2]=src[0];                                     } break;
-                STBI__CASE(2,4) { dest[0]=dest[1]=dest[2]=src[0], dest[3]=src[1];                     } break;
-                STBI__CASE(3,4) { dest[0]=src[0],dest[1]=src[1],dest[2]=src[2],dest[3]=0xffff;        } break;
-                STBI__CASE(3,1) { dest[0]=stbi__compute_y_16(src[0],src[1],src[2]);                   } break;
-                STBI__CASE(3,2) { dest[0]=stbi__compute_y_16(src[0],src[1],src[2]), dest[1] = 0xffff; } break;
-                STBI__CASE(4,1) { dest[0]=stbi__compute_y_16(src[0],src[1],src[2]);                   } break;
-                STBI__CASE(4,2) { dest[0]=stbi__compute_y_16(src[0],src[1],src[2]), dest[1] = src[3]; } break;
-                STBI__CASE(4,3) { dest[0]=src[0],dest[1]=src[1],dest[2]=src[2];                       } break;
-            default: STBI_ASSERT(0);
-        }
-#undef STBI__CASE
-    }
+    for (j=0; j < (int) y; ++j)
+        stbi__convert_row16(good + (size_t) j * x * req_comp, data + (size_t) j * x * img_n, img_n, req_comp, x);
     
     STBI_FREE(data);
     return good;
 }
 
+// n 16-bit values to 8 bits, rounded to nearest. v/257 rounded is, exactly,
+// t = v+128 (saturating), (t - (t>>8)) >> 8. dest may be src
+static void stbi__reduce_16_to_8(stbi_uc *dest, stbi__uint16 const *src, size_t n)
+{
+    size_t i = 0;
+#ifdef STBI_SSE2
+    if (stbi__sse2_available()) {
+        __m128i bias = _mm_set1_epi16(128);
+        for (; i+16 <= n; i += 16) {
+            __m128i a = _mm_adds_epu16(_mm_loadu_si128((__m128i const *) (src + i)), bias);
+            __m128i b = _mm_adds_epu16(_mm_loadu_si128((__m128i const *) (src + i + 8)), bias);
+            a = _mm_srli_epi16(_mm_sub_epi16(a, _mm_srli_epi16(a, 8)), 8);
+            b = _mm_srli_epi16(_mm_sub_epi16(b, _mm_srli_epi16(b, 8)), 8);
+            _mm_storeu_si128((__m128i *) (dest + i), _mm_packus_epi16(a, b));
+        }
+    }
+#endif
+    for (; i < n; ++i) {
+        unsigned int t = src[i] + 128;
+        if (t > 65535) t = 65535;
+        dest[i] = (stbi_uc) ((t - (t >> 8)) >> 8);
+    }
+}
+
+// n 8-bit values to 16 bits, replicated to the high and low byte; maps 0->0, 255->0xffff
+static void stbi__widen_8_to_16(stbi__uint16 *dest, stbi_uc const *src, size_t n)
+{
+    size_t i = 0;
+#ifdef STBI_SSE2
+    if (stbi__sse2_available()) {
+        for (; i+16 <= n; i += 16) {
+            __m128i v = _mm_loadu_si128((__m128i const *) (src + i));
+            _mm_storeu_si128((__m128i *) (dest + i),     _mm_unpacklo_epi8(v, v));
+            _mm_storeu_si128((__m128i *) (dest + i + 8), _mm_unpackhi_epi8(v, v));
+        }
+    }
+#endif
+    for (; i < n; ++i)
+        dest[i] = (stbi__uint16) ((src[i] << 8) + src[i]);
+}
+
+// pixels at a time for the bit depth converters' channel conversion
+#define STBI__DEPTH_CHUNK 256
+
+// img_n 16-bit channels to out_n 8-bit ones in one sweep: each chunk of
+// pixels has its channels converted at 16 bits, then is reduced while still
+// in cache. works in place unless the pixels grow; frees orig otherwise
+static stbi_uc *stbi__convert_16_to_8(stbi__uint16 *orig, int img_n, int out_n, int w, int h)
+{
+    stbi__uint16 temp[STBI__DEPTH_CHUNK*4];
+    stbi_uc *reduced = (stbi_uc *) orig;
+    int i, j;
+    
+    if (out_n > img_n*2) {
+        reduced = (stbi_uc *) stbi__malloc_mad3(out_n, w, h, 0);
+        if (reduced == NULL) {
+            STBI_FREE(orig);
+            return stbi__errpuc("outofmem", "Out of memory");
+        }
+    }
+    
+    if (img_n == out_n) {
+        stbi__reduce_16_to_8(reduced, orig, (size_t) w * h * img_n);
+    } else {
+        // in place, a chunk's output never gets past its input, and the
+        // input is all read before any of it is written
+        for (j=0; j < h; ++j) {
+            for (i=0; i < w; i += STBI__DEPTH_CHUNK) {
+                int len = w - i < STBI__DEPTH_CHUNK ? w - i : STBI__DEPTH_CHUNK;
+                size_t k = (size_t) j * w + i;
+                stbi__convert_row16(temp, orig + k * img_n, img_n, out_n, len);
+                stbi__reduce_16_to_8(reduced + k * out_n, temp, (size_t) len * out_n);
+            }
+        }
+    }
+    
+    if (reduced != (stbi_uc *) orig) {
+        STBI_FREE(orig);
+    } else {
+        // give back the half (or more) that's left over
+        void *p = STBI_REALLOC_SIZED(orig, (size_t) w * h * img_n * 2, (size_t) w * h * out_n);
+        if (p) reduced = (stbi_uc *) p;
+    }
+    return reduced;
+}
+
+// img_n 8-bit channels to out_n 16-bit ones in one sweep. channels are
+// converted at 8 bits, so this rounds the same as an 8-bit load
+static stbi__uint16 *stbi__convert_8_to_16(stbi_uc *orig, int img_n, int out_n, int w, int h)
+{
+    stbi_uc temp[STBI__DEPTH_CHUNK*4];
+    stbi__uint16 *enlarged;
+    int i, j;
+    
+    enlarged = (stbi__uint16 *) stbi__malloc_mad3(out_n * 2, w, h, 0);
+    if (enlarged == NULL) {
+        STBI_FREE(orig);
+        return (stbi__uint16 *) stbi__errpuc("outofmem", "Out of memory");
+    }
+    
+    if (img_n == out_n) {
+        stbi__widen_8_to_16(enlarged, orig, (size_t) w * h * img_n);
+    } else {
+        for (j=0; j < h; ++j) {
+            for (i=0; i < w; i += STBI__DEPTH_CHUNK) {
+                int len = w - i < STBI__DEPTH_CHUNK ? w - i : STBI__DEPTH_CHUNK;
+                size_t k = (size_t) j * w + i;
+                stbi__convert_row(temp, orig + k * img_n, img_n, out_n, len);
+                stbi__widen_8_to_16(enlarged + k * out_n, temp, (size_t) len * out_n);
+            }
+        }
+    }
+    
+    STBI_FREE(orig);
+    return enlarged;
+}
+
 #ifndef STBI_NO_LINEAR
-static float   *stbi__ldr_to_hdr(stbi_uc *data, int x, int y, int comp)
+static float   *stbi__ldr_to_hdr(stbi__context *s, stbi_uc *data, int x, int y, int comp)
 {
     int i,k,n;
     float *output;
+    float color[256], alpha[256];
     if (!data) return NULL;
     output = (float *) stbi__malloc_mad4(x, y, comp, sizeof(float), 0);
     if (output == NULL) { STBI_FREE(data); return stbi__errpf("outofmem", "Out of memory"); }
+    // there are only 256 inputs, so do the pow() for each once
+    for (i=0; i < 256; ++i) {
+        color[i] = (float) (pow(i/255.0f, s->l2h_gamma) * s->l2h_scale);
+        alpha[i] = i/255.0f;
+    }
     // compute number of non-alpha components
     if (comp & 1) n = comp; else n = comp-1;
     for (i=0; i < x*y; ++i) {
         for (k=0; k < n; ++k) {
-            output[i*comp + k] = (float) (pow(data[i*comp+k]/255.0f, stbi__l2h_gamma) * stbi__l2h_scale);
+            output[i*comp + k] = color[data[i*comp+k]];
+        }
+        if (k < comp) output[i*comp + k] = alpha[data[i*comp+k]];
+    }
+    STBI_FREE(data);
+    return output;
+}
+
+// the same for 16-bit data, with the curve as a table unless the image is
+// smaller than the table: the values stbi__load_gpu_main packs
+static float   *stbi__ldr16_to_hdr(stbi__context *s, stbi__uint16 *data, int x, int y, int comp)
+{
+    int k,n;
+    size_t i, len = (size_t) x * y * comp;
+    float *output, *color = NULL;
+    if (!data) return NULL;
+    output = (float *) stbi__malloc_mad4(x, y, comp, sizeof(float), 0);
+    if (len > 65536) color = (float *) stbi__malloc(65536 * sizeof(float));
+    if (output == NULL || (len > 65536 && color == NULL)) {
+        STBI_FREE(data);
+        STBI_FREE(output);
+        STBI_FREE(color);
+        return stbi__errpf("outofmem", "Out of memory");
+    }
+    if (color)
+        for (k=0; k < 65536; ++k)
+            color[k] = (float) (pow(k / 65535.0f, s->l2h_gamma) * s->l2h_scale);
+    // compute number of non-alpha components
+    if (comp & 1) n = comp; else n = comp-1;
+    for (i=0; i < len; i += comp) {
+        for (k=0; k < n; ++k) {
+            if (color)
+                output[i+k] = color[data[i+k]];
+            else
+                output[i+k] = (float) (pow(data[i+k] / 65535.0f, s->l2h_gamma) * s->l2h_scale);
         }
-        if (k < comp) output[i*comp + k] = data[i*comp+k]/255.0f;
+        if (k < comp) output[i+k] = data[i+k] / 65535.0f;
     }
     STBI_FREE(data);
+    STBI_FREE(color);
     return output;
 }
 #endif
 
 #ifndef STBI_NO_HDR
 #define stbi__float2int(x)   ((int) (x))
-static stbi_uc *stbi__hdr_to_ldr(float   *data, int x, int y, int comp)
+
+static int stbi__hdr_to_ldr_color(stbi__context *s, float v)
 {
-    int i,k,n;
+    float z = (float) pow(v*s->h2l_scale_i, s->h2l_gamma_i) * 255 + 0.5f;
+    if (z < 0) z = 0;
+    if (z > 255) z = 255;
+    return stbi__float2int(z);
+}
+
+// step a positive float to the next larger or smaller one
+static float stbi__float_step(float v, int dir)
+{
+    union { stbi__uint32 u; float f; } b;
+    b.f = v;
+    b.u += dir;
+    return b.f;
+}
+
+// stbi__hdr_to_ldr_color is a non-decreasing step function, so instead of
+// a pow() per value, find the least input giving each output k = 1..255 and
+// binary search those. each threshold starts from the inverse of the curve
+// and is stepped an ulp at a time until it's exact; returns 0 if the
+// settings are such that it couldn't be, and pow() it is
+static int stbi__hdr_to_ldr_thresholds(stbi__context *s, float *t)
+{
+    int k, steps;
+    if (!(s->h2l_gamma_i > 0 && s->h2l_scale_i > 0)) return 0;
+    for (k=1; k < 256; ++k) {
+        float v = (float) (pow((k - 0.5) / 255, 1.0 / s->h2l_gamma_i) / s->h2l_scale_i);
+        if (!(v > 0 && v <= FLT_MAX)) return 0;
+        for (steps=0; stbi__hdr_to_ldr_color(s, v) < k; ++steps) {
+            if (steps == 64) return 0;
+            v = stbi__float_step(v, 1);
+        }
+        for (steps=0; v > 0 && stbi__hdr_to_ldr_color(s, stbi__float_step(v, -1)) >= k; ++steps) {
+            if (steps == 64) return 0;
+            v = stbi__float_step(v, -1);
+        }
+        t[k] = v;
+    }
+    return 1;
+}
+
+static stbi_uc *stbi__hdr_to_ldr(stbi__context *s, float   *data, int x, int y, int comp)
+{
+    int i,k,n,lookup;
     stbi_uc *output;
+    float t[256];
     if (!data) return NULL;
     output = (stbi_uc *) stbi__malloc_mad3(x, y, comp, 0);
     if (output == NULL) { STBI_FREE(data); return stbi__errpuc("outofmem", "Out of memory"); }
+    lookup = stbi__hdr_to_ldr_thresholds(s, t);
     // compute number of non-alpha components
     if (comp & 1) n = comp; else n = comp-1;
     for (i=0; i < x*y; ++i) {
         for (k=0; k < n; ++k) {
-            float z = (float) pow(data[i*comp+k]*stbi__h2l_scale_i, stbi__h2l_gamma_i) * 255 + 0.5f;
-            if (z < 0) z = 0;
-            if (z > 255) z = 255;
-            output[i*comp + k] = (stbi_uc) stbi__float2int(z);
+            float v = data[i*comp+k];
+            if (lookup) {
+                int c = 0;
+                if (v >= t[c+128]) c += 128;
+                if (v >= t[c+ 64]) c +=  64;
+                if (v >= t[c+ 32]) c +=  32;
+                if (v >= t[c+ 16]) c +=  16;
+                if (v >= t[c+  8]) c +=   8;
+                if (v >= t[c+  4]) c +=   4;
+                if (v >= t[c+  2]) c +=   2;
+                if (v >= t[c+  1]) c +=   1;
+                output[i*comp + k] = (stbi_uc) c;
+            } else {
+                output[i*comp + k] = (stbi_uc) stbi__hdr_to_ldr_color(s, v);
+            }
         }
         if (k < comp) {
             float z = data[i*comp+k] * 255 + 0.5f;
@@ -1660,6 +3844,192 @@ static stbi_uc *stbi__hdr_to_ldr(float   *data, int x, int y, int comp)
 }
 #endif
 
+#ifndef STBI_NO_LINEAR
+// float to IEEE half, rounded to nearest even like glm::packHalf1x16 and
+// F16C; too big goes to infinity and NaNs stay NaN
+static stbi__uint16 stbi__float_to_half(float f)
+{
+    union { stbi__uint32 u; float f; } v;
+    stbi__uint32 sign, h, m, rem, half;
+    int shift;
+    v.f = f;
+    sign = (v.u >> 16) & 0x8000;
+    v.u &= 0x7fffffff;
+    if (v.u >= 0x7f800000) // inf or nan
+        return (stbi__uint16) (sign | 0x7c00 | (v.u > 0x7f800000 ? 0x200 | ((v.u >> 13) & 0x3ff) : 0));
+    if (v.u >= 0x477ff000) // 65520 and up round to infinity
+        return (stbi__uint16) (sign | 0x7c00);
+    if (v.u >= 0x38800000) {
+        // normal: rebias the exponent, and the carry out of the mantissa
+        // when rounding up bumps the exponent by itself
+        h = (v.u - 0x38000000) >> 13;
+        rem = v.u & 0x1fff;
+        if (rem > 0x1000 || (rem == 0x1000 && (h & 1))) ++h;
+        return (stbi__uint16) (sign | h);
+    }
+    // denormal half, or zero
+    if ((v.u >> 23) < 102) return (stbi__uint16) sign;
+    m = (v.u & 0x7fffff) | 0x800000;
+    shift = 126 - (int) (v.u >> 23);
+    h = m >> shift;
+    rem = m & (((stbi__uint32) 1 << shift) - 1);
+    half = (stbi__uint32) 1 << (shift-1);
+    if (rem > half || (rem == half && (h & 1))) ++h;
+    return (stbi__uint16) (sign | h);
+}
+
+// rgb to GL_RGB9_E5 (EXT_texture_shared_exponent, glm::packF3x9_E1x5): 9-bit
+// mantissas from bit 0 up and a 5-bit exponent biased by 15 on top
+static stbi__uint32 stbi__float_to_rgb9e5(float r, float g, float b)
+{
+    union { stbi__uint32 u; float f; } v, scale;
+    float maxc;
+    int e, rm, gm, bm;
+    // clamp to what the format holds, written so NaN comes out 0
+    r = r > 0 ? (r < 65408.0f ? r : 65408.0f) : 0;
+    g = g > 0 ? (g < 65408.0f ? g : 65408.0f) : 0;
+    b = b > 0 ? (b < 65408.0f ? b : 65408.0f) : 0;
+    maxc = r > g ? r : g;
+    if (b > maxc) maxc = b;
+    // shared exponent max(-16, floor(log2(maxc))) + 16, the log from the float bits
+    v.f = maxc;
+    e = (int) (v.u >> 23) - 127;
+    if (e < -16) e = -16;
+    e += 16;
+    // mantissas are then x / 2^(e-24), rounded; scaling by a power of two is exact
+    scale.u = (stbi__uint32) (127 + 24 - e) << 23;
+    if ((int) (maxc * scale.f + 0.5f) == 512) {
+        ++e;
+        scale.u -= (stbi__uint32) 1 << 23;
+    }
+    rm = (int) (r * scale.f + 0.5f);
+    gm = (int) (g * scale.f + 0.5f);
+    bm = (int) (b * scale.f + 0.5f);
+    return (stbi__uint32) rm | (stbi__uint32) gm << 9 | (stbi__uint32) bm << 18 | (stbi__uint32) e << 27;
+}
+
+#ifdef STBI_AVX2
+static STBI__F16C_TARGET int stbi__float_to_half_f16c(stbi__uint16 *dst, float const *src, int n)
+{
+    int i;
+    for (i=0; i+8 <= n; i += 8)
+        _mm_storeu_si128((__m128i *) (dst+i), _mm256_cvtps_ph(_mm256_loadu_ps(src+i), 0));
+    return i;
+}
+#endif
+
+// whether stbi__pack_row can use the F16C conversion; asked once per image
+static int stbi__pack_simd(int fmt)
+{
+#ifdef STBI_AVX2
+    return fmt == STBI__FMT_HALF && stbi__f16c_available();
+#else
+    STBI_NOTUSED(fmt);
+    return 0;
+#endif
+}
+
+// pack a row of w pixels of n floats as row 'row' of a half or rgb9e5 image
+static void stbi__pack_row(void *out, int row, int w, float const *src, int n, int fmt, int simd)
+{
+    int i = 0;
+    if (fmt == STBI__FMT_HALF) {
+        stbi__uint16 *dst = (stbi__uint16 *) out + (size_t) row * w * n;
+#ifdef STBI_AVX2
+        if (simd) i = stbi__float_to_half_f16c(dst, src, w*n);
+#else
+        STBI_NOTUSED(simd);
+#endif
+        for (; i < w*n; ++i)
+            dst[i] = stbi__float_to_half(src[i]);
+    } else {
+        stbi__uint32 *dst = (stbi__uint32 *) out + (size_t) row * w;
+        STBI_ASSERT(n == 3);
+        for (i=0; i < w; ++i, src += 3)
+            dst[i] = stbi__float_to_rgb9e5(src[0], src[1], src[2]);
+    }
+}
+
+// stbi_loadh and stbi_load_rgb9e5. HDR files are packed a row at a time as
+// they're decoded; other files go from their 8 or 16 bits through
+// stbi_loadf's curve to the output, with no float image in between; the
+// values are stbi__ldr_to_hdr's and stbi__ldr16_to_hdr's
+static void *stbi__load_gpu_main(stbi__context *s, int *x, int *y, int *comp, int req_comp, int fmt)
+{
+    stbi__result_info ri;
+    void *data, *out;
+    float *frow, *color = NULL;
+    float color8[256];
+    int w, h, n, nc, i, j, k, is16, c, simd = stbi__pack_simd(fmt);
+    
+    if (fmt == STBI__FMT_RGB9E5) req_comp = 3;
+#ifndef STBI_NO_HDR
+    if (stbi__hdr_test(s))
+        return stbi__hdr_load_as(s, x, y, comp, req_comp, fmt);
+#endif
+    
+    // a JPEG would only be widened, for a bigger table of the curve to go through
+#ifndef STBI_NO_JPEG
+    if (stbi__jpeg_test(s))
+        data = stbi__load_main(s, x, y, comp, req_comp, &ri, 8);
+    else
+#endif
+    data = stbi__load_main(s, x, y, comp, req_comp, &ri, 16);
+    if (data == NULL) return NULL;
+    w = *x;
+    h = *y;
+    n = req_comp ? req_comp : *comp;
+    is16 = ri.bits_per_channel == 16;
+    if (ri.num_channels) {
+        if (is16)
+            data = stbi__convert_format16((stbi__uint16 *) data, ri.num_channels, n, w, h);
+        else
+            data = stbi__convert_format((stbi_uc *) data, ri.num_channels, n, w, h);
+        if (data == NULL) return NULL;
+    }
+    
+    // the curve as a table, unless a 16-bit image is smaller than the table
+    if (!is16)
+        color = color8;
+    else if ((size_t) w * h * n > 65536)
+        color = (float *) stbi__malloc(65536 * sizeof(float));
+    out = stbi__malloc_mad3(w, h, fmt == STBI__FMT_HALF ? n * 2 : 4, 0);
+    frow = (float *) stbi__malloc_mad2(w, n * sizeof(float), 0);
+    if (!out || !frow || (is16 && !color && (size_t) w * h * n > 65536)) {
+        STBI_FREE(data);
+        STBI_FREE(out);
+        STBI_FREE(frow);
+        if (color != color8) STBI_FREE(color);
+        return stbi__errpuc("outofmem", "Out of memory");
+    }
+    if (color)
+        for (i=0; i < (is16 ? 65536 : 256); ++i)
+            color[i] = (float) (pow(i / (is16 ? 65535.0f : 255.0f), s->l2h_gamma) * s->l2h_scale);
+    
+    nc = (n & 1) ? n : n-1; // non-alpha components
+    for (j=0; j < h; ++j) {
+        size_t base = (size_t) j * w * n;
+        for (i=0; i < w*n; i += n) {
+            for (k=0; k < n; ++k) {
+                c = is16 ? ((stbi__uint16 *) data)[base+i+k] : ((stbi_uc *) data)[base+i+k];
+                if (k == nc)
+                    frow[i+k] = c / (is16 ? 65535.0f : 255.0f);
+                else if (color)
+                    frow[i+k] = color[c];
+                else
+                    frow[i+k] = (float) (pow(c / 65535.0f, s->l2h_gamma) * s->l2h_scale);
+            }
+        }
+        stbi__pack_row(out, s->flip ? h-1-j : j, w, frow, n, fmt, simd);
+    }
+    
+    STBI_FREE(data);
+    STBI_FREE(frow);
+    if (color != color8) STBI_FREE(color);
+    return out;
+}
+#endif // !STBI_NO_LINEAR
+
 //////////////////////////////////////////////////////////////////////////////
 //
 //  "baseline" JPEG/JFIF decoder
@@ -1703,7 +4073,9 @@ typedef struct
     stbi__huffman huff_dc[4];
     stbi__huffman huff_ac[4];
     stbi__uint16 dequant[4][64];
+    stbi__int16 fast_dc[4][1 << FAST_BITS];
     stbi__int16 fast_ac[4][1 << FAST_BITS];
+    stbi__int16 fast_ac_ref[4][1 << FAST_BITS]; // for progressive AC refinement scans
     
     // sizes for components, interleaved MCUs
     int img_h_max, img_v_max;
@@ -1723,11 +4095,15 @@ typedef struct
         stbi_uc *data;
         void *raw_data, *raw_coeff;
         stbi_uc *linebuf;
-        short   *coeff;   // progressive only
+        short   *coeff;   // progressive only: acs, allocated by the first scan that has any
+        short   *coeff_dc; // progressive only: dcs
+        stbi__uint64 *coeff_mask; // per block, which zigzag positions have been coded (bit 0: the dc)
         int      coeff_w, coeff_h; // number of 8x8 coefficient blocks
+        int      bs;      // each block's IDCT is bs x bs pixels of data
+        void   (*idct_kernel)(stbi_uc *out, int out_stride, short data[64]);
     } img_comp[4];
     
-    stbi__uint32   code_buffer; // jpeg entropy-coded buffer
+    stbi__uint64   code_buffer; // jpeg entropy-coded buffer, next bit in the msb
     int            code_bits;   // number of valid bits
     unsigned char  marker;      // marker seen while filling entropy buffer
     int            nomore;      // flag if we saw a marker so must stop
@@ -1744,9 +4120,20 @@ typedef struct
     
     int scan_n, order[4];
     int restart_interval, todo;
+    int stream_mcu_rows; // if nonzero, component planes hold only this many MCU rows, reused in turn
+    int scale;           // 1, 2, 4 or 8: decode at 1/scale of the full size
+    int dc_seen;         // bitmask of components that have had their first dc scan
+    
+    // for a cropped decode, only MCU columns [mcu_x0,mcu_x1) and rows
+    // [mcu_y0,mcu_y1) go into the component planes; the rest is only entropy
+    // decoded, or skipped over a restart segment at a time
+    int crop, mcu_x0, mcu_x1, mcu_y0, mcu_y1;
+    int crop_x, crop_y, crop_w, crop_h; // output rectangle within the planes
+    int skip_segment;                   // the current restart segment was skipped
     
     // kernels
     void (*idct_block_kernel)(stbi_uc *out, int out_stride, short data[64]);
+    void (*idct_block2_kernel)(stbi_uc *out, int out_stride, short data[128]); // two side-by-side blocks, or NULL
     void (*YCbCr_to_RGB_kernel)(stbi_uc *out, const stbi_uc *y, const stbi_uc *pcb, const stbi_uc *pcr, int count, int step);
     stbi_uc *(*resample_row_hv_2_kernel)(stbi_uc *out, stbi_uc *in_near, stbi_uc *in_far, int w, int hs);
 } stbi__jpeg;
@@ -1793,6 +4180,31 @@ static int stbi__build_huffman(stbi__huffman *h, int *count)
     return 1;
 }
 
+// build a table that decodes a DC difference, the code for its size and
+// then that many bits, in one go: diff * 16 + combined length.
+static void stbi__build_fast_dc(stbi__int16 *fast_dc, stbi__huffman *h)
+{
+    int i;
+    for (i=0; i < (1 << FAST_BITS); ++i) {
+        stbi_uc fast = h->fast[i];
+        fast_dc[i] = 0;
+        if (fast < 255) {
+            int t = h->values[fast];
+            int len = h->size[fast];
+            
+            if (t <= 15 && len + t <= FAST_BITS) {
+                int k = 0;
+                if (t) {
+                    int m = 1 << (t - 1);
+                    k = ((i << len) & ((1 << FAST_BITS) - 1)) >> (FAST_BITS - t);
+                    if (k < m) k += (~0U << t) + 1;
+                }
+                fast_dc[i] = (stbi__int16) ((k * 16) + (len + t));
+            }
+        }
+    }
+}
+
 // build a table that decodes both magnitude and value of small ACs in
 // one go.
 static void stbi__build_fast_ac(stbi__int16 *fast_ac, stbi__huffman *h)
@@ -1820,8 +4232,55 @@ static void stbi__build_fast_ac(stbi__int16 *fast_ac, stbi__huffman *h)
     }
 }
 
+// the same for progressive refinement scans, where every new coefficient is
+// +-1 (a sign bit after the code). k is 0 for r=15 s=0, which skips 16
+// zeros, and for an end of block (run 0); longer eob runs, which have bits
+// of their own, aren't in the table.
+static void stbi__build_fast_ac_refine(stbi__int16 *fast_ac, stbi__huffman *h)
+{
+    int i;
+    for (i=0; i < (1 << FAST_BITS); ++i) {
+        stbi_uc fast = h->fast[i];
+        fast_ac[i] = 0;
+        if (fast < 255) {
+            int rs = h->values[fast];
+            int run = (rs >> 4) & 15;
+            int len = h->size[fast];
+            
+            if ((rs & 15) == 1 && len + 1 <= FAST_BITS) {
+                int k = (i >> (FAST_BITS - len - 1)) & 1 ? 1 : -1;
+                fast_ac[i] = (stbi__int16) ((k * 256) + (run * 16) + (len + 1));
+            } else if (rs == 0xf0 || rs == 0x00) {
+                fast_ac[i] = (stbi__int16) ((run * 16) + len);
+            }
+        }
+    }
+}
+
+// the next 8 bytes, big-endian
+stbi_inline static stbi__uint64 stbi__jload64(const stbi_uc *p)
+{
+    return (stbi__uint64) p[0] << 56 | (stbi__uint64) p[1] << 48 | (stbi__uint64) p[2] << 40 | (stbi__uint64) p[3] << 32 |
+           (stbi__uint64) p[4] << 24 | (stbi__uint64) p[5] << 16 | (stbi__uint64) p[6] <<  8 | (stbi__uint64) p[7];
+}
+
 static void stbi__grow_buffer_unsafe(stbi__jpeg *j)
 {
+    stbi__context *s = j->s;
+    if (!j->nomore && s->img_buffer_end - s->img_buffer >= 8) {
+        stbi__uint64 v = stbi__jload64(s->img_buffer);
+        stbi__uint64 ones = ~(stbi__uint64) 0 / 255; // 0x0101...01
+        // no 0xff byte means no stuffing and no marker, so one load tops
+        // the buffer up to 56..63 bits. the bits of a byte that didn't fit
+        // whole land past code_bits, and are the same ones the next load
+        // (or stbi__get8) ORs in
+        if (((~v - ones) & v & (ones << 7)) == 0) {
+            j->code_buffer |= v >> j->code_bits;
+            s->img_buffer += (63 - j->code_bits) >> 3;
+            j->code_bits |= 56;
+            return;
+        }
+    }
     do {
         unsigned int b = j->nomore ? 0 : stbi__get8(j->s);
         if (b == 0xff) {
@@ -1833,14 +4292,11 @@ static void stbi__grow_buffer_unsafe(stbi__jpeg *j)
                 return;
             }
         }
-        j->code_buffer |= b << (24 - j->code_bits);
+        j->code_buffer |= (stbi__uint64) b << (56 - j->code_bits);
         j->code_bits += 8;
-    } while (j->code_bits <= 24);
+    } while (j->code_bits <= 56);
 }
 
-// (1 << n) - 1
-static const stbi__uint32 stbi__bmask[17]={0,1,3,7,15,31,63,127,255,511,1023,2047,4095,8191,16383,32767,65535};
-
 // decode a jpeg huffman value from the bitstream
 stbi_inline static int stbi__jpeg_huff_decode(stbi__jpeg *j, stbi__huffman *h)
 {
@@ -1851,7 +4307,7 @@ stbi_inline static int stbi__jpeg_huff_decode(stbi__jpeg *j, stbi__huffman *h)
     
     // look at the top FAST_BITS and determine what symbol ID it is,
     // if the code is <= FAST_BITS
-    c = (j->code_buffer >> (32 - FAST_BITS)) & ((1 << FAST_BITS)-1);
+    c = (int) (j->code_buffer >> (64 - FAST_BITS));
     k = h->fast[c];
     if (k < 255) {
         int s = h->size[k];
@@ -1868,7 +4324,7 @@ stbi_inline static int stbi__jpeg_huff_decode(stbi__jpeg *j, stbi__huffman *h)
     // end; in other words, regardless of the number of bits, it
     // wants to be compared against something shifted to have 16;
     // that way we don't need to shift inside the loop.
-    temp = j->code_buffer >> 16;
+    temp = (unsigned int) (j->code_buffer >> 48);
     for (k=FAST_BITS+1 ; ; ++k)
         if (temp < h->maxcode[k])
             break;
@@ -1882,8 +4338,8 @@ stbi_inline static int stbi__jpeg_huff_decode(stbi__jpeg *j, stbi__huffman *h)
         return -1;
     
     // convert the huffman code to the symbol id
-    c = ((j->code_buffer >> (32 - k)) & stbi__bmask[k]) + h->delta[k];
-    STBI_ASSERT((((j->code_buffer) >> (32 - h->size[c])) & stbi__bmask[h->size[c]]) == h->code[c]);
+    c = (int) (j->code_buffer >> (64 - k)) + h->delta[k];
+    STBI_ASSERT((j->code_buffer >> (64 - h->size[c])) == h->code[c]);
     
     // convert the id to a symbol
     j->code_bits -= k;
@@ -1900,37 +4356,54 @@ stbi_inline static int stbi__extend_receive(stbi__jpeg *j, int n)
 {
     unsigned int k;
     int sgn;
+    STBI_ASSERT(n >= 1 && n < (int) (sizeof(stbi__jbias)/sizeof(*stbi__jbias)));
     if (j->code_bits < n) stbi__grow_buffer_unsafe(j);
     
-    sgn = (stbi__int32)j->code_buffer >> 31; // sign bit is always in MSB
-    k = stbi_lrot(j->code_buffer, n);
-    STBI_ASSERT(n >= 0 && n < (int) (sizeof(stbi__bmask)/sizeof(*stbi__bmask)));
-    j->code_buffer = k & ~stbi__bmask[n];
-    k &= stbi__bmask[n];
+    sgn = (stbi__int32) (j->code_buffer >> 32) >> 31; // sign bit is always in MSB
+    k = (unsigned int) (j->code_buffer >> (64 - n));
+    j->code_buffer <<= n;
     j->code_bits -= n;
     return k + (stbi__jbias[n] & ~sgn);
 }
 
-// get some unsigned bits
+// get some unsigned bits, n >= 1
 stbi_inline static int stbi__jpeg_get_bits(stbi__jpeg *j, int n)
 {
     unsigned int k;
     if (j->code_bits < n) stbi__grow_buffer_unsafe(j);
-    k = stbi_lrot(j->code_buffer, n);
-    j->code_buffer = k & ~stbi__bmask[n];
-    k &= stbi__bmask[n];
+    k = (unsigned int) (j->code_buffer >> (64 - n));
+    j->code_buffer <<= n;
     j->code_bits -= n;
     return k;
 }
 
 stbi_inline static int stbi__jpeg_get_bit(stbi__jpeg *j)
 {
-    unsigned int k;
+    int k;
     if (j->code_bits < 1) stbi__grow_buffer_unsafe(j);
-    k = j->code_buffer;
+    k = (int) (j->code_buffer >> 63);
     j->code_buffer <<= 1;
     --j->code_bits;
-    return k & 0x80000000;
+    return k;
+}
+
+// a DC difference, through the combined table if it's there
+stbi_inline static int stbi__jpeg_decode_dc(stbi__jpeg *j, stbi__huffman *hdc, stbi__int16 *fdc, int *diff)
+{
+    int t;
+    if (j->code_bits < 16) stbi__grow_buffer_unsafe(j);
+    t = fdc[j->code_buffer >> (64 - FAST_BITS)];
+    if (t) { // fast-DC path
+        int s = t & 15; // combined length
+        j->code_buffer <<= s;
+        j->code_bits -= s;
+        *diff = t >> 4;
+        return 1;
+    }
+    t = stbi__jpeg_huff_decode(j, hdc);
+    if (t < 0 || t > 15) return stbi__err("bad huffman code","Corrupt JPEG");
+    *diff = t ? stbi__extend_receive(j, t) : 0;
+    return 1;
 }
 
 // given a value that's at position X in the zigzag stream,
@@ -1951,19 +4424,15 @@ static const stbi_uc stbi__jpeg_dezigzag[64+15] =
 };
 
 // decode one 64-entry block--
-static int stbi__jpeg_decode_block(stbi__jpeg *j, short data[64], stbi__huffman *hdc, stbi__huffman *hac, stbi__int16 *fac, int b, stbi__uint16 *dequant)
+static int stbi__jpeg_decode_block(stbi__jpeg *j, short data[64], stbi__huffman *hdc, stbi__int16 *fdc, stbi__huffman *hac, stbi__int16 *fac, int b, stbi__uint16 *dequant)
 {
     int diff,dc,k;
-    int t;
     
-    if (j->code_bits < 16) stbi__grow_buffer_unsafe(j);
-    t = stbi__jpeg_huff_decode(j, hdc);
-    if (t < 0) return stbi__err("bad huffman code","Corrupt JPEG");
+    if (!stbi__jpeg_decode_dc(j, hdc, fdc, &diff)) return 0;
     
     // 0 all the ac values now so we can do it 32-bits at a time
     memset(data,0,64*sizeof(data[0]));
     
-    diff = t ? stbi__extend_receive(j, t) : 0;
     dc = j->img_comp[b].dc_pred + diff;
     j->img_comp[b].dc_pred = dc;
     data[0] = (short) (dc * dequant[0]);
@@ -1974,7 +4443,7 @@ static int stbi__jpeg_decode_block(stbi__jpeg *j, short data[64], stbi__huffman
         unsigned int zig;
         int c,r,s;
         if (j->code_bits < 16) stbi__grow_buffer_unsafe(j);
-        c = (j->code_buffer >> (32 - FAST_BITS)) & ((1 << FAST_BITS)-1);
+        c = (int) (j->code_buffer >> (64 - FAST_BITS));
         r = fac[c];
         if (r) { // fast-AC path
             k += (r >> 4) & 15; // run
@@ -2003,34 +4472,74 @@ static int stbi__jpeg_decode_block(stbi__jpeg *j, short data[64], stbi__huffman
     return 1;
 }
 
-static int stbi__jpeg_decode_block_prog_dc(stbi__jpeg *j, short data[64], stbi__huffman *hdc, int b)
+// index of the lowest set bit of a nonzero z
+#if defined(_MSC_VER) && defined(_M_X64)
+#include <intrin.h>
+stbi_inline static int stbi__ctz64(stbi__uint64 z)
+{
+    unsigned long i;
+    _BitScanForward64(&i, z);
+    return (int) i;
+}
+#elif defined(__GNUC__)
+#define stbi__ctz64(z)  __builtin_ctzll(z)
+#else
+stbi_inline static int stbi__ctz64(stbi__uint64 z)
+{
+    int n = 0;
+    while (!(z & 1)) { z >>= 1; ++n; }
+    return n;
+}
+#endif
+
+// progressive blocks keep their dc and acs apart (natural order, not yet
+// dequantized), and which zigzag positions have been coded in 'mask';
+// anything not in the mask is zero and never gets written, so nothing has
+// to be cleared and the ac memory isn't touched until a scan needs it
+static int stbi__jpeg_decode_block_prog_dc(stbi__jpeg *j, short *dcp, stbi__uint64 *mask, stbi__huffman *hdc, stbi__int16 *fdc, int b)
 {
     int diff,dc;
-    int t;
     if (j->spec_end != 0) return stbi__err("can't merge dc and ac", "Corrupt JPEG");
     
-    if (j->code_bits < 16) stbi__grow_buffer_unsafe(j);
-    
     if (j->succ_high == 0) {
         // first scan for DC coefficient, must be first
-        memset(data,0,64*sizeof(data[0])); // 0 all the ac values now
-        t = stbi__jpeg_huff_decode(j, hdc);
-        diff = t ? stbi__extend_receive(j, t) : 0;
+        if (!stbi__jpeg_decode_dc(j, hdc, fdc, &diff)) return 0;
         
         dc = j->img_comp[b].dc_pred + diff;
         j->img_comp[b].dc_pred = dc;
-        data[0] = (short) (dc << j->succ_low);
+        *dcp = (short) (dc << j->succ_low);
+        *mask = 1; // must be first, so this also clears any acs
     } else {
         // refinement scan for DC coefficient
-        if (stbi__jpeg_get_bit(j))
-            data[0] += (short) (1 << j->succ_low);
+        if (stbi__jpeg_get_bit(j) && (*mask & 1))
+            *dcp += (short) (1 << j->succ_low);
     }
     return 1;
 }
 
-// @OPTIMIZE: store non-zigzagged during the decode passes,
-// and only de-zigzag when dequantizing
-static int stbi__jpeg_decode_block_prog_ac(stbi__jpeg *j, short data[64], stbi__huffman *hac, stbi__int16 *fac)
+// refinement bit for each already-nonzero coefficient in 'todo', taking
+// the bits 16 at a time
+static void stbi__jpeg_refine_nonzero(stbi__jpeg *j, short data[64], stbi__uint64 todo, short bit)
+{
+    while (todo) {
+        stbi__uint64 b;
+        int n;
+        if (j->code_bits < 16) stbi__grow_buffer_unsafe(j);
+        b = j->code_buffer;
+        for (n=0; todo && n < 16; ++n) {
+            short *p = &data[stbi__jpeg_dezigzag[stbi__ctz64(todo)]];
+            todo &= todo - 1;
+            // *p += sign(*p)*bit if the bit is set and *p doesn't have it yet;
+            // no branches, as the bits are as good as random
+            *p = (short) (*p + (int) ((b >> 63) & ((*p & bit) == 0)) * ((*p >> 15) | 1) * bit);
+            b <<= 1;
+        }
+        j->code_buffer <<= n;
+        j->code_bits -= n;
+    }
+}
+
+static int stbi__jpeg_decode_block_prog_ac(stbi__jpeg *j, short data[64], stbi__uint64 *mask, stbi__huffman *hac, stbi__int16 *fac, stbi__int16 *fac_ref)
 {
     int k;
     if (j->spec_start == 0) return stbi__err("can't merge dc and ac", "Corrupt JPEG");
@@ -2048,15 +4557,17 @@ static int stbi__jpeg_decode_block_prog_ac(stbi__jpeg *j, short data[64], stbi__
             unsigned int zig;
             int c,r,s;
             if (j->code_bits < 16) stbi__grow_buffer_unsafe(j);
-            c = (j->code_buffer >> (32 - FAST_BITS)) & ((1 << FAST_BITS)-1);
+            c = (int) (j->code_buffer >> (64 - FAST_BITS));
             r = fac[c];
             if (r) { // fast-AC path
                 k += (r >> 4) & 15; // run
                 s = r & 15; // combined length
                 j->code_buffer <<= s;
                 j->code_bits -= s;
-                zig = stbi__jpeg_dezigzag[k++];
+                zig = stbi__jpeg_dezigzag[k];
                 data[zig] = (short) ((r >> 8) << shift);
+                *mask |= (stbi__uint64) (data[zig] != 0) << (k < 63 ? k : 63);
+                ++k;
             } else {
                 int rs = stbi__jpeg_huff_decode(j, hac);
                 if (rs < 0) return stbi__err("bad huffman code","Corrupt JPEG");
@@ -2073,76 +4584,86 @@ static int stbi__jpeg_decode_block_prog_ac(stbi__jpeg *j, short data[64], stbi__
                     k += 16;
                 } else {
                     k += r;
-                    zig = stbi__jpeg_dezigzag[k++];
+                    zig = stbi__jpeg_dezigzag[k];
                     data[zig] = (short) (stbi__extend_receive(j,s) << shift);
+                    // (a corrupt file can shift a value out to 0)
+                    *mask |= (stbi__uint64) (data[zig] != 0) << (k < 63 ? k : 63);
+                    ++k;
                 }
             }
         } while (k <= j->spec_end);
     } else {
-        // refinement scan for these AC coefficients
-        
+        // refinement scan for these AC coefficients: each symbol skips r
+        // zero coefficients, refining the nonzero ones passed on the way,
+        // then places a new +-1 at the next zero
         short bit = (short) (1 << j->succ_low);
+        stbi__uint64 band = (~(stbi__uint64) 0 << j->spec_start) & (~(stbi__uint64) 0 >> (63 - j->spec_end));
         
         if (j->eob_run) {
             --j->eob_run;
-            for (k = j->spec_start; k <= j->spec_end; ++k) {
-                short *p = &data[stbi__jpeg_dezigzag[k]];
-                if (*p != 0)
-                    if (stbi__jpeg_get_bit(j))
-                        if ((*p & bit)==0) {
-                            if (*p > 0)
-                                *p += bit;
-                            else
-                                *p -= bit;
-                        }
-            }
+            stbi__jpeg_refine_nonzero(j, data, *mask & band, bit);
         } else {
             k = j->spec_start;
             do {
-                int r,s;
-                int rs = stbi__jpeg_huff_decode(j, hac); // @OPTIMIZE see if we can use the fast path here, advance-by-r is so slow, eh
-                if (rs < 0) return stbi__err("bad huffman code","Corrupt JPEG");
-                s = rs & 15;
-                r = rs >> 4;
-                if (s == 0) {
-                    if (r < 15) {
-                        j->eob_run = (1 << r) - 1;
-                        if (r)
-                            j->eob_run += stbi__jpeg_get_bits(j, r);
-                        r = 64; // force end of block
+                stbi__uint64 zeros, passed;
+                int c,r,s,t;
+                if (j->code_bits < 16) stbi__grow_buffer_unsafe(j);
+                c = (int) (j->code_buffer >> (64 - FAST_BITS));
+                r = fac_ref[c];
+                if (r) { // fast path, code and sign bit in one go
+                    s = r & 15;
+                    j->code_buffer <<= s;
+                    j->code_bits -= s;
+                    s = (r >> 8) * bit;
+                    r = (r >> 4) & 15;
+                    if (s == 0 && r == 0)
+                        r = 64; // end of block
+                } else {
+                    int rs = stbi__jpeg_huff_decode(j, hac);
+                    if (rs < 0) return stbi__err("bad huffman code","Corrupt JPEG");
+                    s = rs & 15;
+                    r = rs >> 4;
+                    if (s == 0) {
+                        if (r < 15) {
+                            j->eob_run = (1 << r) - 1;
+                            if (r)
+                                j->eob_run += stbi__jpeg_get_bits(j, r);
+                            r = 64; // force end of block
+                        } else {
+                            // r=15 s=0 skips 16 zeros: a run of 15 and then
+                            // "place" s=0 at the 16th
+                        }
                     } else {
-                        // r=15 s=0 should write 16 0s, so we just do
-                        // a run of 15 0s and then write s (which is 0),
-                        // so we don't have to do anything special here
+                        if (s != 1) return stbi__err("bad huffman code", "Corrupt JPEG");
+                        // sign bit
+                        if (stbi__jpeg_get_bit(j))
+                            s = bit;
+                        else
+                            s = -bit;
                     }
-                } else {
-                    if (s != 1) return stbi__err("bad huffman code", "Corrupt JPEG");
-                    // sign bit
-                    if (stbi__jpeg_get_bit(j))
-                        s = bit;
-                    else
-                        s = -bit;
                 }
                 
-                // advance by r
-                while (k <= j->spec_end) {
-                    short *p = &data[stbi__jpeg_dezigzag[k++]];
-                    if (*p != 0) {
-                        if (stbi__jpeg_get_bit(j))
-                            if ((*p & bit)==0) {
-                                if (*p > 0)
-                                    *p += bit;
-                                else
-                                    *p -= bit;
-                            }
-                    } else {
-                        if (r == 0) {
-                            *p = (short) s;
-                            break;
-                        }
-                        --r;
-                    }
+                // find the zero after r others; past the band if there isn't
+                // one, or at the end of block
+                zeros = 0;
+                if (r < 64) {
+                    zeros = ~*mask & band & (~(stbi__uint64) 0 << k);
+                    while (r-- > 0 && zeros)
+                        zeros &= zeros - 1;
+                }
+                if (zeros) {
+                    t = stbi__ctz64(zeros);
+                    passed = ((stbi__uint64) 1 << t) - 1;
+                } else {
+                    t = j->spec_end + 1;
+                    passed = ~(stbi__uint64) 0;
+                }
+                stbi__jpeg_refine_nonzero(j, data, *mask & band & passed & (~(stbi__uint64) 0 << k), bit);
+                if (s && zeros) {
+                    data[stbi__jpeg_dezigzag[t]] = (short) s;
+                    *mask |= (stbi__uint64) 1 << t;
                 }
+                k = t + 1;
             } while (k <= j->spec_end);
         }
     }
@@ -2260,6 +4781,58 @@ static void stbi__idct_block(stbi_uc *out, int out_stride, short data[64])
     }
 }
 
+// reduced-size IDCTs for scaled decoding: an N-point IDCT of the top-left
+// NxN coefficients gives an NxN block that's close to the 8x8 one box
+// filtered down. coefficients stay in units of the 8-point transform, so
+// the constants are 0.5*C(u)*cos((2x+1)u*pi/2N)
+static void stbi__idct_4x4(stbi_uc *out, int out_stride, short data[64])
+{
+    int i,val[16],*v=val;
+    stbi_uc *o;
+    short *d = data;
+    
+    // columns, keeping 2 extra bits of precision like stbi__idct_block
+    for (i=0; i < 4; ++i,++d,++v) {
+        int e0 = (d[0] + d[16]) * stbi__f2f(0.353553391f) + 512;
+        int e1 = (d[0] - d[16]) * stbi__f2f(0.353553391f) + 512;
+        int o0 = d[8]*stbi__f2f(0.461939766f) + d[24]*stbi__f2f(0.191341716f);
+        int o1 = d[8]*stbi__f2f(0.191341716f) - d[24]*stbi__f2f(0.461939766f);
+        v[ 0] = (e0+o0) >> 10;
+        v[12] = (e0-o0) >> 10;
+        v[ 4] = (e1+o1) >> 10;
+        v[ 8] = (e1-o1) >> 10;
+    }
+    
+    for (i=0, v=val, o=out; i < 4; ++i,v+=4,o+=out_stride) {
+        // 1<<12 from the constants plus 1<<2 from the columns; round and
+        // add the 128 bias before the shift
+        int e0 = (v[0] + v[2]) * stbi__f2f(0.353553391f) + (1<<13) + (128<<14);
+        int e1 = (v[0] - v[2]) * stbi__f2f(0.353553391f) + (1<<13) + (128<<14);
+        int o0 = v[1]*stbi__f2f(0.461939766f) + v[3]*stbi__f2f(0.191341716f);
+        int o1 = v[1]*stbi__f2f(0.191341716f) - v[3]*stbi__f2f(0.461939766f);
+        o[0] = stbi__clamp((e0+o0) >> 14);
+        o[3] = stbi__clamp((e0-o0) >> 14);
+        o[1] = stbi__clamp((e1+o1) >> 14);
+        o[2] = stbi__clamp((e1-o1) >> 14);
+    }
+}
+
+// the 2-point constants are all 0.5*cos(pi/4), so the 2D ones are all 1/8
+static void stbi__idct_2x2(stbi_uc *out, int out_stride, short data[64])
+{
+    int a = data[0] + data[8] + 4 + (128<<3), b = data[0] - data[8] + 4 + (128<<3);
+    out[0]            = stbi__clamp((a + data[1] + data[9]) >> 3);
+    out[1]            = stbi__clamp((a - data[1] - data[9]) >> 3);
+    out[out_stride  ] = stbi__clamp((b + data[1] - data[9]) >> 3);
+    out[out_stride+1] = stbi__clamp((b - data[1] + data[9]) >> 3);
+}
+
+static void stbi__idct_1x1(stbi_uc *out, int out_stride, short data[64])
+{
+    STBI_NOTUSED(out_stride);
+    out[0] = stbi__clamp((data[0] + 4 + (128<<3)) >> 3);
+}
+
 #ifdef STBI_SSE2
 // sse2 integer IDCT. not the fastest possible implementation but it
 // produces bit-identical results to the generic C version so it's
@@ -2290,43 +4863,215 @@ __m128i out##_h = _mm_srai_epi32(_mm_unpackhi_epi16(_mm_setzero_si128(), (in)),
     
     // wide add
 #define dct_wadd(out, a, b) \
-__m128i out##_l = _mm_add_epi32(a##_l, b##_l); \
-__m128i out##_h = _mm_add_epi32(a##_h, b##_h)
+__m128i out##_l = _mm_add_epi32(a##_l, b##_l); \
+__m128i out##_h = _mm_add_epi32(a##_h, b##_h)
+    
+    // wide sub
+#define dct_wsub(out, a, b) \
+__m128i out##_l = _mm_sub_epi32(a##_l, b##_l); \
+__m128i out##_h = _mm_sub_epi32(a##_h, b##_h)
+    
+    // butterfly a/b, add bias, then shift by "s" and pack
+#define dct_bfly32o(out0, out1, a,b,bias,s) \
+{ \
+__m128i abiased_l = _mm_add_epi32(a##_l, bias); \
+__m128i abiased_h = _mm_add_epi32(a##_h, bias); \
+dct_wadd(sum, abiased, b); \
+dct_wsub(dif, abiased, b); \
+out0 = _mm_packs_epi32(_mm_srai_epi32(sum_l, s), _mm_srai_epi32(sum_h, s)); \
+out1 = _mm_packs_epi32(_mm_srai_epi32(dif_l, s), _mm_srai_epi32(dif_h, s)); \
+}
+    
+    // 8-bit interleave step (for transposes)
+#define dct_interleave8(a, b) \
+tmp = a; \
+a = _mm_unpacklo_epi8(a, b); \
+b = _mm_unpackhi_epi8(tmp, b)
+    
+    // 16-bit interleave step (for transposes)
+#define dct_interleave16(a, b) \
+tmp = a; \
+a = _mm_unpacklo_epi16(a, b); \
+b = _mm_unpackhi_epi16(tmp, b)
+    
+#define dct_pass(bias,shift) \
+{ \
+/* even part */ \
+dct_rot(t2e,t3e, row2,row6, rot0_0,rot0_1); \
+__m128i sum04 = _mm_add_epi16(row0, row4); \
+__m128i dif04 = _mm_sub_epi16(row0, row4); \
+dct_widen(t0e, sum04); \
+dct_widen(t1e, dif04); \
+dct_wadd(x0, t0e, t3e); \
+dct_wsub(x3, t0e, t3e); \
+dct_wadd(x1, t1e, t2e); \
+dct_wsub(x2, t1e, t2e); \
+/* odd part */ \
+dct_rot(y0o,y2o, row7,row3, rot2_0,rot2_1); \
+dct_rot(y1o,y3o, row5,row1, rot3_0,rot3_1); \
+__m128i sum17 = _mm_add_epi16(row1, row7); \
+__m128i sum35 = _mm_add_epi16(row3, row5); \
+dct_rot(y4o,y5o, sum17,sum35, rot1_0,rot1_1); \
+dct_wadd(x4, y0o, y4o); \
+dct_wadd(x5, y1o, y5o); \
+dct_wadd(x6, y2o, y5o); \
+dct_wadd(x7, y3o, y4o); \
+dct_bfly32o(row0,row7, x0,x7,bias,shift); \
+dct_bfly32o(row1,row6, x1,x6,bias,shift); \
+dct_bfly32o(row2,row5, x2,x5,bias,shift); \
+dct_bfly32o(row3,row4, x3,x4,bias,shift); \
+}
+    
+    __m128i rot0_0 = dct_const(stbi__f2f(0.5411961f), stbi__f2f(0.5411961f) + stbi__f2f(-1.847759065f));
+    __m128i rot0_1 = dct_const(stbi__f2f(0.5411961f) + stbi__f2f( 0.765366865f), stbi__f2f(0.5411961f));
+    __m128i rot1_0 = dct_const(stbi__f2f(1.175875602f) + stbi__f2f(-0.899976223f), stbi__f2f(1.175875602f));
+    __m128i rot1_1 = dct_const(stbi__f2f(1.175875602f), stbi__f2f(1.175875602f) + stbi__f2f(-2.562915447f));
+    __m128i rot2_0 = dct_const(stbi__f2f(-1.961570560f) + stbi__f2f( 0.298631336f), stbi__f2f(-1.961570560f));
+    __m128i rot2_1 = dct_const(stbi__f2f(-1.961570560f), stbi__f2f(-1.961570560f) + stbi__f2f( 3.072711026f));
+    __m128i rot3_0 = dct_const(stbi__f2f(-0.390180644f) + stbi__f2f( 2.053119869f), stbi__f2f(-0.390180644f));
+    __m128i rot3_1 = dct_const(stbi__f2f(-0.390180644f), stbi__f2f(-0.390180644f) + stbi__f2f( 1.501321110f));
+    
+    // rounding biases in column/row passes, see stbi__idct_block for explanation.
+    __m128i bias_0 = _mm_set1_epi32(512);
+    __m128i bias_1 = _mm_set1_epi32(65536 + (128<<17));
+    
+    // load
+    row0 = _mm_load_si128((const __m128i *) (data + 0*8));
+    row1 = _mm_load_si128((const __m128i *) (data + 1*8));
+    row2 = _mm_load_si128((const __m128i *) (data + 2*8));
+    row3 = _mm_load_si128((const __m128i *) (data + 3*8));
+    row4 = _mm_load_si128((const __m128i *) (data + 4*8));
+    row5 = _mm_load_si128((const __m128i *) (data + 5*8));
+    row6 = _mm_load_si128((const __m128i *) (data + 6*8));
+    row7 = _mm_load_si128((const __m128i *) (data + 7*8));
+    
+    // column pass
+    dct_pass(bias_0, 10);
+    
+    {
+        // 16bit 8x8 transpose pass 1
+        dct_interleave16(row0, row4);
+        dct_interleave16(row1, row5);
+        dct_interleave16(row2, row6);
+        dct_interleave16(row3, row7);
+        
+        // transpose pass 2
+        dct_interleave16(row0, row2);
+        dct_interleave16(row1, row3);
+        dct_interleave16(row4, row6);
+        dct_interleave16(row5, row7);
+        
+        // transpose pass 3
+        dct_interleave16(row0, row1);
+        dct_interleave16(row2, row3);
+        dct_interleave16(row4, row5);
+        dct_interleave16(row6, row7);
+    }
+    
+    // row pass
+    dct_pass(bias_1, 17);
+    
+    {
+        // pack
+        __m128i p0 = _mm_packus_epi16(row0, row1); // a0a1a2a3...a7b0b1b2b3...b7
+        __m128i p1 = _mm_packus_epi16(row2, row3);
+        __m128i p2 = _mm_packus_epi16(row4, row5);
+        __m128i p3 = _mm_packus_epi16(row6, row7);
+        
+        // 8bit 8x8 transpose pass 1
+        dct_interleave8(p0, p2); // a0e0a1e1...
+        dct_interleave8(p1, p3); // c0g0c1g1...
+        
+        // transpose pass 2
+        dct_interleave8(p0, p1); // a0c0e0g0...
+        dct_interleave8(p2, p3); // b0d0f0h0...
+        
+        // transpose pass 3
+        dct_interleave8(p0, p2); // a0b0c0d0...
+        dct_interleave8(p1, p3); // a4b4c4d4...
+        
+        // store
+        _mm_storel_epi64((__m128i *) out, p0); out += out_stride;
+        _mm_storel_epi64((__m128i *) out, _mm_shuffle_epi32(p0, 0x4e)); out += out_stride;
+        _mm_storel_epi64((__m128i *) out, p2); out += out_stride;
+        _mm_storel_epi64((__m128i *) out, _mm_shuffle_epi32(p2, 0x4e)); out += out_stride;
+        _mm_storel_epi64((__m128i *) out, p1); out += out_stride;
+        _mm_storel_epi64((__m128i *) out, _mm_shuffle_epi32(p1, 0x4e)); out += out_stride;
+        _mm_storel_epi64((__m128i *) out, p3); out += out_stride;
+        _mm_storel_epi64((__m128i *) out, _mm_shuffle_epi32(p3, 0x4e));
+    }
+    
+#undef dct_const
+#undef dct_rot
+#undef dct_widen
+#undef dct_wadd
+#undef dct_wsub
+#undef dct_bfly32o
+#undef dct_interleave8
+#undef dct_interleave16
+#undef dct_pass
+}
+
+#endif // STBI_SSE2
+
+#ifdef STBI_AVX2
+// avx2 integer IDCT of two horizontally adjacent blocks at once. this is the
+// sse2 version with the left block in the low 128-bit lane and the right
+// block in the high lane; every step of it works within lanes, so the
+// results are still bit-identical to the generic C version.
+static STBI__AVX2_TARGET void stbi__idct2_avx2(stbi_uc *out, int out_stride, short data[128])
+{
+    __m256i row0, row1, row2, row3, row4, row5, row6, row7;
+    __m256i tmp;
+    
+#define dct_const(x,y)  _mm256_setr_epi16((x),(y),(x),(y),(x),(y),(x),(y),(x),(y),(x),(y),(x),(y),(x),(y))
+    
+#define dct_rot(out0,out1, x,y,c0,c1) \
+__m256i c0##lo = _mm256_unpacklo_epi16((x),(y)); \
+__m256i c0##hi = _mm256_unpackhi_epi16((x),(y)); \
+__m256i out0##_l = _mm256_madd_epi16(c0##lo, c0); \
+__m256i out0##_h = _mm256_madd_epi16(c0##hi, c0); \
+__m256i out1##_l = _mm256_madd_epi16(c0##lo, c1); \
+__m256i out1##_h = _mm256_madd_epi16(c0##hi, c1)
+    
+#define dct_widen(out, in) \
+__m256i out##_l = _mm256_srai_epi32(_mm256_unpacklo_epi16(_mm256_setzero_si256(), (in)), 4); \
+__m256i out##_h = _mm256_srai_epi32(_mm256_unpackhi_epi16(_mm256_setzero_si256(), (in)), 4)
+    
+#define dct_wadd(out, a, b) \
+__m256i out##_l = _mm256_add_epi32(a##_l, b##_l); \
+__m256i out##_h = _mm256_add_epi32(a##_h, b##_h)
     
-    // wide sub
 #define dct_wsub(out, a, b) \
-__m128i out##_l = _mm_sub_epi32(a##_l, b##_l); \
-__m128i out##_h = _mm_sub_epi32(a##_h, b##_h)
+__m256i out##_l = _mm256_sub_epi32(a##_l, b##_l); \
+__m256i out##_h = _mm256_sub_epi32(a##_h, b##_h)
     
-    // butterfly a/b, add bias, then shift by "s" and pack
 #define dct_bfly32o(out0, out1, a,b,bias,s) \
 { \
-__m128i abiased_l = _mm_add_epi32(a##_l, bias); \
-__m128i abiased_h = _mm_add_epi32(a##_h, bias); \
+__m256i abiased_l = _mm256_add_epi32(a##_l, bias); \
+__m256i abiased_h = _mm256_add_epi32(a##_h, bias); \
 dct_wadd(sum, abiased, b); \
 dct_wsub(dif, abiased, b); \
-out0 = _mm_packs_epi32(_mm_srai_epi32(sum_l, s), _mm_srai_epi32(sum_h, s)); \
-out1 = _mm_packs_epi32(_mm_srai_epi32(dif_l, s), _mm_srai_epi32(dif_h, s)); \
+out0 = _mm256_packs_epi32(_mm256_srai_epi32(sum_l, s), _mm256_srai_epi32(sum_h, s)); \
+out1 = _mm256_packs_epi32(_mm256_srai_epi32(dif_l, s), _mm256_srai_epi32(dif_h, s)); \
 }
     
-    // 8-bit interleave step (for transposes)
 #define dct_interleave8(a, b) \
 tmp = a; \
-a = _mm_unpacklo_epi8(a, b); \
-b = _mm_unpackhi_epi8(tmp, b)
+a = _mm256_unpacklo_epi8(a, b); \
+b = _mm256_unpackhi_epi8(tmp, b)
     
-    // 16-bit interleave step (for transposes)
 #define dct_interleave16(a, b) \
 tmp = a; \
-a = _mm_unpacklo_epi16(a, b); \
-b = _mm_unpackhi_epi16(tmp, b)
+a = _mm256_unpacklo_epi16(a, b); \
+b = _mm256_unpackhi_epi16(tmp, b)
     
 #define dct_pass(bias,shift) \
 { \
 /* even part */ \
 dct_rot(t2e,t3e, row2,row6, rot0_0,rot0_1); \
-__m128i sum04 = _mm_add_epi16(row0, row4); \
-__m128i dif04 = _mm_sub_epi16(row0, row4); \
+__m256i sum04 = _mm256_add_epi16(row0, row4); \
+__m256i dif04 = _mm256_sub_epi16(row0, row4); \
 dct_widen(t0e, sum04); \
 dct_widen(t1e, dif04); \
 dct_wadd(x0, t0e, t3e); \
@@ -2336,8 +5081,8 @@ dct_wsub(x2, t1e, t2e); \
 /* odd part */ \
 dct_rot(y0o,y2o, row7,row3, rot2_0,rot2_1); \
 dct_rot(y1o,y3o, row5,row1, rot3_0,rot3_1); \
-__m128i sum17 = _mm_add_epi16(row1, row7); \
-__m128i sum35 = _mm_add_epi16(row3, row5); \
+__m256i sum17 = _mm256_add_epi16(row1, row7); \
+__m256i sum35 = _mm256_add_epi16(row3, row5); \
 dct_rot(y4o,y5o, sum17,sum35, rot1_0,rot1_1); \
 dct_wadd(x4, y0o, y4o); \
 dct_wadd(x5, y1o, y5o); \
@@ -2349,28 +5094,39 @@ dct_bfly32o(row2,row5, x2,x5,bias,shift); \
 dct_bfly32o(row3,row4, x3,x4,bias,shift); \
 }
     
-    __m128i rot0_0 = dct_const(stbi__f2f(0.5411961f), stbi__f2f(0.5411961f) + stbi__f2f(-1.847759065f));
-    __m128i rot0_1 = dct_const(stbi__f2f(0.5411961f) + stbi__f2f( 0.765366865f), stbi__f2f(0.5411961f));
-    __m128i rot1_0 = dct_const(stbi__f2f(1.175875602f) + stbi__f2f(-0.899976223f), stbi__f2f(1.175875602f));
-    __m128i rot1_1 = dct_const(stbi__f2f(1.175875602f), stbi__f2f(1.175875602f) + stbi__f2f(-2.562915447f));
-    __m128i rot2_0 = dct_const(stbi__f2f(-1.961570560f) + stbi__f2f( 0.298631336f), stbi__f2f(-1.961570560f));
-    __m128i rot2_1 = dct_const(stbi__f2f(-1.961570560f), stbi__f2f(-1.961570560f) + stbi__f2f( 3.072711026f));
-    __m128i rot3_0 = dct_const(stbi__f2f(-0.390180644f) + stbi__f2f( 2.053119869f), stbi__f2f(-0.390180644f));
-    __m128i rot3_1 = dct_const(stbi__f2f(-0.390180644f), stbi__f2f(-0.390180644f) + stbi__f2f( 1.501321110f));
+    // row k of the left block in the low lane, of the right block in the high lane
+#define dct_load(k) \
+_mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i *) (data + (k)*8))), \
+                        _mm_loadu_si128((const __m128i *) (data + 64 + (k)*8)), 1)
+    
+    // p holds rows r and r+1 of both blocks; write out 16 pixels of each row
+#define dct_store2(p) \
+tmp = _mm256_permute4x64_epi64(p, 0xd8); \
+_mm_storeu_si128((__m128i *) out, _mm256_castsi256_si128(tmp)); out += out_stride; \
+_mm_storeu_si128((__m128i *) out, _mm256_extracti128_si256(tmp, 1)); out += out_stride
+    
+    __m256i rot0_0 = dct_const(stbi__f2f(0.5411961f), stbi__f2f(0.5411961f) + stbi__f2f(-1.847759065f));
+    __m256i rot0_1 = dct_const(stbi__f2f(0.5411961f) + stbi__f2f( 0.765366865f), stbi__f2f(0.5411961f));
+    __m256i rot1_0 = dct_const(stbi__f2f(1.175875602f) + stbi__f2f(-0.899976223f), stbi__f2f(1.175875602f));
+    __m256i rot1_1 = dct_const(stbi__f2f(1.175875602f), stbi__f2f(1.175875602f) + stbi__f2f(-2.562915447f));
+    __m256i rot2_0 = dct_const(stbi__f2f(-1.961570560f) + stbi__f2f( 0.298631336f), stbi__f2f(-1.961570560f));
+    __m256i rot2_1 = dct_const(stbi__f2f(-1.961570560f), stbi__f2f(-1.961570560f) + stbi__f2f( 3.072711026f));
+    __m256i rot3_0 = dct_const(stbi__f2f(-0.390180644f) + stbi__f2f( 2.053119869f), stbi__f2f(-0.390180644f));
+    __m256i rot3_1 = dct_const(stbi__f2f(-0.390180644f), stbi__f2f(-0.390180644f) + stbi__f2f( 1.501321110f));
     
     // rounding biases in column/row passes, see stbi__idct_block for explanation.
-    __m128i bias_0 = _mm_set1_epi32(512);
-    __m128i bias_1 = _mm_set1_epi32(65536 + (128<<17));
+    __m256i bias_0 = _mm256_set1_epi32(512);
+    __m256i bias_1 = _mm256_set1_epi32(65536 + (128<<17));
     
     // load
-    row0 = _mm_load_si128((const __m128i *) (data + 0*8));
-    row1 = _mm_load_si128((const __m128i *) (data + 1*8));
-    row2 = _mm_load_si128((const __m128i *) (data + 2*8));
-    row3 = _mm_load_si128((const __m128i *) (data + 3*8));
-    row4 = _mm_load_si128((const __m128i *) (data + 4*8));
-    row5 = _mm_load_si128((const __m128i *) (data + 5*8));
-    row6 = _mm_load_si128((const __m128i *) (data + 6*8));
-    row7 = _mm_load_si128((const __m128i *) (data + 7*8));
+    row0 = dct_load(0);
+    row1 = dct_load(1);
+    row2 = dct_load(2);
+    row3 = dct_load(3);
+    row4 = dct_load(4);
+    row5 = dct_load(5);
+    row6 = dct_load(6);
+    row7 = dct_load(7);
     
     // column pass
     dct_pass(bias_0, 10);
@@ -2400,32 +5156,28 @@ dct_bfly32o(row3,row4, x3,x4,bias,shift); \
     
     {
         // pack
-        __m128i p0 = _mm_packus_epi16(row0, row1); // a0a1a2a3...a7b0b1b2b3...b7
-        __m128i p1 = _mm_packus_epi16(row2, row3);
-        __m128i p2 = _mm_packus_epi16(row4, row5);
-        __m128i p3 = _mm_packus_epi16(row6, row7);
+        __m256i p0 = _mm256_packus_epi16(row0, row1);
+        __m256i p1 = _mm256_packus_epi16(row2, row3);
+        __m256i p2 = _mm256_packus_epi16(row4, row5);
+        __m256i p3 = _mm256_packus_epi16(row6, row7);
         
         // 8bit 8x8 transpose pass 1
-        dct_interleave8(p0, p2); // a0e0a1e1...
-        dct_interleave8(p1, p3); // c0g0c1g1...
+        dct_interleave8(p0, p2);
+        dct_interleave8(p1, p3);
         
         // transpose pass 2
-        dct_interleave8(p0, p1); // a0c0e0g0...
-        dct_interleave8(p2, p3); // b0d0f0h0...
+        dct_interleave8(p0, p1);
+        dct_interleave8(p2, p3);
         
         // transpose pass 3
-        dct_interleave8(p0, p2); // a0b0c0d0...
-        dct_interleave8(p1, p3); // a4b4c4d4...
+        dct_interleave8(p0, p2);
+        dct_interleave8(p1, p3);
         
         // store
-        _mm_storel_epi64((__m128i *) out, p0); out += out_stride;
-        _mm_storel_epi64((__m128i *) out, _mm_shuffle_epi32(p0, 0x4e)); out += out_stride;
-        _mm_storel_epi64((__m128i *) out, p2); out += out_stride;
-        _mm_storel_epi64((__m128i *) out, _mm_shuffle_epi32(p2, 0x4e)); out += out_stride;
-        _mm_storel_epi64((__m128i *) out, p1); out += out_stride;
-        _mm_storel_epi64((__m128i *) out, _mm_shuffle_epi32(p1, 0x4e)); out += out_stride;
-        _mm_storel_epi64((__m128i *) out, p3); out += out_stride;
-        _mm_storel_epi64((__m128i *) out, _mm_shuffle_epi32(p3, 0x4e));
+        dct_store2(p0);
+        dct_store2(p2);
+        dct_store2(p1);
+        dct_store2(p3);
     }
     
 #undef dct_const
@@ -2437,9 +5189,10 @@ dct_bfly32o(row3,row4, x3,x4,bias,shift); \
 #undef dct_interleave8
 #undef dct_interleave16
 #undef dct_pass
+#undef dct_load
+#undef dct_store2
 }
-
-#endif // STBI_SSE2
+#endif // STBI_AVX2
 
 #ifdef STBI_NEON
 
@@ -2679,71 +5432,333 @@ static void stbi__jpeg_reset(stbi__jpeg *j)
     j->marker = STBI__MARKER_none;
     j->todo = j->restart_interval ? j->restart_interval : 0x7fffffff;
     j->eob_run = 0;
+    j->skip_segment = 0;
     // no more than 1<<31 MCUs if no restart_interal? that's plenty safe,
     // since we don't even allow 1<<30 pixels
 }
 
-static int stbi__parse_entropy_coded_data(stbi__jpeg *z)
+// returns 1 if any of units [first, first+count) of the current scan are in
+// the cropped window. units are MCUs for interleaved scans, else blocks of
+// the one component, per_row of them to a row
+static int stbi__jpeg_units_wanted(stbi__jpeg *z, int first, int count, int per_row)
 {
-    stbi__jpeg_reset(z);
-    if (!z->progressive) {
-        if (z->scan_n == 1) {
-            int i,j;
-            STBI_SIMD_ALIGN(short, data[64]);
-            int n = z->order[0];
-            // non-interleaved data, we just need to process one block at a time,
-            // in trivial scanline order
-            // number of blocks to do just depends on how many actual "pixels" this
-            // component has, independent of interleaved MCU blocking and such
-            int w = (z->img_comp[n].x+7) >> 3;
-            int h = (z->img_comp[n].y+7) >> 3;
-            for (j=0; j < h; ++j) {
-                for (i=0; i < w; ++i) {
-                    int ha = z->img_comp[n].ha;
-                    if (!stbi__jpeg_decode_block(z, data, z->huff_dc+z->img_comp[n].hd, z->huff_ac+ha, z->fast_ac[ha], n, z->dequant[z->img_comp[n].tq])) return 0;
-                    z->idct_block_kernel(z->img_comp[n].data+z->img_comp[n].w2*j*8+i*8, z->img_comp[n].w2, data);
-                    // every data block is an MCU, so countdown the restart interval
-                    if (--z->todo <= 0) {
-                        if (z->code_bits < 24) stbi__grow_buffer_unsafe(z);
-                        // if it's NOT a restart, then just bail, so we get corrupt data
-                        // rather than no data
-                        if (!STBI__RESTART(z->marker)) return 1;
-                        stbi__jpeg_reset(z);
-                    }
+    int h = 1, v = 1, r;
+    if (z->scan_n == 1) {
+        h = z->img_comp[z->order[0]].h;
+        v = z->img_comp[z->order[0]].v;
+    }
+    for (r = first / per_row; r <= (first+count-1) / per_row && r < z->mcu_y1*v; ++r) {
+        int a = first - r*per_row, b = first+count - r*per_row;
+        if (r >= z->mcu_y0*v && a < z->mcu_x1*h && b > z->mcu_x0*h) return 1;
+    }
+    return 0;
+}
+
+// skip entropy-coded data without decoding it, up to the next marker (or
+// the next one that isn't RSTn), and leave that marker in z->marker
+static void stbi__jpeg_skip_to_marker(stbi__jpeg *z, int stop_at_restart)
+{
+    int c;
+    if (z->marker != STBI__MARKER_none && (stop_at_restart || !STBI__RESTART(z->marker)))
+        return;
+    z->marker = STBI__MARKER_none;
+    z->nomore = 1;
+    while (!stbi__at_eof(z->s)) {
+        if (!z->s->read_from_callbacks) {
+            stbi_uc *p = (stbi_uc *) memchr(z->s->img_buffer, 0xff, z->s->img_buffer_end - z->s->img_buffer);
+            z->s->img_buffer = p ? p : z->s->img_buffer_end;
+        }
+        if (stbi__get8(z->s) != 0xff) continue;
+        c = stbi__get8(z->s);
+        while (c == 0xff) c = stbi__get8(z->s); // fill bytes
+        if (c == 0 || (!stop_at_restart && STBI__RESTART(c))) continue;
+        z->marker = (unsigned char) c;
+        return;
+    }
+}
+
+// for a cropped decode, call before unit m of a scan: if it starts a restart
+// segment with nothing in the window, the segment's data is skipped. returns
+// 0 while skipping, in which case just count the unit down as usual
+static int stbi__jpeg_crop_unit(stbi__jpeg *z, int m, int per_row)
+{
+    if (z->restart_interval && z->todo == z->restart_interval && !stbi__jpeg_units_wanted(z, m, z->restart_interval, per_row)) {
+        stbi__jpeg_skip_to_marker(z, 1);
+        z->skip_segment = 1;
+    }
+    return !z->skip_segment;
+}
+
+// decode 'count' horizontally adjacent blocks of component n from a baseline
+// scan and IDCT them into out, two at a time if there's a kernel for that.
+// blocks outside a cropped window pass a NULL out and are only decoded
+static int stbi__jpeg_decode_block_run(stbi__jpeg *z, int n, stbi_uc *out, int count)
+{
+    STBI_SIMD_ALIGN(short, data[128]);
+    int ha = z->img_comp[n].ha;
+    int bs = z->img_comp[n].bs;
+    int i = 0;
+    if (out == NULL) {
+        for (; i < count; ++i)
+            if (!stbi__jpeg_decode_block(z, data, z->huff_dc+z->img_comp[n].hd, z->fast_dc[z->img_comp[n].hd], z->huff_ac+ha, z->fast_ac[ha], n, z->dequant[z->img_comp[n].tq])) return 0;
+        return 1;
+    }
+    if (z->idct_block2_kernel && bs == 8) {
+        for (; i+1 < count; i += 2) {
+            if (!stbi__jpeg_decode_block(z, data   , z->huff_dc+z->img_comp[n].hd, z->fast_dc[z->img_comp[n].hd], z->huff_ac+ha, z->fast_ac[ha], n, z->dequant[z->img_comp[n].tq])) return 0;
+            if (!stbi__jpeg_decode_block(z, data+64, z->huff_dc+z->img_comp[n].hd, z->fast_dc[z->img_comp[n].hd], z->huff_ac+ha, z->fast_ac[ha], n, z->dequant[z->img_comp[n].tq])) return 0;
+            z->idct_block2_kernel(out+i*8, z->img_comp[n].w2, data);
+        }
+    }
+    for (; i < count; ++i) {
+        if (!stbi__jpeg_decode_block(z, data, z->huff_dc+z->img_comp[n].hd, z->fast_dc[z->img_comp[n].hd], z->huff_ac+ha, z->fast_ac[ha], n, z->dequant[z->img_comp[n].tq])) return 0;
+        z->img_comp[n].idct_kernel(out+i*bs, z->img_comp[n].w2, data);
+    }
+    return 1;
+}
+
+// decode MCU row j of the current baseline scan; for a non-interleaved scan
+// that's the v rows of blocks the component contributes to it. returns 0 on
+// error, 2 if a marker other than RSTn cut the scan short, else 1
+static int stbi__jpeg_decode_mcu_row(stbi__jpeg *z, int j)
+{
+    int i,k,y;
+    int jr = z->stream_mcu_rows ? j % z->stream_mcu_rows : j - z->mcu_y0; // plane row, if planes are a ring or cropped
+    int in_rows = j >= z->mcu_y0 && j < z->mcu_y1;
+    if (z->scan_n == 1) {
+        int n = z->order[0];
+        // non-interleaved data, we just need to process one block at a time,
+        // in trivial scanline order
+        // number of blocks to do just depends on how many actual "pixels" this
+        // component has, independent of interleaved MCU blocking and such
+        int w = (z->img_comp[n].x+7) >> 3;
+        int h = (z->img_comp[n].y+7) >> 3;
+        int bs = z->img_comp[n].bs;
+        int x0 = z->mcu_x0 * z->img_comp[n].h, x1 = z->mcu_x1 * z->img_comp[n].h;
+        for (y=0; y < z->img_comp[n].v && j*z->img_comp[n].v + y < h; ++y) {
+            stbi_uc *out = in_rows ? z->img_comp[n].data + z->img_comp[n].w2*(jr*z->img_comp[n].v + y)*bs : NULL;
+            for (i=0; i < w; ++i) {
+                if (!z->crop || stbi__jpeg_crop_unit(z, (j*z->img_comp[n].v + y)*w + i, w))
+                    if (!stbi__jpeg_decode_block_run(z, n, out && i >= x0 && i < x1 ? out+(i-x0)*bs : NULL, 1)) return 0;
+                // every data block is an MCU, so countdown the restart interval
+                if (--z->todo <= 0) {
+                    if (z->code_bits < 24) stbi__grow_buffer_unsafe(z);
+                    // if it's NOT a restart, then just bail, so we get corrupt data
+                    // rather than no data
+                    if (!STBI__RESTART(z->marker)) return 2;
+                    stbi__jpeg_reset(z);
                 }
             }
-            return 1;
-        } else { // interleaved
-            int i,j,k,x,y;
-            STBI_SIMD_ALIGN(short, data[64]);
-            for (j=0; j < z->img_mcu_y; ++j) {
-                for (i=0; i < z->img_mcu_x; ++i) {
-                    // scan an interleaved mcu... process scan_n components in order
-                    for (k=0; k < z->scan_n; ++k) {
-                        int n = z->order[k];
-                        // scan out an mcu's worth of this component; that's just determined
-                        // by the basic H and V specified for the component
-                        for (y=0; y < z->img_comp[n].v; ++y) {
-                            for (x=0; x < z->img_comp[n].h; ++x) {
-                                int x2 = (i*z->img_comp[n].h + x)*8;
-                                int y2 = (j*z->img_comp[n].v + y)*8;
-                                int ha = z->img_comp[n].ha;
-                                if (!stbi__jpeg_decode_block(z, data, z->huff_dc+z->img_comp[n].hd, z->huff_ac+ha, z->fast_ac[ha], n, z->dequant[z->img_comp[n].tq])) return 0;
-                                z->idct_block_kernel(z->img_comp[n].data+z->img_comp[n].w2*y2+x2, z->img_comp[n].w2, data);
-                            }
-                        }
-                    }
-                    // after all interleaved components, that's an interleaved MCU,
-                    // so now count down the restart interval
-                    if (--z->todo <= 0) {
-                        if (z->code_bits < 24) stbi__grow_buffer_unsafe(z);
-                        if (!STBI__RESTART(z->marker)) return 1;
-                        stbi__jpeg_reset(z);
+        }
+    } else { // interleaved
+        for (i=0; i < z->img_mcu_x; ++i) {
+            int in = in_rows && i >= z->mcu_x0 && i < z->mcu_x1;
+            // scan an interleaved mcu... process scan_n components in order
+            if (!z->crop || stbi__jpeg_crop_unit(z, j*z->img_mcu_x + i, z->img_mcu_x)) {
+                for (k=0; k < z->scan_n; ++k) {
+                    int n = z->order[k];
+                    // scan out an mcu's worth of this component; that's just determined
+                    // by the basic H and V specified for the component. each row of
+                    // h blocks is adjacent in the output plane.
+                    for (y=0; y < z->img_comp[n].v; ++y) {
+                        int x2 = (i - z->mcu_x0)*z->img_comp[n].h*z->img_comp[n].bs;
+                        int y2 = (jr*z->img_comp[n].v + y)*z->img_comp[n].bs;
+                        if (!stbi__jpeg_decode_block_run(z, n, in ? z->img_comp[n].data+z->img_comp[n].w2*y2+x2 : NULL, z->img_comp[n].h)) return 0;
                     }
                 }
             }
-            return 1;
+            // after all interleaved components, that's an interleaved MCU,
+            // so now count down the restart interval
+            if (--z->todo <= 0) {
+                if (z->code_bits < 24) stbi__grow_buffer_unsafe(z);
+                if (!STBI__RESTART(z->marker)) return 2;
+                stbi__jpeg_reset(z);
+            }
+        }
+    }
+    return 1;
+}
+
+#ifndef STBI_NO_THREADS
+// Baseline scans with a restart interval are made of independent segments:
+// the entropy decoder and the dc predictors are reset at every RSTn marker,
+// and each segment covers a known run of MCUs. So if the whole scan is in
+// memory, we can find the markers up front and hand segments to workers,
+// each with its own copy of the decoder state, writing disjoint blocks of
+// the shared component planes.
+
+typedef struct
+{
+    stbi__jpeg *z;            // decoder state after the scan header, copied per worker
+    stbi_uc **seg;            // start of each segment, just past its RSTn marker
+    stbi_uc *end;             // first byte of the marker that ends the scan
+    int count;
+    int num_workers;
+    int failed[STBI_MAX_THREADS];
+} stbi__jpeg_segments;
+
+// decode MCUs [first, first+count) of the current baseline scan, starting from
+// a freshly reset entropy decoder
+static int stbi__jpeg_decode_mcu_range(stbi__jpeg *z, int first, int count)
+{
+    int m, i, j, k, y;
+    if (z->scan_n == 1) {
+        int n = z->order[0];
+        int w = (z->img_comp[n].x+7) >> 3;
+        int x0 = z->mcu_x0 * z->img_comp[n].h, x1 = z->mcu_x1 * z->img_comp[n].h;
+        int y0 = z->mcu_y0 * z->img_comp[n].v, y1 = z->mcu_y1 * z->img_comp[n].v;
+        for (m=first; m < first+count; ++m) {
+            i = m % w;
+            j = m / w;
+            if (!stbi__jpeg_decode_block_run(z, n, i >= x0 && i < x1 && j >= y0 && j < y1 ? z->img_comp[n].data+(z->img_comp[n].w2*(j-y0)+i-x0)*z->img_comp[n].bs : NULL, 1)) return 0;
+        }
+    } else {
+        for (m=first; m < first+count; ++m) {
+            int in;
+            i = m % z->img_mcu_x;
+            j = m / z->img_mcu_x;
+            in = i >= z->mcu_x0 && i < z->mcu_x1 && j >= z->mcu_y0 && j < z->mcu_y1;
+            for (k=0; k < z->scan_n; ++k) {
+                int n = z->order[k];
+                for (y=0; y < z->img_comp[n].v; ++y) {
+                    int x2 = (i - z->mcu_x0)*z->img_comp[n].h*z->img_comp[n].bs;
+                    int y2 = ((j - z->mcu_y0)*z->img_comp[n].v + y)*z->img_comp[n].bs;
+                    if (!stbi__jpeg_decode_block_run(z, n, in ? z->img_comp[n].data+z->img_comp[n].w2*y2+x2 : NULL, z->img_comp[n].h)) return 0;
+                }
+            }
+        }
+    }
+    return 1;
+}
+
+static void stbi__jpeg_segment_worker(void *arg, int worker)
+{
+    stbi__jpeg_segments *g = (stbi__jpeg_segments *) arg;
+    stbi__jpeg *z = &g->z[worker];
+    stbi__context s;
+    int total, per_row, i;
+    if (z->scan_n == 1) {
+        int n = z->order[0];
+        per_row = (z->img_comp[n].x+7) >> 3;
+        total = per_row * ((z->img_comp[n].y+7) >> 3);
+    } else {
+        per_row = z->img_mcu_x;
+        total = z->img_mcu_x * z->img_mcu_y;
+    }
+    g->failed[worker] = 0;
+    z->s = &s;
+    for (i=worker; i < g->count; i += g->num_workers) {
+        int first = i * z->restart_interval;
+        int count = total - first < z->restart_interval ? total - first : z->restart_interval;
+        stbi_uc *end = i+1 < g->count ? g->seg[i+1] - 2 : g->end;
+        if (z->crop && !stbi__jpeg_units_wanted(z, first, count, per_row))
+            continue;
+        stbi__start_mem(&s, g->seg[i], (int) (end - g->seg[i]));
+        stbi__jpeg_reset(z);
+        if (!stbi__jpeg_decode_mcu_range(z, first, count)) {
+            g->failed[worker] = 1;
+            return;
+        }
+    }
+}
+
+// returns 1 or 0 like stbi__parse_entropy_coded_data, or -1 if this scan
+// can't be split and should be decoded serially instead
+static int stbi__parse_entropy_coded_data_mt(stbi__jpeg *z)
+{
+    stbi__jpeg_segments g;
+    stbi_uc *p = z->s->img_buffer, *end = z->s->img_buffer_end;
+    int total, expected, k, ok;
+
+    if (z->scan_n == 1) {
+        int n = z->order[0];
+        total = ((z->img_comp[n].x+7) >> 3) * ((z->img_comp[n].y+7) >> 3);
+    } else
+        total = z->img_mcu_x * z->img_mcu_y;
+    expected = (total + z->restart_interval - 1) / z->restart_interval;
+    if (expected < 2) return -1;
+
+    // locate the RSTn markers; stuffed zeros and fill bytes are skipped, any
+    // other marker ends the scan
+    g.seg = (stbi_uc **) stbi__scratch_malloc_mad2(z->s->alloc, expected, sizeof(stbi_uc *), 0);
+    if (!g.seg) return -1;
+    g.seg[0] = p;
+    g.count = 1;
+    for (;;) {
+        p = (stbi_uc *) memchr(p, 0xff, end - p);
+        if (p == NULL || p+1 >= end) { p = end; break; }
+        if (p[1] == 0x00 || p[1] == 0xff) { ++p; continue; }
+        if (!STBI__RESTART(p[1])) break;
+        if (g.count == expected) {
+            // more segments than MCUs; let the serial decoder sort it out
+            g.count = 0;
+            break;
+        }
+        g.seg[g.count++] = p+2;
+        p += 2;
+    }
+    if (g.count != expected) {
+        stbi__scratch_free(z->s->alloc, g.seg);
+        return -1;
+    }
+    g.end = p;
+
+    g.num_workers = z->s->num_threads < g.count ? z->s->num_threads : g.count;
+    if (g.num_workers > STBI_MAX_THREADS) g.num_workers = STBI_MAX_THREADS;
+    g.z = (stbi__jpeg *) stbi__scratch_malloc_mad2(z->s->alloc, g.num_workers, sizeof(stbi__jpeg), 0);
+    if (!g.z) {
+        stbi__scratch_free(z->s->alloc, g.seg);
+        return -1;
+    }
+    for (k=0; k < g.num_workers; ++k)
+        g.z[k] = *z;
+    stbi__parallel_run(g.num_workers, stbi__jpeg_segment_worker, &g);
+
+    ok = 1;
+    for (k=0; k < g.num_workers; ++k)
+        if (g.failed[k]) ok = 0;
+    stbi__scratch_free(z->s->alloc, g.z);
+    stbi__scratch_free(z->s->alloc, g.seg);
+
+    // leave the stream at the marker that ended the scan, as the serial path would
+    z->s->img_buffer = p;
+    z->marker = STBI__MARKER_none;
+    return ok;
+}
+#endif // STBI_NO_THREADS
+
+// progressive acs, the bulk of the memory, for component n
+static int stbi__jpeg_alloc_coeff(stbi__jpeg *z, int n)
+{
+    z->img_comp[n].raw_coeff = stbi__scratch_malloc_mad3(z->s->alloc, z->img_comp[n].coeff_w * 8, z->img_comp[n].coeff_h * 8, sizeof(short), 15);
+    if (z->img_comp[n].raw_coeff == NULL)
+        return stbi__err("outofmem", "Out of memory");
+    z->img_comp[n].coeff = (short*) (((size_t) z->img_comp[n].raw_coeff + 15) & ~15);
+    return 1;
+}
+
+static int stbi__parse_entropy_coded_data(stbi__jpeg *z)
+{
+#ifndef STBI_NO_THREADS
+    if (z->s->num_threads > 1 && !z->progressive && z->restart_interval && z->s->io.read == NULL) {
+        int r = stbi__parse_entropy_coded_data_mt(z);
+        if (r >= 0) return r;
+    }
+#endif
+    stbi__jpeg_reset(z);
+    if (!z->progressive) {
+        int j;
+        for (j=0; j < z->img_mcu_y; ++j) {
+            int r;
+            if (j >= z->mcu_y1) {
+                // the rest of the scan is below the cropped window
+                stbi__jpeg_skip_to_marker(z, 0);
+                return 1;
+            }
+            r = stbi__jpeg_decode_mcu_row(z, j);
+            if (r != 1) return r != 0;
         }
+        return 1;
     } else {
         if (z->scan_n == 1) {
             int i,j;
@@ -2754,16 +5769,24 @@ static int stbi__parse_entropy_coded_data(stbi__jpeg *z)
             // component has, independent of interleaved MCU blocking and such
             int w = (z->img_comp[n].x+7) >> 3;
             int h = (z->img_comp[n].y+7) >> 3;
+            if (z->spec_start != 0 && !z->img_comp[n].coeff)
+                if (!stbi__jpeg_alloc_coeff(z, n)) return 0;
             for (j=0; j < h; ++j) {
+                if (j >= z->mcu_y1 * z->img_comp[n].v) {
+                    stbi__jpeg_skip_to_marker(z, 0);
+                    return 1;
+                }
                 for (i=0; i < w; ++i) {
-                    short *data = z->img_comp[n].coeff + 64 * (i + j * z->img_comp[n].coeff_w);
-                    if (z->spec_start == 0) {
-                        if (!stbi__jpeg_decode_block_prog_dc(z, data, &z->huff_dc[z->img_comp[n].hd], n))
-                            return 0;
-                    } else {
-                        int ha = z->img_comp[n].ha;
-                        if (!stbi__jpeg_decode_block_prog_ac(z, data, &z->huff_ac[ha], z->fast_ac[ha]))
-                            return 0;
+                    int b = i + j * z->img_comp[n].coeff_w;
+                    if (!z->crop || stbi__jpeg_crop_unit(z, j*w + i, w)) {
+                        if (z->spec_start == 0) {
+                            if (!stbi__jpeg_decode_block_prog_dc(z, z->img_comp[n].coeff_dc + b, z->img_comp[n].coeff_mask + b, &z->huff_dc[z->img_comp[n].hd], z->fast_dc[z->img_comp[n].hd], n))
+                                return 0;
+                        } else {
+                            int ha = z->img_comp[n].ha;
+                            if (!stbi__jpeg_decode_block_prog_ac(z, z->img_comp[n].coeff + 64 * b, z->img_comp[n].coeff_mask + b, &z->huff_ac[ha], z->fast_ac[ha], z->fast_ac_ref[ha]))
+                                return 0;
+                        }
                     }
                     // every data block is an MCU, so countdown the restart interval
                     if (--z->todo <= 0) {
@@ -2777,19 +5800,25 @@ static int stbi__parse_entropy_coded_data(stbi__jpeg *z)
         } else { // interleaved
             int i,j,k,x,y;
             for (j=0; j < z->img_mcu_y; ++j) {
+                if (j >= z->mcu_y1) {
+                    stbi__jpeg_skip_to_marker(z, 0);
+                    return 1;
+                }
                 for (i=0; i < z->img_mcu_x; ++i) {
                     // scan an interleaved mcu... process scan_n components in order
-                    for (k=0; k < z->scan_n; ++k) {
-                        int n = z->order[k];
-                        // scan out an mcu's worth of this component; that's just determined
-                        // by the basic H and V specified for the component
-                        for (y=0; y < z->img_comp[n].v; ++y) {
-                            for (x=0; x < z->img_comp[n].h; ++x) {
-                                int x2 = (i*z->img_comp[n].h + x);
-                                int y2 = (j*z->img_comp[n].v + y);
-                                short *data = z->img_comp[n].coeff + 64 * (x2 + y2 * z->img_comp[n].coeff_w);
-                                if (!stbi__jpeg_decode_block_prog_dc(z, data, &z->huff_dc[z->img_comp[n].hd], n))
-                                    return 0;
+                    if (!z->crop || stbi__jpeg_crop_unit(z, j*z->img_mcu_x + i, z->img_mcu_x)) {
+                        for (k=0; k < z->scan_n; ++k) {
+                            int n = z->order[k];
+                            // scan out an mcu's worth of this component; that's just determined
+                            // by the basic H and V specified for the component
+                            for (y=0; y < z->img_comp[n].v; ++y) {
+                                for (x=0; x < z->img_comp[n].h; ++x) {
+                                    int x2 = (i*z->img_comp[n].h + x);
+                                    int y2 = (j*z->img_comp[n].v + y);
+                                    int b = x2 + y2 * z->img_comp[n].coeff_w;
+                                    if (!stbi__jpeg_decode_block_prog_dc(z, z->img_comp[n].coeff_dc + b, z->img_comp[n].coeff_mask + b, &z->huff_dc[z->img_comp[n].hd], z->fast_dc[z->img_comp[n].hd], n))
+                                        return 0;
+                                }
                             }
                         }
                     }
@@ -2807,26 +5836,43 @@ static int stbi__parse_entropy_coded_data(stbi__jpeg *z)
     }
 }
 
-static void stbi__jpeg_dequantize(short *data, stbi__uint16 *dequant)
-{
-    int i;
-    for (i=0; i < 64; ++i)
-        data[i] *= dequant[i];
-}
-
 static void stbi__jpeg_finish(stbi__jpeg *z)
 {
     if (z->progressive) {
         // dequantize and idct the data
-        int i,j,n;
+        int i,j,k,n;
+        STBI_SIMD_ALIGN(short, tmp[64]);
         for (n=0; n < z->s->img_n; ++n) {
             int w = (z->img_comp[n].x+7) >> 3;
             int h = (z->img_comp[n].y+7) >> 3;
-            for (j=0; j < h; ++j) {
-                for (i=0; i < w; ++i) {
-                    short *data = z->img_comp[n].coeff + 64 * (i + j * z->img_comp[n].coeff_w);
-                    stbi__jpeg_dequantize(data, z->dequant[z->img_comp[n].tq]);
-                    z->idct_block_kernel(z->img_comp[n].data+z->img_comp[n].w2*j*8+i*8, z->img_comp[n].w2, data);
+            int bs = z->img_comp[n].bs;
+            stbi__uint16 *dq = z->dequant[z->img_comp[n].tq];
+            // only the blocks in the cropped window
+            int x0 = z->mcu_x0 * z->img_comp[n].h, y0 = z->mcu_y0 * z->img_comp[n].v;
+            if (w > z->mcu_x1 * z->img_comp[n].h) w = z->mcu_x1 * z->img_comp[n].h;
+            if (h > z->mcu_y1 * z->img_comp[n].v) h = z->mcu_y1 * z->img_comp[n].v;
+            for (j=y0; j < h; ++j) {
+                for (i=x0; i < w; ++i) {
+                    int b = i + j * z->img_comp[n].coeff_w;
+                    stbi__uint64 m = z->img_comp[n].coeff_mask[b];
+                    stbi_uc *out = z->img_comp[n].data+(z->img_comp[n].w2*(j-y0)+i-x0)*bs;
+                    short dc = (short) ((m & 1) ? z->img_comp[n].coeff_dc[b] * dq[0] : 0);
+                    if ((m >> 1) == 0 && bs == 8) {
+                        // dc only, as in most blocks of a smooth image: the
+                        // full-size idct comes out flat
+                        stbi_uc v = stbi__clamp(((dc + 4) >> 3) + 128);
+                        for (k=0; k < 8; ++k)
+                            memset(out + k*z->img_comp[n].w2, v, 8);
+                    } else {
+                        short *data = z->img_comp[n].coeff + 64 * b;
+                        memset(tmp, 0, sizeof(tmp));
+                        tmp[0] = dc;
+                        for (m >>= 1; m; m &= m - 1) {
+                            int zig = stbi__jpeg_dezigzag[stbi__ctz64(m) + 1];
+                            tmp[zig] = (short) (data[zig] * dq[zig]);
+                        }
+                        z->img_comp[n].idct_kernel(out, z->img_comp[n].w2, tmp);
+                    }
                 }
             }
         }
@@ -2883,8 +5929,12 @@ static int stbi__process_marker(stbi__jpeg *z, int m)
                 }
                 for (i=0; i < n; ++i)
                     v[i] = stbi__get8(z->s);
-                if (tc != 0)
+                if (tc == 0) {
+                    stbi__build_fast_dc(z->fast_dc[th], z->huff_dc + th);
+                } else {
                     stbi__build_fast_ac(z->fast_ac[th], z->huff_ac + th);
+                    stbi__build_fast_ac_refine(z->fast_ac_ref[th], z->huff_ac + th);
+                }
                 L -= n;
             }
             return L==0;
@@ -2980,17 +6030,22 @@ static int stbi__free_jpeg_components(stbi__jpeg *z, int ncomp, int why)
     int i;
     for (i=0; i < ncomp; ++i) {
         if (z->img_comp[i].raw_data) {
-            STBI_FREE(z->img_comp[i].raw_data);
+            stbi__scratch_free(z->s->alloc, z->img_comp[i].raw_data);
             z->img_comp[i].raw_data = NULL;
             z->img_comp[i].data = NULL;
         }
         if (z->img_comp[i].raw_coeff) {
-            STBI_FREE(z->img_comp[i].raw_coeff);
+            stbi__scratch_free(z->s->alloc, z->img_comp[i].raw_coeff);
             z->img_comp[i].raw_coeff = 0;
             z->img_comp[i].coeff = 0;
         }
+        if (z->img_comp[i].coeff_mask) {
+            stbi__scratch_free(z->s->alloc, z->img_comp[i].coeff_mask);
+            z->img_comp[i].coeff_mask = NULL;
+            z->img_comp[i].coeff_dc = NULL;
+        }
         if (z->img_comp[i].linebuf) {
-            STBI_FREE(z->img_comp[i].linebuf);
+            stbi__scratch_free(z->s->alloc, z->img_comp[i].linebuf);
             z->img_comp[i].linebuf = NULL;
         }
     }
@@ -3045,10 +6100,47 @@ static int stbi__process_frame_header(stbi__jpeg *z, int scan)
     z->img_mcu_x = (s->img_x + z->img_mcu_w-1) / z->img_mcu_w;
     z->img_mcu_y = (s->img_y + z->img_mcu_h-1) / z->img_mcu_h;
     
+    z->scale = s->scale_denom;
+    z->crop = 0;
+    z->mcu_x0 = z->mcu_y0 = 0;
+    z->mcu_x1 = z->img_mcu_x;
+    z->mcu_y1 = z->img_mcu_y;
+    z->crop_x = z->crop_y = 0;
+    z->crop_w = (s->img_x + z->scale-1) / z->scale;
+    z->crop_h = (s->img_y + z->scale-1) / z->scale;
+    if (s->roi_w) {
+        // the MCUs covering the region, plus one more all round if there's
+        // upsampling to do, since that looks at neighbouring samples
+        int x0,y0,x1,y1, mw = z->img_mcu_w / z->scale, mh = z->img_mcu_h / z->scale, m = h_max > 1 || v_max > 1;
+        if (!stbi__clip_roi(s, z->crop_w, z->crop_h, &x0, &y0, &x1, &y1)) return stbi__err("bad region", "Region is outside the image");
+        z->mcu_x0 = x0 / mw - m;       if (z->mcu_x0 < 0) z->mcu_x0 = 0;
+        z->mcu_y0 = y0 / mh - m;       if (z->mcu_y0 < 0) z->mcu_y0 = 0;
+        z->mcu_x1 = (x1-1) / mw + 1+m; if (z->mcu_x1 > z->img_mcu_x) z->mcu_x1 = z->img_mcu_x;
+        z->mcu_y1 = (y1-1) / mh + 1+m; if (z->mcu_y1 > z->img_mcu_y) z->mcu_y1 = z->img_mcu_y;
+        z->crop = 1;
+        z->crop_x = x0 - z->mcu_x0 * mw;
+        z->crop_y = y0 - z->mcu_y0 * mh;
+        z->crop_w = x1 - x0;
+        z->crop_h = y1 - y0;
+    }
     for (i=0; i < s->img_n; ++i) {
         // number of effective pixels (e.g. for non-interleaved MCU)
         z->img_comp[i].x = (s->img_x * z->img_comp[i].h + h_max-1) / h_max;
         z->img_comp[i].y = (s->img_y * z->img_comp[i].v + v_max-1) / v_max;
+        // when scaling down, each block becomes 8/scale pixels square. a
+        // subsampled component whose subsampling is no more than the scale
+        // gets a bigger IDCT instead, which lands it at the full output
+        // resolution so it needs no upsampling
+        q = h_max / z->img_comp[i].h;
+        z->img_comp[i].bs = 8 / z->scale;
+        if (q <= z->scale && q * z->img_comp[i].h == h_max && q * z->img_comp[i].v == v_max)
+            z->img_comp[i].bs *= q;
+        switch (z->img_comp[i].bs) {
+            case 1:  z->img_comp[i].idct_kernel = stbi__idct_1x1; break;
+            case 2:  z->img_comp[i].idct_kernel = stbi__idct_2x2; break;
+            case 4:  z->img_comp[i].idct_kernel = stbi__idct_4x4; break;
+            default: z->img_comp[i].idct_kernel = z->idct_block_kernel; break;
+        }
         // to simplify generation, we'll allocate enough memory to decode
         // the bogus oversized data from using interleaved MCUs and their
         // big blocks (e.g. a 16x16 iMCU on an image of width 33); we won't
@@ -3056,24 +6148,30 @@ static int stbi__process_frame_header(stbi__jpeg *z, int scan)
         //
         // img_mcu_x, img_mcu_y: <=17 bits; comp[i].h and .v are <=4 (checked earlier)
         // so these muls can't overflow with 32-bit ints (which we require)
-        z->img_comp[i].w2 = z->img_mcu_x * z->img_comp[i].h * 8;
-        z->img_comp[i].h2 = z->img_mcu_y * z->img_comp[i].v * 8;
+        z->img_comp[i].w2 = (z->mcu_x1 - z->mcu_x0) * z->img_comp[i].h * z->img_comp[i].bs;
+        z->img_comp[i].h2 = (z->mcu_y1 - z->mcu_y0) * z->img_comp[i].v * z->img_comp[i].bs;
+        if (z->stream_mcu_rows && z->stream_mcu_rows < z->img_mcu_y && !z->progressive)
+            z->img_comp[i].h2 = z->stream_mcu_rows * z->img_comp[i].v * z->img_comp[i].bs;
         z->img_comp[i].coeff = 0;
         z->img_comp[i].raw_coeff = 0;
+        z->img_comp[i].coeff_mask = NULL;
         z->img_comp[i].linebuf = NULL;
-        z->img_comp[i].raw_data = stbi__malloc_mad2(z->img_comp[i].w2, z->img_comp[i].h2, 15);
+        z->img_comp[i].raw_data = stbi__scratch_malloc_mad2(z->s->alloc, z->img_comp[i].w2, z->img_comp[i].h2, 15);
         if (z->img_comp[i].raw_data == NULL)
             return stbi__free_jpeg_components(z, i+1, stbi__err("outofmem", "Out of memory"));
         // align blocks for idct using mmx/sse
         z->img_comp[i].data = (stbi_uc*) (((size_t) z->img_comp[i].raw_data + 15) & ~15);
         if (z->progressive) {
-            // w2, h2 are multiples of 8 (see above)
-            z->img_comp[i].coeff_w = z->img_comp[i].w2 / 8;
-            z->img_comp[i].coeff_h = z->img_comp[i].h2 / 8;
-            z->img_comp[i].raw_coeff = stbi__malloc_mad3(z->img_comp[i].w2, z->img_comp[i].h2, sizeof(short), 15);
-            if (z->img_comp[i].raw_coeff == NULL)
+            // one set of coefficients per block, whatever size it's decoded at
+            z->img_comp[i].coeff_w = z->img_mcu_x * z->img_comp[i].h;
+            z->img_comp[i].coeff_h = z->img_mcu_y * z->img_comp[i].v;
+            // each block's mask, then its dc; the coefficients themselves
+            // are only valid where the mask says so
+            z->img_comp[i].coeff_mask = (stbi__uint64 *) stbi__scratch_malloc_mad3(z->s->alloc, z->img_comp[i].coeff_w, z->img_comp[i].coeff_h, sizeof(stbi__uint64) + sizeof(short), 0);
+            if (z->img_comp[i].coeff_mask == NULL)
                 return stbi__free_jpeg_components(z, i+1, stbi__err("outofmem", "Out of memory"));
-            z->img_comp[i].coeff = (short*) (((size_t) z->img_comp[i].raw_coeff + 15) & ~15);
+            memset(z->img_comp[i].coeff_mask, 0, (size_t) z->img_comp[i].coeff_w * z->img_comp[i].coeff_h * sizeof(stbi__uint64));
+            z->img_comp[i].coeff_dc = (short *) (z->img_comp[i].coeff_mask + z->img_comp[i].coeff_w * z->img_comp[i].coeff_h);
         }
     }
     
@@ -3116,18 +6214,30 @@ static int stbi__decode_jpeg_header(stbi__jpeg *z, int scan)
 // decode image to YCbCr format
 static int stbi__decode_jpeg_image(stbi__jpeg *j)
 {
-    int m;
+    int m, k, r, scans = 0;
+    STBI__PROF_VAR(t)
     for (m = 0; m < 4; m++) {
         j->img_comp[m].raw_data = NULL;
         j->img_comp[m].raw_coeff = NULL;
+        j->img_comp[m].coeff_mask = NULL;
     }
     j->restart_interval = 0;
+    j->dc_seen = 0;
     if (!stbi__decode_jpeg_header(j, STBI__SCAN_load)) return 0;
     m = stbi__get_marker(j);
     while (!stbi__EOI(m)) {
         if (stbi__SOS(m)) {
             if (!stbi__process_scan_header(j)) return 0;
-            if (!stbi__parse_entropy_coded_data(j)) return 0;
+            STBI__PROF_START(t);
+            r = stbi__parse_entropy_coded_data(j);
+            STBI__PROF_END(STBI_stage_jpeg_entropy, t);
+            if (!r) return 0;
+            ++scans;
+            if (j->progressive && j->spec_start == 0 && j->succ_high == 0)
+                for (k=0; k < j->scan_n; ++k)
+                    j->dc_seen |= 1 << j->order[k];
+            if (j->s->preview && j->dc_seen == (1 << j->s->img_n) - 1)
+                break; // that's all a preview uses
             if (j->marker == STBI__MARKER_none ) {
                 // handle 0s at the end of image data from IP Kamera 9060
                 while (!stbi__at_eof(j->s)) {
@@ -3148,9 +6258,33 @@ static int stbi__decode_jpeg_image(stbi__jpeg *j)
             if (!stbi__process_marker(j, m)) return 0;
         }
         m = stbi__get_marker(j);
+        if (m == STBI__MARKER_none && j->s->preview && scans && stbi__at_eof(j->s))
+            break; // a file cut short, which a preview makes do with
     }
-    if (j->progressive)
+    if (j->progressive) {
+        STBI__PROF_START(t);
         stbi__jpeg_finish(j);
+        STBI__PROF_END(STBI_stage_jpeg_idct, t);
+    }
+    if (j->scale > 1 || j->crop) {
+        // from here on, sizes are those of the scaled-down, cropped planes
+        int x, y, w = j->img_mcu_w / j->scale, h = j->img_mcu_h / j->scale;
+        for (m=0; m < j->s->img_n; ++m) {
+            int cw = j->img_comp[m].h * j->img_comp[m].bs, ch = j->img_comp[m].v * j->img_comp[m].bs;
+            x = (j->img_comp[m].x * j->img_comp[m].bs + 7) >> 3;
+            y = (j->img_comp[m].y * j->img_comp[m].bs + 7) >> 3;
+            if (x > j->mcu_x1 * cw) x = j->mcu_x1 * cw;
+            if (y > j->mcu_y1 * ch) y = j->mcu_y1 * ch;
+            j->img_comp[m].x = x - j->mcu_x0 * cw;
+            j->img_comp[m].y = y - j->mcu_y0 * ch;
+        }
+        x = (j->s->img_x + j->scale-1) / j->scale;
+        y = (j->s->img_y + j->scale-1) / j->scale;
+        if (x > j->mcu_x1 * w) x = j->mcu_x1 * w;
+        if (y > j->mcu_y1 * h) y = j->mcu_y1 * h;
+        j->s->img_x = x - j->mcu_x0 * w;
+        j->s->img_y = y - j->mcu_y0 * h;
+    }
     return 1;
 }
 
@@ -3351,6 +6485,74 @@ static stbi_uc *stbi__resample_row_hv_2_simd(stbi_uc *out, stbi_uc *in_near, stb
 }
 #endif
 
+#ifdef STBI_AVX2
+// same filter as stbi__resample_row_hv_2_simd, 16 input pixels at a time
+static STBI__AVX2_TARGET stbi_uc *stbi__resample_row_hv_2_avx2(stbi_uc *out, stbi_uc *in_near, stbi_uc *in_far, int w, int hs)
+{
+    int i=0,t0,t1;
+    
+    if (w == 1) {
+        out[0] = out[1] = stbi__div4(3*in_near[0] + in_far[0] + 2);
+        return out;
+    }
+    
+    t1 = 3*in_near[0] + in_far[0];
+    for (; i < ((w-1) & ~15); i += 16) {
+        // vertical pass, 3*x + y = 4*x + (y - x)
+        __m256i farw  = _mm256_cvtepu8_epi16(_mm_loadu_si128((__m128i *) (in_far + i)));
+        __m256i nearw = _mm256_cvtepu8_epi16(_mm_loadu_si128((__m128i *) (in_near + i)));
+        __m256i diff  = _mm256_sub_epi16(farw, nearw);
+        __m256i nears = _mm256_slli_epi16(nearw, 2);
+        __m256i curr  = _mm256_add_epi16(nears, diff); // current row
+        
+        // "prev" is curr shifted right by 1 pixel with t1 shifted in, "next" is
+        // curr shifted left by 1 pixel with the first pixel of the next group
+        // shifted in. both have to cross the 128-bit lane boundary.
+        __m256i prv0 = _mm256_alignr_epi8(curr, _mm256_permute2x128_si256(curr, curr, 0x08), 14);
+        __m256i nxt0 = _mm256_alignr_epi8(_mm256_permute2x128_si256(curr, curr, 0x81), curr, 2);
+        __m256i prev = _mm256_insert_epi16(prv0, t1, 0);
+        __m256i next = _mm256_insert_epi16(nxt0, 3*in_near[i+16] + in_far[i+16], 15);
+        
+        // horizontal pass, even = cur*4 + (prev - cur), odd = cur*4 + (next - cur)
+        __m256i bias = _mm256_set1_epi16(8);
+        __m256i curs = _mm256_slli_epi16(curr, 2);
+        __m256i prvd = _mm256_sub_epi16(prev, curr);
+        __m256i nxtd = _mm256_sub_epi16(next, curr);
+        __m256i curb = _mm256_add_epi16(curs, bias);
+        __m256i even = _mm256_add_epi16(prvd, curb);
+        __m256i odd  = _mm256_add_epi16(nxtd, curb);
+        
+        // interleave even and odd pixels, then undo scaling; the in-lane
+        // unpack and pack leave the 32 output pixels in order
+        __m256i int0 = _mm256_unpacklo_epi16(even, odd);
+        __m256i int1 = _mm256_unpackhi_epi16(even, odd);
+        __m256i de0  = _mm256_srli_epi16(int0, 4);
+        __m256i de1  = _mm256_srli_epi16(int1, 4);
+        __m256i outv = _mm256_packus_epi16(de0, de1);
+        _mm256_storeu_si256((__m256i *) (out + i*2), outv);
+        
+        // "previous" value for next iter
+        t1 = 3*in_near[i+15] + in_far[i+15];
+    }
+    
+    t0 = t1;
+    t1 = 3*in_near[i] + in_far[i];
+    out[i*2] = stbi__div16(3*t1 + t0 + 8);
+    
+    for (++i; i < w; ++i) {
+        t0 = t1;
+        t1 = 3*in_near[i]+in_far[i];
+        out[i*2-1] = stbi__div16(3*t0 + t1 + 8);
+        out[i*2  ] = stbi__div16(3*t1 + t0 + 8);
+    }
+    out[w*2-1] = stbi__div4(t1+2);
+    
+    STBI_NOTUSED(hs);
+    
+    return out;
+}
+#endif
+
 static stbi_uc *stbi__resample_row_generic(stbi_uc *out, stbi_uc *in_near, stbi_uc *in_far, int w, int hs)
 {
     // resample with nearest-neighbor
@@ -3525,10 +6727,77 @@ static void stbi__YCbCr_to_RGB_simd(stbi_uc *out, stbi_uc const *y, stbi_uc cons
 }
 #endif
 
+#ifdef STBI_AVX2
+// stbi__YCbCr_to_RGB_simd 16 pixels at a time; same arithmetic, same results
+static STBI__AVX2_TARGET void stbi__YCbCr_to_RGB_avx2(stbi_uc *out, stbi_uc const *y, stbi_uc const *pcb, stbi_uc const *pcr, int count, int step)
+{
+    int i = 0;
+    
+    if (step == 4) {
+        __m128i signflip  = _mm_set1_epi8(-0x80);
+        __m256i cr_const0 = _mm256_set1_epi16(   (short) ( 1.40200f*4096.0f+0.5f));
+        __m256i cr_const1 = _mm256_set1_epi16( - (short) ( 0.71414f*4096.0f+0.5f));
+        __m256i cb_const0 = _mm256_set1_epi16( - (short) ( 0.34414f*4096.0f+0.5f));
+        __m256i cb_const1 = _mm256_set1_epi16(   (short) ( 1.77200f*4096.0f+0.5f));
+        __m256i y_bias = _mm256_set1_epi16(128);
+        __m256i xw = _mm256_set1_epi16(255); // alpha channel
+        
+        for (; i+15 < count; i += 16) {
+            // load
+            __m128i y_bytes = _mm_loadu_si128((__m128i *) (y+i));
+            __m128i cr_biased = _mm_xor_si128(_mm_loadu_si128((__m128i *) (pcr+i)), signflip); // -128
+            __m128i cb_biased = _mm_xor_si128(_mm_loadu_si128((__m128i *) (pcb+i)), signflip); // -128
+            
+            // widen to short: y to y*256+128, cr and cb left-shifted by 8
+            __m256i yw  = _mm256_or_si256(_mm256_slli_epi16(_mm256_cvtepu8_epi16(y_bytes), 8), y_bias);
+            __m256i crw = _mm256_slli_epi16(_mm256_cvtepu8_epi16(cr_biased), 8);
+            __m256i cbw = _mm256_slli_epi16(_mm256_cvtepu8_epi16(cb_biased), 8);
+            
+            // color transform
+            __m256i yws = _mm256_srli_epi16(yw, 4);
+            __m256i cr0 = _mm256_mulhi_epi16(cr_const0, crw);
+            __m256i cb0 = _mm256_mulhi_epi16(cb_const0, cbw);
+            __m256i cb1 = _mm256_mulhi_epi16(cbw, cb_const1);
+            __m256i cr1 = _mm256_mulhi_epi16(crw, cr_const1);
+            __m256i rws = _mm256_add_epi16(cr0, yws);
+            __m256i gwt = _mm256_add_epi16(cb0, yws);
+            __m256i bws = _mm256_add_epi16(yws, cb1);
+            __m256i gws = _mm256_add_epi16(gwt, cr1);
+            
+            // descale
+            __m256i rw = _mm256_srai_epi16(rws, 4);
+            __m256i bw = _mm256_srai_epi16(bws, 4);
+            __m256i gw = _mm256_srai_epi16(gws, 4);
+            
+            // back to byte, set up for transpose
+            __m256i brb = _mm256_packus_epi16(rw, bw);
+            __m256i gxb = _mm256_packus_epi16(gw, xw);
+            
+            // transpose to interleave channels; low lane has pixels 0-7,
+            // high lane pixels 8-15
+            __m256i t0 = _mm256_unpacklo_epi8(brb, gxb);
+            __m256i t1 = _mm256_unpackhi_epi8(brb, gxb);
+            __m256i o0 = _mm256_unpacklo_epi16(t0, t1);
+            __m256i o1 = _mm256_unpackhi_epi16(t0, t1);
+            
+            // store
+            _mm256_storeu_si256((__m256i *) (out + 0), _mm256_permute2x128_si256(o0, o1, 0x20));
+            _mm256_storeu_si256((__m256i *) (out + 32), _mm256_permute2x128_si256(o0, o1, 0x31));
+            out += 64;
+        }
+    }
+    
+    // leftovers, and step != 4
+    stbi__YCbCr_to_RGB_simd(out, y+i, pcb+i, pcr+i, count-i, step);
+}
+#endif
+
 // set up the kernels
 static void stbi__setup_jpeg(stbi__jpeg *j)
 {
     j->idct_block_kernel = stbi__idct_block;
+    j->idct_block2_kernel = NULL;
+    j->stream_mcu_rows = 0;
     j->YCbCr_to_RGB_kernel = stbi__YCbCr_to_RGB_row;
     j->resample_row_hv_2_kernel = stbi__resample_row_hv_2;
     
@@ -3540,6 +6809,14 @@ static void stbi__setup_jpeg(stbi__jpeg *j)
     }
 #endif
     
+#ifdef STBI_AVX2
+    if (stbi__avx2_available()) {
+        j->idct_block2_kernel = stbi__idct2_avx2;
+        j->YCbCr_to_RGB_kernel = stbi__YCbCr_to_RGB_avx2;
+        j->resample_row_hv_2_kernel = stbi__resample_row_hv_2_avx2;
+    }
+#endif
+    
 #ifdef STBI_NEON
     j->idct_block_kernel = stbi__idct_simd;
     j->YCbCr_to_RGB_kernel = stbi__YCbCr_to_RGB_simd;
@@ -3570,7 +6847,161 @@ static stbi_uc stbi__blinn_8x8(stbi_uc x, stbi_uc y)
     return (stbi_uc) ((t + (t >>8)) >> 8);
 }
 
-static stbi_uc *load_jpeg_image(stbi__jpeg *z, int *out_x, int *out_y, int *comp, int req_comp)
+// work out how many components to output and to decode, and whether the
+// source components are RGB rather than YCbCr
+static void stbi__jpeg_output_format(stbi__jpeg *z, int req_comp, int *n, int *decode_n, int *is_rgb)
+{
+    // determine actual number of components to generate
+    *n = req_comp ? req_comp : z->s->img_n >= 3 ? 3 : 1;
+    
+    *is_rgb = z->s->img_n == 3 && (z->rgb == 3 || (z->app14_color_transform == 0 && !z->jfif));
+    
+    if (z->s->img_n == 3 && *n < 3 && !*is_rgb)
+        *decode_n = 1;
+    else
+        *decode_n = z->s->img_n;
+}
+
+static int stbi__jpeg_setup_resample(stbi__jpeg *z, stbi__resample *res_comp, int decode_n)
+{
+    int k, f;
+    for (k=0; k < decode_n; ++k) {
+        stbi__resample *r = &res_comp[k];
+        
+        // allocate line buffer big enough for upsampling off the edges
+        // with upsample factor of 4
+        z->img_comp[k].linebuf = (stbi_uc *) stbi__scratch_malloc(z->s->alloc, z->s->img_x + 3);
+        if (!z->img_comp[k].linebuf) return stbi__err("outofmem", "Out of memory");
+        
+        // planes decoded with bigger blocks than the rest are upsampled already
+        f = z->img_comp[k].bs * z->scale / 8;
+        r->hs      = z->img_h_max / z->img_comp[k].h / f;
+        r->vs      = z->img_v_max / z->img_comp[k].v / f;
+        r->ystep   = r->vs >> 1;
+        r->w_lores = (z->s->img_x + r->hs-1) / r->hs;
+        r->ypos    = 0;
+        r->line0   = r->line1 = z->img_comp[k].data;
+        
+        if      (r->hs == 1 && r->vs == 1) r->resample = resample_row_1;
+        else if (r->hs == 1 && r->vs == 2) r->resample = stbi__resample_row_v_2;
+        else if (r->hs == 2 && r->vs == 1) r->resample = stbi__resample_row_h_2;
+        else if (r->hs == 2 && r->vs == 2) r->resample = z->resample_row_hv_2_kernel;
+        else                               r->resample = stbi__resample_row_generic;
+    }
+    return 1;
+}
+
+// resample and color-convert the next output row. 3-channel output stores a
+// junk 4th byte past the end of the row
+static void stbi__jpeg_convert_row(stbi__jpeg *z, stbi__resample *res_comp, int decode_n, int n, int is_rgb, stbi_uc *out)
+{
+    unsigned int i;
+    int k;
+    stbi_uc *coutput[4];
+    STBI__PROF_VAR(t)
+    STBI__PROF_START(t);
+    for (k=0; k < decode_n; ++k) {
+        stbi__resample *r = &res_comp[k];
+        int y_bot = r->ystep >= (r->vs >> 1);
+        coutput[k] = r->resample(z->img_comp[k].linebuf,
+                                 y_bot ? r->line1 : r->line0,
+                                 y_bot ? r->line0 : r->line1,
+                                 r->w_lores, r->hs);
+        if (++r->ystep >= r->vs) {
+            r->ystep = 0;
+            r->line0 = r->line1;
+            if (++r->ypos < z->img_comp[k].y) {
+                r->line1 += z->img_comp[k].w2;
+                // when streaming, the plane is a ring of MCU rows
+                if (r->line1 == z->img_comp[k].data + z->img_comp[k].w2 * z->img_comp[k].h2)
+                    r->line1 = z->img_comp[k].data;
+            }
+        }
+    }
+    STBI__PROF_END(STBI_stage_jpeg_upsample, t);
+    STBI__PROF_START(t);
+    if (n >= 3) {
+        stbi_uc *y = coutput[0];
+        if (z->s->img_n == 3) {
+            if (is_rgb) {
+                for (i=0; i < z->s->img_x; ++i) {
+                    out[0] = y[i];
+                    out[1] = coutput[1][i];
+                    out[2] = coutput[2][i];
+                    out[3] = 255;
+                    out += n;
+                }
+            } else {
+                z->YCbCr_to_RGB_kernel(out, y, coutput[1], coutput[2], z->s->img_x, n);
+            }
+        } else if (z->s->img_n == 4) {
+            if (z->app14_color_transform == 0) { // CMYK
+                for (i=0; i < z->s->img_x; ++i) {
+                    stbi_uc m = coutput[3][i];
+                    out[0] = stbi__blinn_8x8(coutput[0][i], m);
+                    out[1] = stbi__blinn_8x8(coutput[1][i], m);
+                    out[2] = stbi__blinn_8x8(coutput[2][i], m);
+                    out[3] = 255;
+                    out += n;
+                }
+            } else if (z->app14_color_transform == 2) { // YCCK
+                z->YCbCr_to_RGB_kernel(out, y, coutput[1], coutput[2], z->s->img_x, n);
+                for (i=0; i < z->s->img_x; ++i) {
+                    stbi_uc m = coutput[3][i];
+                    out[0] = stbi__blinn_8x8(255 - out[0], m);
+                    out[1] = stbi__blinn_8x8(255 - out[1], m);
+                    out[2] = stbi__blinn_8x8(255 - out[2], m);
+                    out += n;
+                }
+            } else { // YCbCr + alpha?  Ignore the fourth channel for now
+                z->YCbCr_to_RGB_kernel(out, y, coutput[1], coutput[2], z->s->img_x, n);
+            }
+        } else
+            for (i=0; i < z->s->img_x; ++i) {
+                out[0] = out[1] = out[2] = y[i];
+                out[3] = 255; // not used if n==3
+                out += n;
+            }
+    } else {
+        if (is_rgb) {
+            if (n == 1)
+                for (i=0; i < z->s->img_x; ++i)
+                    *out++ = stbi__compute_y(coutput[0][i], coutput[1][i], coutput[2][i]);
+            else {
+                for (i=0; i < z->s->img_x; ++i, out += 2) {
+                    out[0] = stbi__compute_y(coutput[0][i], coutput[1][i], coutput[2][i]);
+                    out[1] = 255;
+                }
+            }
+        } else if (z->s->img_n == 4 && z->app14_color_transform == 0) {
+            for (i=0; i < z->s->img_x; ++i) {
+                stbi_uc m = coutput[3][i];
+                stbi_uc r = stbi__blinn_8x8(coutput[0][i], m);
+                stbi_uc g = stbi__blinn_8x8(coutput[1][i], m);
+                stbi_uc b = stbi__blinn_8x8(coutput[2][i], m);
+                out[0] = stbi__compute_y(r, g, b);
+                if (n == 2) out[1] = 255;
+                out += n;
+            }
+        } else if (z->s->img_n == 4 && z->app14_color_transform == 2) {
+            for (i=0; i < z->s->img_x; ++i) {
+                out[0] = stbi__blinn_8x8(255 - coutput[0][i], coutput[3][i]);
+                if (n == 2) out[1] = 255;
+                out += n;
+            }
+        } else {
+            stbi_uc *y = coutput[0];
+            if (n == 1)
+                for (i=0; i < z->s->img_x; ++i) out[i] = y[i];
+            else
+                for (i=0; i < z->s->img_x; ++i) *out++ = y[i], *out++ = 255;
+        }
+    }
+    STBI__PROF_END(STBI_stage_jpeg_color, t);
+}
+
+// with wide set, the output is 16 bits per channel, widened a row at a time
+static stbi_uc *load_jpeg_image(stbi__jpeg *z, int *out_x, int *out_y, int *comp, int req_comp, int wide)
 {
     int n, decode_n, is_rgb;
     z->s->img_n = 0; // make stbi__cleanup_jpeg safe
@@ -3581,163 +7012,100 @@ static stbi_uc *load_jpeg_image(stbi__jpeg *z, int *out_x, int *out_y, int *comp
     // load a jpeg image from whichever source, but leave in YCbCr format
     if (!stbi__decode_jpeg_image(z)) { stbi__cleanup_jpeg(z); return NULL; }
     
-    // determine actual number of components to generate
-    n = req_comp ? req_comp : z->s->img_n >= 3 ? 3 : 1;
-    
-    is_rgb = z->s->img_n == 3 && (z->rgb == 3 || (z->app14_color_transform == 0 && !z->jfif));
-    
-    if (z->s->img_n == 3 && n < 3 && !is_rgb)
-        decode_n = 1;
-    else
-        decode_n = z->s->img_n;
+    stbi__jpeg_output_format(z, req_comp, &n, &decode_n, &is_rgb);
     
     // resample and color-convert
     {
-        int k;
-        unsigned int i,j;
+        int j;
         stbi_uc *output;
-        stbi_uc *coutput[4];
+        size_t stride = (size_t) n * z->crop_w * (wide ? 2 : 1);
+        stbi_uc *spill = NULL, *line = NULL;
+        int flip = 0;
         
         stbi__resample res_comp[4];
         
-        for (k=0; k < decode_n; ++k) {
-            stbi__resample *r = &res_comp[k];
-            
-            // allocate line buffer big enough for upsampling off the edges
-            // with upsample factor of 4
-            z->img_comp[k].linebuf = (stbi_uc *) stbi__malloc(z->s->img_x + 3);
-            if (!z->img_comp[k].linebuf) { stbi__cleanup_jpeg(z); return stbi__errpuc("outofmem", "Out of memory"); }
-            
-            r->hs      = z->img_h_max / z->img_comp[k].h;
-            r->vs      = z->img_v_max / z->img_comp[k].v;
-            r->ystep   = r->vs >> 1;
-            r->w_lores = (z->s->img_x + r->hs-1) / r->hs;
-            r->ypos    = 0;
-            r->line0   = r->line1 = z->img_comp[k].data;
-            
-            if      (r->hs == 1 && r->vs == 1) r->resample = resample_row_1;
-            else if (r->hs == 1 && r->vs == 2) r->resample = stbi__resample_row_v_2;
-            else if (r->hs == 2 && r->vs == 1) r->resample = stbi__resample_row_h_2;
-            else if (r->hs == 2 && r->vs == 2) r->resample = z->resample_row_hv_2_kernel;
-            else                               r->resample = stbi__resample_row_generic;
+        if (z->s->into) {
+            if (!stbi__into_fits(z->s, z->crop_w, z->crop_h, n)) { stbi__cleanup_jpeg(z); return stbi__errpuc("buffer too small", "Output buffer too small"); }
+            stride = z->s->into_stride;
+            flip = z->s->flip;
+        }
+        
+        if (!stbi__jpeg_setup_resample(z, res_comp, decode_n)) { stbi__cleanup_jpeg(z); return NULL; }
+        
+        if (z->crop || wide) {
+            // convert whole rows of the window and copy out (or widen) the region
+            line = (stbi_uc *) stbi__scratch_malloc(z->s->alloc, n * z->s->img_x + 1);
+            if (!line) { stbi__cleanup_jpeg(z); return stbi__errpuc("outofmem", "Out of memory"); }
+        } else if (z->s->into && n == 3) {
+            spill = (stbi_uc *) stbi__scratch_malloc(z->s->alloc, 3 * z->s->img_x + 1);
+            if (!spill) { stbi__cleanup_jpeg(z); return stbi__errpuc("outofmem", "Out of memory"); }
         }
         
         // can't error after this so, this is safe
-        output = (stbi_uc *) stbi__malloc_mad3(n, z->s->img_x, z->s->img_y, 1);
-        if (!output) { stbi__cleanup_jpeg(z); return stbi__errpuc("outofmem", "Out of memory"); }
+        if (z->s->into)
+            output = z->s->into;
+        else
+            output = (stbi_uc *) stbi__malloc_mad3(n * (wide ? 2 : 1), z->crop_w, z->crop_h, 1);
+        if (!output) {
+            stbi__scratch_free(z->s->alloc, line);
+            stbi__scratch_free(z->s->alloc, spill);
+            stbi__cleanup_jpeg(z);
+            return stbi__errpuc("outofmem", "Out of memory");
+        }
         
         // now go ahead and resample
-        for (j=0; j < z->s->img_y; ++j) {
-            stbi_uc *out = output + n * z->s->img_x * j;
-            for (k=0; k < decode_n; ++k) {
-                stbi__resample *r = &res_comp[k];
-                int y_bot = r->ystep >= (r->vs >> 1);
-                coutput[k] = r->resample(z->img_comp[k].linebuf,
-                                         y_bot ? r->line1 : r->line0,
-                                         y_bot ? r->line0 : r->line1,
-                                         r->w_lores, r->hs);
-                if (++r->ystep >= r->vs) {
-                    r->ystep = 0;
-                    r->line0 = r->line1;
-                    if (++r->ypos < z->img_comp[k].y)
-                        r->line1 += z->img_comp[k].w2;
-                }
+        for (j=0; j < z->crop_y + z->crop_h; ++j) {
+            stbi_uc *row, *out;
+            if (j < z->crop_y) {
+                // above the region, but the upsampler needs to see it go by
+                stbi__jpeg_convert_row(z, res_comp, decode_n, n, is_rgb, line);
+                continue;
             }
-            if (n >= 3) {
-                stbi_uc *y = coutput[0];
-                if (z->s->img_n == 3) {
-                    if (is_rgb) {
-                        for (i=0; i < z->s->img_x; ++i) {
-                            out[0] = y[i];
-                            out[1] = coutput[1][i];
-                            out[2] = coutput[2][i];
-                            out[3] = 255;
-                            out += n;
-                        }
-                    } else {
-                        z->YCbCr_to_RGB_kernel(out, y, coutput[1], coutput[2], z->s->img_x, n);
-                    }
-                } else if (z->s->img_n == 4) {
-                    if (z->app14_color_transform == 0) { // CMYK
-                        for (i=0; i < z->s->img_x; ++i) {
-                            stbi_uc m = coutput[3][i];
-                            out[0] = stbi__blinn_8x8(coutput[0][i], m);
-                            out[1] = stbi__blinn_8x8(coutput[1][i], m);
-                            out[2] = stbi__blinn_8x8(coutput[2][i], m);
-                            out[3] = 255;
-                            out += n;
-                        }
-                    } else if (z->app14_color_transform == 2) { // YCCK
-                        z->YCbCr_to_RGB_kernel(out, y, coutput[1], coutput[2], z->s->img_x, n);
-                        for (i=0; i < z->s->img_x; ++i) {
-                            stbi_uc m = coutput[3][i];
-                            out[0] = stbi__blinn_8x8(255 - out[0], m);
-                            out[1] = stbi__blinn_8x8(255 - out[1], m);
-                            out[2] = stbi__blinn_8x8(255 - out[2], m);
-                            out += n;
-                        }
-                    } else { // YCbCr + alpha?  Ignore the fourth channel for now
-                        z->YCbCr_to_RGB_kernel(out, y, coutput[1], coutput[2], z->s->img_x, n);
-                    }
-                } else
-                    for (i=0; i < z->s->img_x; ++i) {
-                        out[0] = out[1] = out[2] = y[i];
-                        out[3] = 255; // not used if n==3
-                        out += n;
-                    }
-            } else {
-                if (is_rgb) {
-                    if (n == 1)
-                        for (i=0; i < z->s->img_x; ++i)
-                            *out++ = stbi__compute_y(coutput[0][i], coutput[1][i], coutput[2][i]);
-                    else {
-                        for (i=0; i < z->s->img_x; ++i, out += 2) {
-                            out[0] = stbi__compute_y(coutput[0][i], coutput[1][i], coutput[2][i]);
-                            out[1] = 255;
-                        }
-                    }
-                } else if (z->s->img_n == 4 && z->app14_color_transform == 0) {
-                    for (i=0; i < z->s->img_x; ++i) {
-                        stbi_uc m = coutput[3][i];
-                        stbi_uc r = stbi__blinn_8x8(coutput[0][i], m);
-                        stbi_uc g = stbi__blinn_8x8(coutput[1][i], m);
-                        stbi_uc b = stbi__blinn_8x8(coutput[2][i], m);
-                        out[0] = stbi__compute_y(r, g, b);
-                        out[1] = 255;
-                        out += n;
-                    }
-                } else if (z->s->img_n == 4 && z->app14_color_transform == 2) {
-                    for (i=0; i < z->s->img_x; ++i) {
-                        out[0] = stbi__blinn_8x8(255 - coutput[0][i], coutput[3][i]);
-                        out[1] = 255;
-                        out += n;
-                    }
-                } else {
-                    stbi_uc *y = coutput[0];
-                    if (n == 1)
-                        for (i=0; i < z->s->img_x; ++i) out[i] = y[i];
-                    else
-                        for (i=0; i < z->s->img_x; ++i) *out++ = y[i], *out++ = 255;
-                }
+            row = output + stride * (flip ? z->crop_h-1 - (j - z->crop_y) : j - z->crop_y);
+            out = line ? line : row;
+            if (spill) {
+                // 3-channel rows get a junk 4th byte stored past their end. in the
+                // caller's buffer that's only harmless where the next row, still to
+                // be written, starts right there: packed and top-down, and not the
+                // last row. any other row is converted via the spill row, since the
+                // byte would land on a finished row, the caller's padding (another
+                // image, in an atlas) or past the end
+                size_t junk = (size_t) (row - output) + 3 * z->s->img_x;
+                if (flip || stride != 3 * z->s->img_x || junk >= z->s->into_size)
+                    out = spill;
             }
+            stbi__jpeg_convert_row(z, res_comp, decode_n, n, is_rgb, out);
+            if (out == spill)
+                memcpy(row, spill, 3 * z->s->img_x);
+            else if (wide)
+                stbi__widen_8_to_16((stbi__uint16 *) row, line + n * z->crop_x, (size_t) n * z->crop_w);
+            else if (out == line)
+                memcpy(row, line + n * z->crop_x, (size_t) n * z->crop_w);
         }
+        stbi__scratch_free(z->s->alloc, line);
+        stbi__scratch_free(z->s->alloc, spill);
         stbi__cleanup_jpeg(z);
-        *out_x = z->s->img_x;
-        *out_y = z->s->img_y;
+        *out_x = z->crop_w;
+        *out_y = z->crop_h;
         if (comp) *comp = z->s->img_n >= 3 ? 3 : 1; // report original components, not output
         return output;
     }
 }
 
-static void *stbi__jpeg_load(stbi__context *s, int *x, int *y, int *comp, int req_comp, stbi__result_info *ri)
+static void *stbi__jpeg_load(stbi__context *s, int *x, int *y, int *comp, int req_comp, stbi__result_info *ri, int bpc)
 {
     unsigned char* result;
-    stbi__jpeg* j = (stbi__jpeg*) stbi__malloc(sizeof(stbi__jpeg));
-    STBI_NOTUSED(ri);
+    // callers that want 16 bits get them straight from the color converter,
+    // skipping a whole 8-bit image; stbi_load_into's buffer is always 8-bit
+    int wide = bpc == 16 && !s->into;
+    stbi__jpeg* j = (stbi__jpeg*) stbi__scratch_malloc(s->alloc, sizeof(stbi__jpeg));
+    if (!j) return stbi__errpuc("outofmem", "Out of memory");
+    ri->cropped = 1;
     j->s = s;
     stbi__setup_jpeg(j);
-    result = load_jpeg_image(j, x,y,comp,req_comp);
-    STBI_FREE(j);
+    result = load_jpeg_image(j, x,y,comp,req_comp, wide);
+    stbi__scratch_free(s->alloc, j);
+    if (result && wide) ri->bits_per_channel = 16;
     return result;
 }
 
@@ -3786,14 +7154,20 @@ static int stbi__jpeg_info(stbi__context *s, int *x, int *y, int *comp)
 #ifndef STBI_NO_ZLIB
 
 // fast-way is faster to check than jpeg huffman, but slow way is slower
-#define STBI__ZFAST_BITS  9 // accelerate all cases in default tables
+#define STBI__ZFAST_BITS  10 // accelerate all cases in default tables
 #define STBI__ZFAST_MASK  ((1 << STBI__ZFAST_BITS) - 1)
 
+// fast table entries are (size << 9) | value; in the literal/length table an
+// entry whose code is followed by a second literal that still fits in
+// STBI__ZFAST_BITS also carries that literal in bits 16..23 and the combined
+// code size in bits 24..28, flagged by STBI__ZFAST_PAIR
+#define STBI__ZFAST_PAIR  0x80000000u
+
 // zlib-style huffman encoding
 // (jpegs packs from left, zlib from right, so can't share code)
 typedef struct
 {
-    stbi__uint16 fast[1 << STBI__ZFAST_BITS];
+    stbi__uint32 fast[1 << STBI__ZFAST_BITS];
     stbi__uint16 firstcode[16];
     int maxcode[17];
     stbi__uint16 firstsymbol[16];
@@ -3849,7 +7223,7 @@ static int stbi__zbuild_huffman(stbi__zhuffman *z, const stbi_uc *sizelist, int
         int s = sizelist[i];
         if (s) {
             int c = next_code[s] - z->firstcode[s] + z->firstsymbol[s];
-            stbi__uint16 fastv = (stbi__uint16) ((s << 9) | i);
+            stbi__uint32 fastv = (stbi__uint32) ((s << 9) | i);
             z->size [c] = (stbi_uc     ) s;
             z->value[c] = (stbi__uint16) i;
             if (s <= STBI__ZFAST_BITS) {
@@ -3865,6 +7239,23 @@ static int stbi__zbuild_huffman(stbi__zhuffman *z, const stbi_uc *sizelist, int
     return 1;
 }
 
+// pair up literals in the literal/length fast table, so runs of short
+// literal codes come out two per lookup
+static void stbi__zbuild_literal_pairs(stbi__zhuffman *z)
+{
+    int i;
+    for (i=0; i < (1 << STBI__ZFAST_BITS); ++i) {
+        stbi__uint32 e = z->fast[i], e2;
+        int s = e >> 9, s2;
+        if (!e || (e & 511) >= 256) continue;
+        // the next code starts s bits in; entries below i only gained high bits
+        e2 = z->fast[i >> s] & 0xffff;
+        s2 = e2 >> 9;
+        if (e2 && (e2 & 511) < 256 && s + s2 <= STBI__ZFAST_BITS)
+            z->fast[i] = STBI__ZFAST_PAIR | ((stbi__uint32) (s + s2) << 24) | ((e2 & 255) << 16) | e;
+    }
+}
+
 // zlib-from-memory implementation for PNG reading
 //    because PNG allows splitting the zlib stream arbitrarily,
 //    and it's annoying structurally to have PNG call ZLIB call PNG,
@@ -3875,12 +7266,18 @@ typedef struct
 {
     stbi_uc *zbuffer, *zbuffer_end;
     int num_bits;
-    stbi__uint32 code_buffer;
+    stbi__uint64 code_buffer;    // bits past num_bits, if any, are the bytes at zbuffer
     
     char *zout;
     char *zout_start;
     char *zout_end;
     int   z_expandable;
+    stbi_allocator const *alloc; // for growing zout; NULL for STBI_MALLOC
+    
+    // incremental inflate: stop between symbols once zout reaches zout_pause
+    // (NULL to run to the end), and pick up from final_block/in_block later
+    char *zout_pause;
+    int   final_block, in_block;
     
     stbi__zhuffman z_length, z_distance;
 } stbi__zbuf;
@@ -3891,20 +7288,45 @@ stbi_inline static stbi_uc stbi__zget8(stbi__zbuf *z)
     return *z->zbuffer++;
 }
 
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86) || \
+   (defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+#define STBI__ZLOAD_LE
+#endif
+
+stbi_inline static stbi__uint64 stbi__zload64(const stbi_uc *p)
+{
+#ifdef STBI__ZLOAD_LE
+    stbi__uint64 v;
+    memcpy(&v, p, 8);
+    return v;
+#else
+    return (stbi__uint64) p[0]       | (stbi__uint64) p[1] <<  8 | (stbi__uint64) p[2] << 16 | (stbi__uint64) p[3] << 24 |
+           (stbi__uint64) p[4] << 32 | (stbi__uint64) p[5] << 40 | (stbi__uint64) p[6] << 48 | (stbi__uint64) p[7] << 56;
+#endif
+}
+
 static void stbi__fill_bits(stbi__zbuf *z)
 {
+    if (z->zbuffer_end - z->zbuffer >= 8) {
+        // one 8-byte load tops the buffer up to 56..63 bits. the bytes that
+        // don't fit whole are left in zbuffer, and the bits of them that did
+        // land past num_bits are the same ones the next load ORs in
+        z->code_buffer |= stbi__zload64(z->zbuffer) << z->num_bits;
+        z->zbuffer += (63 - z->num_bits) >> 3;
+        z->num_bits |= 56;
+        return;
+    }
     do {
-        STBI_ASSERT(z->code_buffer < (1U << z->num_bits));
-        z->code_buffer |= (unsigned int) stbi__zget8(z) << z->num_bits;
+        z->code_buffer |= (stbi__uint64) stbi__zget8(z) << z->num_bits;
         z->num_bits += 8;
-    } while (z->num_bits <= 24);
+    } while (z->num_bits <= 48);
 }
 
 stbi_inline static unsigned int stbi__zreceive(stbi__zbuf *z, int n)
 {
     unsigned int k;
     if (z->num_bits < n) stbi__fill_bits(z);
-    k = z->code_buffer & ((1 << n) - 1);
+    k = (unsigned int) (z->code_buffer & ((1 << n) - 1));
     z->code_buffer >>= n;
     z->num_bits -= n;
     return k;
@@ -3915,7 +7337,7 @@ static int stbi__zhuffman_decode_slowpath(stbi__zbuf *a, stbi__zhuffman *z)
     int b,s,k;
     // not resolved by fast table, so compute it the slow way
     // use jpeg approach, which requires MSbits at top
-    k = stbi__bit_reverse(a->code_buffer, 16);
+    k = stbi__bit_reverse((int) (a->code_buffer & 0xffff), 16);
     for (s=STBI__ZFAST_BITS+1; ; ++s)
         if (k < z->maxcode[s])
             break;
@@ -3952,8 +7374,7 @@ static int stbi__zexpand(stbi__zbuf *z, char *zout, int n)  // need to make room
     limit = old_limit = (int) (z->zout_end - z->zout_start);
     while (cur + n > limit)
         limit *= 2;
-    q = (char *) STBI_REALLOC_SIZED(z->zout_start, old_limit, limit);
-    STBI_NOTUSED(old_limit);
+    q = (char *) stbi__scratch_realloc(z->alloc, z->zout_start, old_limit, limit);
     if (q == NULL) return stbi__err("outofmem", "Out of memory");
     z->zout_start = q;
     z->zout       = q + cur;
@@ -3975,11 +7396,66 @@ static const int stbi__zdist_base[32] = { 1,2,3,4,5,7,9,13,17,25,33,49,65,97,129
 static const int stbi__zdist_extra[32] =
 { 0,0,0,0,1,1,2,2,3,3,4,4,5,5,6,6,7,7,8,8,9,9,10,10,11,11,12,12,13,13};
 
+// returns 0 on error, 1 at the end of the block, 2 if paused at zout_pause
 static int stbi__parse_huffman_block(stbi__zbuf *a)
 {
-    char *zout = a->zout;
+    char *zout = a->zout, *pause = a->zout_pause;
+    // the bit buffer lives in locals here: stores through zout could alias
+    // the struct, which would otherwise force a reload after every byte
+    stbi_uc *in = a->zbuffer, *in_end = a->zbuffer_end;
+    stbi__uint64 bits = a->code_buffer;
+    int nbits = a->num_bits;
     for(;;) {
-        int z = stbi__zhuffman_decode(a, &a->z_length);
+        stbi__uint32 e;
+        int z, s, len, dist;
+        stbi_uc *p;
+        if (pause && zout >= pause) {
+            a->zout = zout;
+            a->zbuffer = in;
+            a->code_buffer = bits;
+            a->num_bits = nbits;
+            return 2;
+        }
+        // 48 bits covers a length code, its extra bits, a distance code and
+        // its extra bits, so one refill per iteration is enough
+        if (nbits < 48) {
+            if (in_end - in >= 8) {
+                bits |= stbi__zload64(in) << nbits;
+                in += (63 - nbits) >> 3;
+                nbits |= 56;
+            } else {
+                do {
+                    bits |= (stbi__uint64) (in < in_end ? *in++ : 0) << nbits;
+                    nbits += 8;
+                } while (nbits <= 48);
+            }
+        }
+        e = a->z_length.fast[bits & STBI__ZFAST_MASK];
+        if (e & STBI__ZFAST_PAIR) {
+            if (zout + 2 > a->zout_end) {
+                if (!stbi__zexpand(a, zout, 2)) return 0;
+                zout = a->zout;
+            }
+            zout[0] = (char) e;
+            zout[1] = (char) (e >> 16);
+            zout += 2;
+            s = (e >> 24) & 31;
+            bits >>= s;
+            nbits -= s;
+            continue;
+        }
+        if (e) {
+            s = e >> 9;
+            bits >>= s;
+            nbits -= s;
+            z = e & 511;
+        } else {
+            a->code_buffer = bits;
+            a->num_bits = nbits;
+            z = stbi__zhuffman_decode_slowpath(a, &a->z_length);
+            bits = a->code_buffer;
+            nbits = a->num_bits;
+        }
         if (z < 256) {
             if (z < 0) return stbi__err("bad huffman code","Corrupt PNG"); // error in huffman codes
             if (zout >= a->zout_end) {
@@ -3987,32 +7463,65 @@ static int stbi__parse_huffman_block(stbi__zbuf *a)
                 zout = a->zout;
             }
             *zout++ = (char) z;
+            continue;
+        }
+        if (z == 256) {
+            a->zout = zout;
+            a->zbuffer = in;
+            a->code_buffer = bits;
+            a->num_bits = nbits;
+            return 1;
+        }
+        z -= 257;
+        len = stbi__zlength_base[z];
+        if (stbi__zlength_extra[z]) {
+            s = stbi__zlength_extra[z];
+            len += (int) (bits & ((1 << s) - 1));
+            bits >>= s;
+            nbits -= s;
+        }
+        e = a->z_distance.fast[bits & STBI__ZFAST_MASK];
+        if (e) {
+            s = e >> 9;
+            bits >>= s;
+            nbits -= s;
+            z = e & 511;
         } else {
-            stbi_uc *p;
-            int len,dist;
-            if (z == 256) {
-                a->zout = zout;
-                return 1;
-            }
-            z -= 257;
-            len = stbi__zlength_base[z];
-            if (stbi__zlength_extra[z]) len += stbi__zreceive(a, stbi__zlength_extra[z]);
-            z = stbi__zhuffman_decode(a, &a->z_distance);
-            if (z < 0) return stbi__err("bad huffman code","Corrupt PNG");
-            dist = stbi__zdist_base[z];
-            if (stbi__zdist_extra[z]) dist += stbi__zreceive(a, stbi__zdist_extra[z]);
-            if (zout - a->zout_start < dist) return stbi__err("bad dist","Corrupt PNG");
-            if (zout + len > a->zout_end) {
-                if (!stbi__zexpand(a, zout, len)) return 0;
-                zout = a->zout;
-            }
-            p = (stbi_uc *) (zout - dist);
-            if (dist == 1) { // run of one byte; common in images.
-                stbi_uc v = *p;
-                if (len) { do *zout++ = v; while (--len); }
+            a->code_buffer = bits;
+            a->num_bits = nbits;
+            z = stbi__zhuffman_decode_slowpath(a, &a->z_distance);
+            bits = a->code_buffer;
+            nbits = a->num_bits;
+        }
+        if (z < 0) return stbi__err("bad huffman code","Corrupt PNG");
+        dist = stbi__zdist_base[z];
+        if (stbi__zdist_extra[z]) {
+            s = stbi__zdist_extra[z];
+            dist += (int) (bits & ((1 << s) - 1));
+            bits >>= s;
+            nbits -= s;
+        }
+        if (zout - a->zout_start < dist) return stbi__err("bad dist","Corrupt PNG");
+        if (zout + len > a->zout_end) {
+            if (!stbi__zexpand(a, zout, len)) return 0;
+            zout = a->zout;
+        }
+        p = (stbi_uc *) (zout - dist);
+        if (dist == 1) { // run of one byte; common in images.
+            memset(zout, *p, len);
+            zout += len;
+        } else if (dist >= 8 && a->zout_end - zout >= len + 16) {
+            // copy in whole words, overshooting into the slack past len; a word
+            // never overlaps the bytes it reads once dist is at least its size
+            char *end = zout + len;
+            if (dist >= 16) {
+                do { memcpy(zout, p, 16); zout += 16; p += 16; } while (zout < end);
             } else {
-                if (len) { do *zout++ = *p++; while (--len); }
+                do { memcpy(zout, p, 8); zout += 8; p += 8; } while (zout < end);
             }
+            zout = end;
+        } else {
+            if (len) { do *zout++ = *p++; while (--len); }
         }
     }
 }
@@ -4063,6 +7572,7 @@ static int stbi__compute_huffman_codes(stbi__zbuf *a)
     if (n != ntot) return stbi__err("bad codelengths","Corrupt PNG");
     if (!stbi__zbuild_huffman(&a->z_length, lencodes, hlit)) return 0;
     if (!stbi__zbuild_huffman(&a->z_distance, lencodes+hlit, hdist)) return 0;
+    stbi__zbuild_literal_pairs(&a->z_length);
     return 1;
 }
 
@@ -4074,21 +7584,29 @@ static int stbi__parse_uncompressed_block(stbi__zbuf *a)
         stbi__zreceive(a, a->num_bits & 7); // discard
     // drain the bit-packed data into header
     k = 0;
-    while (a->num_bits > 0) {
+    while (a->num_bits > 0 && k < 4) {
         header[k++] = (stbi_uc) (a->code_buffer & 255); // suppress MSVC run-time check
         a->code_buffer >>= 8;
         a->num_bits -= 8;
     }
-    STBI_ASSERT(a->num_bits == 0);
     // now fill header the normal way
     while (k < 4)
         header[k++] = stbi__zget8(a);
     len  = header[1] * 256 + header[0];
     nlen = header[3] * 256 + header[2];
     if (nlen != (len ^ 0xffff)) return stbi__err("zlib corrupt","Corrupt PNG");
-    if (a->zbuffer + len > a->zbuffer_end) return stbi__err("read past buffer","Corrupt PNG");
     if (a->zout + len > a->zout_end)
         if (!stbi__zexpand(a, a->zout, len)) return 0;
+    // the 64-bit buffer may hold the first few bytes of the block, too
+    while (a->num_bits > 0 && len > 0) {
+        *a->zout++ = (char) (a->code_buffer & 255);
+        a->code_buffer >>= 8;
+        a->num_bits -= 8;
+        --len;
+    }
+    // anything past num_bits is stale once zbuffer moves on
+    a->code_buffer &= ((stbi__uint64) 1 << a->num_bits) - 1;
+    if (a->zbuffer + len > a->zbuffer_end) return stbi__err("read past buffer","Corrupt PNG");
     memcpy(a->zout, a->zbuffer, len);
     a->zbuffer += len;
     a->zout += len;
@@ -4137,15 +7655,20 @@ static const stbi_uc stbi__zdefault_distance[32] =
  }
  */
 
-static int stbi__parse_zlib(stbi__zbuf *a, int parse_header)
+// inflate blocks until the end of the stream, or until zout reaches
+// zout_pause; stored blocks are copied whole, so may run past it
+static int stbi__parse_zlib_blocks(stbi__zbuf *a)
 {
-    int final, type;
-    if (parse_header)
-        if (!stbi__parse_zlib_header(a)) return 0;
-    a->num_bits = 0;
-    a->code_buffer = 0;
-    do {
-        final = stbi__zreceive(a,1);
+    int type;
+    for (;;) {
+        if (a->in_block) {
+            int r = stbi__parse_huffman_block(a);
+            if (r != 1) return r != 0;
+            a->in_block = 0;
+        }
+        if (a->final_block) return 1;
+        if (a->zout_pause && a->zout >= a->zout_pause) return 1;
+        a->final_block = stbi__zreceive(a,1);
         type = stbi__zreceive(a,2);
         if (type == 0) {
             if (!stbi__parse_uncompressed_block(a)) return 0;
@@ -4156,13 +7679,24 @@ static int stbi__parse_zlib(stbi__zbuf *a, int parse_header)
                 // use fixed code lengths
                 if (!stbi__zbuild_huffman(&a->z_length  , stbi__zdefault_length  , 288)) return 0;
                 if (!stbi__zbuild_huffman(&a->z_distance, stbi__zdefault_distance,  32)) return 0;
+                stbi__zbuild_literal_pairs(&a->z_length);
             } else {
                 if (!stbi__compute_huffman_codes(a)) return 0;
             }
-            if (!stbi__parse_huffman_block(a)) return 0;
+            a->in_block = 1;
         }
-    } while (!final);
-    return 1;
+    }
+}
+
+static int stbi__parse_zlib(stbi__zbuf *a, int parse_header)
+{
+    if (parse_header)
+        if (!stbi__parse_zlib_header(a)) return 0;
+    a->num_bits = 0;
+    a->code_buffer = 0;
+    a->final_block = 0;
+    a->in_block = 0;
+    return stbi__parse_zlib_blocks(a);
 }
 
 static int stbi__do_zlib(stbi__zbuf *a, char *obuf, int olen, int exp, int parse_header)
@@ -4171,6 +7705,7 @@ static int stbi__do_zlib(stbi__zbuf *a, char *obuf, int olen, int exp, int parse
     a->zout       = obuf;
     a->zout_end   = obuf + olen;
     a->z_expandable = exp;
+    a->zout_pause = NULL;
     
     return stbi__parse_zlib(a, parse_header);
 }
@@ -4180,6 +7715,7 @@ STBIDEF char *stbi_zlib_decode_malloc_guesssize(const char *buffer, int len, int
     stbi__zbuf a;
     char *p = (char *) stbi__malloc(initial_size);
     if (p == NULL) return NULL;
+    a.alloc = NULL;
     a.zbuffer = (stbi_uc *) buffer;
     a.zbuffer_end = (stbi_uc *) buffer + len;
     if (stbi__do_zlib(&a, p, initial_size, 1, 1)) {
@@ -4196,25 +7732,33 @@ STBIDEF char *stbi_zlib_decode_malloc(char const *buffer, int len, int *outlen)
     return stbi_zlib_decode_malloc_guesssize(buffer, len, 16384, outlen);
 }
 
-STBIDEF char *stbi_zlib_decode_malloc_guesssize_headerflag(const char *buffer, int len, int initial_size, int *outlen, int parse_header)
+// inflate into a buffer from 'al' that grows as needed
+static char *stbi__zlib_decode_scratch(stbi_allocator const *al, const char *buffer, int len, int initial_size, int *outlen, int parse_header)
 {
     stbi__zbuf a;
-    char *p = (char *) stbi__malloc(initial_size);
+    char *p = (char *) stbi__scratch_malloc(al, initial_size);
     if (p == NULL) return NULL;
+    a.alloc = al;
     a.zbuffer = (stbi_uc *) buffer;
     a.zbuffer_end = (stbi_uc *) buffer + len;
     if (stbi__do_zlib(&a, p, initial_size, 1, parse_header)) {
         if (outlen) *outlen = (int) (a.zout - a.zout_start);
         return a.zout_start;
     } else {
-        STBI_FREE(a.zout_start);
+        stbi__scratch_free(al, a.zout_start);
         return NULL;
     }
 }
 
+STBIDEF char *stbi_zlib_decode_malloc_guesssize_headerflag(const char *buffer, int len, int initial_size, int *outlen, int parse_header)
+{
+    return stbi__zlib_decode_scratch(NULL, buffer, len, initial_size, outlen, parse_header);
+}
+
 STBIDEF int stbi_zlib_decode_buffer(char *obuffer, int olen, char const *ibuffer, int ilen)
 {
     stbi__zbuf a;
+    a.alloc = NULL;
     a.zbuffer = (stbi_uc *) ibuffer;
     a.zbuffer_end = (stbi_uc *) ibuffer + ilen;
     if (stbi__do_zlib(&a, obuffer, olen, 0, 1))
@@ -4228,6 +7772,7 @@ STBIDEF char *stbi_zlib_decode_noheader_malloc(char const *buffer, int len, int
     stbi__zbuf a;
     char *p = (char *) stbi__malloc(16384);
     if (p == NULL) return NULL;
+    a.alloc = NULL;
     a.zbuffer = (stbi_uc *) buffer;
     a.zbuffer_end = (stbi_uc *) buffer+len;
     if (stbi__do_zlib(&a, p, 16384, 1, 0)) {
@@ -4242,6 +7787,7 @@ STBIDEF char *stbi_zlib_decode_noheader_malloc(char const *buffer, int len, int
 STBIDEF int stbi_zlib_decode_noheader_buffer(char *obuffer, int olen, const char *ibuffer, int ilen)
 {
     stbi__zbuf a;
+    a.alloc = NULL;
     a.zbuffer = (stbi_uc *) ibuffer;
     a.zbuffer_end = (stbi_uc *) ibuffer + ilen;
     if (stbi__do_zlib(&a, obuffer, olen, 0, 0))
@@ -4285,11 +7831,25 @@ static int stbi__check_png_header(stbi__context *s)
     return 1;
 }
 
+// chunk state that stbi__parse_png_file leaves behind when it stops at IEND
+// without decoding, so the image can be inflated and unfiltered in bands
+typedef struct
+{
+    stbi_uc palette[1024], pal_img_n;
+    stbi_uc has_trans, tc[3];
+    stbi__uint16 tc16[3];
+    stbi__uint32 pal_len, idata_len;
+    int interlace, color, is_iphone;
+} stbi__png_deferred;
+
 typedef struct
 {
     stbi__context *s;
     stbi_uc *idata, *expanded, *out;
     int depth;
+    stbi__png_deferred *defer;       // if set, IEND fills this in instead of decoding
+    stbi_uc *band_prior, *band_save; // unfiltered row above the rows being decoded, and where to keep their last one
+    stbi_uc *band_out;               // if set, stbi__create_png_image_raw writes here instead of allocating 'out'
 } stbi__png;
 
 
@@ -4324,6 +7884,163 @@ static int stbi__paeth(int a, int b, int c)
     return c;
 }
 
+#ifdef STBI_SSE2
+static int stbi__png_load32(stbi_uc const *p)
+{
+    int v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+static void stbi__png_store32(stbi_uc *p, int v)
+{
+    memcpy(p, &v, 4);
+}
+
+// undoes the filter on one row of n pixels of bpp bytes (3, 4, 6 or 8),
+// one pixel per step with the left pixel kept in a register. the row above
+// and the output are obpp bytes per pixel; if that's more than bpp, the
+// extra bytes are opaque alpha, so adding the alpha channel costs no
+// separate pass.
+static void stbi__png_unfilter_row_simd(int filter, stbi_uc *cur, stbi_uc const *prior, stbi_uc const *raw, stbi__uint32 n, int bpp, int obpp)
+{
+    STBI_SIMD_ALIGN(stbi_uc, last_raw[16]);
+    STBI_SIMD_ALIGN(stbi_uc, last_prior[16]);
+    STBI_SIMD_ALIGN(stbi_uc, last_cur[16]);
+    STBI_SIMD_ALIGN(stbi_uc, alpha_bytes[16]);
+    __m128i zero = _mm_setzero_si128();
+    __m128i one = _mm_set1_epi8(1);
+    __m128i low7 = _mm_set1_epi8(0x7f);
+    __m128i a = zero, c = zero; // left and upper-left pixels
+    __m128i alpha, b, d, x;
+    stbi_uc *out = cur;
+    stbi__uint32 i, m = n-1;
+    int wide = obpp > 4, pass, k;
+    
+    // pixels are loaded and stored 4 or 8 bytes at a time even when they're
+    // only 3 or 6 wide; the spill is overwritten by the next pixel
+#define STBI__PX_LOAD(p)     (wide ? _mm_loadl_epi64((__m128i const *) (p)) : _mm_cvtsi32_si128(stbi__png_load32(p)))
+#define STBI__PX_STORE(p, v) if (wide) _mm_storel_epi64((__m128i *) (p), v); else stbi__png_store32(p, _mm_cvtsi128_si32(v))
+    
+    if (filter == STBI__F_none && bpp == obpp) {
+        memcpy(cur, raw, n*bpp);
+        return;
+    }
+    
+    memset(last_raw, 0, sizeof(last_raw));
+    memset(last_prior, 0, sizeof(last_prior));
+    for (k=0; k < 16; ++k)
+        alpha_bytes[k] = (stbi_uc) (k >= bpp && k < obpp ? 255 : 0);
+    alpha = _mm_load_si128((__m128i const *) alpha_bytes);
+    
+    for (pass=0; pass < 2; ++pass) {
+#define STBI__CASE(f) \
+case f:     \
+for (i=0; i < m; ++i, raw+=bpp, cur+=obpp, prior+=obpp)
+        switch (filter) {
+                STBI__CASE(STBI__F_none)         { x = STBI__PX_LOAD(raw); STBI__PX_STORE(cur, _mm_or_si128(x, alpha)); } break;
+                STBI__CASE(STBI__F_sub)          { a = _mm_add_epi8(STBI__PX_LOAD(raw), a); STBI__PX_STORE(cur, _mm_or_si128(a, alpha)); } break;
+                // with no row above, paeth always predicts the left pixel
+                STBI__CASE(STBI__F_paeth_first)  { a = _mm_add_epi8(STBI__PX_LOAD(raw), a); STBI__PX_STORE(cur, _mm_or_si128(a, alpha)); } break;
+                STBI__CASE(STBI__F_up)           { x = _mm_add_epi8(STBI__PX_LOAD(raw), STBI__PX_LOAD(prior)); STBI__PX_STORE(cur, _mm_or_si128(x, alpha)); } break;
+                STBI__CASE(STBI__F_avg)          {
+                    // floor((a+b)/2) from pavgb's rounded-up average
+                    b = STBI__PX_LOAD(prior);
+                    x = _mm_sub_epi8(_mm_avg_epu8(a, b), _mm_and_si128(_mm_xor_si128(a, b), one));
+                    a = _mm_add_epi8(STBI__PX_LOAD(raw), x);
+                    STBI__PX_STORE(cur, _mm_or_si128(a, alpha));
+                } break;
+                STBI__CASE(STBI__F_avg_first)    {
+                    x = _mm_and_si128(_mm_srli_epi16(a, 1), low7);
+                    a = _mm_add_epi8(STBI__PX_LOAD(raw), x);
+                    STBI__PX_STORE(cur, _mm_or_si128(a, alpha));
+                } break;
+                STBI__CASE(STBI__F_paeth)        {
+                    // predictor in 16-bit lanes; a and c stay widened between pixels
+                    __m128i pa, pb, pc, smallest, use_a, use_b, pred;
+                    b = _mm_unpacklo_epi8(STBI__PX_LOAD(prior), zero);
+                    d = STBI__PX_LOAD(raw);
+                    pa = _mm_sub_epi16(b, c);   // p-a
+                    pb = _mm_sub_epi16(a, c);   // p-b
+                    pc = _mm_add_epi16(pa, pb); // p-c
+                    pa = _mm_max_epi16(pa, _mm_sub_epi16(zero, pa));
+                    pb = _mm_max_epi16(pb, _mm_sub_epi16(zero, pb));
+                    pc = _mm_max_epi16(pc, _mm_sub_epi16(zero, pc));
+                    smallest = _mm_min_epi16(pc, _mm_min_epi16(pa, pb));
+                    // ties go to a, then b, then c
+                    use_a = _mm_cmpeq_epi16(smallest, pa);
+                    use_b = _mm_cmpeq_epi16(smallest, pb);
+                    pred = _mm_or_si128(_mm_and_si128(use_b, b), _mm_andnot_si128(use_b, c));
+                    pred = _mm_or_si128(_mm_and_si128(use_a, a), _mm_andnot_si128(use_a, pred));
+                    x = _mm_add_epi8(_mm_packus_epi16(pred, pred), d);
+                    STBI__PX_STORE(cur, _mm_or_si128(x, alpha));
+                    a = _mm_unpacklo_epi8(x, zero);
+                    c = b;
+                } break;
+        }
+#undef STBI__CASE
+        if (pass == 0) {
+            // the last pixel goes through scratch copies, so the loads and
+            // stores above never run past the end of the row
+            memcpy(last_raw, raw, bpp);
+            if (filter == STBI__F_up || filter == STBI__F_avg || filter == STBI__F_paeth)
+                memcpy(last_prior, prior, obpp);
+            out = cur;
+            raw = last_raw;
+            prior = last_prior;
+            cur = last_cur;
+            m = 1;
+        }
+    }
+    memcpy(out, last_cur, obpp);
+#undef STBI__PX_LOAD
+#undef STBI__PX_STORE
+}
+#endif
+
+#ifdef STBI_AVX2
+// the vertical filters don't depend on the pixel to the left, so these go
+// 16 or 32 bytes at a time; pshufb spreads 8-bit RGB (or 16-bit RGB) out to
+// RGBA on the way. the rest falls back to stbi__png_unfilter_row_simd.
+static STBI__AVX2_TARGET void stbi__png_unfilter_row_avx2(int filter, stbi_uc *cur, stbi_uc const *prior, stbi_uc const *raw, stbi__uint32 n, int bpp, int obpp)
+{
+    stbi__uint32 i = 0;
+    
+    if (filter == STBI__F_up && bpp == obpp) {
+        stbi__uint32 nb = n*bpp;
+        for (; i+32 <= nb; i += 32) {
+            __m256i r = _mm256_loadu_si256((__m256i const *) (raw+i));
+            __m256i p = _mm256_loadu_si256((__m256i const *) (prior+i));
+            _mm256_storeu_si256((__m256i *) (cur+i), _mm256_add_epi8(r, p));
+        }
+        for (; i < nb; ++i)
+            cur[i] = STBI__BYTECAST(raw[i] + prior[i]);
+        return;
+    }
+    
+    if ((filter == STBI__F_none || filter == STBI__F_up) && obpp > bpp) {
+        __m128i spread, alpha;
+        int step = (bpp == 3 ? 4 : 2); // pixels per 16 output bytes
+        if (bpp == 3) {
+            spread = _mm_setr_epi8(0,1,2,-1, 3,4,5,-1, 6,7,8,-1, 9,10,11,-1);
+            alpha  = _mm_setr_epi8(0,0,0,-1, 0,0,0,-1, 0,0,0,-1, 0,0,0,-1);
+        } else {
+            spread = _mm_setr_epi8(0,1,2,3,4,5,-1,-1, 6,7,8,9,10,11,-1,-1);
+            alpha  = _mm_setr_epi8(0,0,0,0,0,0,-1,-1, 0,0,0,0,0,0,-1,-1);
+        }
+        // 16-byte loads from raw read up to 4 bytes past the pixels used
+        for (; (i+step)*bpp + 4 <= n*bpp; i += step) {
+            __m128i x = _mm_shuffle_epi8(_mm_loadu_si128((__m128i const *) (raw + i*bpp)), spread);
+            if (filter == STBI__F_up)
+                x = _mm_add_epi8(x, _mm_loadu_si128((__m128i const *) (prior + i*obpp)));
+            _mm_storeu_si128((__m128i *) (cur + i*obpp), _mm_or_si128(x, alpha));
+        }
+    }
+    
+    stbi__png_unfilter_row_simd(filter, cur + i*obpp, prior + i*obpp, raw + i*bpp, n-i, bpp, obpp);
+}
+#endif
+
 static const stbi_uc stbi__depth_scale_table[9] = { 0, 0xff, 0x55, 0, 0x11, 0,0,0, 0x01 };
 
 // create the png data from post-deflated data
@@ -4339,9 +8056,13 @@ static int stbi__create_png_image_raw(stbi__png *a, stbi_uc *raw, stbi__uint32 r
     int output_bytes = out_n*bytes;
     int filter_bytes = img_n*bytes;
     int width = x;
+    void (*unfilter_kernel)(int filter, stbi_uc *cur, stbi_uc const *prior, stbi_uc const *raw, stbi__uint32 n, int bpp, int obpp) = NULL;
     
     STBI_ASSERT(out_n == s->img_n || out_n == s->img_n+1);
-    a->out = (stbi_uc *) stbi__malloc_mad3(x, y, output_bytes, 0); // extra bytes to write off the end into
+    if (a->band_out)
+        a->out = a->band_out;
+    else
+        a->out = (stbi_uc *) stbi__malloc_mad3(x, y, output_bytes, 0); // extra bytes to write off the end into
     if (!a->out) return stbi__err("outofmem", "Out of memory");
     
     if (!stbi__mad3sizes_valid(img_n, x, depth, 7)) return stbi__err("too large", "Corrupt PNG");
@@ -4353,6 +8074,16 @@ static int stbi__create_png_image_raw(stbi__png *a, stbi_uc *raw, stbi__uint32 r
     // so just check for raw_len < img_len always.
     if (raw_len < img_len) return stbi__err("not enough pixels","Corrupt PNG");
     
+    // the simd kernels take whole pixels of 3 to 8 bytes
+#ifdef STBI_SSE2
+    if (depth >= 8 && filter_bytes >= 3 && stbi__sse2_available())
+        unfilter_kernel = stbi__png_unfilter_row_simd;
+#endif
+#ifdef STBI_AVX2
+    if (depth >= 8 && filter_bytes >= 3 && stbi__avx2_available())
+        unfilter_kernel = stbi__png_unfilter_row_avx2;
+#endif
+    
     for (j=0; j < y; ++j) {
         stbi_uc *cur = a->out + stride*j;
         stbi_uc *prior;
@@ -4369,8 +8100,20 @@ static int stbi__create_png_image_raw(stbi__png *a, stbi_uc *raw, stbi__uint32 r
         }
         prior = cur - stride; // bugfix: need to compute this after 'cur +=' computation above
         
-        // if first row, use special filter that doesn't sample previous row
-        if (j == 0) filter = first_row_filter[filter];
+        // if first row, use special filter that doesn't sample previous row,
+        // unless this is a band that continues from an earlier one
+        if (j == 0) {
+            if (a->band_prior)
+                prior = a->band_prior + (cur - a->out);
+            else
+                filter = first_row_filter[filter];
+        }
+        
+        if (unfilter_kernel) {
+            unfilter_kernel(filter, cur, prior, raw, x, filter_bytes, output_bytes);
+            raw += x*filter_bytes;
+            continue;
+        }
         
         // handle first byte explicitly
         for (k=0; k < filter_bytes; ++k) {
@@ -4451,6 +8194,11 @@ for (k=0; k < filter_bytes; ++k)
         }
     }
     
+    // the next band unfilters against our last row as it is now, before
+    // expansion or byte swapping
+    if (a->band_save)
+        memcpy(a->band_save, a->out + stride*(y-1), stride);
+    
     // we make a separate pass to expand bits to pixels; for performance,
     // this could run two scanlines behind the above code, so it won't
     // intefere with filtering but will still be in the cache.
@@ -4578,109 +8326,446 @@ static int stbi__create_png_image(stbi__png *a, stbi_uc *image_data, stbi__uint3
             image_data_len -= img_len;
         }
     }
-    a->out = final;
-    
-    return 1;
+    a->out = final;
+    
+    return 1;
+}
+
+#ifndef STBI_NO_THREADS
+// threaded decode: worker 0 inflates into a buffer sized for the whole
+// image, publishing how many bytes are ready every STBI__PNG_MT_CHUNK, and
+// the other workers unfilter bands of rows as soon as their bytes are in.
+// each unfilter worker takes a fixed set of passes (just the one pass if
+// the image isn't interlaced), in the order their data arrives. unlike the
+// serial path, inflate stops once it has all of the image's bytes, so
+// anything wrong with the zlib stream past that point goes unnoticed.
+#define STBI__PNG_MT_CHUNK 65536
+
+typedef struct
+{
+    stbi__png *a;
+    stbi__zbuf z;
+    stbi__uint32 need;             // filtered bytes in all passes
+    stbi__uint32 volatile avail;   // how many of those are inflated; only worker 0 stores
+    stbi__uint32 volatile failed;
+    int out_n, depth, color, interlaced, num_unfilter;
+    stbi__uint32 pass_x[7], pass_y[7], pass_off[7];
+    stbi_uc *pass_out[7], *pass_save[7]; // unfiltered pass, and two rows to carry between bands
+} stbi__png_mt;
+
+static void stbi__png_mt_inflate(stbi__png_mt *m)
+{
+    stbi__zbuf *z = &m->z;
+    for (;;) {
+        stbi__uint32 have = (stbi__uint32) (z->zout - z->zout_start);
+        z->zout_pause = z->zout + (m->need - have < STBI__PNG_MT_CHUNK ? m->need - have : STBI__PNG_MT_CHUNK);
+        if (!stbi__parse_zlib_blocks(z)) break;
+        have = (stbi__uint32) (z->zout - z->zout_start);
+        stbi__atomic_store(&m->avail, have < m->need ? have : m->need);
+        if (have >= m->need) return;
+        if (z->final_block && !z->in_block) {
+            stbi__err("not enough pixels","Corrupt PNG");
+            break;
+        }
+        if (stbi__atomic_load(&m->failed)) return;
+    }
+    stbi__atomic_store(&m->failed, 1);
+}
+
+static int stbi__png_mt_unfilter(stbi__png_mt *m, int p)
+{
+    static const int xorig[] = { 0,4,0,2,0,1,0 };
+    static const int yorig[] = { 0,0,4,0,2,0,1 };
+    static const int xspc[]  = { 8,8,4,4,2,2,1 };
+    static const int yspc[]  = { 8,8,8,4,4,2,2 };
+    stbi__png b = *m->a;
+    stbi__uint32 x = m->pass_x[p], y = m->pass_y[p], row, n, i, j;
+    stbi__uint32 row_len = (((b.s->img_n * x * m->depth) + 7) >> 3) + 1;
+    size_t stride = (size_t) x * m->out_n * (m->depth == 16 ? 2 : 1);
+    stbi__uint32 band = row_len < STBI__PNG_MT_CHUNK ? STBI__PNG_MT_CHUNK / row_len : 1;
+    stbi_uc *raw = (stbi_uc *) m->z.zout_start + m->pass_off[p];
+    stbi_uc *save[2], *t;
+    int ok;
+    STBI__PROF_VAR(t0)
+    save[0] = m->pass_save[p];
+    save[1] = m->pass_save[p] + stride;
+    
+    for (row=0; row < y; row += n) {
+        n = y - row < band ? y - row : band;
+        while (stbi__atomic_load(&m->avail) < m->pass_off[p] + (row+n)*row_len) {
+            if (stbi__atomic_load(&m->failed)) return 0;
+            stbi__thread_yield();
+        }
+        b.band_out = m->pass_out[p] + stride*row;
+        b.band_prior = row ? save[0] : NULL;
+        b.band_save = save[1];
+        STBI__PROF_START(t0);
+        ok = stbi__create_png_image_raw(&b, raw + row*row_len, n*row_len, m->out_n, x, n, m->depth, m->color);
+        STBI__PROF_END(STBI_stage_png_unfilter, t0);
+        if (!ok) return 0;
+        t = save[0]; save[0] = save[1]; save[1] = t;
+    }
+    
+    if (m->interlaced) {
+        stbi__uint32 img_x = m->a->s->img_x;
+        int out_bytes = m->out_n * (m->depth == 16 ? 2 : 1);
+        stbi_uc *final = m->a->out;
+        STBI__PROF_START(t0);
+        for (j=0; j < y; ++j) {
+            stbi_uc *dst = final + ((size_t) (j*yspc[p]+yorig[p]) * img_x + xorig[p]) * out_bytes;
+            stbi_uc *src = m->pass_out[p] + stride*j;
+            for (i=0; i < x; ++i, dst += xspc[p]*out_bytes, src += out_bytes)
+                memcpy(dst, src, out_bytes);
+        }
+        STBI__PROF_END(STBI_stage_png_unfilter, t0);
+    }
+    return 1;
+}
+
+static void stbi__png_mt_worker(void *arg, int worker)
+{
+    stbi__png_mt *m = (stbi__png_mt *) arg;
+    int num_passes = m->interlaced ? 7 : 1, c = worker-1, p;
+    STBI__PROF_VAR(t)
+    if (worker == 0) {
+        STBI__PROF_START(t);
+        stbi__png_mt_inflate(m);
+        STBI__PROF_END(STBI_stage_png_inflate, t);
+        return;
+    }
+    // the last pass is the biggest, so it goes to the first unfilter worker
+    for (p = (num_passes-1-c) % m->num_unfilter; p < num_passes; p += m->num_unfilter) {
+        if (!m->pass_x[p] || !m->pass_y[p]) continue;
+        if (!stbi__png_mt_unfilter(m, p)) {
+            stbi__atomic_store(&m->failed, 1);
+            return;
+        }
+    }
+}
+
+// does what inflating a->idata and calling stbi__create_png_image would
+static int stbi__create_png_image_mt(stbi__png *a, stbi__uint32 idata_len, int out_n, int depth, int color, int interlaced, int parse_header)
+{
+    static const int xorig[] = { 0,4,0,2,0,1,0 };
+    static const int yorig[] = { 0,0,4,0,2,0,1 };
+    static const int xspc[]  = { 8,8,4,4,2,2,1 };
+    static const int yspc[]  = { 8,8,8,4,4,2,2 };
+    stbi__context *s = a->s;
+    stbi__png_mt m;
+    stbi__uint32 slack = 65536 + 258; // a stored block or a match can run past zout_pause
+    int out_bytes = out_n * (depth == 16 ? 2 : 1);
+    int num_passes = interlaced ? 7 : 1, live = 0, p, ok = 1;
+    
+    if (!stbi__mad3sizes_valid(s->img_n, s->img_x, depth, 7)) return stbi__err("too large", "Corrupt PNG");
+    m.a = a;
+    m.need = 0;
+    m.avail = 0;
+    m.failed = 0;
+    m.out_n = out_n;
+    m.depth = depth;
+    m.color = color;
+    m.interlaced = interlaced;
+    for (p=0; p < num_passes; ++p) {
+        if (interlaced) {
+            m.pass_x[p] = (s->img_x - xorig[p] + xspc[p]-1) / xspc[p];
+            m.pass_y[p] = (s->img_y - yorig[p] + yspc[p]-1) / yspc[p];
+        } else {
+            m.pass_x[p] = s->img_x;
+            m.pass_y[p] = s->img_y;
+        }
+        m.pass_off[p] = m.need;
+        m.pass_out[p] = m.pass_save[p] = NULL;
+        if (m.pass_x[p] && m.pass_y[p]) {
+            m.need += ((((s->img_n * m.pass_x[p] * depth) + 7) >> 3) + 1) * m.pass_y[p];
+            ++live;
+        }
+    }
+    
+    a->expanded = (stbi_uc *) stbi__scratch_malloc(s->alloc, (size_t) m.need + slack);
+    a->out = (stbi_uc *) stbi__malloc_mad3(s->img_x, s->img_y, out_bytes, 0);
+    if (!a->expanded || !a->out) return stbi__err("outofmem", "Out of memory");
+    for (p=0; p < num_passes && ok; ++p) {
+        if (!m.pass_x[p] || !m.pass_y[p]) continue;
+        m.pass_out[p] = interlaced ? (stbi_uc *) stbi__malloc_mad3(m.pass_x[p], m.pass_y[p], out_bytes, 0) : a->out;
+        m.pass_save[p] = (stbi_uc *) stbi__malloc_mad3(2, m.pass_x[p], out_bytes, 0);
+        if (!m.pass_out[p] || !m.pass_save[p]) ok = stbi__err("outofmem", "Out of memory");
+    }
+    
+    if (ok) {
+        stbi__zbuf *z = &m.z;
+        z->zbuffer = a->idata;
+        z->zbuffer_end = a->idata + idata_len;
+        z->zout = z->zout_start = (char *) a->expanded;
+        z->zout_end = z->zout_start + m.need + slack;
+        z->z_expandable = 0; // the unfilter workers read from it as it fills
+        z->alloc = s->alloc;
+        z->zout_pause = z->zout_start; // just the zlib header for now
+        ok = stbi__parse_zlib(z, parse_header);
+    }
+    if (ok) {
+        m.num_unfilter = interlaced ? live : 1;
+        if (m.num_unfilter > s->num_threads-1) m.num_unfilter = s->num_threads-1;
+        if (m.num_unfilter > STBI_MAX_THREADS-1) m.num_unfilter = STBI_MAX_THREADS-1;
+        stbi__parallel_run(1 + m.num_unfilter, stbi__png_mt_worker, &m);
+        ok = !m.failed;
+    }
+    
+    for (p=0; p < num_passes; ++p) {
+        if (interlaced) STBI_FREE(m.pass_out[p]);
+        STBI_FREE(m.pass_save[p]);
+    }
+    stbi__scratch_free(s->alloc, a->idata); a->idata = NULL;
+    return ok;
+}
+#endif // STBI_NO_THREADS
+
+// tRNS color keys and palette expansion, a run of pixels at a time. the
+// SSE2 loops compare whole pixels as 16-, 32- or 64-bit lanes, with the
+// alpha forced on in both the pixel and the key so it doesn't take part;
+// the AVX2 palette loop looks up 8 pixels per gather.
+#ifdef STBI_SSE2
+static stbi__uint32 stbi__png_trans_simd(stbi_uc *p, stbi__uint32 count, stbi_uc const tc[3], int out_n)
+{
+    stbi__uint32 i = 0;
+    if (out_n == 2) {
+        __m128i grey = _mm_set1_epi16(0x00ff), key = _mm_set1_epi16(tc[0]);
+        __m128i alpha = _mm_set1_epi16((short) 0xff00);
+        for (; i+8 <= count; i += 8) {
+            __m128i v = _mm_and_si128(_mm_loadu_si128((__m128i const *) (p + i*2)), grey);
+            __m128i m = _mm_cmpeq_epi16(v, key);
+            _mm_storeu_si128((__m128i *) (p + i*2), _mm_or_si128(v, _mm_andnot_si128(m, alpha)));
+        }
+    } else {
+        __m128i alpha = _mm_set1_epi32((int) 0xff000000);
+        __m128i key = _mm_set1_epi32((int) (tc[0] | (tc[1] << 8) | ((stbi__uint32) tc[2] << 16) | 0xff000000));
+        for (; i+4 <= count; i += 4) {
+            __m128i v = _mm_loadu_si128((__m128i const *) (p + i*4));
+            __m128i m = _mm_cmpeq_epi32(_mm_or_si128(v, alpha), key);
+            _mm_storeu_si128((__m128i *) (p + i*4), _mm_andnot_si128(_mm_and_si128(m, alpha), v));
+        }
+    }
+    return i;
+}
+
+static stbi__uint32 stbi__png_trans16_simd(stbi__uint16 *p, stbi__uint32 count, stbi__uint16 const tc[3], int out_n)
+{
+    stbi__uint32 i = 0;
+    if (out_n == 2) {
+        __m128i grey = _mm_set1_epi32(0xffff), key = _mm_set1_epi32(tc[0]);
+        __m128i alpha = _mm_set1_epi32((int) 0xffff0000);
+        for (; i+4 <= count; i += 4) {
+            __m128i v = _mm_and_si128(_mm_loadu_si128((__m128i const *) (p + i*2)), grey);
+            __m128i m = _mm_cmpeq_epi32(v, key);
+            _mm_storeu_si128((__m128i *) (p + i*2), _mm_or_si128(v, _mm_andnot_si128(m, alpha)));
+        }
+    } else {
+        // SSE2 has no 64-bit compare: both 32-bit halves have to match
+        __m128i alpha = _mm_set_epi32((int) 0xffff0000, 0, (int) 0xffff0000, 0);
+        int rg = (int) (tc[0] | ((stbi__uint32) tc[1] << 16));
+        __m128i key = _mm_set_epi32((int) (tc[2] | 0xffff0000), rg, (int) (tc[2] | 0xffff0000), rg);
+        for (; i+2 <= count; i += 2) {
+            __m128i v = _mm_loadu_si128((__m128i const *) (p + i*4));
+            __m128i m = _mm_cmpeq_epi32(_mm_or_si128(v, alpha), key);
+            m = _mm_and_si128(m, _mm_shuffle_epi32(m, _MM_SHUFFLE(2,3,0,1)));
+            _mm_storeu_si128((__m128i *) (p + i*4), _mm_andnot_si128(_mm_and_si128(m, alpha), v));
+        }
+    }
+    return i;
+}
+#endif
+
+#ifdef STBI_AVX2
+static STBI__AVX2_TARGET stbi__uint32 stbi__png_expand_avx2(stbi_uc *out, stbi_uc const *idx, stbi__uint32 count, stbi_uc const *palette, int out_n)
+{
+    stbi__uint32 i = 0;
+    if (out_n == 4) {
+        for (; i+8 <= count; i += 8) {
+            __m256i k = _mm256_cvtepu8_epi32(_mm_loadl_epi64((__m128i const *) (idx + i)));
+            _mm256_storeu_si256((__m256i *) (out + i*4), _mm256_i32gather_epi32((int const *) palette, k, 4));
+        }
+    } else {
+        // drop every fourth byte, leaving 12 bytes at the bottom of each
+        // lane; the 16-byte stores overlap, and run 4 bytes past the 8
+        // pixels, so stop while there are at least 2 more pixels to write
+        __m256i pack = _mm256_setr_epi8(0,1,2,4,5,6,8,9,10,12,13,14,-1,-1,-1,-1,
+                                        0,1,2,4,5,6,8,9,10,12,13,14,-1,-1,-1,-1);
+        for (; i+10 <= count; i += 8) {
+            __m256i k = _mm256_cvtepu8_epi32(_mm_loadl_epi64((__m128i const *) (idx + i)));
+            __m256i v = _mm256_shuffle_epi8(_mm256_i32gather_epi32((int const *) palette, k, 4), pack);
+            _mm_storeu_si128((__m128i *) (out + i*3),      _mm256_castsi256_si128(v));
+            _mm_storeu_si128((__m128i *) (out + i*3 + 12), _mm256_extracti128_si256(v, 1));
+        }
+    }
+    return i;
 }
+#endif
 
-static int stbi__compute_transparency(stbi__png *z, stbi_uc tc[3], int out_n)
+static void stbi__png_trans_pixels(stbi_uc *p, stbi__uint32 count, stbi_uc const tc[3], int out_n)
 {
-    stbi__context *s = z->s;
-    stbi__uint32 i, pixel_count = s->img_x * s->img_y;
-    stbi_uc *p = z->out;
+    stbi__uint32 i = 0;
     
     // compute color-based transparency, assuming we've
     // already got 255 as the alpha value in the output
     STBI_ASSERT(out_n == 2 || out_n == 4);
-    
+#ifdef STBI_SSE2
+    if (stbi__sse2_available())
+        i = stbi__png_trans_simd(p, count, tc, out_n);
+#endif
+    p += i*out_n;
     if (out_n == 2) {
-        for (i=0; i < pixel_count; ++i) {
+        for (; i < count; ++i) {
             p[1] = (p[0] == tc[0] ? 0 : 255);
             p += 2;
         }
     } else {
-        for (i=0; i < pixel_count; ++i) {
+        for (; i < count; ++i) {
             if (p[0] == tc[0] && p[1] == tc[1] && p[2] == tc[2])
                 p[3] = 0;
             p += 4;
         }
     }
-    return 1;
 }
 
-static int stbi__compute_transparency16(stbi__png *z, stbi__uint16 tc[3], int out_n)
+static void stbi__png_trans16_pixels(stbi__uint16 *p, stbi__uint32 count, stbi__uint16 const tc[3], int out_n)
 {
-    stbi__context *s = z->s;
-    stbi__uint32 i, pixel_count = s->img_x * s->img_y;
-    stbi__uint16 *p = (stbi__uint16*) z->out;
+    stbi__uint32 i = 0;
     
     // compute color-based transparency, assuming we've
     // already got 65535 as the alpha value in the output
     STBI_ASSERT(out_n == 2 || out_n == 4);
-    
+#ifdef STBI_SSE2
+    if (stbi__sse2_available())
+        i = stbi__png_trans16_simd(p, count, tc, out_n);
+#endif
+    p += i*out_n;
     if (out_n == 2) {
-        for (i = 0; i < pixel_count; ++i) {
+        for (; i < count; ++i) {
             p[1] = (p[0] == tc[0] ? 0 : 65535);
             p += 2;
         }
     } else {
-        for (i = 0; i < pixel_count; ++i) {
+        for (; i < count; ++i) {
             if (p[0] == tc[0] && p[1] == tc[1] && p[2] == tc[2])
                 p[3] = 0;
             p += 4;
         }
     }
+}
+
+// palette is 256 RGBA entries; out_n is 3 or 4
+static void stbi__png_expand_pixels(stbi_uc *out, stbi_uc const *idx, stbi__uint32 count, stbi_uc const *palette, int out_n)
+{
+    stbi__uint32 i = 0;
+#ifdef STBI_AVX2
+    if (stbi__avx2_available())
+        i = stbi__png_expand_avx2(out, idx, count, palette, out_n);
+#endif
+    if (out_n == 4) {
+        for (; i < count; ++i)
+            memcpy(out + i*4, palette + idx[i]*4, 4);
+    } else {
+        // copy 4 bytes and step 3, which the next pixel writes over
+        for (; i+1 < count; ++i)
+            memcpy(out + i*3, palette + idx[i]*4, 4);
+        if (i < count)
+            memcpy(out + i*3, palette + idx[i]*4, 3);
+    }
+}
+
+static int stbi__compute_transparency(stbi__png *z, stbi_uc tc[3], int out_n)
+{
+    stbi__context *s = z->s;
+    stbi__png_trans_pixels(z->out, s->img_x * s->img_y, tc, out_n);
+    return 1;
+}
+
+static int stbi__compute_transparency16(stbi__png *z, stbi__uint16 tc[3], int out_n)
+{
+    stbi__context *s = z->s;
+    stbi__png_trans16_pixels((stbi__uint16 *) z->out, s->img_x * s->img_y, tc, out_n);
     return 1;
 }
 
 static int stbi__expand_png_palette(stbi__png *a, stbi_uc *palette, int len, int pal_img_n)
 {
-    stbi__uint32 i, pixel_count = a->s->img_x * a->s->img_y;
-    stbi_uc *p, *temp_out, *orig = a->out;
+    stbi__uint32 pixel_count = a->s->img_x * a->s->img_y;
+    stbi_uc *p;
     
     p = (stbi_uc *) stbi__malloc_mad2(pixel_count, pal_img_n, 0);
     if (p == NULL) return stbi__err("outofmem", "Out of memory");
     
-    // between here and free(out) below, exitting would leak
-    temp_out = p;
-    
-    if (pal_img_n == 3) {
-        for (i=0; i < pixel_count; ++i) {
-            int n = orig[i]*4;
-            p[0] = palette[n  ];
-            p[1] = palette[n+1];
-            p[2] = palette[n+2];
-            p += 3;
-        }
-    } else {
-        for (i=0; i < pixel_count; ++i) {
-            int n = orig[i]*4;
-            p[0] = palette[n  ];
-            p[1] = palette[n+1];
-            p[2] = palette[n+2];
-            p[3] = palette[n+3];
-            p += 4;
-        }
-    }
+    stbi__png_expand_pixels(p, a->out, pixel_count, palette, pal_img_n);
     STBI_FREE(a->out);
-    a->out = temp_out;
+    a->out = p;
     
     STBI_NOTUSED(len);
     
     return 1;
 }
 
-static int stbi__unpremultiply_on_load = 0;
-static int stbi__de_iphone_flag = 0;
-
-STBIDEF void stbi_set_unpremultiply_on_load(int flag_true_if_should_unpremultiply)
-{
-    stbi__unpremultiply_on_load = flag_true_if_should_unpremultiply;
-}
+// filtered bytes per band for stbi__create_png_image_banded
+#define STBI__PNG_BAND 16384
 
-STBIDEF void stbi_convert_iphone_png_to_rgb(int flag_true_if_should_convert)
+// for non-interlaced images with tRNS or a palette: unfilter a band of rows
+// at a time, as the threaded and streaming decoders do, and apply the color
+// key or expand the palette while the band is still in cache, rather than
+// in passes over the whole image afterwards. a paletted image's indices
+// only take a band's worth of memory, too. pal_out_n is 0 if there's no
+// palette; otherwise tc and tc16 are NULL.
+static int stbi__create_png_image_banded(stbi__png *a, stbi_uc *raw, stbi__uint32 raw_len, int out_n, int depth, int color, stbi_uc const *palette, int pal_out_n, stbi_uc const *tc, stbi__uint16 const *tc16)
 {
-    stbi__de_iphone_flag = flag_true_if_should_convert;
+    stbi__context *s = a->s;
+    stbi__uint32 x = s->img_x, y = s->img_y, row, n, row_len, band;
+    size_t stride = (size_t) x * out_n * (depth == 16 ? 2 : 1);
+    stbi_uc *final, *idx = NULL, *rows, *save[2], *t;
+    int ok = 1;
+    
+    if (!stbi__mad3sizes_valid(s->img_n, x, depth, 7)) return stbi__err("too large", "Corrupt PNG");
+    row_len = (((s->img_n * x * depth) + 7) >> 3) + 1;
+    if (raw_len / row_len < y) return stbi__err("not enough pixels","Corrupt PNG");
+    band = row_len < STBI__PNG_BAND ? STBI__PNG_BAND / row_len : 1;
+    if (band > y) band = y;
+    
+    final = (stbi_uc *) stbi__malloc_mad3(x, y, pal_out_n ? pal_out_n : (int) (stride / x), 0);
+    rows = (stbi_uc *) stbi__scratch_malloc(s->alloc, stride * 2);
+    if (pal_out_n) idx = (stbi_uc *) stbi__scratch_malloc(s->alloc, stride * band);
+    if (!final || !rows || (pal_out_n && !idx)) {
+        STBI_FREE(final);
+        stbi__scratch_free(s->alloc, rows);
+        stbi__scratch_free(s->alloc, idx);
+        return stbi__err("outofmem", "Out of memory");
+    }
+    save[0] = rows;
+    save[1] = rows + stride;
+    
+    for (row=0; row < y && ok; row += n) {
+        stbi_uc *out = final + stride*row;
+        n = y - row < band ? y - row : band;
+        a->band_out = pal_out_n ? idx : out;
+        a->band_prior = row ? save[0] : NULL;
+        a->band_save = save[1];
+        ok = stbi__create_png_image_raw(a, raw + (size_t) row*row_len, n*row_len, out_n, x, n, depth, color);
+        if (ok) {
+            if (pal_out_n)
+                stbi__png_expand_pixels(final + (size_t) row * x * pal_out_n, idx, x*n, palette, pal_out_n);
+            else if (depth == 16)
+                stbi__png_trans16_pixels((stbi__uint16 *) out, x*n, tc16, out_n);
+            else
+                stbi__png_trans_pixels(out, x*n, tc, out_n);
+        }
+        t = save[0]; save[0] = save[1]; save[1] = t;
+    }
+    
+    a->band_out = a->band_prior = a->band_save = NULL;
+    stbi__scratch_free(s->alloc, rows);
+    stbi__scratch_free(s->alloc, idx);
+    if (!ok) {
+        STBI_FREE(final);
+        a->out = NULL;
+        return 0;
+    }
+    a->out = final;
+    return 1;
 }
 
 static void stbi__de_iphone(stbi__png *z)
@@ -4698,7 +8783,7 @@ static void stbi__de_iphone(stbi__png *z)
         }
     } else {
         STBI_ASSERT(s->img_out_n == 4);
-        if (stbi__unpremultiply_on_load) {
+        if (s->unpremultiply) {
             // convert bgr to rgb and unpremultiply
             for (i=0; i < pixel_count; ++i) {
                 stbi_uc a = p[3];
@@ -4736,10 +8821,14 @@ static int stbi__parse_png_file(stbi__png *z, int scan, int req_comp)
     stbi__uint32 ioff=0, idata_limit=0, i, pal_len=0;
     int first=1,k,interlace=0, color=0, is_iphone=0;
     stbi__context *s = z->s;
+    STBI__PROF_VAR(t)
     
     z->expanded = NULL;
     z->idata = NULL;
     z->out = NULL;
+    z->band_prior = NULL;
+    z->band_save = NULL;
+    z->band_out = NULL;
     
     if (!stbi__check_png_header(s)) return 0;
     
@@ -4830,7 +8919,7 @@ static int stbi__parse_png_file(stbi__png *z, int scan, int req_comp)
                     while (ioff + c.length > idata_limit)
                         idata_limit *= 2;
                     STBI_NOTUSED(idata_limit_old);
-                    p = (stbi_uc *) STBI_REALLOC_SIZED(z->idata, idata_limit_old, idata_limit); if (p == NULL) return stbi__err("outofmem", "Out of memory");
+                    p = (stbi_uc *) stbi__scratch_realloc(s->alloc, z->idata, idata_limit_old, idata_limit); if (p == NULL) return stbi__err("outofmem", "Out of memory");
                     z->idata = p;
                 }
                 if (!stbi__getn(s, z->idata+ioff,c.length)) return stbi__err("outofdata","Corrupt PNG");
@@ -4840,41 +8929,74 @@ static int stbi__parse_png_file(stbi__png *z, int scan, int req_comp)
                 
             case STBI__PNG_TYPE('I','E','N','D'): {
                 stbi__uint32 raw_len, bpl;
+                int ok, banded = 0, pal_out_n = req_comp >= 3 ? req_comp : pal_img_n;
                 if (first) return stbi__err("first not IHDR", "Corrupt PNG");
                 if (scan != STBI__SCAN_load) return 1;
                 if (z->idata == NULL) return stbi__err("no IDAT","Corrupt PNG");
-                // initial guess for decoded data size to avoid unnecessary reallocs
-                bpl = (s->img_x * z->depth + 7) / 8; // bytes per line, per component
-                raw_len = bpl * s->img_y * s->img_n /* pixels */ + s->img_y /* filter mode per row */;
-                z->expanded = (stbi_uc *) stbi_zlib_decode_malloc_guesssize_headerflag((char *) z->idata, ioff, raw_len, (int *) &raw_len, !is_iphone);
-                if (z->expanded == NULL) return 0; // zlib should set error
-                STBI_FREE(z->idata); z->idata = NULL;
+                if (z->defer) {
+                    stbi__png_deferred *d = z->defer;
+                    memcpy(d->palette, palette, sizeof(palette));
+                    memcpy(d->tc, tc, sizeof(tc));
+                    memcpy(d->tc16, tc16, sizeof(tc16));
+                    d->pal_img_n = pal_img_n;
+                    d->has_trans = has_trans;
+                    d->pal_len   = pal_len;
+                    d->idata_len = ioff;
+                    d->interlace = interlace;
+                    d->color     = color;
+                    d->is_iphone = is_iphone;
+                    return 1;
+                }
                 if ((req_comp == s->img_n+1 && req_comp != 3 && !pal_img_n) || has_trans)
                     s->img_out_n = s->img_n+1;
                 else
                     s->img_out_n = s->img_n;
-                if (!stbi__create_png_image(z, z->expanded, raw_len, s->img_out_n, z->depth, color, interlace)) return 0;
-                if (has_trans) {
+#ifndef STBI_NO_THREADS
+                if (s->num_threads > 1) {
+                    if (!stbi__create_png_image_mt(z, ioff, s->img_out_n, z->depth, color, interlace, !is_iphone)) return 0;
+                } else
+#endif
+                {
+                    // initial guess for decoded data size to avoid unnecessary reallocs
+                    bpl = (s->img_x * z->depth + 7) / 8; // bytes per line, per component
+                    raw_len = bpl * s->img_y * s->img_n /* pixels */ + s->img_y /* filter mode per row */;
+                    STBI__PROF_START(t);
+                    z->expanded = (stbi_uc *) stbi__zlib_decode_scratch(s->alloc, (char *) z->idata, ioff, raw_len, (int *) &raw_len, !is_iphone);
+                    STBI__PROF_END(STBI_stage_png_inflate, t);
+                    if (z->expanded == NULL) return 0; // zlib should set error
+                    stbi__scratch_free(s->alloc, z->idata); z->idata = NULL;
+                    STBI__PROF_START(t);
+                    banded = !interlace && !is_iphone && (pal_img_n || has_trans);
+                    if (banded)
+                        ok = stbi__create_png_image_banded(z, z->expanded, raw_len, s->img_out_n, z->depth, color,
+                                                           palette, pal_img_n ? pal_out_n : 0, has_trans ? tc : NULL, has_trans ? tc16 : NULL);
+                    else
+                        ok = stbi__create_png_image(z, z->expanded, raw_len, s->img_out_n, z->depth, color, interlace);
+                    STBI__PROF_END(STBI_stage_png_unfilter, t);
+                    if (!ok) return 0;
+                }
+                STBI__PROF_START(t);
+                if (has_trans && !banded) {
                     if (z->depth == 16) {
                         if (!stbi__compute_transparency16(z, tc16, s->img_out_n)) return 0;
                     } else {
                         if (!stbi__compute_transparency(z, tc, s->img_out_n)) return 0;
                     }
                 }
-                if (is_iphone && stbi__de_iphone_flag && s->img_out_n > 2)
+                if (is_iphone && s->de_iphone && s->img_out_n > 2)
                     stbi__de_iphone(z);
                 if (pal_img_n) {
                     // pal_img_n == 3 or 4
                     s->img_n = pal_img_n; // record the actual colors we had
-                    s->img_out_n = pal_img_n;
-                    if (req_comp >= 3) s->img_out_n = req_comp;
-                    if (!stbi__expand_png_palette(z, palette, pal_len, s->img_out_n))
+                    s->img_out_n = pal_out_n;
+                    if (!banded && !stbi__expand_png_palette(z, palette, pal_len, s->img_out_n))
                         return 0;
                 } else if (has_trans) {
                     // non-paletted image with tRNS -> source image has (constant) alpha
                     ++s->img_n;
                 }
-                STBI_FREE(z->expanded); z->expanded = NULL;
+                STBI__PROF_END(STBI_stage_convert, t);
+                stbi__scratch_free(s->alloc, z->expanded); z->expanded = NULL;
                 return 1;
             }
                 
@@ -4911,21 +9033,15 @@ static void *stbi__do_png(stbi__png *p, int *x, int *y, int *n, int req_comp, st
             ri->bits_per_channel = p->depth;
         result = p->out;
         p->out = NULL;
-        if (req_comp && req_comp != p->s->img_out_n) {
-            if (ri->bits_per_channel == 8)
-                result = stbi__convert_format((unsigned char *) result, p->s->img_out_n, req_comp, p->s->img_x, p->s->img_y);
-            else
-                result = stbi__convert_format16((stbi__uint16 *) result, p->s->img_out_n, req_comp, p->s->img_x, p->s->img_y);
-            p->s->img_out_n = req_comp;
-            if (result == NULL) return result;
-        }
+        if (req_comp && req_comp != p->s->img_out_n)
+            ri->num_channels = p->s->img_out_n; // the postprocess pass converts, along with any bit depth
         *x = p->s->img_x;
         *y = p->s->img_y;
         if (n) *n = p->s->img_n;
     }
     STBI_FREE(p->out);      p->out      = NULL;
-    STBI_FREE(p->expanded); p->expanded = NULL;
-    STBI_FREE(p->idata);    p->idata    = NULL;
+    stbi__scratch_free(p->s->alloc, p->expanded); p->expanded = NULL;
+    stbi__scratch_free(p->s->alloc, p->idata);    p->idata    = NULL;
     
     return result;
 }
@@ -4934,6 +9050,7 @@ static void *stbi__png_load(stbi__context *s, int *x, int *y, int *comp, int req
 {
     stbi__png p;
     p.s = s;
+    p.defer = NULL;
     return stbi__do_png(&p, x,y,comp,req_comp, ri);
 }
 
@@ -5139,14 +9256,20 @@ static void *stbi__bmp_parse_header(stbi__context *s, stbi__bmp_data *info)
     return (void *) 1;
 }
 
+// frees what stbi__rows_alloc returned, unless it's the caller's buffer
+static void stbi__rows_free(stbi__context *s, stbi_uc *out)
+{
+    if (out != s->into) STBI_FREE(out);
+}
 
 static void *stbi__bmp_load(stbi__context *s, int *x, int *y, int *comp, int req_comp, stbi__result_info *ri)
 {
-    stbi_uc *out;
+    stbi_uc *out, *line = NULL;
     unsigned int mr=0,mg=0,mb=0,ma=0, all_a;
     stbi_uc pal[256][4];
     int psize=0,i,j,width;
-    int flip_vertically, pad, target;
+    int flip_vertically, pad, target, flip;
+    size_t stride;
     stbi__bmp_data info;
     STBI_NOTUSED(ri);
     
@@ -5181,11 +9304,14 @@ static void *stbi__bmp_load(stbi__context *s, int *x, int *y, int *comp, int req
     if (!stbi__mad3sizes_valid(target, s->img_x, s->img_y, 0))
         return stbi__errpuc("too large", "Corrupt BMP");
     
-    out = (stbi_uc *) stbi__malloc_mad3(target, s->img_x, s->img_y, 0);
-    if (!out) return stbi__errpuc("outofmem", "Out of memory");
+    // rows are written to where they end up, so bottom-up files need no flip
+    out = stbi__rows_alloc(s, s->img_x, s->img_y, target, req_comp, &stride, &flip);
+    if (!out) return NULL;
+    flip ^= flip_vertically;
+#define STBI__BMP_ROW(j)  (out + stride * (flip ? (int) s->img_y-1-(j) : (j)))
     if (info.bpp < 16) {
-        int z=0;
-        if (psize == 0 || psize > 256) { STBI_FREE(out); return stbi__errpuc("invalid", "Corrupt BMP"); }
+        int z;
+        if (psize == 0 || psize > 256) { stbi__rows_free(s, out); return stbi__errpuc("invalid", "Corrupt BMP"); }
         for (i=0; i < psize; ++i) {
             pal[i][2] = stbi__get8(s);
             pal[i][1] = stbi__get8(s);
@@ -5197,16 +9323,18 @@ static void *stbi__bmp_load(stbi__context *s, int *x, int *y, int *comp, int req
         if (info.bpp == 1) width = (s->img_x + 7) >> 3;
         else if (info.bpp == 4) width = (s->img_x + 1) >> 1;
         else if (info.bpp == 8) width = s->img_x;
-        else { STBI_FREE(out); return stbi__errpuc("bad bpp", "Corrupt BMP"); }
+        else { stbi__rows_free(s, out); return stbi__errpuc("bad bpp", "Corrupt BMP"); }
         pad = (-width)&3;
         if (info.bpp == 1) {
             for (j=0; j < (int) s->img_y; ++j) {
+                stbi_uc *o = STBI__BMP_ROW(j);
                 int bit_offset = 7, v = stbi__get8(s);
-                for (i=0; i < (int) s->img_x; ++i) {
+                for (i=0, z=0; i < (int) s->img_x; ++i) {
                     int color = (v>>bit_offset)&0x1;
-                    out[z++] = pal[color][0];
-                    out[z++] = pal[color][1];
-                    out[z++] = pal[color][2];
+                    o[z++] = pal[color][0];
+                    o[z++] = pal[color][1];
+                    o[z++] = pal[color][2];
+                    if (target == 4) o[z++] = 255;
                     if((--bit_offset) < 0) {
                         bit_offset = 7;
                         v = stbi__get8(s);
@@ -5216,29 +9344,30 @@ static void *stbi__bmp_load(stbi__context *s, int *x, int *y, int *comp, int req
             }
         } else {
             for (j=0; j < (int) s->img_y; ++j) {
-                for (i=0; i < (int) s->img_x; i += 2) {
+                stbi_uc *o = STBI__BMP_ROW(j);
+                for (i=0, z=0; i < (int) s->img_x; i += 2) {
                     int v=stbi__get8(s),v2=0;
                     if (info.bpp == 4) {
                         v2 = v & 15;
                         v >>= 4;
                     }
-                    out[z++] = pal[v][0];
-                    out[z++] = pal[v][1];
-                    out[z++] = pal[v][2];
-                    if (target == 4) out[z++] = 255;
+                    o[z++] = pal[v][0];
+                    o[z++] = pal[v][1];
+                    o[z++] = pal[v][2];
+                    if (target == 4) o[z++] = 255;
                     if (i+1 == (int) s->img_x) break;
                     v = (info.bpp == 8) ? stbi__get8(s) : v2;
-                    out[z++] = pal[v][0];
-                    out[z++] = pal[v][1];
-                    out[z++] = pal[v][2];
-                    if (target == 4) out[z++] = 255;
+                    o[z++] = pal[v][0];
+                    o[z++] = pal[v][1];
+                    o[z++] = pal[v][2];
+                    if (target == 4) o[z++] = 255;
                 }
                 stbi__skip(s, pad);
             }
         }
     } else {
         int rshift=0,gshift=0,bshift=0,ashift=0,rcount=0,gcount=0,bcount=0,acount=0;
-        int z = 0;
+        int z;
         int easy=0;
         stbi__skip(s, info.offset - 14 - info.hsz);
         if (info.bpp == 24) width = 3 * s->img_x;
@@ -5252,62 +9381,68 @@ static void *stbi__bmp_load(stbi__context *s, int *x, int *y, int *comp, int req
                 easy = 2;
         }
         if (!easy) {
-            if (!mr || !mg || !mb) { STBI_FREE(out); return stbi__errpuc("bad masks", "Corrupt BMP"); }
+            if (!mr || !mg || !mb) { stbi__rows_free(s, out); return stbi__errpuc("bad masks", "Corrupt BMP"); }
             // right shift amt to put high bit in position #7
             rshift = stbi__high_bit(mr)-7; rcount = stbi__bitcount(mr);
             gshift = stbi__high_bit(mg)-7; gcount = stbi__bitcount(mg);
             bshift = stbi__high_bit(mb)-7; bcount = stbi__bitcount(mb);
             ashift = stbi__high_bit(ma)-7; acount = stbi__bitcount(ma);
+        } else if (target != easy + 2) {
+            // adding or dropping alpha needs the row somewhere if it isn't in memory
+            line = (stbi_uc *) stbi__scratch_malloc(s->alloc, s->img_x * 4);
+            if (!line) { stbi__rows_free(s, out); return stbi__errpuc("outofmem", "Out of memory"); }
         }
         for (j=0; j < (int) s->img_y; ++j) {
+            stbi_uc *o = STBI__BMP_ROW(j);
             if (easy) {
-                for (i=0; i < (int) s->img_x; ++i) {
-                    unsigned char a;
-                    out[z+2] = stbi__get8(s);
-                    out[z+1] = stbi__get8(s);
-                    out[z+0] = stbi__get8(s);
-                    z += 3;
-                    a = (easy == 2 ? stbi__get8(s) : 255);
-                    all_a |= a;
-                    if (target == 4) out[z++] = a;
+                // BGR(A) rows, swapped straight from the file to the output
+                int n = easy + 2;
+                stbi_uc *buf = target == n ? o : line;
+                stbi_uc const *p = stbi__getn_inplace(s, buf, s->img_x * n);
+                if (!p) {
+                    memset(buf, 0, s->img_x * n); // as stbi__get8 would read
+                    p = buf;
+                }
+                if (easy == 2 && !all_a)
+                    for (i=0; i < (int) s->img_x; ++i)
+                        all_a |= p[i*4+3];
+                if (target == n) {
+                    stbi__swap_rb(o, p, s->img_x, n);
+                } else {
+                    for (i=0; i < (int) s->img_x; ++i, p += n, o += target) {
+                        o[0] = p[2];
+                        o[1] = p[1];
+                        o[2] = p[0];
+                        if (target == 4) o[3] = 255;
+                    }
                 }
             } else {
                 int bpp = info.bpp;
-                for (i=0; i < (int) s->img_x; ++i) {
+                for (i=0, z=0; i < (int) s->img_x; ++i) {
                     stbi__uint32 v = (bpp == 16 ? (stbi__uint32) stbi__get16le(s) : stbi__get32le(s));
                     unsigned int a;
-                    out[z++] = STBI__BYTECAST(stbi__shiftsigned(v & mr, rshift, rcount));
-                    out[z++] = STBI__BYTECAST(stbi__shiftsigned(v & mg, gshift, gcount));
-                    out[z++] = STBI__BYTECAST(stbi__shiftsigned(v & mb, bshift, bcount));
+                    o[z++] = STBI__BYTECAST(stbi__shiftsigned(v & mr, rshift, rcount));
+                    o[z++] = STBI__BYTECAST(stbi__shiftsigned(v & mg, gshift, gcount));
+                    o[z++] = STBI__BYTECAST(stbi__shiftsigned(v & mb, bshift, bcount));
                     a = (ma ? stbi__shiftsigned(v & ma, ashift, acount) : 255);
                     all_a |= a;
-                    if (target == 4) out[z++] = STBI__BYTECAST(a);
+                    if (target == 4) o[z++] = STBI__BYTECAST(a);
                 }
             }
             stbi__skip(s, pad);
         }
+        stbi__scratch_free(s->alloc, line);
     }
     
     // if alpha channel is all 0s, replace with all 255s
     if (target == 4 && all_a == 0)
-        for (i=4*s->img_x*s->img_y-1; i >= 0; i -= 4)
-            out[i] = 255;
-    
-    if (flip_vertically) {
-        stbi_uc t;
-        for (j=0; j < (int) s->img_y>>1; ++j) {
-            stbi_uc *p1 = out +      j     *s->img_x*target;
-            stbi_uc *p2 = out + (s->img_y-1-j)*s->img_x*target;
-            for (i=0; i < (int) s->img_x*target; ++i) {
-                t = p1[i], p1[i] = p2[i], p2[i] = t;
-            }
-        }
-    }
+        for (j=0; j < (int) s->img_y; ++j)
+            for (i=0; i < (int) s->img_x; ++i)
+                out[stride*j + i*4 + 3] = 255;
+#undef STBI__BMP_ROW
     
-    if (req_comp && req_comp != target) {
-        out = stbi__convert_format(out, target, req_comp, s->img_x, s->img_y);
-        if (out == NULL) return out; // stbi__convert_format frees input on failure
-    }
+    if (req_comp && req_comp != target)
+        ri->num_channels = target; // the postprocess pass converts
     
     *x = s->img_x;
     *y = s->img_y;
@@ -5503,19 +9638,31 @@ static void *stbi__tga_load(stbi__context *s, int *x, int *y, int *comp, int req
     if (!stbi__mad3sizes_valid(tga_width, tga_height, tga_comp, 0))
         return stbi__errpuc("too large", "Corrupt TGA");
     
-    tga_data = (unsigned char*)stbi__malloc_mad3(tga_width, tga_height, tga_comp, 0);
-    if (!tga_data) return stbi__errpuc("outofmem", "Out of memory");
-    
     // skip to the data's starting position (offset usually = 0)
     stbi__skip(s, tga_offset );
     
     if ( !tga_indexed && !tga_is_RLE && !tga_rgb16 ) {
+        // each row goes straight from the file to where it ends up, with
+        // BGR(A) swapped on the way
+        size_t stride;
+        int flip;
+        tga_data = stbi__rows_alloc(s, tga_width, tga_height, tga_comp, req_comp, &stride, &flip);
+        if (!tga_data) return NULL;
+        flip ^= tga_inverted;
         for (i=0; i < tga_height; ++i) {
-            int row = tga_inverted ? tga_height -i - 1 : i;
-            stbi_uc *tga_row = tga_data + row*tga_width*tga_comp;
-            stbi__getn(s, tga_row, tga_width * tga_comp);
+            stbi_uc *tga_row = tga_data + stride * (flip ? tga_height - i - 1 : i);
+            stbi_uc const *p = stbi__getn_inplace(s, tga_row, tga_width * tga_comp);
+            if (!p)
+                memset(tga_row, 0, tga_width * tga_comp);
+            else if (tga_comp >= 3)
+                stbi__swap_rb(tga_row, p, tga_width, tga_comp);
+            else if (p != tga_row)
+                memcpy(tga_row, p, tga_width * tga_comp);
         }
     } else  {
+        tga_data = (unsigned char*)stbi__malloc_mad3(tga_width, tga_height, tga_comp, 0);
+        if (!tga_data) return stbi__errpuc("outofmem", "Out of memory");
+        
         //   do I need to load a palette?
         if ( tga_indexed)
         {
@@ -5619,24 +9766,15 @@ static void *stbi__tga_load(stbi__context *s, int *x, int *y, int *comp, int req
         {
             STBI_FREE( tga_palette );
         }
+        
+        // swap RGB - if the source data was RGB16, it already is in the right order
+        if (tga_comp >= 3 && !tga_rgb16)
+            stbi__swap_rb(tga_data, tga_data, tga_width * tga_height, tga_comp);
     }
     
-    // swap RGB - if the source data was RGB16, it already is in the right order
-    if (tga_comp >= 3 && !tga_rgb16)
-    {
-        unsigned char* tga_pixel = tga_data;
-        for (i=0; i < tga_width * tga_height; ++i)
-        {
-            unsigned char temp = tga_pixel[0];
-            tga_pixel[0] = tga_pixel[2];
-            tga_pixel[2] = temp;
-            tga_pixel += tga_comp;
-        }
-    }
-    
-    // convert to target component count
+    // converting to the target component count is left to the postprocess pass
     if (req_comp && req_comp != tga_comp)
-        tga_data = stbi__convert_format(tga_data, tga_comp, req_comp, tga_width, tga_height);
+        ri->num_channels = tga_comp;
     
     //   the things I do to get rid of an error message, and yet keep
     //   Microsoft's C compilers happy... [8^(
@@ -5658,12 +9796,38 @@ static int stbi__psd_test(stbi__context *s)
     return r;
 }
 
-static int stbi__psd_decode_rle(stbi__context *s, stbi_uc *p, int pixelCount)
+// n bytes of the file into p; past its end they're zero, as stbi__get8's are
+static void stbi__psd_getn(stbi__context *s, stbi_uc *p, int n)
+{
+    // stbi__skip can leave a memory context's position past its end
+    int got = s->img_buffer < s->img_buffer_end ? (int) (s->img_buffer_end - s->img_buffer) : 0;
+    if (got >= n) {
+        memcpy(p, s->img_buffer, n);
+        s->img_buffer += n;
+        return;
+    }
+    memcpy(p, s->img_buffer, got);
+    s->img_buffer = s->img_buffer_end;
+    if (s->read_from_callbacks) {
+        int count = (s->io.read)(s->io_user_data, (char *) p + got, n - got);
+        if (count > 0) got += count;
+    }
+    memset(p + got, 0, n - got);
+}
+
+// RLE as used by .PSD and .TIFF
+// Loop until you get the number of unpacked bytes you are expecting:
+//     Read the next source byte into n.
+//     If n is between 0 and 127 inclusive, copy the next n+1 bytes literally.
+//     Else if n is between -127 and -1 inclusive, copy the next byte -n+1 times.
+//     Else if n is 128, noop.
+// Endloop
+static int stbi__psd_decode_rle(stbi__context *s, stbi_uc *p, int n)
 {
     int count, nleft, len;
     
     count = 0;
-    while ((nleft = pixelCount - count) > 0) {
+    while ((nleft = n - count) > 0) {
         len = stbi__get8(s);
         if (len == 128) {
             // No-op.
@@ -5671,65 +9835,226 @@ static int stbi__psd_decode_rle(stbi__context *s, stbi_uc *p, int pixelCount)
             // Copy next len+1 bytes literally.
             len++;
             if (len > nleft) return 0; // corrupt data
+            stbi__psd_getn(s, p + count, len);
             count += len;
-            while (len) {
-                *p = stbi__get8(s);
-                p += 4;
-                len--;
-            }
         } else if (len > 128) {
-            stbi_uc   val;
             // Next -len+1 bytes in the dest are replicated from next source byte.
             // (Interpret len as a negative 8-bit int.)
             len = 257 - len;
             if (len > nleft) return 0; // corrupt data
-            val = stbi__get8(s);
+            memset(p + count, stbi__get8(s), len);
             count += len;
-            while (len) {
-                *p = val;
-                p += 4;
-                len--;
-            }
         }
     }
     
     return 1;
 }
 
-static void *stbi__psd_load(stbi__context *s, int *x, int *y, int *comp, int req_comp, stbi__result_info *ri, int bpc)
+// the end of one channel's n bytes of RLE data starting at p, without
+// decoding it, or NULL if it's corrupt or runs past end
+static stbi_uc const *stbi__psd_rle_skip(stbi_uc const *p, stbi_uc const *end, int n)
+{
+    while (n > 0) {
+        int len;
+        if (p == end) return NULL;
+        len = *p++;
+        if (len < 128) {
+            len++;
+            if (len > n || len > end - p) return NULL;
+            p += len;
+            n -= len;
+        } else if (len > 128) {
+            len = 257 - len;
+            if (len > n || p == end) return NULL;
+            p++;
+            n -= len;
+        }
+    }
+    return p;
+}
+
+// a channel's RLE data that stbi__psd_rle_skip has checked, decoded a band
+// at a time; a run or literal can carry on from one band into the next
+typedef struct
+{
+    stbi_uc const *p;
+    int left;  // bytes of the current run or literal still to come
+    int fill;  // whether it's a run
+} stbi__psd_rle;
+
+static void stbi__psd_rle_band(stbi__psd_rle *z, stbi_uc *dest, int n)
+{
+    while (n > 0) {
+        int len;
+        if (!z->left) {
+            len = *z->p++;
+            if (len == 128) continue;
+            z->fill = len > 128;
+            z->left = z->fill ? 257 - len : len + 1;
+        }
+        len = z->left < n ? z->left : n;
+        if (z->fill) {
+            memset(dest, *z->p, len);
+        } else {
+            memcpy(dest, z->p, len);
+            z->p += len;
+        }
+        dest += len;
+        n -= len;
+        z->left -= len;
+        if (z->fill && !z->left) z->p++;
+    }
+}
+
+// count pixels of the first n (up to 4) channel planes, stored as bps (1 or
+// 2) big-endian bytes per sample, to RGBA: 8-bit, with 16-bit samples
+// rounded as stbi__reduce_16_to_8 does, or 16-bit if wide. the channels
+// past n are 0, or opaque for alpha
+static void stbi__psd_interleave(stbi_uc *out, stbi_uc const *plane[4], int n, int bps, int wide, int count)
+{
+    int i = 0, c;
+#ifdef STBI_SSE2
+    if (stbi__sse2_available()) {
+        __m128i v[4], lo, hi;
+        if (!wide) {
+            // 16 pixels at a time: bytes r,g and b,a pair up, then the pairs
+            __m128i bias = _mm_set1_epi16(128);
+            for (; i+16 <= count; i += 16) {
+                __m128i rg, ba;
+                for (c=0; c < 4; ++c) {
+                    if (c >= n) {
+                        v[c] = _mm_set1_epi8(c == 3 ? -1 : 0);
+                    } else if (bps == 1) {
+                        v[c] = _mm_loadu_si128((__m128i const *) (plane[c] + i));
+                    } else {
+                        lo = _mm_loadu_si128((__m128i const *) (plane[c] + i*2));
+                        hi = _mm_loadu_si128((__m128i const *) (plane[c] + i*2 + 16));
+                        lo = _mm_adds_epu16(_mm_or_si128(_mm_slli_epi16(lo, 8), _mm_srli_epi16(lo, 8)), bias);
+                        hi = _mm_adds_epu16(_mm_or_si128(_mm_slli_epi16(hi, 8), _mm_srli_epi16(hi, 8)), bias);
+                        lo = _mm_srli_epi16(_mm_sub_epi16(lo, _mm_srli_epi16(lo, 8)), 8);
+                        hi = _mm_srli_epi16(_mm_sub_epi16(hi, _mm_srli_epi16(hi, 8)), 8);
+                        v[c] = _mm_packus_epi16(lo, hi);
+                    }
+                }
+                rg = _mm_unpacklo_epi8(v[0], v[1]);
+                ba = _mm_unpacklo_epi8(v[2], v[3]);
+                _mm_storeu_si128((__m128i *) (out + i*4),      _mm_unpacklo_epi16(rg, ba));
+                _mm_storeu_si128((__m128i *) (out + i*4 + 16), _mm_unpackhi_epi16(rg, ba));
+                rg = _mm_unpackhi_epi8(v[0], v[1]);
+                ba = _mm_unpackhi_epi8(v[2], v[3]);
+                _mm_storeu_si128((__m128i *) (out + i*4 + 32), _mm_unpacklo_epi16(rg, ba));
+                _mm_storeu_si128((__m128i *) (out + i*4 + 48), _mm_unpackhi_epi16(rg, ba));
+            }
+        } else {
+            // 8 pixels at a time, byte swapped, then paired up the same way
+            for (; i+8 <= count; i += 8) {
+                for (c=0; c < 4; ++c) {
+                    if (c >= n) {
+                        v[c] = _mm_set1_epi16(c == 3 ? -1 : 0);
+                    } else {
+                        lo = _mm_loadu_si128((__m128i const *) (plane[c] + i*2));
+                        v[c] = _mm_or_si128(_mm_slli_epi16(lo, 8), _mm_srli_epi16(lo, 8));
+                    }
+                }
+                lo = _mm_unpacklo_epi16(v[0], v[1]);
+                hi = _mm_unpacklo_epi16(v[2], v[3]);
+                _mm_storeu_si128((__m128i *) (out + i*8),      _mm_unpacklo_epi32(lo, hi));
+                _mm_storeu_si128((__m128i *) (out + i*8 + 16), _mm_unpackhi_epi32(lo, hi));
+                lo = _mm_unpackhi_epi16(v[0], v[1]);
+                hi = _mm_unpackhi_epi16(v[2], v[3]);
+                _mm_storeu_si128((__m128i *) (out + i*8 + 32), _mm_unpacklo_epi32(lo, hi));
+                _mm_storeu_si128((__m128i *) (out + i*8 + 48), _mm_unpackhi_epi32(lo, hi));
+            }
+        }
+    }
+#endif
+    for (c=0; c < 4; ++c) {
+        int k;
+        if (wide) {
+            stbi__uint16 *q = (stbi__uint16 *) out + c;
+            if (c >= n) {
+                stbi__uint16 val = c == 3 ? 65535 : 0;
+                for (k=i; k < count; ++k) q[k*4] = val;
+            } else {
+                for (k=i; k < count; ++k) q[k*4] = (stbi__uint16) ((plane[c][k*2] << 8) | plane[c][k*2+1]);
+            }
+        } else {
+            stbi_uc *p = out + c;
+            if (c >= n) {
+                stbi_uc val = c == 3 ? 255 : 0;
+                for (k=i; k < count; ++k) p[k*4] = val;
+            } else if (bps == 1) {
+                for (k=i; k < count; ++k) p[k*4] = plane[c][k];
+            } else {
+                for (k=i; k < count; ++k) {
+                    unsigned int t = ((plane[c][k*2] << 8) | plane[c][k*2+1]) + 128;
+                    if (t > 65535) t = 65535;
+                    p[k*4] = (stbi_uc) ((t - (t >> 8)) >> 8);
+                }
+            }
+        }
+    }
+}
+
+// remove weird white matte from PSD
+static void stbi__psd_unmatte(stbi_uc *out, int count, int wide)
+{
+    int i;
+    if (wide) {
+        for (i=0; i < count; ++i) {
+            stbi__uint16 *pixel = (stbi__uint16 *) out + 4*i;
+            if (pixel[3] != 0 && pixel[3] != 65535) {
+                float a = pixel[3] / 65535.0f;
+                float ra = 1.0f / a;
+                float inv_a = 65535.0f * (1 - ra);
+                pixel[0] = (stbi__uint16) (pixel[0]*ra + inv_a);
+                pixel[1] = (stbi__uint16) (pixel[1]*ra + inv_a);
+                pixel[2] = (stbi__uint16) (pixel[2]*ra + inv_a);
+            }
+        }
+    } else {
+        for (i=0; i < count; ++i) {
+            unsigned char *pixel = out + 4*i;
+            if (pixel[3] != 0 && pixel[3] != 255) {
+                float a = pixel[3] / 255.0f;
+                float ra = 1.0f / a;
+                float inv_a = 255.0f * (1 - ra);
+                pixel[0] = (unsigned char) (pixel[0]*ra + inv_a);
+                pixel[1] = (unsigned char) (pixel[1]*ra + inv_a);
+                pixel[2] = (unsigned char) (pixel[2]*ra + inv_a);
+            }
+        }
+    }
+}
+
+// reads the header up to the image data, leaving the context at the
+// compression type
+static int stbi__psd_header(stbi__context *s, int *w, int *h, int *channelCount, int *bitdepth)
 {
-    int pixelCount;
-    int channelCount, compression;
-    int channel, i;
-    int bitdepth;
-    int w,h;
-    stbi_uc *out;
-    STBI_NOTUSED(ri);
-    
     // Check identifier
     if (stbi__get32be(s) != 0x38425053)   // "8BPS"
-        return stbi__errpuc("not PSD", "Corrupt PSD image");
+        return stbi__err("not PSD", "Corrupt PSD image");
     
     // Check file type version.
     if (stbi__get16be(s) != 1)
-        return stbi__errpuc("wrong version", "Unsupported version of PSD image");
+        return stbi__err("wrong version", "Unsupported version of PSD image");
     
     // Skip 6 reserved bytes.
     stbi__skip(s, 6 );
     
     // Read the number of channels (R, G, B, A, etc).
-    channelCount = stbi__get16be(s);
-    if (channelCount < 0 || channelCount > 16)
-        return stbi__errpuc("wrong channel count", "Unsupported number of channels in PSD image");
+    *channelCount = stbi__get16be(s);
+    if (*channelCount < 0 || *channelCount > 16)
+        return stbi__err("wrong channel count", "Unsupported number of channels in PSD image");
     
     // Read the rows and columns of the image.
-    h = stbi__get32be(s);
-    w = stbi__get32be(s);
+    *h = stbi__get32be(s);
+    *w = stbi__get32be(s);
     
     // Make sure the depth is 8 bits.
-    bitdepth = stbi__get16be(s);
-    if (bitdepth != 8 && bitdepth != 16)
-        return stbi__errpuc("unsupported bit depth", "PSD bit depth is not 8 or 16 bit");
+    *bitdepth = stbi__get16be(s);
+    if (*bitdepth != 8 && *bitdepth != 16)
+        return stbi__err("unsupported bit depth", "PSD bit depth is not 8 or 16 bit");
     
     // Make sure the color mode is RGB.
     // Valid options are:
@@ -5742,7 +10067,7 @@ static void *stbi__psd_load(stbi__context *s, int *x, int *y, int *comp, int req
     //   8: Duotone
     //   9: Lab color
     if (stbi__get16be(s) != 3)
-        return stbi__errpuc("wrong color format", "PSD is not in RGB color format");
+        return stbi__err("wrong color format", "PSD is not in RGB color format");
     
     // Skip the Mode Data.  (It's the palette for indexed color; other info for other modes.)
     stbi__skip(s,stbi__get32be(s) );
@@ -5753,6 +10078,30 @@ static void *stbi__psd_load(stbi__context *s, int *x, int *y, int *comp, int req
     // Skip the reserved data.
     stbi__skip(s, stbi__get32be(s) );
     
+    // Check size
+    if (!stbi__mad3sizes_valid(4, *w, *h, 0))
+        return stbi__err("too large", "Corrupt PSD");
+    
+    return 1;
+}
+
+// pixels at a time in a band of the channels' rows
+#define STBI__PSD_BAND 16384
+
+static void *stbi__psd_load(stbi__context *s, int *x, int *y, int *comp, int req_comp, stbi__result_info *ri, int bpc)
+{
+    stbi__psd_rle rle[4];
+    stbi_uc const *start[4], *plane[4];
+    stbi_uc *out, *buf = NULL;
+    int channelCount, compression;
+    int channel, n, j, rows;
+    int bitdepth, bps, wide, direct;
+    int w,h;
+    size_t plane_size;
+    
+    if (!stbi__psd_header(s, &w, &h, &channelCount, &bitdepth))
+        return NULL;
+    
     // Find out if the data is compressed.
     // Known values:
     //   0: no compression
@@ -5761,130 +10110,93 @@ static void *stbi__psd_load(stbi__context *s, int *x, int *y, int *comp, int req
     if (compression > 1)
         return stbi__errpuc("bad compression", "PSD has an unknown compression format");
     
-    // Check size
-    if (!stbi__mad3sizes_valid(4, w, h, 0))
-        return stbi__errpuc("too large", "Corrupt PSD");
-    
     // Create the destination image.
-    
-    if (!compression && bitdepth == 16 && bpc == 16) {
-        out = (stbi_uc *) stbi__malloc_mad3(8, w, h, 0);
-        ri->bits_per_channel = 16;
-    } else
-        out = (stbi_uc *) stbi__malloc(4 * w*h);
-    
+    wide = bitdepth == 16 && bpc == 16;
+    out = (stbi_uc *) stbi__malloc_mad3(wide ? 8 : 4, w, h, 0);
     if (!out) return stbi__errpuc("outofmem", "Out of memory");
-    pixelCount = w*h;
-    
-    // Initialize the data to zero.
-    //memset( out, 0, pixelCount * 4 );
-    
-    // Finally, the image data.
-    if (compression) {
-        // RLE as used by .PSD and .TIFF
-        // Loop until you get the number of unpacked bytes you are expecting:
-        //     Read the next source byte into n.
-        //     If n is between 0 and 127 inclusive, copy the next n+1 bytes literally.
-        //     Else if n is between -127 and -1 inclusive, copy the next byte -n+1 times.
-        //     Else if n is 128, noop.
-        // Endloop
-        
-        // The RLE-compressed data is preceeded by a 2-byte data count for each row in the data,
-        // which we're going to just skip.
+    if (wide) ri->bits_per_channel = 16;
+    
+    // The RLE-compressed data is preceeded by a 2-byte data count for each row in the data,
+    // which we're going to just skip.
+    if (compression)
         stbi__skip(s, h * channelCount * 2 );
-        
-        // Read the RLE data by channel.
-        for (channel = 0; channel < 4; channel++) {
-            stbi_uc *p;
-            
-            p = out+channel;
-            if (channel >= channelCount) {
-                // Fill this channel with default data.
-                for (i = 0; i < pixelCount; i++, p += 4)
-                    *p = (channel == 3 ? 255 : 0);
-            } else {
-                // Read the RLE data.
-                if (!stbi__psd_decode_rle(s, p, pixelCount)) {
-                    STBI_FREE(out);
-                    return stbi__errpuc("corrupt", "bad RLE data");
-                }
-            }
+    
+    // The image data is each channel in order (Red, Green, Blue, Alpha, ...) where each
+    // channel consists of an 8-bit (or 16-bit, big-endian) value for each pixel in the
+    // image; only the first four are used.
+    n = channelCount < 4 ? channelCount : 4;
+    bps = bitdepth / 8;
+    plane_size = (size_t) w * h * bps;
+    
+    // From memory, each channel is used where it is: find where they start,
+    // then decode a band of each one's rows (if it's compressed) at a time
+    // and interleave it, so the channels are never held whole. Otherwise,
+    // or if the data is short or corrupt, read them in whole first.
+    direct = !s->io.read && s->img_buffer <= s->img_buffer_end;
+    if (direct) {
+        stbi_uc const *p = s->img_buffer;
+        for (channel = 0; channel < n && p; ++channel) {
+            start[channel] = p;
+            if (compression)
+                p = stbi__psd_rle_skip(p, s->img_buffer_end, (int) plane_size);
+            else
+                p = (size_t) (s->img_buffer_end - p) >= plane_size ? p + plane_size : NULL;
         }
-        
-    } else {
-        // We're at the raw image data.  It's each channel in order (Red, Green, Blue, Alpha, ...)
-        // where each channel consists of an 8-bit (or 16-bit) value for each pixel in the image.
-        
-        // Read the data by channel.
-        for (channel = 0; channel < 4; channel++) {
-            if (channel >= channelCount) {
-                // Fill this channel with default data.
-                if (bitdepth == 16 && bpc == 16) {
-                    stbi__uint16 *q = ((stbi__uint16 *) out) + channel;
-                    stbi__uint16 val = channel == 3 ? 65535 : 0;
-                    for (i = 0; i < pixelCount; i++, q += 4)
-                        *q = val;
-                } else {
-                    stbi_uc *p = out+channel;
-                    stbi_uc val = channel == 3 ? 255 : 0;
-                    for (i = 0; i < pixelCount; i++, p += 4)
-                        *p = val;
-                }
-            } else {
-                if (ri->bits_per_channel == 16) {    // output bpc
-                    stbi__uint16 *q = ((stbi__uint16 *) out) + channel;
-                    for (i = 0; i < pixelCount; i++, q += 4)
-                        *q = (stbi__uint16) stbi__get16be(s);
-                } else {
-                    stbi_uc *p = out+channel;
-                    if (bitdepth == 16) {  // input bpc
-                        for (i = 0; i < pixelCount; i++, p += 4)
-                            *p = (stbi_uc) (stbi__get16be(s) >> 8);
-                    } else {
-                        for (i = 0; i < pixelCount; i++, p += 4)
-                            *p = stbi__get8(s);
-                    }
-                }
+        direct = p != NULL;
+    }
+    
+    rows = w > 0 && w < STBI__PSD_BAND ? STBI__PSD_BAND / w : 1;
+    if (n && (compression || !direct)) {
+        buf = (stbi_uc *) stbi__scratch_malloc_mad3(s->alloc, n * bps, w, direct ? rows : h, 0);
+        if (!buf) {
+            STBI_FREE(out);
+            return stbi__errpuc("outofmem", "Out of memory");
+        }
+    }
+    for (channel = 0; channel < n; channel++) {
+        if (direct) {
+            rle[channel].p = start[channel];
+            rle[channel].left = 0;
+        } else {
+            stbi_uc *p = buf + channel * plane_size;
+            start[channel] = p;
+            if (!compression) {
+                stbi__psd_getn(s, p, (int) plane_size);
+            } else if (!stbi__psd_decode_rle(s, p, (int) plane_size)) {
+                stbi__scratch_free(s->alloc, buf);
+                STBI_FREE(out);
+                return stbi__errpuc("corrupt", "bad RLE data");
             }
         }
     }
     
-    // remove weird white matte from PSD
-    if (channelCount >= 4) {
-        if (ri->bits_per_channel == 16) {
-            for (i=0; i < w*h; ++i) {
-                stbi__uint16 *pixel = (stbi__uint16 *) out + 4*i;
-                if (pixel[3] != 0 && pixel[3] != 65535) {
-                    float a = pixel[3] / 65535.0f;
-                    float ra = 1.0f / a;
-                    float inv_a = 65535.0f * (1 - ra);
-                    pixel[0] = (stbi__uint16) (pixel[0]*ra + inv_a);
-                    pixel[1] = (stbi__uint16) (pixel[1]*ra + inv_a);
-                    pixel[2] = (stbi__uint16) (pixel[2]*ra + inv_a);
-                }
-            }
-        } else {
-            for (i=0; i < w*h; ++i) {
-                unsigned char *pixel = out + 4*i;
-                if (pixel[3] != 0 && pixel[3] != 255) {
-                    float a = pixel[3] / 255.0f;
-                    float ra = 1.0f / a;
-                    float inv_a = 255.0f * (1 - ra);
-                    pixel[0] = (unsigned char) (pixel[0]*ra + inv_a);
-                    pixel[1] = (unsigned char) (pixel[1]*ra + inv_a);
-                    pixel[2] = (unsigned char) (pixel[2]*ra + inv_a);
-                }
+    for (j = 0; j < h; j += rows) {
+        int count = (h - j < rows ? h - j : rows) * w;
+        size_t first = (size_t) j * w;
+        stbi_uc *o = out + first * (wide ? 8 : 4);
+        for (channel = 0; channel < n; channel++) {
+            if (direct && compression) {
+                stbi_uc *p = buf + (size_t) channel * rows * w * bps;
+                stbi__psd_rle_band(&rle[channel], p, count * bps);
+                plane[channel] = p;
+            } else {
+                plane[channel] = start[channel] + first * bps;
             }
         }
+        stbi__psd_interleave(o, plane, n, bps, wide, count);
+        if (channelCount >= 4)
+            stbi__psd_unmatte(o, count, wide);
     }
+    if (buf) stbi__scratch_free(s->alloc, buf);
     
     // convert to desired output format
     if (req_comp && req_comp != 4) {
-        if (ri->bits_per_channel == 16)
-            out = (stbi_uc *) stbi__convert_format16((stbi__uint16 *) out, 4, req_comp, w, h);
-        else
+        if (ri->bits_per_channel == 16) {
+            ri->num_channels = 4; // the postprocess pass converts, along with the bit depth
+        } else {
             out = stbi__convert_format(out, 4, req_comp, w, h);
-        if (out == NULL) return out; // stbi__convert_format frees input on failure
+            if (out == NULL) return out; // stbi__convert_format frees input on failure
+        }
     }
     
     if (comp) *comp = 4;
@@ -5893,6 +10205,72 @@ static void *stbi__psd_load(stbi__context *s, int *x, int *y, int *comp, int req
     
     return out;
 }
+
+// every channel of the merged image, alpha and extra channels too, as a
+// plane of w*h samples in file order, without the white matte removal;
+// 16-bit samples are reduced to their high byte unless bpc is 16, and 8-bit
+// ones widened if it is
+static void *stbi__psd_load_planes(stbi__context *s, int *x, int *y, int *comp, int bpc)
+{
+    int channelCount, compression;
+    int channel, bitdepth, ob, w, h;
+    size_t i, plane_size, total;
+    stbi_uc *planes, *p;
+    
+    if (!stbi__psd_header(s, &w, &h, &channelCount, &bitdepth))
+        return NULL;
+    if (channelCount < 1)
+        return stbi__errpuc("no channels", "PSD has no channels");
+    compression = stbi__get16be(s);
+    if (compression > 1)
+        return stbi__errpuc("bad compression", "PSD has an unknown compression format");
+    
+    // room for the samples as stored, or widened
+    ob = bpc == 16 ? 2 : 1;
+    planes = (stbi_uc *) stbi__malloc_mad3(channelCount * (bitdepth == 16 ? 2 : ob), w, h, 0);
+    if (!planes) return stbi__errpuc("outofmem", "Out of memory");
+    
+    if (compression)
+        stbi__skip(s, h * channelCount * 2 );
+    plane_size = (size_t) w * h * (bitdepth / 8);
+    for (channel = 0; channel < channelCount; channel++) {
+        p = planes + channel * plane_size;
+        if (!compression) {
+            stbi__psd_getn(s, p, (int) plane_size);
+        } else if (!stbi__psd_decode_rle(s, p, (int) plane_size)) {
+            STBI_FREE(planes);
+            return stbi__errpuc("corrupt", "bad RLE data");
+        }
+    }
+    
+    total = (size_t) w * h * channelCount;
+    if (bitdepth == 16 && ob == 2) {
+        for (i=0; i < total; ++i)
+            ((stbi__uint16 *) planes)[i] = (stbi__uint16) ((planes[i*2] << 8) | planes[i*2+1]);
+    } else if (bitdepth == 16) {
+        // rounded like every other 16-bit to 8-bit reduction
+        for (i=0; i < total; ++i)
+            ((stbi__uint16 *) planes)[i] = (stbi__uint16) ((planes[i*2] << 8) | planes[i*2+1]);
+        stbi__reduce_16_to_8(planes, (stbi__uint16 *) planes, total);
+        p = (stbi_uc *) STBI_REALLOC_SIZED(planes, total*2, total);
+        if (p) planes = p;
+    } else if (ob == 2) {
+        // backwards, so each sample is read before its slot is written
+        for (i=total; i-- > 0; )
+            ((stbi__uint16 *) planes)[i] = (stbi__uint16) (planes[i] * 257);
+    }
+    
+    if (s->flip) {
+        for (channel = 0; channel < channelCount; channel++)
+            stbi__vertical_flip(planes + (size_t) channel * w * h * ob, w, h, ob);
+    }
+    
+    if (comp) *comp = channelCount;
+    *y = h;
+    *x = w;
+    
+    return planes;
+}
 #endif
 
 // *************************************************************************************************
@@ -6140,6 +10518,9 @@ typedef struct
     int cur_x, cur_y;
     int line_size;
     int delay;
+    int frame;                    // frames drawn so far
+    int frame_x, frame_y, frame_w, frame_h; // where the last frame was drawn (in pixels)
+    int dirty_x, dirty_y, dirty_w, dirty_h; // everything the last frame changed, disposal included
 } stbi__gif;
 
 static int stbi__gif_test_raw(stbi__context *s)
@@ -6334,67 +10715,102 @@ static stbi_uc *stbi__process_gif_raster(stbi__context *s, stbi__gif *g)
     }
 }
 
+// read the header and set up the canvas for the first frame
+static int stbi__gif_start(stbi__context *s, stbi__gif *g, int *comp)
+{
+    if (!stbi__gif_header(s, g, comp,0))     return 0; // stbi__g_failure_reason set by stbi__gif_header
+    if (!stbi__mad3sizes_valid(4, g->w, g->h, 0)) return stbi__err("too large", "GIF too large");
+    g->out = (stbi_uc *) stbi__malloc_mad3(4, g->w, g->h, 0);
+    g->background = (stbi_uc *) stbi__malloc_mad3(4, g->w, g->h, 0);
+    g->history = (stbi_uc *) stbi__malloc_mad2(g->w, g->h, 0);
+    if (!g->out || !g->background || !g->history) return stbi__err("outofmem", "Out of memory");
+    
+    // image is treated as "tranparent" at the start - ie, nothing overwrites the current background;
+    // background colour is only used for pixels that are not rendered first frame, after that "background"
+    // color refers to teh color that was there the previous frame.
+    memset( g->out, 0x00, 4 * g->w * g->h );
+    memset( g->background, 0x00, 4 * g->w * g->h ); // state of the background (starts transparent)
+    memset( g->history, 0x00, g->w * g->h );        // pixels that were affected previous frame
+    return 1;
+}
+
+// grow the dirty rectangle to cover another one
+static void stbi__gif_add_dirty(stbi__gif *g, int x, int y, int w, int h)
+{
+    int x1, y1;
+    if (w <= 0 || h <= 0) return;
+    if (g->dirty_w <= 0 || g->dirty_h <= 0) {
+        g->dirty_x = x; g->dirty_y = y;
+        g->dirty_w = w; g->dirty_h = h;
+        return;
+    }
+    x1 = g->dirty_x + g->dirty_w > x + w ? g->dirty_x + g->dirty_w : x + w;
+    y1 = g->dirty_y + g->dirty_h > y + h ? g->dirty_y + g->dirty_h : y + h;
+    if (x < g->dirty_x) g->dirty_x = x;
+    if (y < g->dirty_y) g->dirty_y = y;
+    g->dirty_w = x1 - g->dirty_x;
+    g->dirty_h = y1 - g->dirty_y;
+}
+
 // this function is designed to support animated gifs, although stb_image doesn't support it
 // two back is the image from two frames ago, used for a very specific disposal format
 static stbi_uc *stbi__gif_load_next(stbi__context *s, stbi__gif *g, int *comp, int req_comp, stbi_uc *two_back)
 {
     int dispose;
     int first_frame;
-    int pi;
+    int pi, pend, row;
     int pcount;
     
     // on first frame, any non-written pixels get the background colour (non-transparent)
-    first_frame = 0;
-    if (g->out == 0) {
-        if (!stbi__gif_header(s, g, comp,0))     return 0; // stbi__g_failure_reason set by stbi__gif_header
-        g->out = (stbi_uc *) stbi__malloc(4 * g->w * g->h);
-        g->background = (stbi_uc *) stbi__malloc(4 * g->w * g->h);
-        g->history = (stbi_uc *) stbi__malloc(g->w * g->h);
-        if (g->out == 0)                      return stbi__errpuc("outofmem", "Out of memory");
-        
-        // image is treated as "tranparent" at the start - ie, nothing overwrites the current background;
-        // background colour is only used for pixels that are not rendered first frame, after that "background"
-        // color refers to teh color that was there the previous frame.
-        memset( g->out, 0x00, 4 * g->w * g->h );
-        memset( g->background, 0x00, 4 * g->w * g->h ); // state of the background (starts transparent)
-        memset( g->history, 0x00, g->w * g->h );        // pixels that were affected previous frame
-        first_frame = 1;
-    } else {
+    if (g->out == 0 && !stbi__gif_start(s, g, comp)) return 0;
+    first_frame = g->frame == 0;
+    if (!first_frame) {
         // second frame - how do we dispoase of the previous one?
         dispose = (g->eflags & 0x1C) >> 2;
-        pcount = g->w * g->h;
         
         if ((dispose == 3) && (two_back == 0)) {
             dispose = 2; // if I don't have an image to revert back to, default to the old background
         }
         
-        if (dispose == 3) { // use previous graphic
-            for (pi = 0; pi < pcount; ++pi) {
-                if (g->history[pi]) {
-                    memcpy( &g->out[pi * 4], &two_back[pi * 4], 4 );
+        // only pixels inside the previous frame's rectangle can be marked in history
+        for (row = g->frame_y; row < g->frame_y + g->frame_h; ++row) {
+            pi = row * g->w + g->frame_x;
+            pend = pi + g->frame_w;
+            if (dispose == 3) { // use previous graphic
+                for (; pi < pend; ++pi) {
+                    if (g->history[pi]) {
+                        memcpy( &g->out[pi * 4], &two_back[pi * 4], 4 );
+                    }
                 }
-            }
-        } else if (dispose == 2) {
-            // restore what was changed last frame to background before that frame;
-            for (pi = 0; pi < pcount; ++pi) {
-                if (g->history[pi]) {
-                    memcpy( &g->out[pi * 4], &g->background[pi * 4], 4 );
+            } else if (dispose == 2) {
+                // restore what was changed last frame to background before that frame;
+                for (; pi < pend; ++pi) {
+                    if (g->history[pi]) {
+                        memcpy( &g->out[pi * 4], &g->background[pi * 4], 4 );
+                    }
                 }
+            } else {
+                // This is a non-disposal case eithe way, so just
+                // leave the pixels as is, and they will become the new background
+                // 1: do not dispose
+                // 0:  not specified.
             }
-        } else {
-            // This is a non-disposal case eithe way, so just
-            // leave the pixels as is, and they will become the new background
-            // 1: do not dispose
-            // 0:  not specified.
         }
         
-        // background is what out is after the undoing of the previou frame;
-        memcpy( g->background, g->out, 4 * g->w * g->h );
+        // background is what out is after the undoing of the previou frame; the
+        // two can only differ where the last frame changed something. clear my
+        // history there too.
+        for (row = g->dirty_y; row < g->dirty_y + g->dirty_h; ++row) {
+            pi = row * g->w + g->dirty_x;
+            memcpy( &g->background[pi * 4], &g->out[pi * 4], 4 * g->dirty_w );
+            memset( &g->history[pi], 0x00, g->dirty_w );
+        }
+        
+        g->dirty_w = g->dirty_h = 0;
+        if (dispose == 2 || dispose == 3)
+            stbi__gif_add_dirty(g, g->frame_x, g->frame_y, g->frame_w, g->frame_h);
     }
     
-    // clear my history;
-    memset( g->history, 0x00, g->w * g->h );        // pixels that were affected previous frame
-    
     for (;;) {
         int tag = stbi__get8(s);
         switch (tag) {
@@ -6410,6 +10826,13 @@ static stbi_uc *stbi__gif_load_next(stbi__context *s, stbi__gif *g, int *comp, i
                 if (((x + w) > (g->w)) || ((y + h) > (g->h)))
                     return stbi__errpuc("bad Image Descriptor", "Corrupt GIF");
                 
+                g->frame_x = x; g->frame_y = y;
+                g->frame_w = w; g->frame_h = h;
+                if (first_frame)
+                    stbi__gif_add_dirty(g, 0, 0, g->w, g->h);
+                else
+                    stbi__gif_add_dirty(g, x, y, w, h);
+                
                 g->line_size = g->w * 4;
                 g->start_x = x * 4;
                 g->start_y = y * g->line_size;
@@ -6451,6 +10874,7 @@ static stbi_uc *stbi__gif_load_next(stbi__context *s, stbi__gif *g, int *comp, i
                     }
                 }
                 
+                ++g->frame;
                 return o;
             }
                 
@@ -6535,7 +10959,7 @@ static void *stbi__load_gif_main(stbi__context *s, int **delays, int *x, int *y,
                 }
                 memcpy( out + ((layers - 1) * stride), u, stride );
                 if (layers >= 2) {
-                    two_back = out - 2 * stride;
+                    two_back = out + (layers - 2) * stride;
                 }
                 
                 if (delays) {
@@ -6576,6 +11000,8 @@ static void *stbi__gif_load(stbi__context *s, int *x, int *y, int *comp, int req
         // can be done for multiple frames.
         if (req_comp && req_comp != 4)
             u = stbi__convert_format(u, 4, req_comp, g.w, g.h);
+    } else {
+        STBI_FREE(g.out);
     }
     
     // free buffers needed for multiple frame loading;
@@ -6639,46 +11065,115 @@ static char *stbi__hdr_gettoken(stbi__context *z, char *buffer)
     return buffer;
 }
 
+// 2^(e-136), the factor for an rgbe pixel with exponent byte e, put
+// together from its float bits; the same as ldexp(1.0f, e-136) including
+// the denormals, and 0 for e == 0 so a zero pixel needs no special case
+static float stbi__hdr_scale(int e)
+{
+    union { stbi__uint32 u; float f; } v;
+    v.u = e >= 10 ? (stbi__uint32) (e-9) << 23 : e ? (stbi__uint32) 1 << (e+13) : 0;
+    return v.f;
+}
+
 static void stbi__hdr_convert(float *output, stbi_uc *input, int req_comp)
 {
-    if ( input[3] != 0 ) {
-        float f1;
-        // Exponent
-        f1 = (float) ldexp(1.0f, input[3] - (int)(128 + 8));
-        if (req_comp <= 2)
-            output[0] = (input[0] + input[1] + input[2]) * f1 / 3;
-        else {
-            output[0] = input[0] * f1;
-            output[1] = input[1] * f1;
-            output[2] = input[2] * f1;
-        }
-        if (req_comp == 2) output[1] = 1;
-        if (req_comp == 4) output[3] = 1;
-    } else {
-        switch (req_comp) {
-            case 4: output[3] = 1; /* fallthrough */
-            case 3: output[0] = output[1] = output[2] = 0;
-                break;
-            case 2: output[1] = 1; /* fallthrough */
-            case 1: output[0] = 0;
+    float f1 = stbi__hdr_scale(input[3]);
+    if (req_comp <= 2)
+        output[0] = (input[0] + input[1] + input[2]) * f1 / 3;
+    else {
+        output[0] = input[0] * f1;
+        output[1] = input[1] * f1;
+        output[2] = input[2] * f1;
+    }
+    if (req_comp == 2) output[1] = 1;
+    if (req_comp == 4) output[3] = 1;
+}
+
+// convert a scanline of width pixels stored as four planes (r, g, b, e)
+static void stbi__hdr_convert_row(float *output, stbi_uc *planes, int width, int req_comp)
+{
+    stbi_uc *r = planes, *g = planes + width, *b = planes + 2*width, *e = planes + 3*width;
+    stbi_uc rgbe[4];
+    int i = 0;
+#ifdef STBI_SSE2
+    if (req_comp >= 3 && stbi__sse2_available()) {
+        __m128i zero = _mm_setzero_si128();
+        __m128i nine = _mm_set1_epi32(9);
+        __m128 one = _mm_set1_ps(1.0f);
+        for (; i+4 <= width; i += 4) {
+            __m128i ve, big;
+            __m128 vr, vg, vb, va, scale;
+            stbi__uint32 w;
+            memcpy(&w, e+i, 4);
+            ve = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128((int) w), zero), zero);
+            big = _mm_cmpgt_epi32(ve, nine);
+            // exponents 1..9 give denormal scales; leave those to the scalar code
+            if (_mm_movemask_epi8(_mm_andnot_si128(big, _mm_cmpgt_epi32(ve, zero))))
                 break;
+            scale = _mm_castsi128_ps(_mm_and_si128(big, _mm_slli_epi32(_mm_sub_epi32(ve, nine), 23)));
+            memcpy(&w, r+i, 4);
+            vr = _mm_mul_ps(_mm_cvtepi32_ps(_mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128((int) w), zero), zero)), scale);
+            memcpy(&w, g+i, 4);
+            vg = _mm_mul_ps(_mm_cvtepi32_ps(_mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128((int) w), zero), zero)), scale);
+            memcpy(&w, b+i, 4);
+            vb = _mm_mul_ps(_mm_cvtepi32_ps(_mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128((int) w), zero), zero)), scale);
+            va = one;
+            _MM_TRANSPOSE4_PS(vr, vg, vb, va);
+            if (req_comp == 4) {
+                _mm_storeu_ps(output,    vr);
+                _mm_storeu_ps(output+4,  vg);
+                _mm_storeu_ps(output+8,  vb);
+                _mm_storeu_ps(output+12, va);
+                output += 16;
+            } else {
+                // each store spills a 1 into the next pixel, so the last one is split
+                _mm_storeu_ps(output,   vr);
+                _mm_storeu_ps(output+3, vg);
+                _mm_storeu_ps(output+6, vb);
+                _mm_storel_pi((__m64 *) (output+9), va);
+                _mm_store_ss(output+11, _mm_movehl_ps(va, va));
+                output += 12;
+            }
         }
     }
+#endif
+    for (; i < width; ++i) {
+        rgbe[0] = r[i];
+        rgbe[1] = g[i];
+        rgbe[2] = b[i];
+        rgbe[3] = e[i];
+        stbi__hdr_convert(output, rgbe, req_comp);
+        output += req_comp;
+    }
 }
 
-static float *stbi__hdr_load(stbi__context *s, int *x, int *y, int *comp, int req_comp, stbi__result_info *ri)
+// the same as n calls to stbi__get8, but one copy for what's buffered
+static void stbi__hdr_getn(stbi__context *s, stbi_uc *out, int n)
+{
+    int avail = (int) (s->img_buffer_end - s->img_buffer);
+    if (avail > n) avail = n;
+    memcpy(out, s->img_buffer, avail);
+    s->img_buffer += avail;
+    for (; avail < n; ++avail)
+        out[avail] = stbi__get8(s);
+}
+
+// decode to fmt: floats, or for the texture formats a float row at a time
+// that's packed straight into the output (flipped as it goes, since the
+// float postprocess won't see it)
+static void *stbi__hdr_load_as(stbi__context *s, int *x, int *y, int *comp, int req_comp, int fmt)
 {
     char buffer[STBI__HDR_BUFLEN];
     char *token;
     int valid = 0;
     int width, height;
     stbi_uc *scanline;
-    float *hdr_data;
-    int len;
+    stbi_uc *hdr_data;
+    float *row, *tmp = NULL;
+    int len, pixel_size, simd = 0;
     unsigned char count, value;
-    int i, j, k, c1,c2, z;
+    int i, j, k, c1,c2;
     const char *headerToken;
-    STBI_NOTUSED(ri);
     
     // Check identifier
     headerToken = stbi__hdr_gettoken(s,buffer);
@@ -6715,21 +11210,40 @@ static float *stbi__hdr_load(stbi__context *s, int *x, int *y, int *comp, int re
         return stbi__errpf("too large", "HDR image is too large");
     
     // Read data
-    hdr_data = (float *) stbi__malloc_mad4(width, height, req_comp, sizeof(float), 0);
+    pixel_size = fmt == STBI__FMT_FLOAT ? req_comp * 4 : fmt == STBI__FMT_HALF ? req_comp * 2 : 4;
+    hdr_data = (stbi_uc *) stbi__malloc_mad3(width, height, pixel_size, 0);
     if (!hdr_data)
         return stbi__errpf("outofmem", "Out of memory");
+    if (fmt != STBI__FMT_FLOAT) {
+        tmp = (float *) stbi__malloc_mad2(width, req_comp * sizeof(float), 0);
+        if (!tmp) {
+            STBI_FREE(hdr_data);
+            return stbi__errpf("outofmem", "Out of memory");
+        }
+#ifndef STBI_NO_LINEAR
+        simd = stbi__pack_simd(fmt);
+#endif
+    }
+#define STBI__HDR_ROW(j)  (tmp ? tmp : (float *) hdr_data + (size_t) (j) * width * req_comp)
+#ifndef STBI_NO_LINEAR
+#define STBI__HDR_PACK(j) if (tmp) stbi__pack_row(hdr_data, s->flip ? height-1-(j) : (j), width, tmp, req_comp, fmt, simd)
+#else
+#define STBI__HDR_PACK(j) STBI_NOTUSED(simd)
+#endif
     
     // Load image data
     // image data is stored as some number of sca
     if ( width < 8 || width >= 32768) {
         // Read flat data
         for (j=0; j < height; ++j) {
+            row = STBI__HDR_ROW(j);
             for (i=0; i < width; ++i) {
                 stbi_uc rgbe[4];
             main_decode_loop:
                 stbi__getn(s, rgbe, 4);
-                stbi__hdr_convert(hdr_data + j * width * req_comp + i * req_comp, rgbe, req_comp);
+                stbi__hdr_convert(row + i * req_comp, rgbe, req_comp);
             }
+            STBI__HDR_PACK(j);
         }
     } else {
         // Read RLE-encoded data
@@ -6747,7 +11261,8 @@ static float *stbi__hdr_load(stbi__context *s, int *x, int *y, int *comp, int re
                 rgbe[1] = (stbi_uc) c2;
                 rgbe[2] = (stbi_uc) len;
                 rgbe[3] = (stbi_uc) stbi__get8(s);
-                stbi__hdr_convert(hdr_data, rgbe, req_comp);
+                row = STBI__HDR_ROW(0);
+                stbi__hdr_convert(row, rgbe, req_comp);
                 i = 1;
                 j = 0;
                 STBI_FREE(scanline);
@@ -6755,16 +11270,20 @@ static float *stbi__hdr_load(stbi__context *s, int *x, int *y, int *comp, int re
             }
             len <<= 8;
             len |= stbi__get8(s);
-            if (len != width) { STBI_FREE(hdr_data); STBI_FREE(scanline); return stbi__errpf("invalid decoded scanline length", "corrupt HDR"); }
+            if (len != width) { STBI_FREE(hdr_data); STBI_FREE(tmp); STBI_FREE(scanline); return stbi__errpf("invalid decoded scanline length", "corrupt HDR"); }
             if (scanline == NULL) {
                 scanline = (stbi_uc *) stbi__malloc_mad2(width, 4, 0);
                 if (!scanline) {
                     STBI_FREE(hdr_data);
+                    STBI_FREE(tmp);
                     return stbi__errpf("outofmem", "Out of memory");
                 }
             }
             
+            // each component is run-length coded separately, so decode it
+            // into its own plane: runs are a memset and dumps a memcpy
             for (k = 0; k < 4; ++k) {
+                stbi_uc *plane = scanline + k*width;
                 int nleft;
                 i = 0;
                 while ((nleft = width - i) > 0) {
@@ -6773,27 +11292,35 @@ static float *stbi__hdr_load(stbi__context *s, int *x, int *y, int *comp, int re
                         // Run
                         value = stbi__get8(s);
                         count -= 128;
-                        if (count > nleft) { STBI_FREE(hdr_data); STBI_FREE(scanline); return stbi__errpf("corrupt", "bad RLE data in HDR"); }
-                        for (z = 0; z < count; ++z)
-                            scanline[i++ * 4 + k] = value;
+                        if (count > nleft) { STBI_FREE(hdr_data); STBI_FREE(tmp); STBI_FREE(scanline); return stbi__errpf("corrupt", "bad RLE data in HDR"); }
+                        memset(plane + i, value, count);
                     } else {
-                        // Dump
-                        if (count > nleft) { STBI_FREE(hdr_data); STBI_FREE(scanline); return stbi__errpf("corrupt", "bad RLE data in HDR"); }
-                        for (z = 0; z < count; ++z)
-                            scanline[i++ * 4 + k] = stbi__get8(s);
+                        // Dump; an empty one would never finish at end of file
+                        if (count == 0 || count > nleft) { STBI_FREE(hdr_data); STBI_FREE(tmp); STBI_FREE(scanline); return stbi__errpf("corrupt", "bad RLE data in HDR"); }
+                        stbi__hdr_getn(s, plane + i, count);
                     }
+                    i += count;
                 }
             }
-            for (i=0; i < width; ++i)
-                stbi__hdr_convert(hdr_data+(j*width + i)*req_comp, scanline + i*4, req_comp);
+            stbi__hdr_convert_row(STBI__HDR_ROW(j), scanline, width, req_comp);
+            STBI__HDR_PACK(j);
         }
         if (scanline)
             STBI_FREE(scanline);
     }
+#undef STBI__HDR_ROW
+#undef STBI__HDR_PACK
     
+    STBI_FREE(tmp);
     return hdr_data;
 }
 
+static float *stbi__hdr_load(stbi__context *s, int *x, int *y, int *comp, int req_comp, stbi__result_info *ri)
+{
+    STBI_NOTUSED(ri);
+    return (float *) stbi__hdr_load_as(s, x, y, comp, req_comp, STBI__FMT_FLOAT);
+}
+
 static int stbi__hdr_info(stbi__context *s, int *x, int *y, int *comp)
 {
     char buffer[STBI__HDR_BUFLEN];
@@ -6992,118 +11519,673 @@ static int stbi__pic_info(stbi__context *s, int *x, int *y, int *comp)
 //    Does not support ASCII image data (formats P2 and P3)
 //    Does not support 16-bit-per-channel
 
-#ifndef STBI_NO_PNM
+#ifndef STBI_NO_PNM
+
+static int      stbi__pnm_test(stbi__context *s)
+{
+    char p, t;
+    p = (char) stbi__get8(s);
+    t = (char) stbi__get8(s);
+    if (p != 'P' || (t != '5' && t != '6')) {
+        stbi__rewind( s );
+        return 0;
+    }
+    return 1;
+}
+
+static void *stbi__pnm_load(stbi__context *s, int *x, int *y, int *comp, int req_comp, stbi__result_info *ri)
+{
+    stbi_uc *out;
+    size_t stride, row;
+    int j, flip;
+    STBI_NOTUSED(ri);
+    
+    if (!stbi__pnm_info(s, (int *)&s->img_x, (int *)&s->img_y, (int *)&s->img_n))
+        return 0;
+    row = (size_t) s->img_x * s->img_n;
+    
+    *x = s->img_x;
+    *y = s->img_y;
+    if (comp) *comp = s->img_n;
+    
+    if (!stbi__mad3sizes_valid(s->img_n, s->img_x, s->img_y, 0))
+        return stbi__errpuc("too large", "PNM too large");
+    
+    out = stbi__rows_alloc(s, s->img_x, s->img_y, s->img_n, req_comp, &stride, &flip);
+    if (!out) return NULL;
+    if (stride == row && !flip) {
+        stbi__getn(s, out, s->img_n * s->img_x * s->img_y);
+    } else {
+        for (j=0; j < (int) s->img_y; ++j)
+            stbi__getn(s, out + stride * (flip ? (int) s->img_y-1-j : j), (int) row);
+    }
+    
+    if (req_comp && req_comp != s->img_n)
+        ri->num_channels = s->img_n; // the postprocess pass converts
+    return out;
+}
+
+static int      stbi__pnm_isspace(char c)
+{
+    return c == ' ' || c == '\t' || c == '\n' || c == '\v' || c == '\f' || c == '\r';
+}
+
+static void     stbi__pnm_skip_whitespace(stbi__context *s, char *c)
+{
+    for (;;) {
+        while (!stbi__at_eof(s) && stbi__pnm_isspace(*c))
+            *c = (char) stbi__get8(s);
+        
+        if (stbi__at_eof(s) || *c != '#')
+            break;
+        
+        while (!stbi__at_eof(s) && *c != '\n' && *c != '\r' )
+            *c = (char) stbi__get8(s);
+    }
+}
+
+static int      stbi__pnm_isdigit(char c)
+{
+    return c >= '0' && c <= '9';
+}
+
+static int      stbi__pnm_getinteger(stbi__context *s, char *c)
+{
+    int value = 0;
+    
+    while (!stbi__at_eof(s) && stbi__pnm_isdigit(*c)) {
+        value = value*10 + (*c - '0');
+        *c = (char) stbi__get8(s);
+    }
+    
+    return value;
+}
+
+static int      stbi__pnm_info(stbi__context *s, int *x, int *y, int *comp)
+{
+    int maxv, dummy;
+    char c, p, t;
+    
+    if (!x) x = &dummy;
+    if (!y) y = &dummy;
+    if (!comp) comp = &dummy;
+    
+    stbi__rewind(s);
+    
+    // Get identifier
+    p = (char) stbi__get8(s);
+    t = (char) stbi__get8(s);
+    if (p != 'P' || (t != '5' && t != '6')) {
+        stbi__rewind(s);
+        return 0;
+    }
+    
+    *comp = (t == '6') ? 3 : 1;  // '5' is 1-component .pgm; '6' is 3-component .ppm
+    
+    c = (char) stbi__get8(s);
+    stbi__pnm_skip_whitespace(s, &c);
+    
+    *x = stbi__pnm_getinteger(s, &c); // read width
+    stbi__pnm_skip_whitespace(s, &c);
+    
+    *y = stbi__pnm_getinteger(s, &c); // read height
+    stbi__pnm_skip_whitespace(s, &c);
+    
+    maxv = stbi__pnm_getinteger(s, &c);  // read max value
+    
+    if (maxv > 255)
+        return stbi__err("max value > 255", "PPM image not 8-bit");
+    else
+        return 1;
+}
+#endif
+
+//////////////////////////////////////////////////////////////////////////////
+//
+//  streaming decode
+//
+// Baseline JPEGs whose one scan carries every component are decoded into
+// component planes only a few MCU rows tall, one MCU row at a time as the
+// upsampler reaches it. Non-interlaced PNGs are inflated just far enough to
+// unfilter the rows asked for, keeping the 32K window, and go through the
+// usual tRNS/palette/format conversion a band at a time. Everything else is
+// decoded in full up front and handed out from there.
+
+#define STBI__STREAM_JPEG_MCU_ROWS  3   // the upsampler looks at most one row back
+#define STBI__STREAM_PNG_BAND      32   // rows unfiltered and converted per pass
+
+enum
+{
+    STBI__STREAM_full,
+    STBI__STREAM_jpeg,
+    STBI__STREAM_png
+};
+
+struct stbi_stream
+{
+    stbi__context s;
+#ifndef STBI_NO_STDIO
+    FILE *f;
+    long f_start;
+#endif
+    stbi_uc const *buffer;
+    int len;
+    
+    int mode, req_comp;
+    int x, y, comp, n;               // n = channels per output pixel
+    int row;                         // next row to hand out
+    stbi_uc *full;                   // STBI__STREAM_full
+    
+#ifndef STBI_NO_JPEG
+    stbi__jpeg *j;
+    stbi__resample res_comp[4];
+    int decode_n, is_rgb;
+    int mcu_rows, scan_done;         // MCU rows decoded; set if a marker cut the scan short
+    stbi_uc *spill;                  // 3-channel rows are converted here, past the junk byte
+#endif
+    
+#ifndef STBI_NO_PNG
+    stbi__png p;
+    stbi__png_deferred info;
+    stbi__zbuf z;
+    size_t rd;                       // inflated bytes before this have been unfiltered
+    stbi_uc *rows[2];                // last unfiltered row of the previous band, and the next one
+    int filter_n, out_n;             // channels after unfiltering, and after palette expansion
+#endif
+};
+
+// free whatever decoder state the stream holds, leaving it in full mode
+static void stbi__stream_release(stbi_stream *st)
+{
+#ifndef STBI_NO_JPEG
+    if (st->j) {
+        stbi__cleanup_jpeg(st->j);
+        STBI_FREE(st->j);
+        st->j = NULL;
+    }
+    STBI_FREE(st->spill); st->spill = NULL;
+#endif
+#ifndef STBI_NO_PNG
+    STBI_FREE(st->p.idata);   st->p.idata = NULL;
+    STBI_FREE(st->p.out);     st->p.out = NULL;
+    STBI_FREE(st->z.zout_start); st->z.zout_start = NULL;
+    STBI_FREE(st->rows[0]);   st->rows[0] = NULL;
+    STBI_FREE(st->rows[1]);   st->rows[1] = NULL;
+#endif
+    STBI_FREE(st->full); st->full = NULL;
+    st->mode = STBI__STREAM_full;
+}
+
+static void stbi__stream_restart(stbi_stream *st)
+{
+#ifndef STBI_NO_STDIO
+    if (st->f) {
+        fseek(st->f, st->f_start, SEEK_SET);
+        stbi__start_file(&st->s, st->f);
+        return;
+    }
+#endif
+    stbi__start_mem(&st->s, st->buffer, st->len);
+}
+
+#ifndef STBI_NO_JPEG
+// returns 1 if the image can be streamed, 0 on error, -1 to fall back to a full decode
+static int stbi__stream_jpeg_begin(stbi_stream *st)
+{
+    stbi__jpeg *j;
+    int m;
+    j = (stbi__jpeg *) stbi__malloc(sizeof(stbi__jpeg));
+    if (!j) return stbi__err("outofmem", "Out of memory");
+    st->j = j;
+    j->s = &st->s;
+    j->s->img_n = 0; // make stbi__cleanup_jpeg safe
+    stbi__setup_jpeg(j);
+    j->stream_mcu_rows = STBI__STREAM_JPEG_MCU_ROWS;
+    for (m = 0; m < 4; m++) {
+        j->img_comp[m].raw_data = NULL;
+        j->img_comp[m].raw_coeff = NULL;
+        j->img_comp[m].coeff_mask = NULL;
+        j->img_comp[m].linebuf = NULL;
+    }
+    j->restart_interval = 0;
+    if (!stbi__decode_jpeg_header(j, STBI__SCAN_load)) return 0;
+    m = stbi__get_marker(j);
+    while (!stbi__SOS(m)) {
+        if (stbi__EOI(m) || stbi__DNL(m)) return -1;
+        if (!stbi__process_marker(j, m)) return 0;
+        m = stbi__get_marker(j);
+    }
+    if (!stbi__process_scan_header(j)) return 0;
+    if (j->progressive || j->scan_n != j->s->img_n) return -1;
+    stbi__jpeg_reset(j);
+    
+    stbi__jpeg_output_format(j, st->req_comp, &st->n, &st->decode_n, &st->is_rgb);
+    if (!stbi__jpeg_setup_resample(j, st->res_comp, st->decode_n)) return 0;
+    if (st->n == 3) {
+        st->spill = (stbi_uc *) stbi__malloc(3 * j->s->img_x + 1);
+        if (!st->spill) return stbi__err("outofmem", "Out of memory");
+    }
+    st->mcu_rows = 0;
+    st->scan_done = 0;
+    st->comp = j->s->img_n >= 3 ? 3 : 1;
+    return 1;
+}
+
+static int stbi__stream_jpeg_rows(stbi_stream *st, stbi_uc *dst, size_t dst_stride, int count)
+{
+    stbi__jpeg *j = st->j;
+    int r, k;
+    for (r=0; r < count; ++r) {
+        stbi_uc *out = dst + dst_stride * r;
+        // decode MCU rows until every component's lower input line is in its plane
+        for (k=0; k < st->decode_n; ++k) {
+            stbi__resample *res = &st->res_comp[k];
+            int line = res->ypos < j->img_comp[k].y ? res->ypos : j->img_comp[k].y-1;
+            while (st->mcu_rows <= line / (j->img_comp[k].v * j->img_comp[k].bs) && !st->scan_done) {
+                int d = stbi__jpeg_decode_mcu_row(j, st->mcu_rows++);
+                if (d == 0) return -1;
+                if (d == 2) st->scan_done = 1; // like the full decoder, keep going on what we have
+            }
+        }
+        if (st->spill) {
+            stbi__jpeg_convert_row(j, st->res_comp, st->decode_n, st->n, st->is_rgb, st->spill);
+            memcpy(out, st->spill, 3 * j->s->img_x);
+        } else
+            stbi__jpeg_convert_row(j, st->res_comp, st->decode_n, st->n, st->is_rgb, out);
+    }
+    return count;
+}
+#endif
+
+#ifndef STBI_NO_PNG
+// returns 1 if the image can be streamed, 0 on error, -1 to fall back to a full decode
+static int stbi__stream_png_begin(stbi_stream *st)
+{
+    stbi__context *s = &st->s;
+    stbi__png *p = &st->p;
+    stbi__png_deferred *d = &st->info;
+    stbi__zbuf *z = &st->z;
+    size_t stride;
+    p->s = s;
+    p->defer = d;
+    if (!stbi__parse_png_file(p, STBI__SCAN_load, st->req_comp)) return 0;
+    if (d->interlace) return -1;
+    
+    // channel bookkeeping as in the IEND case of stbi__parse_png_file; s->img_n
+    // stays the unfiltered count, which stbi__create_png_image_raw expects
+    if ((st->req_comp == s->img_n+1 && st->req_comp != 3 && !d->pal_img_n) || d->has_trans)
+        st->filter_n = s->img_n+1;
+    else
+        st->filter_n = s->img_n;
+    st->out_n = st->filter_n;
+    st->comp = s->img_n + d->has_trans;
+    if (d->pal_img_n) {
+        st->comp = st->out_n = d->pal_img_n;
+        if (st->req_comp >= 3) st->out_n = st->req_comp;
+    }
+    st->n = st->req_comp ? st->req_comp : st->out_n;
+    
+    stride = (size_t) s->img_x * st->filter_n * (p->depth == 16 ? 2 : 1);
+    st->rows[0] = (stbi_uc *) stbi__malloc(stride);
+    st->rows[1] = (stbi_uc *) stbi__malloc(stride);
+    z->zout_start = (char *) stbi__malloc(65536);
+    if (!st->rows[0] || !st->rows[1] || !z->zout_start) return stbi__err("outofmem", "Out of memory");
+    z->zout = z->zout_start;
+    z->zout_end = z->zout_start + 65536;
+    z->z_expandable = 1;
+    z->alloc = NULL;
+    z->zbuffer = p->idata;
+    z->zbuffer_end = p->idata + d->idata_len;
+    // just the zlib header for now
+    z->zout_pause = z->zout_start;
+    if (!stbi__parse_zlib(z, !d->is_iphone)) return 0;
+    st->rd = 0;
+    return 1;
+}
+
+// inflate until 'need' unread bytes are available or the data runs out
+static int stbi__stream_inflate(stbi_stream *st, size_t need)
+{
+    stbi__zbuf *z = &st->z;
+    size_t used = z->zout - z->zout_start, keep_from;
+    if (used - st->rd >= need || (z->final_block && !z->in_block)) return 1;
+    // drop what's been unfiltered, except the 32K window matches can refer back into
+    keep_from = used > 32768 ? used - 32768 : 0;
+    if (keep_from > st->rd) keep_from = st->rd;
+    if (keep_from) {
+        memmove(z->zout_start, z->zout_start + keep_from, used - keep_from);
+        z->zout -= keep_from;
+        st->rd -= keep_from;
+        used -= keep_from;
+    }
+    if (st->rd + need > (size_t) (z->zout_end - z->zout_start))
+        if (!stbi__zexpand(z, z->zout, (int) (st->rd + need - used))) return 0;
+    z->zout_pause = z->zout_start + st->rd + need;
+    return stbi__parse_zlib_blocks(z);
+}
+
+static int stbi__stream_png_rows(stbi_stream *st, stbi_uc *dst, size_t dst_stride, int count)
+{
+    stbi__context *s = &st->s;
+    stbi__png *p = &st->p;
+    stbi__png_deferred *d = &st->info;
+    stbi__zbuf *z = &st->z;
+    stbi__uint32 img_y = s->img_y;
+    size_t row_len = (((size_t) s->img_n * s->img_x * p->depth + 7) >> 3) + 1;
+    int done = 0;
+    while (done < count) {
+        int rows = count - done < STBI__STREAM_PNG_BAND ? count - done : STBI__STREAM_PNG_BAND;
+        size_t need = rows * row_len, have;
+        stbi_uc *out, *t;
+        int ok, r;
+        if (!stbi__stream_inflate(st, need)) return -1;
+        have = (z->zout - z->zout_start) - st->rd;
+        if (have > need) have = need;
+        
+        // decode the band as if it were a whole image of 'rows' rows
+        s->img_y = rows;
+        p->band_prior = st->row ? st->rows[0] : NULL;
+        p->band_save = st->rows[1];
+        ok = stbi__create_png_image_raw(p, (stbi_uc *) z->zout_start + st->rd, (stbi__uint32) have, st->filter_n, s->img_x, rows, p->depth, d->color);
+        if (ok && d->has_trans) {
+            if (p->depth == 16)
+                ok = stbi__compute_transparency16(p, d->tc16, st->filter_n);
+            else
+                ok = stbi__compute_transparency(p, d->tc, st->filter_n);
+        }
+        if (ok && d->is_iphone && s->de_iphone && st->filter_n > 2) {
+            s->img_out_n = st->filter_n;
+            stbi__de_iphone(p);
+        }
+        if (ok && d->pal_img_n)
+            ok = stbi__expand_png_palette(p, d->palette, d->pal_len, st->out_n);
+        out = p->out;
+        p->out = NULL;
+        if (ok && p->depth == 16) {
+            out = stbi__convert_16_to_8((stbi__uint16 *) out, st->out_n, st->n, s->img_x, rows);
+            if (!out) ok = 0;
+        } else if (ok && st->n != st->out_n) {
+            out = stbi__convert_format(out, st->out_n, st->n, s->img_x, rows);
+            if (!out) ok = 0;
+        }
+        s->img_y = img_y;
+        if (!ok) {
+            STBI_FREE(out);
+            return -1;
+        }
+        
+        for (r=0; r < rows; ++r)
+            memcpy(dst + dst_stride * (done + r), out + (size_t) r * s->img_x * st->n, (size_t) s->img_x * st->n);
+        STBI_FREE(out);
+        t = st->rows[0]; st->rows[0] = st->rows[1]; st->rows[1] = t;
+        st->rd += need;
+        st->row += rows;
+        done += rows;
+    }
+    return count;
+}
+#endif
+
+static int stbi__stream_full_begin(stbi_stream *st)
+{
+    stbi__result_info ri;
+    int x, y;
+    void *result = stbi__load_main(&st->s, &x, &y, &st->comp, st->req_comp, &ri, 8);
+    if (result == NULL) return 0;
+    st->n = st->req_comp ? st->req_comp : st->comp;
+    if (ri.bits_per_channel != 8) {
+        result = stbi__convert_16_to_8((stbi__uint16 *) result, ri.num_channels ? ri.num_channels : st->n, st->n, x, y);
+        if (result == NULL) return 0;
+    } else if (ri.num_channels) {
+        result = stbi__convert_format((stbi_uc *) result, ri.num_channels, st->n, x, y);
+        if (result == NULL) return 0;
+    }
+    st->full = (stbi_uc *) result;
+    st->s.img_x = x;
+    st->s.img_y = y;
+    return 1;
+}
+
+static stbi_stream *stbi__stream_begin(stbi_stream *st, int *x, int *y, int *comp, int req_comp)
+{
+    int r = -1;
+    st->mode = STBI__STREAM_full;
+    st->req_comp = req_comp;
+    st->row = 0;
+    st->full = NULL;
+#ifndef STBI_NO_JPEG
+    st->j = NULL;
+    st->spill = NULL;
+#endif
+#ifndef STBI_NO_PNG
+    st->p.idata = st->p.out = NULL;
+    st->z.zout_start = NULL;
+    st->rows[0] = st->rows[1] = NULL;
+#endif
+    
+#ifndef STBI_NO_JPEG
+    if (stbi__jpeg_test(&st->s)) {
+        st->mode = STBI__STREAM_jpeg;
+        r = stbi__stream_jpeg_begin(st);
+    }
+#endif
+#ifndef STBI_NO_PNG
+    if (st->mode == STBI__STREAM_full && stbi__png_test(&st->s)) {
+        st->mode = STBI__STREAM_png;
+        r = stbi__stream_png_begin(st);
+    }
+#endif
+    if (r < 0) {
+        stbi__stream_release(st);
+        stbi__stream_restart(st);
+        r = stbi__stream_full_begin(st);
+    }
+    if (!r) {
+        stbi_stream_end(st);
+        return NULL;
+    }
+    st->x = st->s.img_x;
+    st->y = st->s.img_y;
+    if (x) *x = st->x;
+    if (y) *y = st->y;
+    if (comp) *comp = st->comp;
+    return st;
+}
+
+STBIDEF stbi_stream *stbi_stream_begin_from_memory(stbi_uc const *buffer, int len, int *x, int *y, int *comp, int req_comp)
+{
+    stbi_stream *st;
+    if (req_comp < 0 || req_comp > 4) return (stbi_stream *) stbi__errpuc("bad req_comp", "Internal error");
+    st = (stbi_stream *) stbi__malloc(sizeof(stbi_stream));
+    if (!st) return (stbi_stream *) stbi__errpuc("outofmem", "Out of memory");
+#ifndef STBI_NO_STDIO
+    st->f = NULL;
+#endif
+    st->buffer = buffer;
+    st->len = len;
+    stbi__start_mem(&st->s, buffer, len);
+    return stbi__stream_begin(st, x, y, comp, req_comp);
+}
 
-static int      stbi__pnm_test(stbi__context *s)
+#ifndef STBI_NO_STDIO
+STBIDEF stbi_stream *stbi_stream_begin(char const *filename, int *x, int *y, int *comp, int req_comp)
 {
-    char p, t;
-    p = (char) stbi__get8(s);
-    t = (char) stbi__get8(s);
-    if (p != 'P' || (t != '5' && t != '6')) {
-        stbi__rewind( s );
-        return 0;
+    stbi_stream *st;
+    FILE *f;
+    if (req_comp < 0 || req_comp > 4) return (stbi_stream *) stbi__errpuc("bad req_comp", "Internal error");
+    f = stbi__fopen(filename, "rb");
+    if (!f) return (stbi_stream *) stbi__errpuc("can't fopen", "Unable to open file");
+    st = (stbi_stream *) stbi__malloc(sizeof(stbi_stream));
+    if (!st) {
+        fclose(f);
+        return (stbi_stream *) stbi__errpuc("outofmem", "Out of memory");
     }
-    return 1;
+    st->f = f;
+    st->f_start = ftell(f);
+    st->buffer = NULL;
+    st->len = 0;
+    stbi__start_file(&st->s, f);
+    return stbi__stream_begin(st, x, y, comp, req_comp);
 }
+#endif
 
-static void *stbi__pnm_load(stbi__context *s, int *x, int *y, int *comp, int req_comp, stbi__result_info *ri)
+STBIDEF int stbi_stream_read_rows(stbi_stream *st, void *dst, size_t dst_stride, int max_rows)
 {
-    stbi_uc *out;
-    STBI_NOTUSED(ri);
-    
-    if (!stbi__pnm_info(s, (int *)&s->img_x, (int *)&s->img_y, (int *)&s->img_n))
-        return 0;
-    
-    *x = s->img_x;
-    *y = s->img_y;
-    if (comp) *comp = s->img_n;
-    
-    if (!stbi__mad3sizes_valid(s->img_n, s->img_x, s->img_y, 0))
-        return stbi__errpuc("too large", "PNM too large");
-    
-    out = (stbi_uc *) stbi__malloc_mad3(s->img_n, s->img_x, s->img_y, 0);
-    if (!out) return stbi__errpuc("outofmem", "Out of memory");
-    stbi__getn(s, out, s->img_n * s->img_x * s->img_y);
-    
-    if (req_comp && req_comp != s->img_n) {
-        out = stbi__convert_format(out, s->img_n, req_comp, s->img_x, s->img_y);
-        if (out == NULL) return out; // stbi__convert_format frees input on failure
+    int count = st->y - st->row, r;
+    if (max_rows < count) count = max_rows;
+    if (count <= 0) return 0;
+    switch (st->mode) {
+#ifndef STBI_NO_JPEG
+        case STBI__STREAM_jpeg:
+            r = stbi__stream_jpeg_rows(st, (stbi_uc *) dst, dst_stride, count);
+            if (r > 0) st->row += r;
+            return r;
+#endif
+#ifndef STBI_NO_PNG
+        case STBI__STREAM_png:
+            return stbi__stream_png_rows(st, (stbi_uc *) dst, dst_stride, count);
+#endif
+        default:
+            for (r=0; r < count; ++r)
+                memcpy((stbi_uc *) dst + dst_stride * r, st->full + (size_t) (st->row + r) * st->x * st->n, (size_t) st->x * st->n);
+            st->row += count;
+            return count;
     }
-    return out;
 }
 
-static int      stbi__pnm_isspace(char c)
+STBIDEF void stbi_stream_end(stbi_stream *st)
 {
-    return c == ' ' || c == '\t' || c == '\n' || c == '\v' || c == '\f' || c == '\r';
+    if (!st) return;
+    stbi__stream_release(st);
+#ifndef STBI_NO_STDIO
+    if (st->f) fclose(st->f);
+#endif
+    STBI_FREE(st);
 }
 
-static void     stbi__pnm_skip_whitespace(stbi__context *s, char *c)
+#ifndef STBI_NO_GIF
+struct stbi_gif
 {
-    for (;;) {
-        while (!stbi__at_eof(s) && stbi__pnm_isspace(*c))
-            *c = (char) stbi__get8(s);
-        
-        if (stbi__at_eof(s) || *c != '#')
-            break;
-        
-        while (!stbi__at_eof(s) && *c != '\n' && *c != '\r' )
-            *c = (char) stbi__get8(s);
+    stbi__context s;
+#ifndef STBI_NO_STDIO
+    FILE *f;
+#endif
+    stbi__gif g;
+    stbi_uc *keep[2];                // the last two frames handed out, newest first
+    int kept_x, kept_y, kept_w, kept_h; // what the newest one changed
+    int status;                      // what next_frame returns once it's done
+};
+
+static void stbi__gif_copy_rect(stbi_uc *dst, stbi_uc const *src, int w, int x, int y, int rw, int rh)
+{
+    int j;
+    for (j=0; j < rh; ++j) {
+        size_t o = ((size_t) (y + j) * w + x) * 4;
+        memcpy(dst + o, src + o, (size_t) rw * 4);
     }
 }
 
-static int      stbi__pnm_isdigit(char c)
+static stbi_gif *stbi__gif_begin(stbi_gif *gif, int *x, int *y)
 {
-    return c >= '0' && c <= '9';
+    memset(&gif->g, 0, sizeof(gif->g));
+    gif->keep[0] = gif->keep[1] = NULL;
+    gif->status = 1;
+    if (!stbi__gif_test(&gif->s)) {
+        stbi__err("not GIF", "Image was not as a gif type.");
+        stbi_gif_end(gif);
+        return NULL;
+    }
+    if (!stbi__gif_start(&gif->s, &gif->g, NULL)) {
+        stbi_gif_end(gif);
+        return NULL;
+    }
+    gif->keep[0] = (stbi_uc *) stbi__malloc_mad3(4, gif->g.w, gif->g.h, 0);
+    gif->keep[1] = (stbi_uc *) stbi__malloc_mad3(4, gif->g.w, gif->g.h, 0);
+    if (!gif->keep[0] || !gif->keep[1]) {
+        stbi__err("outofmem", "Out of memory");
+        stbi_gif_end(gif);
+        return NULL;
+    }
+    if (x) *x = gif->g.w;
+    if (y) *y = gif->g.h;
+    return gif;
 }
 
-static int      stbi__pnm_getinteger(stbi__context *s, char *c)
+STBIDEF stbi_gif *stbi_gif_begin_from_memory(stbi_uc const *buffer, int len, int *x, int *y)
 {
-    int value = 0;
-    
-    while (!stbi__at_eof(s) && stbi__pnm_isdigit(*c)) {
-        value = value*10 + (*c - '0');
-        *c = (char) stbi__get8(s);
-    }
-    
-    return value;
+    stbi_gif *gif = (stbi_gif *) stbi__malloc(sizeof(stbi_gif));
+    if (!gif) return (stbi_gif *) stbi__errpuc("outofmem", "Out of memory");
+#ifndef STBI_NO_STDIO
+    gif->f = NULL;
+#endif
+    stbi__start_mem(&gif->s, buffer, len);
+    return stbi__gif_begin(gif, x, y);
 }
 
-static int      stbi__pnm_info(stbi__context *s, int *x, int *y, int *comp)
+#ifndef STBI_NO_STDIO
+STBIDEF stbi_gif *stbi_gif_begin(char const *filename, int *x, int *y)
 {
-    int maxv, dummy;
-    char c, p, t;
-    
-    if (!x) x = &dummy;
-    if (!y) y = &dummy;
-    if (!comp) comp = &dummy;
-    
-    stbi__rewind(s);
-    
-    // Get identifier
-    p = (char) stbi__get8(s);
-    t = (char) stbi__get8(s);
-    if (p != 'P' || (t != '5' && t != '6')) {
-        stbi__rewind(s);
-        return 0;
+    stbi_gif *gif;
+    FILE *f = stbi__fopen(filename, "rb");
+    if (!f) return (stbi_gif *) stbi__errpuc("can't fopen", "Unable to open file");
+    gif = (stbi_gif *) stbi__malloc(sizeof(stbi_gif));
+    if (!gif) {
+        fclose(f);
+        return (stbi_gif *) stbi__errpuc("outofmem", "Out of memory");
     }
+    gif->f = f;
+    stbi__start_file(&gif->s, f);
+    return stbi__gif_begin(gif, x, y);
+}
+#endif
+
+STBIDEF int stbi_gif_next_frame(stbi_gif *gif, stbi_gif_frame *frame)
+{
+    stbi__gif *g = &gif->g;
+    stbi_uc *u, *t;
+    if (gif->status <= 0) return gif->status;
     
-    *comp = (t == '6') ? 3 : 1;  // '5' is 1-component .pgm; '6' is 3-component .ppm
-    
-    c = (char) stbi__get8(s);
-    stbi__pnm_skip_whitespace(s, &c);
-    
-    *x = stbi__pnm_getinteger(s, &c); // read width
-    stbi__pnm_skip_whitespace(s, &c);
-    
-    *y = stbi__pnm_getinteger(s, &c); // read height
-    stbi__pnm_skip_whitespace(s, &c);
-    
-    maxv = stbi__pnm_getinteger(s, &c);  // read max value
+    u = stbi__gif_load_next(&gif->s, g, NULL, 4, g->frame >= 2 ? gif->keep[1] : NULL);
+    if (u == (stbi_uc *) &gif->s) return gif->status = 0;  // end of animated gif marker
+    if (!u) return gif->status = -1;
     
-    if (maxv > 255)
-        return stbi__err("max value > 255", "PPM image not 8-bit");
-    else
-        return 1;
+    // the older copy becomes the newest: it's out of date wherever either of
+    // the last two frames changed something (or everywhere, early on)
+    t = gif->keep[1];
+    gif->keep[1] = gif->keep[0];
+    gif->keep[0] = t;
+    if (g->frame <= 2) {
+        memcpy(t, g->out, (size_t) g->w * g->h * 4);
+    } else {
+        stbi__gif_copy_rect(t, g->out, g->w, gif->kept_x, gif->kept_y, gif->kept_w, gif->kept_h);
+        stbi__gif_copy_rect(t, g->out, g->w, g->dirty_x, g->dirty_y, g->dirty_w, g->dirty_h);
+    }
+    gif->kept_x = g->dirty_x; gif->kept_y = g->dirty_y;
+    gif->kept_w = g->dirty_w; gif->kept_h = g->dirty_h;
+    
+    frame->pixels  = g->out;
+    frame->x       = g->dirty_x;
+    frame->y       = g->dirty_y;
+    frame->w       = g->dirty_w;
+    frame->h       = g->dirty_h;
+    frame->delay   = g->delay;
+    frame->dispose = (g->eflags & 0x1C) >> 2;
+    frame->index   = g->frame - 1;
+    return 1;
+}
+
+STBIDEF void stbi_gif_end(stbi_gif *gif)
+{
+    if (!gif) return;
+    STBI_FREE(gif->g.out);
+    STBI_FREE(gif->g.background);
+    STBI_FREE(gif->g.history);
+    STBI_FREE(gif->keep[0]);
+    STBI_FREE(gif->keep[1]);
+#ifndef STBI_NO_STDIO
+    if (gif->f) fclose(gif->f);
+#endif
+    STBI_FREE(gif);
 }
 #endif
 
@@ -7234,6 +12316,338 @@ STBIDEF int stbi_is_16_bit_from_callbacks(stbi_io_callbacks const *c, void *user
     return stbi__is_16_main(&s);
 }
 
+#ifndef STBI_NO_JPEG
+// walk the segments up to the frame header, checking it as
+// stbi__process_frame_header does, then on to the first scan for a DRI.
+// *more is set if the data ran out before the first scan
+static int stbi__probe_jpeg(stbi_uc const *p, stbi_uc const *end, stbi_probe_result *r, int *more)
+{
+    int m, L, c, i, sof = 0;
+    while (p < end && *p == 0xff) ++p;
+    ++p; // SOI
+    for (;;) {
+        // the next marker, skipping any padding before it
+        while (p < end && *p != 0xff) ++p;
+        while (p < end && *p == 0xff) ++p;
+        if (end - p < 3) { *more = 1; break; }
+        m = *p;
+        L = (p[1] << 8) | p[2];
+        p += 3;
+        if (m == 0xDD) {
+            if (L != 4 || end - p < 2) {
+                *more = end - p < 2;
+                if (sof) break;
+                return stbi__err("bad DRI len","Corrupt JPEG");
+            }
+            r->restart_interval = (p[0] << 8) | p[1];
+        } else if (m == 0xC0 || m == 0xC1 || m == 0xC2) {
+            if (sof) break;
+            if (L < 11) return stbi__err("bad SOF len","Corrupt JPEG");
+            if (end - p < L - 2) return stbi__err("no SOF", "Corrupt JPEG");
+            if (p[0] != 8) return stbi__err("only 8-bit","JPEG format not supported: 8-bit only");
+            r->y = (p[1] << 8) | p[2]; if (r->y == 0) return stbi__err("no header height", "JPEG format not supported: delayed height");
+            r->x = (p[3] << 8) | p[4]; if (r->x == 0) return stbi__err("0 width","Corrupt JPEG");
+            c = p[5];
+            if (c != 3 && c != 1 && c != 4) return stbi__err("bad component count","Corrupt JPEG");
+            if (L != 8+3*c) return stbi__err("bad SOF len","Corrupt JPEG");
+            for (i=0; i < c; ++i) {
+                int q = p[6+3*i+1];
+                if (!(q >> 4) || (q >> 4) > 4)   return stbi__err("bad H","Corrupt JPEG");
+                if (!(q & 15) || (q & 15) > 4)   return stbi__err("bad V","Corrupt JPEG");
+                if (p[6+3*i+2] > 3)              return stbi__err("bad TQ","Corrupt JPEG");
+            }
+            r->channels = c >= 3 ? 3 : 1;
+            r->progressive = m == 0xC2;
+            sof = 1;
+        } else if (m == 0xDB || m == 0xC4 || (m >= 0xE0 && m <= 0xEF) || m == 0xFE) {
+            if (L < 2) {
+                if (sof) break;
+                return stbi__err("bad segment len","Corrupt JPEG");
+            }
+        } else {
+            // SOS, or a marker the decoder wouldn't take before the frame header
+            if (sof) break;
+            return stbi__err("unknown marker","Corrupt JPEG");
+        }
+        if (end - p < L - 2) { *more = 1; break; }
+        p += L - 2;
+    }
+    if (!sof) return stbi__err("no SOF", "Corrupt JPEG");
+    r->format = STBI_format_jpeg;
+    r->bits_per_channel = 8;
+    return 1;
+}
+#endif
+
+#ifndef STBI_NO_PNG
+// the chunks stbi__parse_png_file reads for STBI__SCAN_header, checked the same way
+static int stbi__probe_png(stbi_uc const *p, stbi_uc const *end, stbi_probe_result *r)
+{
+    int first = 1, pal = 0, pal_len = 0;
+    p += 8;
+    for (;;) {
+        stbi__uint32 len, type;
+        if (end - p < 8) return stbi__err("outofdata","Corrupt PNG");
+        len  = ((stbi__uint32) p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+        type = ((stbi__uint32) p[4] << 24) | (p[5] << 16) | (p[6] << 8) | p[7];
+        p += 8;
+        switch (type) {
+            case STBI__PNG_TYPE('C','g','B','I'):
+                break;
+            case STBI__PNG_TYPE('I','H','D','R'): {
+                stbi_uc h[13] = { 0 }; // read past the end as zeros, like stbi__get8
+                stbi__uint32 w, ht;
+                int depth, color, n;
+                if (!first) return stbi__err("multiple IHDR","Corrupt PNG");
+                first = 0;
+                if (len != 13) return stbi__err("bad IHDR len","Corrupt PNG");
+                memcpy(h, p, end - p < 13 ? (size_t) (end - p) : 13);
+                w  = ((stbi__uint32) h[0] << 24) | (h[1] << 16) | (h[2] << 8) | h[3]; if (w  > (1 << 24)) return stbi__err("too large","Very large image (corrupt?)");
+                ht = ((stbi__uint32) h[4] << 24) | (h[5] << 16) | (h[6] << 8) | h[7]; if (ht > (1 << 24)) return stbi__err("too large","Very large image (corrupt?)");
+                depth = h[8]; if (depth != 1 && depth != 2 && depth != 4 && depth != 8 && depth != 16)  return stbi__err("1/2/4/8/16-bit only","PNG not supported: 1/2/4/8/16-bit only");
+                color = h[9]; if (color > 6)   return stbi__err("bad ctype","Corrupt PNG");
+                if (color == 3 && depth == 16) return stbi__err("bad ctype","Corrupt PNG");
+                if (color == 3) pal = 1; else if (color & 1) return stbi__err("bad ctype","Corrupt PNG");
+                if (h[10]) return stbi__err("bad comp method","Corrupt PNG");
+                if (h[11]) return stbi__err("bad filter method","Corrupt PNG");
+                if (h[12] > 1) return stbi__err("bad interlace method","Corrupt PNG");
+                r->x = (int) w;
+                r->y = (int) ht;
+                if (!r->x || !r->y) return stbi__err("0-pixel image","Corrupt PNG");
+                n = pal ? 4 : (color & 2 ? 3 : 1) + (color & 4 ? 1 : 0);
+                if ((1 << 30) / r->x / n < r->y) return stbi__err("too large", "Image too large to decode");
+                r->format = STBI_format_png;
+                r->bits_per_channel = depth == 16 ? 16 : 8;
+                r->interlaced = h[12];
+                r->channels = pal ? 1 : n;
+                if (!pal) return 1;
+                // if paletted, have to scan to see if we have a tRNS
+                break;
+            }
+            case STBI__PNG_TYPE('P','L','T','E'):
+                if (first) return stbi__err("first not IHDR", "Corrupt PNG");
+                if (len > 256*3 || len % 3) return stbi__err("invalid PLTE","Corrupt PNG");
+                pal_len = len / 3;
+                break;
+            case STBI__PNG_TYPE('t','R','N','S'):
+                if (first) return stbi__err("first not IHDR", "Corrupt PNG");
+                r->channels = 4;
+                return 1;
+            case STBI__PNG_TYPE('I','D','A','T'):
+                if (first) return stbi__err("first not IHDR", "Corrupt PNG");
+                if (!pal_len) return stbi__err("no PLTE","Corrupt PNG");
+                r->channels = 3;
+                return 1;
+            case STBI__PNG_TYPE('I','E','N','D'):
+                if (first) return stbi__err("first not IHDR", "Corrupt PNG");
+                return 1;
+            default:
+                if (first) return stbi__err("first not IHDR", "Corrupt PNG");
+                if ((type & (1 << 29)) == 0) return stbi__err("unknown chunk", "PNG not supported: unknown PNG chunk type");
+                break;
+        }
+        // the chunk and its CRC
+        if ((stbi__uint32) (end - p) < len || end - p - len < 4) return stbi__err("outofdata","Corrupt PNG");
+        p += len + 4;
+    }
+}
+#endif
+
+static int stbi__probe_main(stbi_uc const *buffer, int len, stbi_probe_result *result, int *more)
+{
+    stbi__context s;
+    int ok = 0;
+    STBI_NOTUSED(more);
+    memset(result, 0, sizeof(*result));
+    result->bits_per_channel = 8;
+    
+#ifndef STBI_NO_JPEG
+    if (len >= 2 && buffer[0] == 0xff) {
+        stbi_uc const *p = buffer, *end = buffer + len;
+        while (p < end && *p == 0xff) ++p;
+        if (p < end && *p == 0xd8) return stbi__probe_jpeg(buffer, end, result, more);
+    }
+#endif
+#ifndef STBI_NO_PNG
+    if (len >= 8 && memcmp(buffer, "\x89PNG\r\n\x1a\n", 8) == 0) return stbi__probe_png(buffer, buffer + len, result);
+#endif
+    
+    // the rest have short headers that their info functions read directly
+    stbi__start_mem(&s, buffer, len);
+    if (0) {
+#ifndef STBI_NO_GIF
+    } else if (len >= 4 && memcmp(buffer, "GIF8", 4) == 0) {
+        result->format = STBI_format_gif;
+        ok = stbi__gif_info(&s, &result->x, &result->y, &result->channels);
+#endif
+#ifndef STBI_NO_BMP
+    } else if (len >= 2 && buffer[0] == 'B' && buffer[1] == 'M') {
+        result->format = STBI_format_bmp;
+        ok = stbi__bmp_info(&s, &result->x, &result->y, &result->channels);
+#endif
+#ifndef STBI_NO_PSD
+    } else if (len >= 4 && memcmp(buffer, "8BPS", 4) == 0) {
+        result->format = STBI_format_psd;
+        ok = stbi__psd_info(&s, &result->x, &result->y, &result->channels);
+        stbi__rewind(&s);
+        if (ok && stbi__psd_is16(&s)) result->bits_per_channel = 16;
+#endif
+#ifndef STBI_NO_PIC
+    } else if (len >= 4 && memcmp(buffer, "\x53\x80\xF6\x34", 4) == 0) {
+        result->format = STBI_format_pic;
+        ok = stbi__pic_info(&s, &result->x, &result->y, &result->channels);
+#endif
+#ifndef STBI_NO_PNM
+    } else if (len >= 1 && buffer[0] == 'P') {
+        result->format = STBI_format_pnm;
+        ok = stbi__pnm_info(&s, &result->x, &result->y, &result->channels);
+#endif
+#ifndef STBI_NO_HDR
+    } else if (len >= 2 && buffer[0] == '#' && buffer[1] == '?') {
+        result->format = STBI_format_hdr;
+        result->bits_per_channel = 32;
+        ok = stbi__hdr_info(&s, &result->x, &result->y, &result->channels);
+#endif
+    } else {
+        // tga has no magic, so it gets whatever's left
+#ifndef STBI_NO_TGA
+        result->format = STBI_format_tga;
+        ok = stbi__tga_info(&s, &result->x, &result->y, &result->channels);
+#endif
+    }
+    if (!ok) {
+        result->format = STBI_format_unknown;
+        return stbi__err("unknown image type", "Image not of any known type, or corrupt");
+    }
+    return 1;
+}
+
+STBIDEF int stbi_probe_from_memory(stbi_uc const *buffer, int len, stbi_probe_result *result)
+{
+    int more = 0;
+    return stbi__probe_main(buffer, len, result, &more);
+}
+
+#ifndef STBI_NO_STDIO
+STBIDEF int stbi_probe(char const *filename, stbi_probe_result *result)
+{
+    // the headers are nearly always in the first few K; only if they aren't
+    // (a JPEG with a big EXIF block, say) is the rest of the file needed
+    stbi_uc head[4096];
+    stbi__mapped_file m;
+    int n, r, more = 0;
+    FILE *f = stbi__fopen(filename, "rb");
+    if (!f) return stbi__err("can't fopen", "Unable to open file");
+    n = (int) fread(head, 1, sizeof(head), f);
+    if (n == 0) {
+        fclose(f);
+        return stbi__err("empty file", "Image file is empty");
+    }
+    r = stbi__probe_main(head, n, result, &more);
+    if ((r && !more) || n < (int) sizeof(head)) {
+        fclose(f);
+        return r;
+    }
+    if (fseek(f, 0, SEEK_SET) == 0) {
+        fclose(f);
+        if (!stbi__map_file(&m, filename)) return 0;
+    } else {
+        // a pipe can't be read again from the start, so carry on from here
+        r = stbi__read_stream(&m, f, head, n);
+        fclose(f);
+        if (!r) return 0;
+    }
+    r = stbi__probe_main(m.data, m.len, result, &more);
+    stbi__unmap_file(&m);
+    return r;
+}
+#endif
+
+STBIDEF stbi_uc const *stbi_view_from_memory(stbi_uc const *buffer, int len, int *x, int *y, int *comp, ptrdiff_t *row_stride)
+{
+    stbi__context s;
+    stbi_uc const *p = NULL;
+    int w = 0, h = 0, n = 0, bottom_up = 0;
+    stbi__start_mem(&s, buffer, len);
+#ifndef STBI_NO_PNM
+    if (stbi__pnm_info(&s, &w, &h, &n))
+        p = s.img_buffer; // stbi__pnm_info stops at the first pixel
+#endif
+#ifndef STBI_NO_TGA
+    stbi__rewind(&s);
+    if (!p && stbi__tga_test(&s)) {
+        // only uncompressed, unmapped grey (and grey+alpha) is stored as-is
+        if (len >= 18 && 18 + buffer[0] <= len && buffer[1] == 0 && buffer[2] == 3 && (buffer[16] == 8 || buffer[16] == 16)) {
+            w = buffer[12] | (buffer[13] << 8);
+            h = buffer[14] | (buffer[15] << 8);
+            n = buffer[16] / 8;
+            bottom_up = !(buffer[17] & 32);
+            p = buffer + 18 + buffer[0];
+        }
+    }
+#endif
+    if (!p || w <= 0 || h <= 0 || !stbi__mad3sizes_valid(w, h, n, 0))
+        return stbi__errpuc("not uncompressed", "Image isn't stored uncompressed");
+    if (p > buffer + len || (size_t) (buffer + len - p) < (size_t) w * h * n)
+        return stbi__errpuc("too short", "Image data is cut short");
+    if (x) *x = w;
+    if (y) *y = h;
+    if (comp) *comp = n;
+    if (row_stride) *row_stride = bottom_up ? -(ptrdiff_t) w * n : (ptrdiff_t) w * n;
+    return bottom_up ? p + (size_t) (h-1) * w * n : p;
+}
+
+static void *stbi__load_psd_planes(stbi__context *s, int *x, int *y, int *comp, int bpc)
+{
+#ifndef STBI_NO_PSD
+    if (stbi__psd_test(s))
+        return stbi__psd_load_planes(s, x, y, comp, bpc);
+#else
+    STBI_NOTUSED(x); STBI_NOTUSED(y); STBI_NOTUSED(comp); STBI_NOTUSED(bpc);
+#endif
+    STBI_NOTUSED(s);
+    return stbi__errpuc("not PSD", "Image is not a PSD");
+}
+
+STBIDEF stbi_uc *stbi_load_psd_planes_from_memory(stbi_uc const *buffer, int len, int *x, int *y, int *comp)
+{
+    stbi__context s;
+    stbi__start_mem(&s, buffer, len);
+    return (stbi_uc *) stbi__load_psd_planes(&s, x, y, comp, 8);
+}
+
+STBIDEF stbi_us *stbi_load_psd_planes_16_from_memory(stbi_uc const *buffer, int len, int *x, int *y, int *comp)
+{
+    stbi__context s;
+    stbi__start_mem(&s, buffer, len);
+    return (stbi_us *) stbi__load_psd_planes(&s, x, y, comp, 16);
+}
+
+#ifndef STBI_NO_STDIO
+// the file is mapped, or read in one go, like stbi_load_mapped
+static void *stbi__load_psd_planes_file(char const *filename, int *x, int *y, int *comp, int bpc)
+{
+    stbi__mapped_file m;
+    stbi__context s;
+    void *result;
+    if (!stbi__map_file(&m, filename)) return NULL;
+    stbi__start_mem(&s, m.data, m.len);
+    result = stbi__load_psd_planes(&s, x, y, comp, bpc);
+    stbi__unmap_file(&m);
+    return result;
+}
+
+STBIDEF stbi_uc *stbi_load_psd_planes(char const *filename, int *x, int *y, int *comp)
+{
+    return (stbi_uc *) stbi__load_psd_planes_file(filename, x, y, comp, 8);
+}
+
+STBIDEF stbi_us *stbi_load_psd_planes_16(char const *filename, int *x, int *y, int *comp)
+{
+    return (stbi_us *) stbi__load_psd_planes_file(filename, x, y, comp, 16);
+}
+#endif
+
 #endif // STB_IMAGE_IMPLEMENTATION
 
 /*
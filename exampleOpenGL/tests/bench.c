@@ -0,0 +1,733 @@
+// Decode benchmark: times stb_image.h on a synthetic corpus and on any
+// files (or directories of them) named on the command line, and reports
+// for each image the input MB/s, output megapixels/s and the per-stage
+// times from STBI_PROFILE. The synthetic images cover PNG (every bit depth,
+// each filter, Adam7, palettes), GIF, HDR, TGA, BMP, PSD and PNM. There's no
+// JPEG encoder here, so the JPEGs are the files in jpeg/ next to the
+// binary: res/tianjin_tower.jpg saved again by libjpeg (through Pillow, at
+// quality 85) as baseline 4:4:4, 4:2:2 and 4:2:0, progressive 4:4:4 and
+// 4:2:0, 4:2:0 with a restart marker every MCU row, and greyscale.
+//
+//   make bench
+//   ./bench [-t seconds] [-j threads] [-s] [files or directories...]
+//
+// -t is the least time spent on each image (0.5s by default), -j decodes
+// with stbi_load_from_memory_mt, -s leaves out the synthetic images. Files
+// are read into memory first, so the times don't include I/O. Peak RSS is
+// the process's, so it only goes up from one line to the next.
+
+#define STBI_PROFILE
+#define STB_IMAGE_IMPLEMENTATION
+#include "../stb_image.h"
+
+#include <dirent.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#define W 1024
+#define H 768
+
+typedef struct
+{
+    unsigned char *data;
+    size_t len, cap;
+} buffer;
+
+static void put(buffer *b, void const *p, size_t n)
+{
+    if (b->len + n > b->cap) {
+        b->cap = (b->len + n) * 2;
+        b->data = (unsigned char *) realloc(b->data, b->cap);
+    }
+    memcpy(b->data + b->len, p, n);
+    b->len += n;
+}
+
+static void put8(buffer *b, int v) { unsigned char c = (unsigned char) v; put(b, &c, 1); }
+static void put16le(buffer *b, int v) { put8(b, v); put8(b, v >> 8); }
+static void put32le(buffer *b, unsigned int v) { put16le(b, (int) (v & 0xffff)); put16le(b, (int) (v >> 16)); }
+static void put16be(buffer *b, int v) { put8(b, v >> 8); put8(b, v); }
+static void put32be(buffer *b, unsigned int v) { put16be(b, (int) (v >> 16)); put16be(b, (int) (v & 0xffff)); }
+
+// sample c (0..255) of pixel x,y: flat blocks, gradients and noise, so
+// every kind of run, match and prediction turns up
+static int sample(int x, int y, int c)
+{
+    unsigned int n;
+    switch ((x / 64 + y / 64 * 3) % 3) {
+        case 0:  return (x / 64 * 53 + y / 64 * 97 + c * 71) & 0xff;
+        case 1:  return (x + y * 2 + c * 50) & 0xff;
+        default:
+            n = (unsigned int) x * 73856093u ^ (unsigned int) y * 19349663u ^ (unsigned int) c * 83492791u;
+            n ^= n >> 13;
+            n *= 0x5bd1e995;
+            return (int) ((n ^ (n >> 15)) & 0xff);
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//
+//  zlib: fixed Huffman codes with greedy LZ77 matches, enough to give
+//  inflate real work
+//
+
+typedef struct
+{
+    buffer *out;
+    unsigned int bits;
+    int count;
+} bit_writer;
+
+static void put_bits(bit_writer *w, unsigned int v, int n)
+{
+    w->bits |= v << w->count;
+    w->count += n;
+    while (w->count >= 8) {
+        put8(w->out, (int) w->bits);
+        w->bits >>= 8;
+        w->count -= 8;
+    }
+}
+
+// Huffman codes go most significant bit first
+static void put_code(bit_writer *w, unsigned int code, int n)
+{
+    unsigned int r = 0;
+    int i;
+    for (i=0; i < n; ++i)
+        r |= ((code >> i) & 1) << (n-1-i);
+    put_bits(w, r, n);
+}
+
+static void put_symbol(bit_writer *w, int v)
+{
+    if (v < 144)      put_code(w, 0x30 + v, 8);
+    else if (v < 256) put_code(w, 0x190 + v - 144, 9);
+    else if (v < 280) put_code(w, v - 256, 7);
+    else              put_code(w, 0xc0 + v - 280, 8);
+}
+
+static int const length_base[29] = { 3,4,5,6,7,8,9,10,11,13,15,17,19,23,27,31,35,43,51,59,67,83,99,115,131,163,195,227,258 };
+static int const length_extra[29] = { 0,0,0,0,0,0,0,0,1,1,1,1,2,2,2,2,3,3,3,3,4,4,4,4,5,5,5,5,0 };
+static int const dist_base[30] = { 1,2,3,4,5,7,9,13,17,25,33,49,65,97,129,193,257,385,513,769,1025,1537,2049,3073,4097,6145,8193,12289,16385,24577 };
+static int const dist_extra[30] = { 0,0,0,0,1,1,2,2,3,3,4,4,5,5,6,6,7,7,8,8,9,9,10,10,11,11,12,12,13,13 };
+
+static void put_match(bit_writer *w, int len, int dist)
+{
+    int i = 28, j = 29;
+    while (length_base[i] > len) --i;
+    put_symbol(w, 257 + i);
+    put_bits(w, (unsigned int) (len - length_base[i]), length_extra[i]);
+    while (dist_base[j] > dist) --j;
+    put_code(w, (unsigned int) j, 5);
+    put_bits(w, (unsigned int) (dist - dist_base[j]), dist_extra[j]);
+}
+
+static void deflate(buffer *out, unsigned char const *in, size_t n)
+{
+    static int head[1 << 15];
+    bit_writer w;
+    unsigned int a = 1, b = 0;
+    size_t i, k;
+    w.out = out;
+    w.bits = 0;
+    w.count = 0;
+    put8(out, 0x78);
+    put8(out, 0x01);
+    put_bits(&w, 1, 1);   // final block
+    put_bits(&w, 1, 2);   // fixed codes
+    for (i=0; i < sizeof(head) / sizeof(head[0]); ++i)
+        head[i] = -1;
+    for (i=0; i < n; ) {
+        int len = 0;
+        if (i + 3 <= n) {
+            unsigned int h = ((in[i] << 10) ^ (in[i+1] << 5) ^ in[i+2]) & 0x7fff;
+            int cand = head[h];
+            head[h] = (int) i;
+            if (cand >= 0 && i - cand <= 32768)
+                while (len < 258 && i + len < n && in[cand + len] == in[i + len])
+                    ++len;
+            if (len >= 3) {
+                put_match(&w, len, (int) (i - cand));
+                i += len;
+                continue;
+            }
+        }
+        put_symbol(&w, in[i++]);
+    }
+    put_symbol(&w, 256);
+    if (w.count) put_bits(&w, 0, 8 - w.count);
+    for (k=0; k < n; ++k) {
+        a = (a + in[k]) % 65521;
+        b = (b + a) % 65521;
+    }
+    put32be(out, b << 16 | a);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//
+//  the synthetic images
+//
+
+static unsigned int crc32(unsigned char const *p, size_t n)
+{
+    unsigned int c = 0xffffffff;
+    size_t i;
+    int k;
+    for (i=0; i < n; ++i) {
+        c ^= p[i];
+        for (k=0; k < 8; ++k)
+            c = (c >> 1) ^ (0xedb88320 & (0 - (c & 1)));
+    }
+    return c ^ 0xffffffff;
+}
+
+static void png_chunk(buffer *b, char const *type, unsigned char const *data, size_t n)
+{
+    size_t start;
+    put32be(b, (unsigned int) n);
+    start = b->len;
+    put(b, type, 4);
+    if (n) put(b, data, n);
+    put32be(b, crc32(b->data + start, n + 4));
+}
+
+static int paeth(int a, int b, int c)
+{
+    int p = a + b - c, pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+    return pa <= pb && pa <= pc ? a : pb <= pc ? b : c;
+}
+
+// color type 0, 2, 3 or 6; filter 0-4, or 5 for each in turn row by row
+static void make_png(buffer *b, int color, int depth, int interlace, int filter)
+{
+    static int const xs[7] = { 0,4,0,2,0,1,0 }, ys[7] = { 0,0,4,0,2,0,1 };
+    static int const dx[7] = { 8,8,4,4,2,2,1 }, dy[7] = { 8,8,8,4,4,2,2 };
+    int nc = color == 2 ? 3 : color == 6 ? 4 : 1;
+    int bpp = (nc * depth + 7) / 8, pass, x, y, c, i;
+    size_t row_max = ((size_t) W * nc * depth + 7) / 8;
+    unsigned char *cur = (unsigned char *) calloc(row_max, 1), *prev = (unsigned char *) calloc(row_max, 1);
+    unsigned char ihdr[13], pal[768];
+    buffer raw = { 0, 0, 0 };
+
+    for (pass = 0; pass < (interlace ? 7 : 1); ++pass) {
+        int x0 = interlace ? xs[pass] : 0, y0 = interlace ? ys[pass] : 0;
+        int sx = interlace ? dx[pass] : 1, sy = interlace ? dy[pass] : 1;
+        int pw = (W - x0 + sx - 1) / sx, ph = (H - y0 + sy - 1) / sy;
+        size_t row = ((size_t) pw * nc * depth + 7) / 8;
+        if (pw == 0 || ph == 0) continue;
+        memset(prev, 0, row);
+        for (y=0; y < ph; ++y) {
+            int f = filter == 5 ? y % 5 : filter;
+            memset(cur, 0, row);
+            for (x=0; x < pw; ++x) {
+                for (c=0; c < nc; ++c) {
+                    int v = sample(x0 + x * sx, y0 + y * sy, c);
+                    size_t bit = ((size_t) x * nc + c) * depth;
+                    if (depth == 16) {
+                        cur[bit/8] = (unsigned char) v;
+                        cur[bit/8 + 1] = (unsigned char) (v * 37);
+                    } else if (depth == 8) {
+                        cur[bit/8] = (unsigned char) v;
+                    } else {
+                        cur[bit/8] |= (unsigned char) ((v >> (8 - depth)) << (8 - depth - bit % 8));
+                    }
+                }
+            }
+            put8(&raw, f);
+            for (i=0; i < (int) row; ++i) {
+                int a = i >= bpp ? cur[i - bpp] : 0, up = prev[i], ul = i >= bpp ? prev[i - bpp] : 0;
+                int p = f == 0 ? 0 : f == 1 ? a : f == 2 ? up : f == 3 ? (a + up) / 2 : paeth(a, up, ul);
+                put8(&raw, cur[i] - p);
+            }
+            memcpy(prev, cur, row);
+        }
+    }
+
+    put(b, "\x89PNG\r\n\x1a\n", 8);
+    ihdr[0] = 0; ihdr[1] = 0; ihdr[2] = W >> 8; ihdr[3] = W & 0xff;
+    ihdr[4] = 0; ihdr[5] = 0; ihdr[6] = H >> 8; ihdr[7] = H & 0xff;
+    ihdr[8] = (unsigned char) depth;
+    ihdr[9] = (unsigned char) color;
+    ihdr[10] = 0;
+    ihdr[11] = 0;
+    ihdr[12] = (unsigned char) interlace;
+    png_chunk(b, "IHDR", ihdr, 13);
+    if (color == 3) {
+        for (i=0; i < 256; ++i) {
+            pal[i*3+0] = (unsigned char) i;
+            pal[i*3+1] = (unsigned char) (i * 7);
+            pal[i*3+2] = (unsigned char) (255 - i);
+        }
+        png_chunk(b, "PLTE", pal, 768);
+    }
+    {
+        buffer z = { 0, 0, 0 };
+        deflate(&z, raw.data, raw.len);
+        png_chunk(b, "IDAT", z.data, z.len);
+        free(z.data);
+    }
+    png_chunk(b, "IEND", NULL, 0);
+    free(raw.data);
+    free(cur);
+    free(prev);
+}
+
+// one frame of 8-bit LZW, clearing the table when it fills up
+static void make_gif(buffer *b)
+{
+    unsigned short *dict = (unsigned short *) malloc(4096 * 256 * sizeof(unsigned short));
+    bit_writer w;
+    buffer lzw = { 0, 0, 0 };
+    int next = 258, size = 9, prefix, i;
+    size_t k, n = (size_t) W * H;
+
+    put(b, "GIF89a", 6);
+    put16le(b, W);
+    put16le(b, H);
+    put8(b, 0xf7);   // 256-color global table
+    put8(b, 0);
+    put8(b, 0);
+    for (i=0; i < 256; ++i) {
+        put8(b, i);
+        put8(b, i * 7);
+        put8(b, 255 - i);
+    }
+    put8(b, 0x2c);
+    put16le(b, 0);
+    put16le(b, 0);
+    put16le(b, W);
+    put16le(b, H);
+    put8(b, 0);
+    put8(b, 8);
+
+    w.out = &lzw;
+    w.bits = 0;
+    w.count = 0;
+    memset(dict, 0, 4096 * 256 * sizeof(unsigned short));
+    put_bits(&w, 256, size);
+    prefix = sample(0, 0, 0);
+    for (k=1; k < n; ++k) {
+        int v = sample((int) (k % W), (int) (k / W), 0);
+        unsigned short *e = &dict[prefix * 256 + v];
+        if (*e) {
+            prefix = *e;
+            continue;
+        }
+        put_bits(&w, (unsigned int) prefix, size);
+        *e = (unsigned short) next++;
+        if (next > (1 << size) && size < 12) ++size;
+        if (next == 4096) {
+            put_bits(&w, 256, size);
+            memset(dict, 0, 4096 * 256 * sizeof(unsigned short));
+            next = 258;
+            size = 9;
+        }
+        prefix = v;
+    }
+    put_bits(&w, (unsigned int) prefix, size);
+    put_bits(&w, 257, size);
+    if (w.count) put_bits(&w, 0, 8 - w.count);
+    for (k=0; k < lzw.len; k += 255) {
+        size_t m = lzw.len - k < 255 ? lzw.len - k : 255;
+        put8(b, (int) m);
+        put(b, lzw.data + k, m);
+    }
+    put8(b, 0);
+    put8(b, 0x3b);
+    free(lzw.data);
+    free(dict);
+}
+
+// Radiance RGBE, each channel of each scanline run-length coded, or flat
+static void make_hdr(buffer *b, int rle)
+{
+    unsigned char *row = (unsigned char *) malloc(W * 4);
+    int x, y, c, i, j;
+    char head[64];
+    sprintf(head, "#?RADIANCE\nFORMAT=32-bit_rle_rgbe\n\n-Y %d +X %d\n", H, W);
+    put(b, head, strlen(head));
+    for (y=0; y < H; ++y) {
+        for (x=0; x < W; ++x) {
+            float rgb[3], m;
+            int e;
+            for (c=0; c < 3; ++c)
+                rgb[c] = sample(x, y, c) / 255.0f * (float) (1 << (x / 128));
+            m = rgb[0] > rgb[1] ? rgb[0] : rgb[1];
+            if (rgb[2] > m) m = rgb[2];
+            if (m < 1e-32f) {
+                memset(row + x*4, 0, 4);
+                continue;
+            }
+            frexp(m, &e);
+            for (c=0; c < 3; ++c)
+                row[x*4+c] = (unsigned char) (rgb[c] * 256.0f / (float) ldexp(1.0, e));
+            row[x*4+3] = (unsigned char) (e + 128);
+        }
+        if (!rle) {
+            put(b, row, W * 4);
+            continue;
+        }
+        put8(b, 2);
+        put8(b, 2);
+        put16be(b, W);
+        for (c=0; c < 4; ++c) {
+            for (i=0; i < W; ) {
+                for (j=i+1; j < W && j - i < 127 && row[j*4+c] == row[i*4+c]; ++j);
+                if (j - i >= 4) {
+                    put8(b, 128 + j - i);
+                    put8(b, row[i*4+c]);
+                } else {
+                    // a literal up to the next run of 4
+                    for (j=i; j < W && j - i < 128; ++j)
+                        if (j + 3 < W && row[j*4+c] == row[(j+1)*4+c] && row[j*4+c] == row[(j+2)*4+c] && row[j*4+c] == row[(j+3)*4+c])
+                            break;
+                    if (j == i) j = i + 1;
+                    put8(b, j - i);
+                    for (x=i; x < j; ++x)
+                        put8(b, row[x*4+c]);
+                }
+                i = j;
+            }
+        }
+    }
+    free(row);
+}
+
+static void make_tga(buffer *b, int nc, int rle)
+{
+    int x, y, c, i, j;
+    put8(b, 0);
+    put8(b, 0);
+    put8(b, rle ? 10 : 2);
+    for (i=0; i < 9; ++i) put8(b, 0);
+    put16le(b, W);
+    put16le(b, H);
+    put8(b, nc * 8);
+    put8(b, 0x20 | (nc == 4 ? 8 : 0));   // top-left origin
+    for (y=0; y < H; ++y) {
+        for (x=0; x < W; ) {
+            if (rle) {
+                for (j=x+1; j < W && j - x < 128; ++j) {
+                    for (c=0; c < nc; ++c)
+                        if (sample(j, y, c) != sample(x, y, c)) break;
+                    if (c < nc) break;
+                }
+                if (j - x >= 2) {
+                    put8(b, 0x80 | (j - x - 1));
+                    for (c=0; c < nc; ++c) put8(b, sample(x, y, nc == 4 && c == 3 ? 3 : 2 - c));
+                    x = j;
+                    continue;
+                }
+                put8(b, 0);   // a raw packet of one
+            }
+            for (c=0; c < nc; ++c) put8(b, sample(x, y, nc == 4 && c == 3 ? 3 : 2 - c));
+            ++x;
+        }
+    }
+}
+
+static void make_bmp(buffer *b, int nc)
+{
+    int row = (W * nc + 3) & ~3, x, y, c;
+    put(b, "BM", 2);
+    put32le(b, (unsigned int) (54 + row * H));
+    put32le(b, 0);
+    put32le(b, 54);
+    put32le(b, 40);
+    put32le(b, W);
+    put32le(b, H);
+    put16le(b, 1);
+    put16le(b, nc * 8);
+    put32le(b, 0);
+    put32le(b, (unsigned int) (row * H));
+    put32le(b, 2835);
+    put32le(b, 2835);
+    put32le(b, 0);
+    put32le(b, 0);
+    for (y=H-1; y >= 0; --y) {
+        for (x=0; x < W; ++x)
+            for (c=0; c < nc; ++c)
+                put8(b, sample(x, y, c == 3 ? 3 : 2 - c));
+        for (x = W * nc; x < row; ++x) put8(b, 0);
+    }
+}
+
+// RGBA, PackBits compressed
+static void make_psd(buffer *b, int depth)
+{
+    int bps = depth / 8, row = W * bps, c, y, x, i, j;
+    unsigned char *line = (unsigned char *) malloc(row), *packed = (unsigned char *) malloc(row * 2);
+    size_t counts;
+    put(b, "8BPS", 4);
+    put16be(b, 1);
+    for (i=0; i < 6; ++i) put8(b, 0);
+    put16be(b, 4);
+    put32be(b, H);
+    put32be(b, W);
+    put16be(b, depth);
+    put16be(b, 3);
+    put32be(b, 0);
+    put32be(b, 0);
+    put32be(b, 0);
+    put16be(b, 1);
+    counts = b->len;
+    for (i=0; i < H * 4; ++i) put16be(b, 0);
+    for (c=0; c < 4; ++c) {
+        for (y=0; y < H; ++y) {
+            unsigned char *p = packed;
+            for (x=0; x < W; ++x) {
+                int v = c == 3 ? 0xff : sample(x, y, c);
+                line[x*bps] = (unsigned char) v;
+                if (bps == 2) line[x*2+1] = (unsigned char) (c == 3 ? 0xff : v * 37);
+            }
+            for (i=0; i < row; i = j) {
+                for (j=i+1; j < row && j - i < 128 && line[j] == line[i]; ++j);
+                if (j - i >= 2) {
+                    *p++ = (unsigned char) (257 - (j - i));
+                    *p++ = line[i];
+                } else {
+                    while (j < row && j - i < 128 && !(j + 1 < row && line[j] == line[j+1])) ++j;
+                    *p++ = (unsigned char) (j - i - 1);
+                    memcpy(p, line + i, j - i);
+                    p += j - i;
+                }
+            }
+            b->data[counts + (c * H + y) * 2] = (unsigned char) ((p - packed) >> 8);
+            b->data[counts + (c * H + y) * 2 + 1] = (unsigned char) (p - packed);
+            put(b, packed, p - packed);
+        }
+    }
+    free(line);
+    free(packed);
+}
+
+static void make_pnm(buffer *b)
+{
+    char head[32];
+    int x, y, c;
+    sprintf(head, "P6\n%d %d\n255\n", W, H);
+    put(b, head, strlen(head));
+    for (y=0; y < H; ++y)
+        for (x=0; x < W; ++x)
+            for (c=0; c < 3; ++c)
+                put8(b, sample(x, y, c));
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//
+//  timing
+//
+
+static double now(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+static double peak_rss_mb(void)
+{
+    struct rusage u;
+    getrusage(RUSAGE_SELF, &u);
+#ifdef __APPLE__
+    return u.ru_maxrss / (1024.0 * 1024.0);   // bytes
+#else
+    return u.ru_maxrss / 1024.0;              // kilobytes
+#endif
+}
+
+static double min_seconds = 0.5;
+static int threads = 1;
+
+// one decode of whatever kind suits the image
+static void *decode(unsigned char const *data, int len, int *x, int *y)
+{
+    int n;
+    if (stbi_is_hdr_from_memory(data, len))
+        return stbi_loadf_from_memory(data, len, x, y, &n, 0);
+    if (stbi_is_16_bit_from_memory(data, len))
+        return stbi_load_16_from_memory(data, len, x, y, &n, 0);
+    if (threads > 1)
+        return stbi_load_from_memory_mt(data, len, x, y, &n, 0, threads);
+    return stbi_load_from_memory(data, len, x, y, &n, 0);
+}
+
+static void bench(char const *name, unsigned char const *data, size_t len)
+{
+    stbi_profile prof;
+    double start, elapsed;
+    int x, y, runs, i;
+    void *img = decode(data, (int) len, &x, &y);
+    if (!img) {
+        printf("%-28s fails: %s\n", name, stbi_failure_reason());
+        return;
+    }
+    stbi_image_free(img);
+
+    stbi_profile_reset();
+    start = now();
+    for (runs = 0; runs < 3 || now() - start < min_seconds; ++runs)
+        stbi_image_free(decode(data, (int) len, &x, &y));
+    elapsed = (now() - start) / runs;
+    stbi_profile_get(&prof);
+
+    printf("%-28s %5dx%-5d %8.0f %8.3f %8.1f %8.1f", name, x, y, len / 1024.0, elapsed * 1e3,
+        len / elapsed / 1e6, (double) x * y / elapsed / 1e6);
+    for (i=0; i < STBI_stage_count; ++i)
+        printf(" %8.3f", prof.seconds[i] / runs * 1e3);
+    printf(" %8.1f\n", peak_rss_mb());
+}
+
+// the whole of a file, or NULL
+static unsigned char *read_file(char const *path, long *len)
+{
+    FILE *f = fopen(path, "rb");
+    unsigned char *data;
+    if (!f) return NULL;
+    fseek(f, 0, SEEK_END);
+    *len = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    data = (unsigned char *) malloc(*len > 0 ? *len : 1);
+    if (*len < 0 || fread(data, 1, *len, f) != (size_t) *len) {
+        free(data);
+        data = NULL;
+    }
+    fclose(f);
+    return data;
+}
+
+static void bench_file(char const *path, int quiet)
+{
+    long len;
+    int x, y, n;
+    unsigned char *data = read_file(path, &len);
+    char const *name = strrchr(path, '/');
+    if (!data) {
+        if (!quiet) printf("%-28s can't read\n", path);
+        return;
+    }
+    if (!quiet || stbi_info_from_memory(data, (int) len, &x, &y, &n))
+        bench(name ? name + 1 : path, data, len);
+    free(data);
+}
+
+// a file, or every image in a directory and below it
+static void bench_path(char const *path, int quiet)
+{
+    struct stat st;
+    DIR *dir;
+    struct dirent *e;
+    if (stat(path, &st) != 0 || !S_ISDIR(st.st_mode)) {
+        bench_file(path, quiet);
+        return;
+    }
+    dir = opendir(path);
+    if (!dir) return;
+    while ((e = readdir(dir)) != NULL) {
+        char *sub;
+        if (e->d_name[0] == '.') continue;
+        sub = (char *) malloc(strlen(path) + strlen(e->d_name) + 2);
+        sprintf(sub, "%s/%s", path, e->d_name);
+        bench_path(sub, 1);
+        free(sub);
+    }
+    closedir(dir);
+}
+
+static void bench_synthetic(char const *jpeg_dir)
+{
+    static struct { char const *name, *file; } const jpegs[] = {
+        { "jpeg baseline 4:4:4",    "baseline_444.jpg" },
+        { "jpeg baseline 4:2:2",    "baseline_422.jpg" },
+        { "jpeg baseline 4:2:0",    "baseline_420.jpg" },
+        { "jpeg progressive 4:4:4", "progressive_444.jpg" },
+        { "jpeg progressive 4:2:0", "progressive_420.jpg" },
+        { "jpeg restarts 4:2:0",    "restart_420.jpg" },
+        { "jpeg grey",              "grey.jpg" },
+    };
+    static struct { char const *name; int color, depth, interlace, filter; } const pngs[] = {
+        { "png gray 1-bit",       0,  1, 0, 5 },
+        { "png gray 2-bit",       0,  2, 0, 5 },
+        { "png gray 4-bit",       0,  4, 0, 5 },
+        { "png gray 8-bit",       0,  8, 0, 5 },
+        { "png gray 16-bit",      0, 16, 0, 5 },
+        { "png palette",          3,  8, 0, 0 },
+        { "png rgb none",         2,  8, 0, 0 },
+        { "png rgb sub",          2,  8, 0, 1 },
+        { "png rgb up",           2,  8, 0, 2 },
+        { "png rgb average",      2,  8, 0, 3 },
+        { "png rgb paeth",        2,  8, 0, 4 },
+        { "png rgb 16-bit",       2, 16, 0, 5 },
+        { "png rgba",             6,  8, 0, 5 },
+        { "png rgba 16-bit",      6, 16, 0, 5 },
+        { "png rgb adam7",        2,  8, 1, 5 },
+        { "png gray 4-bit adam7", 0,  4, 1, 5 },
+    };
+    buffer b;
+    size_t i;
+
+#define BENCH(name, make) do { memset(&b, 0, sizeof(b)); make; bench(name, b.data, b.len); free(b.data); } while (0)
+    for (i=0; i < sizeof(pngs) / sizeof(pngs[0]); ++i)
+        BENCH(pngs[i].name, make_png(&b, pngs[i].color, pngs[i].depth, pngs[i].interlace, pngs[i].filter));
+    BENCH("gif",              make_gif(&b));
+    BENCH("hdr rle",          make_hdr(&b, 1));
+    BENCH("hdr flat",         make_hdr(&b, 0));
+    BENCH("tga rgb",          make_tga(&b, 3, 0));
+    BENCH("tga rgba rle",     make_tga(&b, 4, 1));
+    BENCH("bmp rgb",          make_bmp(&b, 3));
+    BENCH("bmp rgba",         make_bmp(&b, 4));
+    BENCH("psd rgba",         make_psd(&b, 8));
+    BENCH("psd rgba 16-bit",  make_psd(&b, 16));
+    BENCH("pnm rgb",          make_pnm(&b));
+#undef BENCH
+    
+    for (i=0; i < sizeof(jpegs) / sizeof(jpegs[0]); ++i) {
+        char path[1024];
+        long len;
+        unsigned char *data;
+        sprintf(path, "%.1000s/%s", jpeg_dir, jpegs[i].file);
+        data = read_file(path, &len);
+        if (data)
+            bench(jpegs[i].name, data, len);
+        else
+            printf("%-28s can't read %s\n", jpegs[i].name, path);
+        free(data);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    char jpeg_dir[1024];
+    char const *slash = strrchr(argv[0], '/');
+    int i, synthetic = 1;
+    for (i=1; i < argc && argv[i][0] == '-'; ++i) {
+        if (!strcmp(argv[i], "-t") && i+1 < argc)
+            min_seconds = atof(argv[++i]);
+        else if (!strcmp(argv[i], "-j") && i+1 < argc)
+            threads = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "-s"))
+            synthetic = 0;
+        else {
+            printf("usage: %s [-t seconds] [-j threads] [-s] [files or directories...]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    printf("%-28s %11s %8s %8s %8s %8s %8s %8s %8s %8s %8s %8s %8s %8s\n", "", "size", "KB", "ms", "MB/s", "MP/s",
+        "entropy", "idct", "upsample", "color", "inflate", "unfilter", "convert", "RSS MB");
+    if (slash)
+        sprintf(jpeg_dir, "%.*s/jpeg", (int) (slash - argv[0]) < 1000 ? (int) (slash - argv[0]) : 1000, argv[0]);
+    else
+        strcpy(jpeg_dir, "jpeg");
+    if (synthetic)
+        bench_synthetic(jpeg_dir);
+    for (; i < argc; ++i)
+        bench_path(argv[i], 0);
+    return 0;
+}
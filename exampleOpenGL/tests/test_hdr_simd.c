@@ -0,0 +1,316 @@
+// HDR and float conversions: the SIMD build against the scalar one (the
+// Makefile compiles this file once more as each, with VARIANT set), and
+// both against the formulas written out with libm. Radiance files, flat and
+// run-length coded and with every exponent, go to float, to 8 bits at a
+// few gammas and scales, and to half floats; 8- and 16-bit images go to
+// float. All of it has to match exactly.
+
+#ifdef VARIANT
+
+#define STB_IMAGE_STATIC
+#define STB_IMAGE_IMPLEMENTATION
+#include "../stb_image.h"
+
+#define NAME2(v, f) v##_##f
+#define NAME(v, f) NAME2(v, f)
+
+stbi_uc *NAME(VARIANT, load)(stbi_uc const *buf, int len, int *x, int *y, int req_comp, stbi_options *opt)
+{
+    int n;
+    return stbi_load_from_memory_opt(buf, len, x, y, &n, req_comp, opt);
+}
+
+float *NAME(VARIANT, loadf)(stbi_uc const *buf, int len, int *x, int *y, int req_comp, stbi_options *opt)
+{
+    int n;
+    return stbi_loadf_from_memory_opt(buf, len, x, y, &n, req_comp, opt);
+}
+
+stbi_us *NAME(VARIANT, loadh)(stbi_uc const *buf, int len, int *x, int *y, int req_comp)
+{
+    int n;
+    return stbi_loadh_from_memory(buf, len, x, y, &n, req_comp);
+}
+
+void NAME(VARIANT, free)(void *p)
+{
+    stbi_image_free(p);
+}
+
+void NAME(VARIANT, options_init)(stbi_options *opt)
+{
+    stbi_options_init(opt);
+}
+
+#else
+
+#include "../stb_image.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define DECLARE(v) \
+    stbi_uc *v##_load(stbi_uc const *buf, int len, int *x, int *y, int req_comp, stbi_options *opt); \
+    float *v##_loadf(stbi_uc const *buf, int len, int *x, int *y, int req_comp, stbi_options *opt); \
+    stbi_us *v##_loadh(stbi_uc const *buf, int len, int *x, int *y, int req_comp); \
+    void v##_free(void *p); \
+    void v##_options_init(stbi_options *opt);
+DECLARE(scalar)
+DECLARE(simd)
+
+static int failures = 0;
+
+#define CHECK(cond, ...) \
+    do { if (!(cond)) { printf("FAIL %s:%d: ", __FILE__, __LINE__); printf(__VA_ARGS__); printf("\n"); ++failures; } } while (0)
+
+static unsigned int seed = 1;
+
+static int rnd(int n)
+{
+    seed = seed * 1103515245 + 12345;
+    return (int) ((seed >> 8) % (unsigned int) n);
+}
+
+typedef struct
+{
+    unsigned char *data;
+    int len, cap;
+} buffer;
+
+static void put(buffer *b, void const *p, int n)
+{
+    if (b->len + n > b->cap) {
+        b->cap = (b->len + n) * 2;
+        b->data = (unsigned char *) realloc(b->data, b->cap);
+    }
+    memcpy(b->data + b->len, p, n);
+    b->len += n;
+}
+
+static void put8(buffer *b, int v) { unsigned char c = (unsigned char) v; put(b, &c, 1); }
+
+// w*h RGBE pixels: runs and noise, exponents 0 (black), 1..9 (denormal
+// scales) and up to 255
+static unsigned char *make_rgbe(int w, int h)
+{
+    unsigned char *p = (unsigned char *) malloc((size_t) w * h * 4);
+    int i, c;
+    for (i=0; i < w*h; ++i) {
+        if (i > 0 && rnd(3) == 0) {
+            memcpy(p + i*4, p + (i-1)*4, 4);
+            continue;
+        }
+        for (c=0; c < 3; ++c)
+            p[i*4+c] = (unsigned char) rnd(256);
+        switch (rnd(4)) {
+            case 0:  p[i*4+3] = (unsigned char) rnd(10); break;
+            case 1:  p[i*4+3] = (unsigned char) (120 + rnd(20)); break;
+            default: p[i*4+3] = (unsigned char) rnd(256); break;
+        }
+    }
+    return p;
+}
+
+// a Radiance file of 'rgbe', with its scanlines run-length coded if 'rle'
+// (the decoder only takes those 8 to 32767 wide)
+static buffer make_hdr(unsigned char const *rgbe, int w, int h, int rle)
+{
+    buffer b = { NULL, 0, 0 };
+    char head[64];
+    int y, c, i, j, k;
+    sprintf(head, "#?RADIANCE\nFORMAT=32-bit_rle_rgbe\n\n-Y %d +X %d\n", h, w);
+    put(&b, head, (int) strlen(head));
+    for (y=0; y < h; ++y) {
+        unsigned char const *row = rgbe + (size_t) y * w * 4;
+        if (!rle) {
+            put(&b, row, w * 4);
+            continue;
+        }
+        put8(&b, 2);
+        put8(&b, 2);
+        put8(&b, w >> 8);
+        put8(&b, w & 0xff);
+        for (c=0; c < 4; ++c) {
+            for (i=0; i < w; i = j) {
+                for (j=i+1; j < w && j - i < 127 && row[j*4+c] == row[i*4+c]; ++j);
+                if (j - i >= 3) {
+                    put8(&b, 128 + j - i);
+                    put8(&b, row[i*4+c]);
+                    continue;
+                }
+                for (j=i+1; j < w && j - i < 128 && !(j + 2 < w && row[j*4+c] == row[(j+1)*4+c] && row[j*4+c] == row[(j+2)*4+c]); ++j);
+                put8(&b, j - i);
+                for (k=i; k < j; ++k)
+                    put8(&b, row[k*4+c]);
+            }
+        }
+    }
+    return b;
+}
+
+// what a pixel comes out as, straight from the format's definition
+static void ref_float(float *out, unsigned char const *rgbe, int req_comp)
+{
+    float scale = rgbe[3] ? (float) ldexp(1.0, rgbe[3] - 136) : 0;
+    if (req_comp <= 2) {
+        out[0] = (rgbe[0] + rgbe[1] + rgbe[2]) * scale / 3;
+    } else {
+        out[0] = rgbe[0] * scale;
+        out[1] = rgbe[1] * scale;
+        out[2] = rgbe[2] * scale;
+    }
+    if (req_comp == 2) out[1] = 1;
+    if (req_comp == 4) out[3] = 1;
+}
+
+static int ref_ldr(float v, stbi_options const *opt)
+{
+    float z = (float) pow(v * (1 / opt->hdr_to_ldr_scale), 1 / opt->hdr_to_ldr_gamma) * 255 + 0.5f;
+    if (z < 0) z = 0;
+    if (z > 255) z = 255;
+    return (int) z;
+}
+
+static void test_hdr(int w, int h, int rle)
+{
+    // at gamma 1 and scale 255/256 the thresholds between 8-bit values are
+    // (2k-1)/512, which exponent 127 and an odd mantissa hit exactly
+    static float const gammas[][2] = { { 2.2f, 1.0f }, { 1.0f, 1.0f }, { 1.0f, 255.0f / 256 }, { 1.8f, 0.5f }, { 2.4f, 4.0f }, { 0.7f, 1e-3f } };
+    unsigned char *rgbe = make_rgbe(w, h);
+    buffer b = make_hdr(rgbe, w, h, rle);
+    stbi_options opt;
+    int req_comp, g, i, k, x, y;
+
+    scalar_options_init(&opt);
+    for (req_comp = 1; req_comp <= 4; ++req_comp) {
+        float *a = scalar_loadf(b.data, b.len, &x, &y, req_comp, &opt);
+        float *s = simd_loadf(b.data, b.len, &x, &y, req_comp, &opt);
+        stbi_us *ha = scalar_loadh(b.data, b.len, &x, &y, req_comp);
+        stbi_us *hs = simd_loadh(b.data, b.len, &x, &y, req_comp);
+        CHECK(a && s && ha && hs && x == w && y == h, "%dx%d rle %d doesn't load", w, h, rle);
+        if (a && s) {
+            CHECK(memcmp(a, s, (size_t) w * h * req_comp * sizeof(float)) == 0, "%dx%d rle %d, %d channels: scalar and SIMD floats differ", w, h, rle, req_comp);
+            for (i=0; i < w*h; ++i) {
+                float want[4];
+                ref_float(want, rgbe + i*4, req_comp);
+                if (memcmp(want, s + i*req_comp, req_comp * sizeof(float)) != 0) {
+                    CHECK(0, "%dx%d rle %d, %d channels: pixel %d (exponent %d) is %g, want %g", w, h, rle, req_comp, i, rgbe[i*4+3], s[i*req_comp], want[0]);
+                    break;
+                }
+            }
+        }
+        if (ha && hs)
+            CHECK(memcmp(ha, hs, (size_t) w * h * req_comp * 2) == 0, "%dx%d rle %d, %d channels: scalar and SIMD halves differ", w, h, rle, req_comp);
+        scalar_free(a);
+        simd_free(s);
+        scalar_free(ha);
+        simd_free(hs);
+    }
+
+    for (g=0; g < (int) (sizeof(gammas) / sizeof(gammas[0])); ++g) {
+        opt.hdr_to_ldr_gamma = gammas[g][0];
+        opt.hdr_to_ldr_scale = gammas[g][1];
+        for (req_comp = 3; req_comp <= 4; ++req_comp) {
+            float *f = scalar_loadf(b.data, b.len, &x, &y, req_comp, NULL);
+            stbi_uc *a = scalar_load(b.data, b.len, &x, &y, req_comp, &opt);
+            stbi_uc *s = simd_load(b.data, b.len, &x, &y, req_comp, &opt);
+            CHECK(f && a && s, "%dx%d rle %d doesn't load at 8 bits", w, h, rle);
+            if (f && a && s) {
+                CHECK(memcmp(a, s, (size_t) w * h * req_comp) == 0, "%dx%d rle %d, gamma %g scale %g: scalar and SIMD differ", w, h, rle, opt.hdr_to_ldr_gamma, opt.hdr_to_ldr_scale);
+                for (i=0; i < w*h*req_comp; ++i) {
+                    k = i % req_comp == 3 ? 255 : ref_ldr(f[i], &opt);
+                    if (s[i] != k) {
+                        CHECK(0, "gamma %g scale %g: %g goes to %d, want %d", opt.hdr_to_ldr_gamma, opt.hdr_to_ldr_scale, f[i], s[i], k);
+                        break;
+                    }
+                }
+            }
+            scalar_free(f);
+            scalar_free(a);
+            simd_free(s);
+        }
+    }
+    free(b.data);
+    free(rgbe);
+}
+
+// 8- or 16-bit RGBA, as an uncompressed PSD, with every value in each channel
+static buffer make_psd(int w, int h, int depth, unsigned short *samples)
+{
+    buffer b = { NULL, 0, 0 };
+    static unsigned char const head[] = { '8','B','P','S', 0,1, 0,0,0,0,0,0, 0,4 };
+    unsigned char tail[] = { 0,0, 0,0,0,0, 0,0,0,0, 0,0,0,0, 0,0 };
+    int c, i;
+    put(&b, head, sizeof(head));
+    put8(&b, h >> 24); put8(&b, h >> 16); put8(&b, h >> 8); put8(&b, h);
+    put8(&b, w >> 24); put8(&b, w >> 16); put8(&b, w >> 8); put8(&b, w);
+    put8(&b, 0);
+    put8(&b, depth);
+    tail[1] = 3;   // RGB mode
+    put(&b, tail, sizeof(tail));
+    for (c=0; c < 4; ++c) {
+        for (i=0; i < w*h; ++i) {
+            int v = c == 3 ? (depth == 16 ? 0xffff : 0xff) : (i * 7 + c * 1001) % (depth == 16 ? 65536 : 256);
+            samples[i*4+c] = (unsigned short) v;
+            if (depth == 16) put8(&b, v >> 8);
+            put8(&b, v);
+        }
+    }
+    return b;
+}
+
+static void test_ldr(int w, int h, int depth, float gamma, float scale)
+{
+    unsigned short *samples = (unsigned short *) malloc((size_t) w * h * 4 * sizeof(unsigned short));
+    buffer b = make_psd(w, h, depth, samples);
+    stbi_options opt;
+    float *a, *s;
+    int x, y, i;
+    scalar_options_init(&opt);
+    opt.ldr_to_hdr_gamma = gamma;
+    opt.ldr_to_hdr_scale = scale;
+    a = scalar_loadf(b.data, b.len, &x, &y, 4, &opt);
+    s = simd_loadf(b.data, b.len, &x, &y, 4, &opt);
+    CHECK(a && s, "%dx%d %d-bit doesn't load as float", w, h, depth);
+    if (a && s) {
+        CHECK(memcmp(a, s, (size_t) w * h * 4 * sizeof(float)) == 0, "%dx%d %d-bit: scalar and SIMD floats differ", w, h, depth);
+        for (i=0; i < w*h*4; ++i) {
+            float max = depth == 16 ? 65535.0f : 255.0f;
+            float want = i % 4 == 3 ? samples[i] / max : (float) (pow(samples[i] / max, gamma) * scale);
+            if (s[i] != want) {
+                CHECK(0, "%d-bit, gamma %g scale %g: %d goes to %g, want %g", depth, gamma, scale, samples[i], s[i], want);
+                break;
+            }
+        }
+    }
+    scalar_free(a);
+    simd_free(s);
+    free(b.data);
+    free(samples);
+}
+
+int main(void)
+{
+    static int const widths[] = { 1, 3, 7, 8, 9, 13, 64, 301 };
+    int i, rle;
+    for (i=0; i < (int) (sizeof(widths) / sizeof(widths[0])); ++i)
+        for (rle = 0; rle <= 1; ++rle)
+            if (!rle || widths[i] >= 8)
+                test_hdr(widths[i], 5, rle);
+    test_hdr(1024, 64, 1);
+    test_ldr(16, 16, 8, 2.2f, 1.0f);
+    test_ldr(16, 16, 8, 1.0f, 3.0f);
+    test_ldr(40, 20, 16, 2.2f, 1.0f);     // under the 16-bit table size: pow() per sample
+    test_ldr(300, 200, 16, 2.2f, 1.0f);   // over it: the table
+    test_ldr(300, 200, 16, 0.45f, 0.5f);
+    if (failures) {
+        printf("test_hdr_simd: %d failures\n", failures);
+        return 1;
+    }
+    printf("test_hdr_simd: ok\n");
+    return 0;
+}
+
+#endif
@@ -0,0 +1,73 @@
+// stbi_load_into: the rows it writes match stbi_load's, and nothing outside
+// them is touched, whatever the stride, flip and channel count
+
+#define STB_IMAGE_IMPLEMENTATION
+#include "../stb_image.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define CANARY 0xa5
+
+static int failures = 0;
+
+#define CHECK(cond, ...) \
+    do { if (!(cond)) { printf("FAIL %s:%d: ", __FILE__, __LINE__); printf(__VA_ARGS__); printf("\n"); ++failures; } } while (0)
+
+static void test_into(char const *filename, int req_comp, size_t pad, int flip)
+{
+    int w, h, n, x, y, j, ok;
+    size_t stride, size, k, row;
+    stbi_uc *ref, *dst;
+
+    stbi_set_flip_vertically_on_load(flip);
+    ref = stbi_load(filename, &w, &h, &n, req_comp);
+    CHECK(ref != NULL, "%s doesn't load: %s", filename, stbi_failure_reason());
+    if (!ref) return;
+
+    row = (size_t) w * req_comp;
+    stride = row + pad;
+    // the last row needs no padding after it; leave a little more to guard
+    size = stride * (h - 1) + row + 16;
+    dst = (stbi_uc *) malloc(size);
+    memset(dst, CANARY, size);
+    ok = stbi_load_into(filename, &x, &y, &n, dst, stride, stride * (h - 1) + row, req_comp);
+    CHECK(ok && x == w && y == h, "%s into a stride of %d doesn't load", filename, (int) stride);
+    if (ok) {
+        for (j=0; j < h; ++j) {
+            if (memcmp(dst + stride * j, ref + row * j, row) != 0) {
+                CHECK(0, "%s, %d channels, stride %d, flip %d: row %d differs", filename, req_comp, (int) stride, flip, j);
+                break;
+            }
+            for (k = row; k < (j == h-1 ? row + 16 : stride); ++k) {
+                if (dst[stride * j + k] != CANARY) {
+                    CHECK(0, "%s, %d channels, stride %d, flip %d: byte %d past row %d written", filename, req_comp, (int) stride, flip, (int) (k - row), j);
+                    j = h;
+                    break;
+                }
+            }
+        }
+    }
+    free(dst);
+    stbi_image_free(ref);
+    stbi_set_flip_vertically_on_load(0);
+}
+
+int main(int argc, char **argv)
+{
+    char const *filename = argc > 1 ? argv[1] : "../res/tianjin_tower.jpg";
+    int req_comp, flip;
+    size_t pads[] = { 0, 1, 5, 64 };
+    size_t p;
+    for (req_comp = 1; req_comp <= 4; ++req_comp)
+        for (flip = 0; flip <= 1; ++flip)
+            for (p = 0; p < sizeof(pads) / sizeof(pads[0]); ++p)
+                test_into(filename, req_comp, pads[p], flip);
+    if (failures) {
+        printf("test_load_into: %d failures\n", failures);
+        return 1;
+    }
+    printf("test_load_into: ok\n");
+    return 0;
+}
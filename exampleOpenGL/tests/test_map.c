@@ -0,0 +1,134 @@
+// the loaders that take the whole file up front (stbi_load_mapped,
+// stbi_load_mt, stbi_probe) read FIFOs and /dev/stdin like plain files, and
+// say so when a file is empty
+
+#define STB_IMAGE_IMPLEMENTATION
+#include "../stb_image.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+static int failures = 0;
+
+#define CHECK(cond, ...) \
+    do { if (!(cond)) { printf("FAIL %s:%d: ", __FILE__, __LINE__); printf(__VA_ARGS__); printf("\n"); ++failures; } } while (0)
+
+// a child that opens 'path' for writing and sends it 'data', or sends it
+// down 'fd' if that isn't -1
+static pid_t feed(char const *path, int fd, unsigned char const *data, long len)
+{
+    pid_t pid = fork();
+    if (pid == 0) {
+        FILE *f = fd < 0 ? fopen(path, "wb") : fdopen(fd, "wb");
+        _exit(f && fwrite(data, 1, len, f) == (size_t) len && fclose(f) == 0 ? 0 : 1);
+    }
+    return pid;
+}
+
+static void reap(char const *what, pid_t pid)
+{
+    int status;
+    waitpid(pid, &status, 0);
+    CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 0, "%s: the writer didn't finish", what);
+}
+
+static int x, y;
+
+static void same(char const *what, stbi_uc *got, stbi_uc const *ref, int w, int h)
+{
+    CHECK(got != NULL, "%s doesn't load: %s", what, stbi_failure_reason());
+    if (got)
+        CHECK(x == w && y == h && memcmp(got, ref, (size_t) w * h * 3) == 0, "%s differs from stbi_load", what);
+    stbi_image_free(got);
+}
+
+int main(int argc, char **argv)
+{
+    char const *filename = argc > 1 ? argv[1] : "../res/tianjin_tower.jpg";
+    char dir[] = "/tmp/test_map_XXXXXX";
+    char fifo[64], empty[64];
+    int w, h, n, fds[2], saved;
+    unsigned char *file, *padded;
+    long file_len;
+    stbi_uc *ref;
+    stbi_probe_result probe;
+    FILE *f;
+    pid_t pid;
+
+    // a loader that opens a FIFO twice waits for a writer that has gone
+    signal(SIGPIPE, SIG_IGN);
+    alarm(60);
+    ref = stbi_load(filename, &w, &h, &n, 3);
+    CHECK(ref != NULL, "%s doesn't load: %s", filename, stbi_failure_reason());
+    f = fopen(filename, "rb");
+    if (!ref || !f) return 1;
+    fseek(f, 0, SEEK_END);
+    file_len = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    file = (unsigned char *) malloc(file_len);
+    if (fread(file, 1, file_len, f) != (size_t) file_len) return 1;
+    fclose(f);
+
+    if (!mkdtemp(dir)) return 1;
+    sprintf(fifo, "%s/fifo", dir);
+    sprintf(empty, "%s/empty", dir);
+    if (mkfifo(fifo, 0600) != 0) return 1;
+
+    pid = feed(fifo, -1, file, file_len);
+    same("stbi_load_mapped from a FIFO", stbi_load_mapped(fifo, &x, &y, &n, 3), ref, w, h);
+    reap("stbi_load_mapped", pid);
+    pid = feed(fifo, -1, file, file_len);
+    same("stbi_load_mt from a FIFO", stbi_load_mt(fifo, &x, &y, &n, 3, 4), ref, w, h);
+    reap("stbi_load_mt", pid);
+    pid = feed(fifo, -1, file, file_len);
+    CHECK(stbi_probe(fifo, &probe) && probe.x == w && probe.y == h, "stbi_probe of a FIFO fails: %s", stbi_failure_reason());
+    reap("stbi_probe", pid);
+
+    // the same JPEG with a 20K APP15 segment after the SOI, so stbi_probe
+    // has to read past its first few K to find the frame header
+    padded = (unsigned char *) calloc(file_len + 20004, 1);
+    memcpy(padded, file, 2);
+    padded[2] = 0xff; padded[3] = 0xef; padded[4] = 20002 >> 8; padded[5] = 20002 & 255;
+    memcpy(padded + 20006, file + 2, file_len - 2);
+    pid = feed(fifo, -1, padded, file_len + 20004);
+    CHECK(stbi_probe(fifo, &probe) && probe.x == w && probe.y == h, "stbi_probe of a padded FIFO fails: %s", stbi_failure_reason());
+    reap("stbi_probe, padded", pid);
+    free(padded);
+
+    // /dev/stdin as a pipe
+    if (pipe(fds) == 0) {
+        saved = dup(0);
+        dup2(fds[0], 0);
+        close(fds[0]);
+        pid = feed(NULL, fds[1], file, file_len);
+        close(fds[1]);
+        same("stbi_load_mapped from /dev/stdin", stbi_load_mapped("/dev/stdin", &x, &y, &n, 3), ref, w, h);
+        reap("/dev/stdin", pid);
+        dup2(saved, 0);
+        close(saved);
+    }
+
+    f = fopen(empty, "wb");
+    if (f) fclose(f);
+    CHECK(stbi_load_mapped(empty, &x, &y, &n, 3) == NULL && strcmp(stbi_failure_reason(), "empty file") == 0,
+          "an empty file gives \"%s\"", stbi_failure_reason());
+    CHECK(!stbi_probe(empty, &probe) && strcmp(stbi_failure_reason(), "empty file") == 0,
+          "stbi_probe of an empty file gives \"%s\"", stbi_failure_reason());
+
+    remove(empty);
+    remove(fifo);
+    rmdir(dir);
+    free(file);
+    stbi_image_free(ref);
+    if (failures) {
+        printf("test_map: %d failures\n", failures);
+        return 1;
+    }
+    printf("test_map: ok\n");
+    return 0;
+}
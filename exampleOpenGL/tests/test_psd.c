@@ -0,0 +1,215 @@
+// PSD loading: whole files against the pixels they were written from, and
+// every truncation of them, which must load (with the missing data as
+// zeros) or fail cleanly, the same from memory as from callbacks
+
+#define STB_IMAGE_IMPLEMENTATION
+#include "../stb_image.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static int failures = 0;
+
+#define CHECK(cond, ...) \
+    do { if (!(cond)) { printf("FAIL %s:%d: ", __FILE__, __LINE__); printf(__VA_ARGS__); printf("\n"); ++failures; } } while (0)
+
+static unsigned char *put16(unsigned char *p, int v) { p[0] = (unsigned char) (v >> 8); p[1] = (unsigned char) v; return p + 2; }
+static unsigned char *put32(unsigned char *p, unsigned int v) { p = put16(p, (int) (v >> 16)); return put16(p, (int) (v & 0xffff)); }
+
+// sample c of pixel i, as stored: runs and noise, so both kinds of packet
+// show up. alpha is opaque, so the white matte removal leaves them alone
+static int sample(int i, int c, int depth)
+{
+    int v;
+    if (c == 3) return depth == 16 ? 0xffff : 0xff;
+    v = (i / 7 % 3 == 0) ? (i * 37 + c * 91) : (c * 50 + i / 7);
+    return depth == 16 ? (v * 263) & 0xffff : v & 0xff;
+}
+
+// PackBits, at most 128 bytes a packet
+static unsigned char *packbits(unsigned char *out, unsigned char const *in, int n)
+{
+    int i = 0;
+    while (i < n) {
+        int j = i + 1;
+        while (j < n && j - i < 128 && in[j] == in[i]) ++j;
+        if (j - i >= 2) {
+            *out++ = (unsigned char) (257 - (j - i));
+            *out++ = in[i];
+        } else {
+            while (j < n && j - i < 128 && !(j + 1 < n && in[j] == in[j+1])) ++j;
+            *out++ = (unsigned char) (j - i - 1);
+            memcpy(out, in + i, j - i);
+            out += j - i;
+        }
+        i = j;
+    }
+    return out;
+}
+
+// an RGB(A) PSD of w*h pixels, returning its length
+static int make_psd(unsigned char *buf, int w, int h, int nc, int depth, int compression)
+{
+    int bps = depth / 8, row = w * bps, c, y, i;
+    unsigned char *p = buf, *counts, *plane = (unsigned char *) malloc((size_t) row * h);
+    memcpy(p, "8BPS", 4); p += 4;
+    p = put16(p, 1);
+    memset(p, 0, 6); p += 6;
+    p = put16(p, nc);
+    p = put32(p, (unsigned int) h);
+    p = put32(p, (unsigned int) w);
+    p = put16(p, depth);
+    p = put16(p, 3);
+    p = put32(p, 0);   // mode data
+    p = put32(p, 0);   // image resources
+    p = put32(p, 0);   // layers
+    p = put16(p, compression);
+    counts = p;
+    if (compression) p += h * nc * 2;
+    for (c=0; c < nc; ++c) {
+        for (i=0; i < w*h; ++i) {
+            int v = sample(i, c, depth);
+            if (depth == 16) put16(plane + i*2, v);
+            else plane[i] = (unsigned char) v;
+        }
+        for (y=0; y < h; ++y) {
+            if (compression) {
+                unsigned char *start = p;
+                p = packbits(p, plane + y * row, row);
+                counts = put16(counts, (int) (p - start));
+            } else {
+                memcpy(p, plane + y * row, row);
+                p += row;
+            }
+        }
+    }
+    free(plane);
+    return (int) (p - buf);
+}
+
+typedef struct
+{
+    unsigned char const *data;
+    int len, pos;
+} reader;
+
+static int read_cb(void *user, char *data, int size)
+{
+    reader *r = (reader *) user;
+    int n = r->len - r->pos < size ? r->len - r->pos : size;
+    memcpy(data, r->data + r->pos, n);
+    r->pos += n;
+    return n;
+}
+
+static void skip_cb(void *user, int n)
+{
+    reader *r = (reader *) user;
+    r->pos = n > r->len - r->pos ? r->len : r->pos + n;
+}
+
+static int eof_cb(void *user)
+{
+    reader *r = (reader *) user;
+    return r->pos >= r->len;
+}
+
+// 16 bits to 8 as stbi_load does for PNG: rounded, not just the high byte
+static int to8(int v)
+{
+    unsigned int t = (unsigned int) v + 128;
+    if (t > 65535) t = 65535;
+    return (int) ((t - (t >> 8)) >> 8);
+}
+
+static void test_whole(int w, int h, int nc, int depth, int compression)
+{
+    static unsigned char buf[1 << 20];
+    int len = make_psd(buf, w, h, nc, depth, compression);
+    int x, y, n, i, c;
+    stbi_us *img = stbi_load_16_from_memory(buf, len, &x, &y, &n, 4);
+    stbi_us *planes = stbi_load_psd_planes_16_from_memory(buf, len, &x, &y, &n);
+    stbi_uc *img8 = stbi_load_from_memory(buf, len, &x, &y, &n, 4);
+    stbi_uc *planes8 = stbi_load_psd_planes_from_memory(buf, len, &x, &y, &n);
+    CHECK(img && planes && x == w && y == h && n == nc, "%dx%d %d channels at %d bits, compression %d", w, h, nc, depth, compression);
+    if (img && planes) {
+        for (i=0; i < w*h; ++i) {
+            for (c=0; c < 4; ++c) {
+                // 8-bit samples widen by 257; a missing alpha is opaque
+                int want = c < nc ? sample(i, c, depth) * (depth == 8 ? 257 : 1) : 65535;
+                if (img[i*4+c] != want || (c < nc && planes[(size_t) c*w*h + i] != want)) {
+                    CHECK(0, "%dx%dx%d/%d/%d: pixel %d channel %d is %d, want %d", w, h, nc, depth, compression, i, c, img[i*4+c], want);
+                    i = w*h;
+                    break;
+                }
+            }
+        }
+    }
+    CHECK(img8 && planes8, "%dx%d %d channels at %d bits, compression %d, to 8 bits", w, h, nc, depth, compression);
+    if (img8 && planes8) {
+        for (i=0; i < w*h; ++i) {
+            for (c=0; c < 4; ++c) {
+                int want = c < nc ? (depth == 8 ? sample(i, c, depth) : to8(sample(i, c, depth))) : 255;
+                if (img8[i*4+c] != want || (c < nc && planes8[(size_t) c*w*h + i] != want)) {
+                    CHECK(0, "%dx%dx%d/%d/%d to 8 bits: pixel %d channel %d is %d, want %d", w, h, nc, depth, compression, i, c, img8[i*4+c], want);
+                    i = w*h;
+                    break;
+                }
+            }
+        }
+    }
+    stbi_image_free(img);
+    stbi_image_free(planes);
+    stbi_image_free(img8);
+    stbi_image_free(planes8);
+}
+
+static void test_truncated(int w, int h, int nc, int depth, int compression)
+{
+    static unsigned char buf[1 << 20];
+    int len = make_psd(buf, w, h, nc, depth, compression), cut;
+    for (cut = 0; cut < len; ++cut) {
+        stbi_io_callbacks cb = { read_cb, skip_cb, eof_cb };
+        reader r;
+        int x1, y1, n1, x2, y2, n2, x3, y3, n3;
+        stbi_uc *mem, *clbk, *planes;
+        unsigned char *copy = (unsigned char *) malloc(cut ? cut : 1);
+        memcpy(copy, buf, cut);   // exactly cut bytes, so reading past them trips ASan
+        r.data = copy; r.len = cut; r.pos = 0;
+        mem = stbi_load_from_memory(copy, cut, &x1, &y1, &n1, 4);
+        clbk = stbi_load_from_callbacks(&cb, &r, &x2, &y2, &n2, 4);
+        planes = stbi_load_psd_planes_from_memory(copy, cut, &x3, &y3, &n3);
+        CHECK(!mem == !clbk, "cut at %d of %d: memory %s, callbacks %s", cut, len, mem ? "loads" : "fails", clbk ? "loads" : "fails");
+        if (mem && clbk)
+            CHECK(memcmp(mem, clbk, (size_t) x1 * y1 * 4) == 0, "cut at %d of %d: memory and callbacks differ", cut, len);
+        // once the header's all there, the pixels load
+        if (cut >= 40)
+            CHECK(mem && planes, "cut at %d of %d (%dx%dx%d/%d/%d) doesn't load", cut, len, w, h, nc, depth, compression);
+        stbi_image_free(mem);
+        stbi_image_free(clbk);
+        stbi_image_free(planes);
+        free(copy);
+    }
+}
+
+int main(void)
+{
+    int depth, compression;
+    for (depth = 8; depth <= 16; depth += 8) {
+        for (compression = 0; compression <= 1; ++compression) {
+            test_whole(1, 1, 3, depth, compression);
+            test_whole(37, 21, 3, depth, compression);
+            test_whole(300, 70, 4, depth, compression);
+            test_whole(5, 3000, 5, depth, compression);
+            test_truncated(23, 9, 4, depth, compression);
+            test_truncated(40, 3, 3, depth, compression);
+        }
+    }
+    if (failures) {
+        printf("test_psd: %d failures\n", failures);
+        return 1;
+    }
+    printf("test_psd: ok\n");
+    return 0;
+}
@@ -0,0 +1,112 @@
+// stbi_view_from_memory: whole PGM/PPM files and grey TGAs give a view of
+// their pixels, and every truncation of them (and a TGA whose ID field runs
+// past the end) gives either NULL or a view that lies inside the buffer
+
+#define STB_IMAGE_IMPLEMENTATION
+#include "../stb_image.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static int failures = 0;
+
+#define CHECK(cond, ...) \
+    do { if (!(cond)) { printf("FAIL %s:%d: ", __FILE__, __LINE__); printf(__VA_ARGS__); printf("\n"); ++failures; } } while (0)
+
+// an uncompressed grey (n == 1) or grey+alpha (n == 2) TGA with an ID field
+// of id_len bytes, returning its length
+static int make_tga(unsigned char *buf, int w, int h, int n, int id_len, int top_down)
+{
+    int i;
+    memset(buf, 0, 18);
+    buf[0] = (unsigned char) id_len;
+    buf[2] = 3;
+    buf[12] = (unsigned char) w; buf[13] = (unsigned char) (w >> 8);
+    buf[14] = (unsigned char) h; buf[15] = (unsigned char) (h >> 8);
+    buf[16] = (unsigned char) (n * 8);
+    buf[17] = (unsigned char) ((top_down ? 32 : 0) | (n == 2 ? 8 : 0));
+    memset(buf + 18, 'i', id_len);
+    for (i=0; i < w*h*n; ++i)
+        buf[18 + id_len + i] = (unsigned char) (i * 7);
+    return 18 + id_len + w*h*n;
+}
+
+static int make_pnm(unsigned char *buf, int w, int h, int n)
+{
+    int len = sprintf((char *) buf, "P%d\n%d %d\n255\n", n == 1 ? 5 : 6, w, h), i;
+    for (i=0; i < w*h*n; ++i)
+        buf[len + i] = (unsigned char) (i * 7);
+    return len + w*h*n;
+}
+
+// the view of 'len' bytes (copied to exactly that much memory, so ASan sees
+// any read past them) must be all there, and match the pixels if 'whole'
+static void check_view(char const *what, unsigned char const *file, int len, int whole, int w, int h, int n)
+{
+    unsigned char *copy = (unsigned char *) malloc(len ? len : 1);
+    stbi_uc const *v;
+    ptrdiff_t stride;
+    int x, y, c, j;
+    memcpy(copy, file, len);
+    v = stbi_view_from_memory(copy, len, &x, &y, &c, &stride);
+    if (whole)
+        CHECK(v && x == w && y == h && c == n, "%s: no view of the whole file", what);
+    if (v) {
+        ptrdiff_t row = (ptrdiff_t) x * c;
+        stbi_uc const *first = stride < 0 ? v + stride * (y-1) : v;
+        CHECK(first >= copy && first + row * y <= copy + len, "%s, %d of the bytes: the view lies outside the buffer", what, len);
+        if (whole && first >= copy && first + row * y <= copy + len) {
+            for (j=0; j < y; ++j) {
+                // the rows are top to bottom, whichever way the file holds them
+                int i, k = stride < 0 ? (y-1-j) : j;
+                for (i=0; i < row; ++i) {
+                    if (v[stride * j + i] != (unsigned char) ((k * row + i) * 7)) {
+                        CHECK(0, "%s: row %d differs", what, j);
+                        j = y;
+                        break;
+                    }
+                }
+            }
+        }
+    }
+    free(copy);
+}
+
+int main(void)
+{
+    static unsigned char buf[1 << 16];
+    static int const ids[] = { 0, 1, 5, 255 };
+    int n, i, top, len, cut;
+    char what[64];
+    for (n = 1; n <= 2; ++n) {
+        for (i=0; i < (int) (sizeof(ids) / sizeof(ids[0])); ++i) {
+            for (top = 0; top <= 1; ++top) {
+                sprintf(what, "tga, %d channels, id %d, top-down %d", n, ids[i], top);
+                len = make_tga(buf, 13, 7, n, ids[i], top);
+                check_view(what, buf, len, 1, 13, 7, n);
+                for (cut = 0; cut < len; ++cut)
+                    check_view(what, buf, cut, 0, 13, 7, n);
+            }
+        }
+        // an 18-byte header whose ID field would run past the end
+        for (i=1; i < 256; ++i) {
+            sprintf(what, "tga header alone, id %d", i);
+            len = make_tga(buf, 1, 1, n, i, 1);
+            check_view(what, buf, 18, 0, 1, 1, n);
+        }
+    }
+    for (n = 1; n <= 3; n += 2) {
+        sprintf(what, "pnm, %d channels", n);
+        len = make_pnm(buf, 11, 5, n);
+        check_view(what, buf, len, 1, 11, 5, n);
+        for (cut = 0; cut < len; ++cut)
+            check_view(what, buf, cut, 0, 11, 5, n);
+    }
+    if (failures) {
+        printf("test_view: %d failures\n", failures);
+        return 1;
+    }
+    printf("test_view: ok\n");
+    return 0;
+}